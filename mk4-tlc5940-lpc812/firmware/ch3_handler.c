@@ -29,10 +29,26 @@ static struct {
 static uint8_t ch3_clicks;
 static uint16_t ch3_click_counter;
 
+extern uint8_t light_switch_position;
+
+
+// ****************************************************************************
+static void post_light_switch_event(uint8_t old_position)
+{
+    if (light_switch_position > old_position) {
+        post_light_program_event(RUN_ON_LIGHT_SWITCH_UP);
+    }
+    else if (light_switch_position < old_position) {
+        post_light_program_event(RUN_ON_LIGHT_SWITCH_DOWN);
+    }
+}
+
 
 // ****************************************************************************
 static void process_ch3_click_timeout(void)
 {
+    uint8_t old_light_switch_position = light_switch_position;
+
     if (ch3_clicks == 0) {          // Any clicks pending?
         return;                     // No: nothing to do
     }
@@ -66,22 +82,24 @@ static void process_ch3_click_timeout(void)
             case 1:
                 // --------------------------
                 // Single click
-                if (config.flags.gearbox_servo_output) {
+                if (CONFIG_GEARBOX_SERVO_OUTPUT) {
                     gearbox_action(ch3_clicks);
                 }
                 else {
                     light_switch_up();
+                    post_light_switch_event(old_light_switch_position);
                 }
                 break;
 
             case 2:
                 // --------------------------
                 // Double click
-                if (config.flags.gearbox_servo_output) {
+                if (CONFIG_GEARBOX_SERVO_OUTPUT) {
                     gearbox_action(ch3_clicks);
                 }
                 else {
                     light_switch_down();
+                    post_light_switch_event(old_light_switch_position);
                 }
                 break;
 
@@ -89,6 +107,7 @@ static void process_ch3_click_timeout(void)
                 // --------------------------
                 // 3 clicks: all lights on/off
                 toggle_light_switch();
+                post_light_switch_event(old_light_switch_position);
 
                 break;
 
@@ -108,6 +127,7 @@ static void process_ch3_click_timeout(void)
                 // --------------------------
                 // 6 clicks: Increment sequencer pattern selection
                 next_light_sequence();
+                post_light_program_event(RUN_ON_CLICKS);
                 break;
 
             case 7:
@@ -154,8 +174,6 @@ static void add_click(void)
 // ****************************************************************************
 void process_ch3_clicks(void)
 {
-    global_flags.gear_changed = 0;
-
     if (global_flags.systick) {
         if (ch3_click_counter) {
             --ch3_click_counter;
@@ -171,6 +189,7 @@ void process_ch3_clicks(void)
     // new_channel_data was seen in a certain amount of systicks
     if (config.flags.ch3_is_local_switch) {
         channel[CH3].normalized = GPIO_CH3 ? -100 : 100;
+        channel[CH3].fine = channel[CH3].normalized * CHANNEL_FINE_SCALE;
     }
 
     if (global_flags.initializing) {
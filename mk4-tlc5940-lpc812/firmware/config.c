@@ -13,26 +13,40 @@ const LIGHT_CONTROLLER_CONFIG_T config = {
 
     .firmware_version = 5,
 
+#ifdef FIXED_CONFIG
+    .mode = FIXED_CONFIG_MODE,
+#else
     .mode = MASTER_WITH_SERVO_READER,
+#endif
     .esc_mode = ESC_FORWARD_BRAKE_REVERSE_TIMEOUT,
 
     .flags = {
         // If mode is MASTER_WITH_SERVO_READER then all *_output flags are
         // mutually exculsive.
         // If mode is MASTER_WITH_UART_READER or MASTER_WITH_CPPM_READER then
-        // there can be one UART output (slave, preprocessor or winch) and
+        // there can be UART outputs (slave, preprocessor and/or winch) and
         // one servo output (steering wheel or gearbox servo)
+#ifdef FIXED_CONFIG
+        .slave_output = FIXED_CONFIG_SLAVE_OUTPUT,
+        .preprocessor_output = FIXED_CONFIG_PREPROCESSOR_OUTPUT,
+        .winch_output = FIXED_CONFIG_WINCH_OUTPUT,
+        .steering_wheel_servo_output = FIXED_CONFIG_STEERING_WHEEL_SERVO_OUTPUT,
+        .gearbox_servo_output = FIXED_CONFIG_GEARBOX_SERVO_OUTPUT,
+#else
         .slave_output = false,
         .preprocessor_output = false,
         .winch_output = false,
         .steering_wheel_servo_output = true,
         .gearbox_servo_output = false,
+#endif
 
         .ch3_is_local_switch = false,
         .ch3_is_momentary = false,
 
         .auto_brake_lights_forward_enabled = true,
         .auto_brake_lights_reverse_enabled = true,
+
+        .preprocessor_output_v2 = false,
     },
 
     .auto_brake_counter_value_forward_min = (500 / __SYSTICK_IN_MS),
@@ -71,6 +85,13 @@ const LIGHT_CONTROLLER_CONFIG_T config = {
     .servo_pulse_max = 2500,
 
     .startup_time = (2000 / __SYSTICK_IN_MS),
+
+    .servo_output_frame_rate = 50,
+
+    .gearbox_servo_speed = 50,
+    .gearbox_servo_ramp_time = (100 / __SYSTICK_IN_MS),
+
+    .servo_input_filter = SERVO_INPUT_FILTER_NONE,
 };
 
 
@@ -8,74 +8,67 @@ const LIGHT_PROGRAMS_T light_programs = {
     .magic = {
         .magic_value = ROM_MAGIC,
         .type = LIGHT_PROGRAMS,
-        .version = CONFIG_VERSION
+        .version = LIGHT_PROGRAMS_VERSION
     },
 
     .number_of_programs = 4,
     .start = {
         &light_programs.programs[0],
-        &light_programs.programs[9],
-        &light_programs.programs[18],
-        &light_programs.programs[33],
+        &light_programs.programs[8],
+        &light_programs.programs[16],
+        &light_programs.programs[29],
     },
 
     .programs = {
         0x00000001,
         0x00000000,
         0xffffffff,
-        0x051f0000,
-        0x031f0000,
-        0x03070664,
-        0x07000000,
-        0x01000000,
-        0xfe000000,
+        0x001f0005,
+        0x001f0003,
+        0x64070603,
+        0x01000007,
+        0x00feffee,
 
         0x00000002,
         0x00000000,
         0xffffffff,
-        0x051f0000,
-        0x031f0000,
-        0x03030264,
-        0x07000000,
-        0x01000000,
-        0xfe000000,
+        0x001f0005,
+        0x001f0003,
+        0x64030203,
+        0x01000007,
+        0x00feffee,
 
         0x00000060,
         0x00000000,
         0xffffffff,
-        0x07000000,
-        0x051f0000,
-        0x031f0000,
-        0x68000000,
-        0x01000007,
-        0x03060664,
-        0x030c0c64,
-        0x70000000,
-        0x01000000,
-        0x03050464,
+        0x05000007,
+        0x03001f00,
+        0x68001f00,
         0x01000000,
-        0xfe000000,
+        0x06090006,
+        0x640c0964,
+        0x00000070,
+        0x03ffe101,
+        0x01640504,
+        0x00feffda,
 
         0x0000001c,
         0x00000000,
         0xffffffff,
-        0x07000000,
-        0x051f0000,
-        0x031f0000,
-        0xa2000000,
-        0x0100000a,
-        0xa4000000,
-        0x0100000d,
-        0x03070664,
-        0x030d0c64,
-        0x01000000,
-        0x03060664,
-        0x030c0c64,
-        0x01000000,
-        0x03070764,
-        0x030d0d64,
+        0x05000007,
+        0x03001f00,
+        0xa2001f00,
         0x01000000,
-        0xfe000000,
+        0x00a40012,
+        0x14010000,
+        0x07060300,
+        0x0d0c0364,
+        0xffdc0164,
+        0x09640609,
+        0xd301640c,
+        0x640709ff,
+        0x01640d09,
+        0x00feffca,
 
         0xff000000,
     }
@@ -0,0 +1,183 @@
+/******************************************************************************
+
+    Light program debugger: frames on the UART
+
+    A firmware built with LIGHT_PROGRAM_DEBUGGER (see makefile) accepts debug
+    commands from tools/light_program_debugger.py. The commands are handled
+    by light_program_debugger_command() in light_programs.c.
+
+    The debugger requires the light controller to be configured as master
+    with UART reader: the debug frames share the RX pin (ST) with the frames
+    of the preprocessor, and the responses share the TX pin (TH) with the
+    diagnostics output. The host tool sends preprocessor frames itself, so
+    that reading the channels and no-signal detection keep working.
+
+    The preprocessor protocol never uses the byte values 0x80..0x87 other
+    than for its start byte 0x87 (see uart_reader.c). Debug frames start with
+    0x86 and escape these values, so that read_preprocessor() stays in sync
+    and the host can tell debug frames from the (ASCII) diagnostics output:
+
+        0x86        Sync byte
+        command     See light_programs.c
+        length      Number of bytes in the payload
+        payload
+        crc low     CRC-16-CCITT (polynomial 0x1021, initial value 0xffff)
+        crc high    of command, length and payload
+
+    All bytes following the sync byte that have a value of 0x80..0x87 are
+    sent as 0x85 followed by the value XOR 0x20. A 0x87 within a frame aborts
+    the frame, as it is the start of a preprocessor frame.
+
+    Frames with a wrong CRC are ignored, so the host retries after a timeout.
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <globals.h>
+#include <uart0.h>
+#include <utils.h>
+
+#ifdef LIGHT_PROGRAM_DEBUGGER
+
+#define FRAME_SYNC 0x86
+#define FRAME_ESCAPE 0x85
+#define ESCAPE_XOR 0x20
+#define PREPROCESSOR_MAGIC_BYTE 0x87
+
+#define MAX_PAYLOAD 8
+
+
+typedef enum {
+    STATE_WAIT_FOR_SYNC = 0,
+    STATE_COMMAND,
+    STATE_LENGTH,
+    STATE_PAYLOAD,
+    STATE_CRC_LOW,
+    STATE_CRC_HIGH
+} STATE_T;
+
+static struct {
+    uint8_t command;
+    uint8_t length;
+    uint8_t payload[MAX_PAYLOAD];
+} frame;
+
+
+// ****************************************************************************
+static void send_escaped(uint8_t data)
+{
+    if (data >= 0x80  &&  data <= PREPROCESSOR_MAGIC_BYTE) {
+        uart0_send_char((char)FRAME_ESCAPE);
+        data ^= ESCAPE_XOR;
+    }
+    uart0_send_char(data);
+}
+
+
+// ****************************************************************************
+void debugger_send_frame(uint8_t command, const uint8_t *payload, uint8_t length)
+{
+    uint16_t crc;
+    int i;
+
+    uart0_send_char((char)FRAME_SYNC);
+    send_escaped(command);
+    send_escaped(length);
+    crc = crc16_ccitt(crc16_ccitt(CRC16_INITIAL_VALUE, command), length);
+
+    for (i = 0; i < length; i++) {
+        send_escaped(payload[i]);
+        crc = crc16_ccitt(crc, payload[i]);
+    }
+
+    send_escaped(crc & 0xff);
+    send_escaped(crc >> 8);
+}
+
+
+// ****************************************************************************
+// Called by read_preprocessor() for every byte received. Returns true if the
+// byte is part of a debug frame, false if it belongs to the preprocessor.
+bool debugger_receive_byte(uint8_t uart_byte)
+{
+    static STATE_T state = STATE_WAIT_FOR_SYNC;
+    static bool escaped;
+    static uint8_t index;
+    static uint16_t crc;
+    static uint8_t crc_low;
+
+    if (uart_byte == FRAME_SYNC) {
+        crc = CRC16_INITIAL_VALUE;
+        escaped = false;
+        state = STATE_COMMAND;
+        return true;
+    }
+
+    if (state == STATE_WAIT_FOR_SYNC) {
+        return false;
+    }
+
+    if (uart_byte == PREPROCESSOR_MAGIC_BYTE) {
+        state = STATE_WAIT_FOR_SYNC;
+        return false;
+    }
+
+    if (uart_byte == FRAME_ESCAPE) {
+        escaped = true;
+        return true;
+    }
+    if (escaped) {
+        uart_byte ^= ESCAPE_XOR;
+        escaped = false;
+    }
+
+    switch (state) {
+        case STATE_COMMAND:
+            frame.command = uart_byte;
+            crc = crc16_ccitt(crc, uart_byte);
+            state = STATE_LENGTH;
+            break;
+
+        case STATE_LENGTH:
+            if (uart_byte > MAX_PAYLOAD) {
+                state = STATE_WAIT_FOR_SYNC;
+                break;
+            }
+            frame.length = uart_byte;
+            crc = crc16_ccitt(crc, uart_byte);
+            index = 0;
+            state = uart_byte ? STATE_PAYLOAD : STATE_CRC_LOW;
+            break;
+
+        case STATE_PAYLOAD:
+            frame.payload[index++] = uart_byte;
+            crc = crc16_ccitt(crc, uart_byte);
+            if (index >= frame.length) {
+                state = STATE_CRC_LOW;
+            }
+            break;
+
+        case STATE_CRC_LOW:
+            crc_low = uart_byte;
+            state = STATE_CRC_HIGH;
+            break;
+
+        case STATE_CRC_HIGH:
+            state = STATE_WAIT_FOR_SYNC;
+            if ((crc_low | (uart_byte << 8)) == crc) {
+                light_program_debugger_command(
+                    frame.command, frame.payload, frame.length);
+            }
+            break;
+
+        case STATE_WAIT_FOR_SYNC:
+        default:
+            state = STATE_WAIT_FOR_SYNC;
+            break;
+    }
+
+    return true;
+}
+
+#endif
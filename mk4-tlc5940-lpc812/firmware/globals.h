@@ -4,7 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define CONFIG_VERSION 1
+#define CONFIG_VERSION 3
+#define LIGHT_PROGRAMS_VERSION 7
 #define __SYSTICK_IN_MS 20
 
 
@@ -74,16 +75,30 @@
 // accordingly!
 #define LIGHT_SWITCH_POSITIONS 9
 
+// 16 lights locally, another 16 potentially at a slave
+#define MAX_LIGHTS 32
+
 #define MAX_LIGHT_PROGRAMS 25
 #define MAX_LIGHT_PROGRAM_VARIABLES 100
 
+// Maximum nesting depth of subroutine calls in light programs
+#define LIGHT_PROGRAM_STACK_DEPTH 4
+
+// Number of instructions each light program may execute per systick before
+// it is suspended until the next systick
+#define MAX_INSTRUCTIONS_PER_SYSTICK 30
+
 // Convenience functions for min/max
 #define MIN(x, y) ((x) < (y) ? x : (y))
 #define MAX(x, y) ((x) > (y) ? x : (y))
 
 
 // Opcodes for light programs
-#define OPCODE_GOTO             0x01    // GOTO instruction offset
+//
+// Instructions are 1 to 6 bytes long. The first byte is the opcode, which
+// determines the length of the instruction (see instruction_length[] in
+// light_programs.c). Multi-byte operands are stored in little endian.
+#define OPCODE_GOTO             0x01    // GOTO relative byte offset (int16_t)
 
 #define OPCODE_SET              0x02    // LED start..stop = var
 #define OPCODE_SET_I            0x03    // LED start..stop = uint8_t immediate
@@ -94,6 +109,20 @@
 #define OPCODE_SLEEP            0x06    // SLEEP type, id (ms)
 #define OPCODE_SLEEP_I          0x07    // SLEEP immediate (ms)
 
+// Short forms of SET and FADE for a single LED (3 bytes instead of 4)
+#define OPCODE_SET_LED          0x08    // LED = var
+#define OPCODE_SET_LED_I        0x09    // LED = uint8_t immediate
+#define OPCODE_FADE_LED         0x0a    // FADE LED with var
+#define OPCODE_FADE_LED_I       0x0b    // FADE LED with uint8_t immediate
+
+#define OPCODE_CALL             0x0c    // CALL relative byte offset (int16_t)
+#define OPCODE_RETURN           0x0d    // RETURN from subroutine
+
+// Apply a frame of a pattern table to a range of LEDs (5 bytes): int16_t
+// offset of the table relative to the next instruction, first LED, frame
+#define OPCODE_PATTERN          0x0e    // LEDs = pattern[var]
+#define OPCODE_PATTERN_I        0x0f    // LEDs = pattern[uint8_t immediate]
+
 #define OPCODE_ASSIGN           0x10    // VAR = type, id
 #define OPCODE_ASSIGN_I         0x11    // VAR = immediate
 
@@ -155,10 +184,31 @@
 #define OPCODE_ABS              0x40    // var = |type, id|
 #define OPCODE_ABS_I            0x41    // var = |immediate|
 
+// SET and FADE of any group of LEDs (6 bytes): var or brightness, followed by
+// a uint32_t mask of the LEDs. The immediate is the brightness (0..255), not
+// a percentage, so that no conversion is needed at run time.
+#define OPCODE_SET_MASK         0x48    // LEDs in mask = var
+#define OPCODE_SET_MASK_I       0x49    // LEDs in mask = uint8_t brightness
+#define OPCODE_FADE_MASK        0x4a    // FADE LEDs in mask with var
+#define OPCODE_FADE_MASK_I      0x4b    // FADE LEDs in mask with uint8_t stepsize
+
+// Short forms of the variable operations with an int8_t immediate (3 bytes
+// instead of 4)
+#define OPCODE_ASSIGN_S         0x50    // VAR = int8_t immediate
+#define OPCODE_ADD_S            0x51    // VAR += int8_t immediate
+#define OPCODE_SUBTRACT_S       0x52    // VAR -= int8_t immediate
+#define OPCODE_MULTIPLY_S       0x53    // VAR *= int8_t immediate
+#define OPCODE_DIVIDE_S         0x54    // VAR /= int8_t immediate
+#define OPCODE_AND_S            0x55    // VAR &= int8_t immediate
+#define OPCODE_OR_S             0x56    // VAR |= int8_t immediate
+#define OPCODE_XOR_S            0x57    // VAR ^= int8_t immediate
+
 #define OPCODE_SKIP_IF_ANY      0x60    // 011 + 29 bits run_state! 0x60 .. 0x7f
 #define OPCODE_SKIP_IF_ALL      0x80    // 100 + 29 bits run_state! 0x80 .. 0x9f
 #define OPCODE_SKIP_IF_NONE     0xA0    // 101 + 29 bits run_state! 0xa0 .. 0xbf
 
+#define OPCODE_PATTERN_TABLE    0xfc    // Header of a pattern table, not executed
+#define OPCODE_SUBROUTINE       0xfd    // Header of a subroutine, not executed
 #define OPCODE_END_OF_PROGRAM   0xfe
 #define OPCODE_END_OF_PROGRAMS  0xff
 
@@ -171,12 +221,38 @@
 #define PARAMETER_TYPE_GEAR 5
 
 
-// Offset of special position within every light program
+// Offset of special position within every light program, in 32-bit words.
+// The instructions following the header are a stream of bytes, padded with
+// zeros to the next word boundary after the OPCODE_END_OF_PROGRAM.
 #define PRIORITY_STATE_OFFSET 0
 #define RUN_STATE_OFFSET 1
 #define LEDS_USED_OFFSET 2
 #define FIRST_OPCODE_OFFSET 3
 
+// The priority states use the lowest byte of the word at
+// PRIORITY_STATE_OFFSET. Programs with local variables have the first
+// variable in bits 8..15 and the number of variables in bits 16..23; they
+// clear them when they start. The instructions address var[] directly, the
+// window is only used for clearing.
+#define PRIORITY_STATE_MASK 0xff
+#define VARIABLES_BASE(word) (((word) >> 8) & 0xff)
+#define VARIABLES_COUNT(word) (((word) >> 16) & 0xff)
+
+// Subroutines are stored in between the light programs. Their header consists
+// of OPCODE_SUBROUTINE in the top-most byte and the length of the subroutine
+// in bytes in the lower 16 bits, followed by the LEDs used. The firmware only
+// enters subroutines through OPCODE_CALL, the header is for tools that parse
+// the light programs.
+#define SUBROUTINE_LEDS_USED_OFFSET 1
+#define SUBROUTINE_FIRST_OPCODE_OFFSET 2
+
+// Pattern tables are stored in between the light programs as well. The header
+// has OPCODE_PATTERN_TABLE in the top-most byte and the length of the table in
+// bytes in the lower 16 bits. The table starts with the number of LEDs per
+// frame and the number of frames, followed by the frames. Each frame holds
+// the brightness (0..255) of each LED.
+#define PATTERN_TABLE_FIRST_BYTE_OFFSET 1
+
 
 #define LED_USED(x) (1 << x)
 #define START_LED(x) (x << 16)
@@ -216,6 +292,24 @@ typedef enum {
 } LIGHT_PROGRAM_RUN_STATE_T;
 
 
+// ****************************************************************************
+// Events that start light programs declared with "run on <event>". They use
+// bits 23..30 of the word at RUN_STATE_OFFSET, which the run states leave
+// free. The firmware modules post them with post_light_program_event().
+typedef enum {
+    RUN_ON_GEAR_CHANGED              = (1 << 23),
+    RUN_ON_LIGHT_SWITCH_UP           = (1 << 24),
+    RUN_ON_LIGHT_SWITCH_DOWN         = (1 << 25),
+    RUN_ON_CLICKS                    = (1 << 26),
+    RUN_ON_HAZARD_ON                 = (1 << 27),
+    RUN_ON_HAZARD_OFF                = (1 << 28),
+    RUN_ON_WINCH_STARTED             = (1 << 29),
+    RUN_ON_SIGNAL_RECOVERED          = (1 << 30)
+} LIGHT_PROGRAM_EVENT_T;
+
+#define RUN_ON_EVENTS_MASK (0xff << 23)
+
+
 // ****************************************************************************
 typedef enum {
     RUN_WHEN_NORMAL_OPERATION           = 0,
@@ -300,6 +394,11 @@ typedef struct {
 
 
 // ****************************************************************************
+// Set in the version of the light programs when the assembler has compiled
+// the programs to native code (native_light_programs[]). The bytecode is
+// still present, but the firmware calls the native code instead.
+#define LIGHT_PROGRAMS_NATIVE 0x8000
+
 typedef struct {
     MAGIC_T magic;
     int number_of_programs;
@@ -307,6 +406,14 @@ typedef struct {
     uint32_t programs[80];
 } LIGHT_PROGRAMS_T;
 
+// Size of the flash region holding light programs uploaded over the UART in
+// maintenance mode, including the LIGHT_PROGRAMS_T header. Must be a multiple
+// of FLASH_PAGE_SIZE.
+#define UPLOADED_LIGHT_PROGRAMS_SIZE 1024
+
+// Flash memory is erased and written in pages of this size (IAP)
+#define FLASH_PAGE_SIZE 64
+
 // ****************************************************************************
 typedef struct {
     uint16_t left;
@@ -314,14 +421,27 @@ typedef struct {
     uint16_t right;
 } SERVO_ENDPOINTS_T;
 
+// Distance of the endpoints of a servo input from its centre in us, as
+// learned by servo_reader.c. 0: not learned yet.
+typedef struct {
+    uint16_t left;
+    uint16_t right;
+} ENDPOINT_DELTA_T;
+
 
 // ****************************************************************************
+// normalized goes from -100 to +100 (percent). fine is the same value with
+// CHANNEL_FINE_SCALE steps per percent, as far as the input provides that
+// resolution; it is passed on by preprocessor protocol v2.
+#define CHANNEL_FINE_SCALE 20
+
 typedef struct {
     uint32_t raw_data;
     SERVO_ENDPOINTS_T endpoint;
     int16_t normalized;
     uint16_t absolute;
     bool reversed;
+    int16_t fine;
 } CHANNEL_T;
 
 
@@ -342,6 +462,15 @@ typedef enum {
 } SERVO_OUTPUT_T;
 
 
+// ****************************************************************************
+// Servo output functions; index into servo_output_endpoint[]
+typedef enum {
+    SERVO_OUTPUT_STEERING_WHEEL = 0,
+    SERVO_OUTPUT_GEARBOX,
+    NUMBER_OF_SERVO_OUTPUTS
+} SERVO_OUTPUT_FUNCTION_T;
+
+
 // ****************************************************************************
 typedef enum {
     REVERSING_SETUP_OFF = 0,
@@ -377,7 +506,6 @@ typedef struct {
     unsigned int braking : 1;               // Set when the brakes are enganged
     unsigned int reversing : 1;             // Set when the car is reversing
 
-    unsigned int gear_changed : 1;          // Set for one mainloop when a new gear was selected
     unsigned int gear : 2;
 
     unsigned int winch_mode : 3;
@@ -409,6 +537,24 @@ typedef enum {
 } ESC_MODE_T;
 
 
+// ****************************************************************************
+// Filter for the servo pulses read from the receiver (see servo_reader.c).
+//
+// SERVO_INPUT_FILTER_MEDIAN uses the median of the last 3 pulses; it removes
+// single glitches and delays steps by one frame.
+// SERVO_INPUT_FILTER_ALPHA_BETA tracks position and speed of the pulse; it
+// also smooths the jitter, but steps take about 3 frames.
+// SERVO_INPUT_FILTER_OUTLIER holds a pulse that jumps away from the previous
+// one until the next pulse confirms it, and ignores changes within the
+// jitter of the receiver; best for crawling near the centre thresholds.
+typedef enum {
+    SERVO_INPUT_FILTER_NONE = 0,
+    SERVO_INPUT_FILTER_MEDIAN = 1,
+    SERVO_INPUT_FILTER_ALPHA_BETA = 2,
+    SERVO_INPUT_FILTER_OUTLIER = 3
+} SERVO_INPUT_FILTER_T;
+
+
 // ****************************************************************************
 typedef struct {
     MAGIC_T magic;
@@ -422,9 +568,12 @@ typedef struct {
         // If mode is MASTER_WITH_SERVO_READER  then all flags are mutually
         // exculsive.
         // If mode is MASTER_WITH_UART_READER or MASTER_WITH_CPPM_INPUT then
-        // there can be one UART output (slave, preprocessor or winch) and one
+        // there can be UART outputs (slave, preprocessor and/or winch) and one
         // servo output (steering wheel or gearbox servo; or switched light
-        // output)
+        // output). More than one UART output share the UART through
+        // multiplexed frames (see CONFIG_UART_MULTIPLEX). Instead of the
+        // UART outputs there can be both servo outputs (see
+        // CONFIG_DUAL_SERVO_OUTPUT).
         unsigned int slave_output : 1;
         unsigned int preprocessor_output : 1;
         unsigned int winch_output : 1;
@@ -437,6 +586,10 @@ typedef struct {
 
         unsigned int auto_brake_lights_forward_enabled : 1;
         unsigned int auto_brake_lights_reverse_enabled : 1;
+
+        // Preprocessor output sends protocol v2 frames (see
+        // preprocessor_output.c) instead of the 4 byte frames
+        unsigned int preprocessor_output_v2 : 1;
     } flags;
 
     uint16_t auto_brake_counter_value_forward_min;
@@ -470,16 +623,97 @@ typedef struct {
     uint32_t baudrate;
     uint16_t no_signal_timeout;
     uint16_t number_of_gears;
-    uint16_t gearbox_servo_active_time;
+    uint16_t gearbox_servo_active_time;     // Not used anymore
     uint16_t gearbox_servo_idle_time;
 
     uint16_t servo_pulse_min;
     uint16_t servo_pulse_max;
 
     uint16_t startup_time;
+
+    // Frame rate of the steering wheel servo output in Hz: 50, 100, 200 or
+    // 333. Any other value (e.g. 0 in older configurations, which had
+    // padding here) gives 50 Hz.
+    uint16_t servo_output_frame_rate;
+
+    // Motion profile of the gearbox servo: maximum speed in us of servo
+    // pulse change per systick (0: jump to the endpoint), and the time in
+    // systicks to accelerate to it (0: no ramp).
+    uint16_t gearbox_servo_speed;
+    uint16_t gearbox_servo_ramp_time;
+
+    // Filter applied to the servo pulses before they are normalized, see
+    // SERVO_INPUT_FILTER_T
+    uint16_t servo_input_filter;
 } LIGHT_CONTROLLER_CONFIG_T;
 
 
+// ****************************************************************************
+// Access to the operating mode and the UART/servo output selection.
+//
+// The generic firmware reads these from the config section so that the
+// configurator can change them. A specialized build
+// (make SPECIALIZED_CONFIG=light_controller.config.txt) turns them into
+// compile-time constants, which allows the compiler to discard all code for
+// modes and outputs that the configuration does not use.
+#ifdef FIXED_CONFIG
+#include "fixed_config.h"
+
+#define CONFIG_MODE FIXED_CONFIG_MODE
+#define CONFIG_SLAVE_OUTPUT FIXED_CONFIG_SLAVE_OUTPUT
+#define CONFIG_PREPROCESSOR_OUTPUT FIXED_CONFIG_PREPROCESSOR_OUTPUT
+#define CONFIG_WINCH_OUTPUT FIXED_CONFIG_WINCH_OUTPUT
+#define CONFIG_STEERING_WHEEL_SERVO_OUTPUT FIXED_CONFIG_STEERING_WHEEL_SERVO_OUTPUT
+#define CONFIG_GEARBOX_SERVO_OUTPUT FIXED_CONFIG_GEARBOX_SERVO_OUTPUT
+#else
+#define CONFIG_MODE (config.mode)
+#define CONFIG_SLAVE_OUTPUT (config.flags.slave_output)
+#define CONFIG_PREPROCESSOR_OUTPUT (config.flags.preprocessor_output)
+#define CONFIG_WINCH_OUTPUT (config.flags.winch_output)
+#define CONFIG_STEERING_WHEEL_SERVO_OUTPUT (config.flags.steering_wheel_servo_output)
+#define CONFIG_GEARBOX_SERVO_OUTPUT (config.flags.gearbox_servo_output)
+#endif
+
+// Steering wheel servo on OUT and gearbox servo on TH. Only possible when TH
+// is neither a servo input nor a UART output.
+#define CONFIG_DUAL_SERVO_OUTPUT (CONFIG_STEERING_WHEEL_SERVO_OUTPUT  && \
+    CONFIG_GEARBOX_SERVO_OUTPUT  &&  CONFIG_MODE != MASTER_WITH_SERVO_READER  && \
+    !CONFIG_SLAVE_OUTPUT  &&  !CONFIG_PREPROCESSOR_OUTPUT  &&  !CONFIG_WINCH_OUTPUT)
+
+// More than one UART output: they send multiplexed frames (see uart_mux.c).
+// A single UART output sends its raw protocol, as before.
+#define CONFIG_UART_MULTIPLEX ((CONFIG_SLAVE_OUTPUT + \
+    CONFIG_PREPROCESSOR_OUTPUT + CONFIG_WINCH_OUTPUT) > 1)
+
+
+// ****************************************************************************
+// Channels of the multiplexed UART frames, in order of their priority
+typedef enum {
+    UART_MUX_CHANNEL_WINCH = 0,
+    UART_MUX_CHANNEL_PREPROCESSOR = 1,
+    UART_MUX_CHANNEL_SLAVE = 2,
+    UART_MUX_NUMBER_OF_CHANNELS
+} UART_MUX_CHANNEL_T;
+
+#define UART_MUX_MAX_PAYLOAD 16
+
+// Size of the fields of a preprocessor protocol v2 frame without sync byte
+// and CRC (see preprocessor_output.c)
+#define PREPROCESSOR_V2_PAYLOAD_SIZE 8
+
+typedef struct {
+    uint8_t channel;
+    uint8_t length;
+    uint8_t payload[UART_MUX_MAX_PAYLOAD];
+} UART_MUX_FRAME_T;
+
+typedef enum {
+    UART_MUX_NO_FRAME = 0,      // Byte does not belong to a multiplexed frame
+    UART_MUX_IN_FRAME,          // Byte is part of an incomplete frame
+    UART_MUX_FRAME_RECEIVED     // A frame with valid CRC is complete
+} UART_MUX_RESULT_T;
+
+
 // ****************************************************************************
 // Definitions for the various light configuration structures
 
@@ -534,6 +768,47 @@ typedef struct {
 } CAR_LIGHT_ARRAY_T;
 
 
+// ****************************************************************************
+// Entry ABI of light programs compiled to native code.
+//
+// The firmware calls each program once per systick (unless it sleeps). The
+// program continues at the instruction given by resume, and returns one of
+// the LIGHT_PROGRAM_xxx codes after executing at most
+// MAX_INSTRUCTIONS_PER_SYSTICK instructions. All data of the firmware is
+// accessed through the environment.
+typedef struct {
+    const uint8_t *PC;                          // Bytecode only
+    uint16_t timer;
+    uint16_t resume;                            // Native code only
+    uint16_t stack[LIGHT_PROGRAM_STACK_DEPTH];
+    uint8_t sp;
+    uint8_t var_base;                           // Local variables
+    uint8_t var_clear;                          // to clear when starting
+    unsigned event : 1;
+} LIGHT_PROGRAM_CPU_T;
+
+typedef struct {
+    int16_t *var;
+    LED_T *light_setpoint;
+    uint8_t *max_change_per_systick;
+    const LED_T *light_actual;
+    uint16_t (* random_min_max)(uint16_t min, uint16_t max);
+    uint32_t car_state;
+    uint32_t leds_already_used;
+    int16_t steering;
+    int16_t throttle;
+    int16_t gear;
+} LIGHT_PROGRAM_ENVIRONMENT_T;
+
+#define LIGHT_PROGRAM_YIELD 0   // Instructions for this systick used up
+#define LIGHT_PROGRAM_SLEEP 1   // Sleep, timer is set
+#define LIGHT_PROGRAM_END 2     // End of program reached
+#define LIGHT_PROGRAM_ERROR 3   // Stack over- or underflow, restart program
+
+typedef uint8_t (* LIGHT_PROGRAM_FUNCTION_T)(
+    const LIGHT_PROGRAM_ENVIRONMENT_T *env, LIGHT_PROGRAM_CPU_T *c);
+
+
 // ****************************************************************************
 // The entropy variable is incremented every mainloop. It can therefore serve
 // as a random value in practical RC car application,
@@ -545,10 +820,13 @@ extern const CAR_LIGHT_ARRAY_T local_leds;
 extern const CAR_LIGHT_ARRAY_T slave_leds;
 extern const GAMMA_TABLE_T gamma_table;
 extern const LIGHT_PROGRAMS_T light_programs;
+extern const LIGHT_PROGRAM_FUNCTION_T native_light_programs[];
+extern volatile const uint32_t uploaded_light_programs[UPLOADED_LIGHT_PROGRAMS_SIZE / 4];
 
 extern GLOBAL_FLAGS_T global_flags;
 extern CHANNEL_T channel[3];
-extern SERVO_ENDPOINTS_T servo_output_endpoint;
+extern SERVO_ENDPOINTS_T servo_output_endpoint[NUMBER_OF_SERVO_OUTPUTS];
+extern ENDPOINT_DELTA_T learned_endpoint_delta[2];      // ST and TH
 
 
 // ****************************************************************************
@@ -559,6 +837,10 @@ bool diagnostics_enabled(void);
 
 void load_persistent_storage(void);
 void write_persistent_storage(void);
+bool write_flash_page(volatile const uint32_t *page, const uint32_t *data);
+
+bool maintenance_requested(void);
+void run_maintenance_mode(void);
 
 void init_servo_reader(void);
 void read_all_servo_channels(void);
@@ -567,6 +849,11 @@ void SCT_irq_handler(void);
 void init_uart_reader(void);
 void read_preprocessor(void);
 
+bool debugger_receive_byte(uint8_t uart_byte);
+void debugger_send_frame(uint8_t command, const uint8_t *payload, uint8_t length);
+void light_program_debugger_command(
+    uint8_t command, const uint8_t *payload, uint8_t length);
+
 void process_ch3_clicks(void);
 
 void process_drive_mode(void);
@@ -578,6 +865,7 @@ void init_servo_output(void);
 void process_servo_output(void);
 void servo_output_setup_action(uint8_t ch3_clicks);
 void gearbox_action(uint8_t ch3_clicks);
+void servo_output_irq_handler(void);
 
 void process_winch(void);
 void winch_action(uint8_t ch3_clicks);
@@ -588,9 +876,14 @@ void reversing_setup_action(uint8_t ch3_clicks);
 
 void output_preprocessor(void);
 
+void uart_mux_send(UART_MUX_CHANNEL_T mux_channel, const uint8_t *payload, uint8_t length);
+void process_uart_mux(void);
+UART_MUX_RESULT_T uart_mux_receive_byte(uint8_t uart_byte, const UART_MUX_FRAME_T **frame);
+
 void init_lights(void);
 void process_lights(void);
 void next_light_sequence(void);
+void post_light_program_event(LIGHT_PROGRAM_EVENT_T event);
 void light_switch_up(void);
 void light_switch_down(void);
 void toggle_light_switch(void);
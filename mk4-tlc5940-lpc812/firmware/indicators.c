@@ -78,6 +78,8 @@ void toggle_hazard_lights(void)
 {
     synchronize_blinking();
     global_flags.blink_hazard = ~global_flags.blink_hazard;
+    post_light_program_event(global_flags.blink_hazard ?
+        RUN_ON_HAZARD_ON : RUN_ON_HAZARD_OFF);
 }
 
 
@@ -8,6 +8,9 @@
           there is no heap (malloc)
         - Mini programming language
             - GOTO to implement loops
+            - CALL/RETURN for subroutines shared by multiple programs
+            - PATTERN table[frame] to set a range of LEDs from a table of
+              brightness values
             - FADE start_led stop_led value (0..100%)
             - FADE start_led stop_led VARIABLE  (0..100%)
             - SLEEP time (ms)
@@ -20,6 +23,8 @@
             - VARIABLE /= {integer, VARIABLE, LED[x], random-value, TH, ST}
             - SET start_led, stop_led = value (0..100%)
             - SET start_led, stop_led = VARIABLE (0..100%)
+            - SET led_mask = value, SET led_mask = VARIABLE, and FADE likewise,
+              for LEDs that are not a consecutive range
             - SKIP IF EQUAL {VARIABLE, LED[x]} {integer, VARIABLE, LED[x], random-value, TH, ST}
             - SKIP IF NOT EQUAL {VARIABLE, LED[x]} {integer, VARIABLE, LED[x], random-value, TH, ST}
             - SKIP IF GREATER OR EQUAL {VARIABLE, LED[x]} {integer, VARIABLE, LED[x], random-value, TH, ST}
@@ -32,8 +37,13 @@
 
 
         - INSTRUCTIONS and OPCODES
-            - Every instruction is 4 bytes
-            - This means that 1 byte opcode + 3 bytes parameters is feasible
+            - Instructions are 1 to 6 bytes: 1 byte opcode + up to 5 bytes
+              parameters. The opcode determines the length.
+            - Short forms (3 bytes) exist for SET/FADE of a single LED and
+              for variable operations with a small (int8_t) immediate
+            - GOTO, CALL and PATTERN targets are byte offsets relative to the
+              next instruction, so that code works the same in programs and
+              in subroutines
             - End-of-program marker to find different programs in the flash
             - 0x00 and 0xff should not be used (empty flash, 0 initialized)
               for opcodes
@@ -48,6 +58,12 @@
             - For SKIP IF EQ... we need to deal with 16 bit immediates. The
               easiest way is to make separate opcodes for immediates and LEDs,
               and immediates and variables, and led/var led/var.
+            - Instructions with a variable or LED and a 16 bit parameter are
+              encoded as: opcode, var/led, parameter low, parameter high.
+              The parameter is either an immediate, or a type (high byte)
+              and id (low byte) for opcodes with an even number.
+            - SKIP IF ANY/ALL/NONE store bits 28..24 of the run-state-mask in
+              the opcode, followed by bits 7..0, 15..8 and 23..16
 
         * VARIABLES
             - Global pool of variables, assigned at "compile time"
@@ -69,9 +85,11 @@
             - Only execute a certain number of instructions per systick
         - Programs are active because of an event, or because of a match state
         - Program triggering events
-            - Gearbox change event
-            - There can only be one event active
-            - New events stop currently running events
+            - Gearbox change, light switch up/down, clicks, hazard on/off,
+              winch started, signal recovered (see LIGHT_PROGRAM_EVENT_T)
+            - The firmware modules post events into a small queue; each
+              event starts every program that runs on it
+            - New events stop currently running programs of the same event
             - Event programs have priority over other programs regarding light use
         - Run states
             - Any of the car states
@@ -82,38 +100,166 @@
 
 
     The first  word of a light program defines the priority states when the
-    program is run.
+    program is run. Bits 8..23 locate the local variables of the program,
+    which are cleared when the program starts (see VARIABLES_BASE in
+    globals.h).
 
     The second word of a light program defines the car states when the program
-    is run. This is mutually exclusive with the priority states.
+    is run. This is mutually exclusive with the priority states. Programs
+    declared with "run on <event>" have the events in bits 23..30 instead;
+    they run from the start when one of the events is posted, until they
+    end.
 
     The third word  is a bit-field, each bit indicating
     whether the corresponding LED is used by the light program.
     If a light is used that is not specified here, weird things may happen.
 
+    The instructions follow as a stream of bytes, padded with zeros to the
+    next word boundary after the end-of-program marker.
+
 
 
 ******************************************************************************/
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <globals.h>
 #include <uart0.h>
 #include <utils.h>
 
-#define MAX_INSTRUCTIONS_PER_SYSTICK 30
-
 // Pre-defined global variables in var[]
 #define GLOBAL_VAR_CLICKS 0
 #define GLOBAL_VAR_LIGHT_SWITCH_POSITION 1
 
-typedef struct {
-    const uint32_t *PC;
-    uint16_t timer;
-    unsigned event : 1;
-} LIGHT_PROGRAM_CPU_T;
+// Pointer to the first instruction of a light program
+#define FIRST_OPCODE(program) ((const uint8_t *)((program) + FIRST_OPCODE_OFFSET))
+
+// Return addresses are stored relative to this to save RAM
+#define PROGRAMS_BASE ((const uint8_t *)active_light_programs->programs)
+
+// End of the light programs built into the firmware image, including their
+// subroutines, pattern tables and native code. Defined by the linker script
+// at the end of the .light_programs section; it limits the verification of
+// a corrupt image.
+#ifndef LIGHT_PROGRAMS_END
+extern const uint8_t _elight_programs[];
+#define LIGHT_PROGRAMS_END _elight_programs
+#endif
+
+#ifdef LIGHT_PROGRAM_UPLOAD
+// Light programs uploaded over the UART in maintenance mode (maintenance.c).
+// The region is part of the firmware image so that flashing a firmware
+// removes previously uploaded light programs.
+__attribute__ ((section(".uploaded_light_programs")))
+volatile const uint32_t uploaded_light_programs[UPLOADED_LIGHT_PROGRAMS_SIZE / 4];
+#endif
+
+// The light programs in use: the uploaded light programs if they are valid,
+// otherwise the light programs built into the firmware image
+static const LIGHT_PROGRAMS_T *active_light_programs = &light_programs;
+static uint32_t programs_size;
 
 static LIGHT_PROGRAM_CPU_T cpu[MAX_LIGHT_PROGRAMS];
+
+#ifdef LIGHT_PROGRAM_STATISTICS
+// Execution counters of each light program, to find programs that use up
+// their MAX_INSTRUCTIONS_PER_SYSTICK or loop without sleeping. They are
+// printed on the diagnostics output every STATISTICS_INTERVAL; the program
+// counters are offsets into programs[] and can be mapped to source lines
+// with tools/light_program_statistics.py and the source map written by the
+// light program assembler.
+#define STATISTICS_INTERVAL (10000 / __SYSTICK_IN_MS)
+
+typedef struct {
+    uint32_t instructions;      // Instructions executed (bytecode only)
+    uint32_t systicks;          // Systicks in which the program ran
+    uint16_t budget_exhausted;  // Systicks that ended with the budget used up
+    uint16_t resets;            // Restarts because the run condition ended
+    uint16_t since_yield;       // Systicks since the last SLEEP or END
+    uint16_t max_since_yield;
+    uint16_t exhausted_pc;      // Where the budget was last used up
+} LIGHT_PROGRAM_STATISTICS_T;
+
+static LIGHT_PROGRAM_STATISTICS_T statistics[MAX_LIGHT_PROGRAMS];
+#endif
+
+#ifdef LIGHT_PROGRAM_DEBUGGER
+// Light program debugger: tools/light_program_debugger.py halts the light
+// programs, single-steps them, sets breakpoints and reads or writes var[] and
+// light_setpoint[]. The frames are received and sent by debugger.c; the
+// commands are handled by light_program_debugger_command().
+//
+// While halted no light program is executed or reset; the LEDs used by the
+// light programs keep their brightness while the rest of the mainloop
+// continues. Breakpoints and program counters are offsets into programs[],
+// which the source map of the light program assembler maps to source lines.
+#define DEBUGGER_PROTOCOL_VERSION 1
+#define MAX_BREAKPOINTS 4
+#define NO_BREAKPOINT 0         // Offset 0 is the header of the first program
+#define HALTED_BY_HOST 0xff
+#define NATIVE_PC 0xffff
+#define MAX_VARIABLES_PER_READ 30
+
+#define COMMAND_STATUS 0x20
+#define COMMAND_HALT 0x21
+#define COMMAND_RESUME 0x22
+#define COMMAND_STEP 0x23
+#define COMMAND_PROGRAM 0x24
+#define COMMAND_BREAKPOINT 0x25
+#define COMMAND_READ_VARIABLES 0x26
+#define COMMAND_WRITE_VARIABLE 0x27
+#define COMMAND_READ_LIGHTS 0x28
+#define COMMAND_WRITE_LIGHT 0x29
+#define EVENT_HALTED 0x30
+#define RESPONSE_ACK 0x06
+#define RESPONSE_NAK 0x15
+
+#define ERROR_UNKNOWN_COMMAND 1
+#define ERROR_INVALID_PARAMETER 2
+#define ERROR_NOT_HALTED 3
+#define ERROR_NATIVE_CODE 4
+
+static struct {
+    bool halted;
+    uint8_t halted_by;          // Program that hit a breakpoint, or HALTED_BY_HOST
+    uint32_t leds_used;         // LEDs used by the light programs when halted
+    uint16_t breakpoint[MAX_BREAKPOINTS];
+    int instruction_budget;     // 1 while single-stepping
+
+    // Program executed by COMMAND_STEP while halted
+    const LIGHT_PROGRAM_CPU_T *stepping;
+
+    // After COMMAND_RESUME the program continues at the breakpoint it was
+    // halted at, so that breakpoint is ignored once
+    const LIGHT_PROGRAM_CPU_T *resuming;
+    const uint8_t *resume_pc;
+
+    // LEDs of programs with higher priority, for single-stepping
+    uint32_t leds_already_used[MAX_LIGHT_PROGRAMS];
+} debugger = {
+    .instruction_budget = MAX_INSTRUCTIONS_PER_SYSTICK
+};
+
+#define INSTRUCTION_BUDGET debugger.instruction_budget
+#else
+#define INSTRUCTION_BUDGET MAX_INSTRUCTIONS_PER_SYSTICK
+#endif
+
+// Events posted by the firmware modules, handled by
+// process_light_program_events() in the same mainloop
+#define EVENT_QUEUE_SIZE 4
+
+static struct {
+    LIGHT_PROGRAM_EVENT_T event[EVENT_QUEUE_SIZE];
+    uint8_t first;
+    uint8_t count;
+} event_queue;
+
+// Number of light programs executed. Remains 0 when the light programs fail
+// verification, so that a corrupt image only disables the light programs.
+static int number_of_programs;
+
 static uint32_t car_state;
 static uint32_t run_state;
 static uint32_t priority_run_state;
@@ -125,6 +271,17 @@ extern LED_T light_actual[];
 extern uint8_t max_change_per_systick[];
 extern uint8_t light_switch_position;
 
+// Only present when the light programs are compiled to native code
+extern const LIGHT_PROGRAM_FUNCTION_T native_light_programs[] __attribute__((weak));
+
+static LIGHT_PROGRAM_ENVIRONMENT_T environment = {
+    .var = var,
+    .light_setpoint = light_setpoint,
+    .max_change_per_systick = max_change_per_systick,
+    .light_actual = light_actual,
+    .random_min_max = random_min_max
+};
+
 
 void init_light_programs(void);
 void process_light_program_events(void);
@@ -134,21 +291,178 @@ uint32_t process_light_programs(void);
 // ****************************************************************************
 static void reset_program(int n)
 {
-    cpu[n].PC = light_programs.start[n] + FIRST_OPCODE_OFFSET;
+    uint32_t priority = *(active_light_programs->start[n] + PRIORITY_STATE_OFFSET);
+
+    cpu[n].PC = FIRST_OPCODE(active_light_programs->start[n]);
+    cpu[n].resume = 0;
     cpu[n].timer = 0;
+    cpu[n].sp = 0;
     cpu[n].event = 0;
+    cpu[n].var_base = VARIABLES_BASE(priority);
+    cpu[n].var_clear = VARIABLES_COUNT(priority);
 }
 
 
 // ****************************************************************************
-void init_light_programs(void)
+// Start the program from the beginning after an error in the light program
+static void restart_program(const uint32_t *program, LIGHT_PROGRAM_CPU_T *c)
 {
+    c->PC = FIRST_OPCODE(program);
+    c->resume = 0;
+    c->sp = 0;
+    c->event = 0;
+}
+
+
+#ifdef LIGHT_PROGRAM_STATISTICS
+// ****************************************************************************
+// The program ended its systick by SLEEP or END
+static void count_yield(const LIGHT_PROGRAM_CPU_T *c, int instructions)
+{
+    LIGHT_PROGRAM_STATISTICS_T *s = &statistics[c - cpu];
+
+    s->instructions += instructions;
+    s->since_yield = 0;
+}
+
+
+// ****************************************************************************
+// The program used up MAX_INSTRUCTIONS_PER_SYSTICK. pc is the offset of the
+// next instruction in programs[], 0xffff for native code.
+static void count_budget_exhausted(
+    const LIGHT_PROGRAM_CPU_T *c, int instructions, uint16_t pc)
+{
+    LIGHT_PROGRAM_STATISTICS_T *s = &statistics[c - cpu];
+
+    s->instructions += instructions;
+    s->exhausted_pc = pc;
+    if (s->budget_exhausted < 0xffff) {
+        ++s->budget_exhausted;
+    }
+    if (s->since_yield < 0xffff) {
+        ++s->since_yield;
+    }
+    if (s->since_yield > s->max_since_yield) {
+        s->max_since_yield = s->since_yield;
+    }
+}
+
+
+// ****************************************************************************
+// Count the reset of a program whose run condition no longer matches, unless
+// it is still in its initial state
+static void count_reset(int n)
+{
+    if (cpu[n].PC != FIRST_OPCODE(active_light_programs->start[n])  ||
+        cpu[n].resume  ||  cpu[n].timer) {
+
+        if (statistics[n].resets < 0xffff) {
+            ++statistics[n].resets;
+        }
+    }
+}
+
+
+// ****************************************************************************
+static void output_statistics(void)
+{
+    static uint16_t interval = STATISTICS_INTERVAL;
+    LIGHT_PROGRAM_STATISTICS_T *s;
     int i;
 
-    for (i = 0; i < light_programs.number_of_programs; i++) {
-        reset_program(i);
+    if (--interval) {
+        return;
+    }
+    interval = STATISTICS_INTERVAL;
+
+    if (!diagnostics_enabled()) {
+        return;
+    }
+
+    for (i = 0; i < number_of_programs; i++) {
+        s = &statistics[i];
+
+        uart0_send_cstring("LP ");
+        uart0_send_uint32(i);
+        uart0_send_cstring(" instructions ");
+        uart0_send_uint32(s->instructions);
+        uart0_send_cstring(" systicks ");
+        uart0_send_uint32(s->systicks);
+        uart0_send_cstring(" exhausted ");
+        uart0_send_uint32(s->budget_exhausted);
+        uart0_send_cstring(" resets ");
+        uart0_send_uint32(s->resets);
+        uart0_send_cstring(" since_yield ");
+        uart0_send_uint32(s->since_yield);
+        uart0_send_cstring(" max_since_yield ");
+        uart0_send_uint32(s->max_since_yield);
+        uart0_send_cstring(" pc ");
+        if (active_light_programs->magic.version & LIGHT_PROGRAMS_NATIVE) {
+            uart0_send_uint16_hex(0xffff);
+        }
+        else {
+            uart0_send_uint16_hex(cpu[i].PC - PROGRAMS_BASE);
+        }
+        uart0_send_cstring(" exhausted_pc ");
+        uart0_send_uint16_hex(s->exhausted_pc);
+        uart0_send_linefeed();
     }
 }
+#endif
+
+
+#ifdef LIGHT_PROGRAM_DEBUGGER
+// ****************************************************************************
+// Returns true, and halts the light programs, if the instruction at pc has a
+// breakpoint
+static bool hit_breakpoint(const LIGHT_PROGRAM_CPU_T *c, const uint8_t *pc)
+{
+    uint16_t offset = pc - PROGRAMS_BASE;
+    uint8_t event[3];
+    int i;
+
+    if (c == debugger.stepping) {
+        return false;
+    }
+
+    if (c == debugger.resuming  &&  pc == debugger.resume_pc) {
+        debugger.resuming = NULL;
+        return false;
+    }
+
+    for (i = 0; i < MAX_BREAKPOINTS; i++) {
+        if (debugger.breakpoint[i] == offset) {
+            debugger.halted = true;
+            debugger.halted_by = c - cpu;
+            debugger.resuming = NULL;
+
+            event[0] = c - cpu;
+            event[1] = offset & 0xff;
+            event[2] = offset >> 8;
+            debugger_send_frame(EVENT_HALTED, event, sizeof(event));
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+
+// ****************************************************************************
+// Reset a program whose run condition does not match
+static void stop_program(int n)
+{
+#ifdef LIGHT_PROGRAM_DEBUGGER
+    // Halted programs keep their state for inspection
+    if (debugger.halted) {
+        return;
+    }
+#endif
+#ifdef LIGHT_PROGRAM_STATISTICS
+    count_reset(n);
+#endif
+    reset_program(n);
+}
 
 
 // ****************************************************************************
@@ -241,6 +555,11 @@ static void load_light_program_environment(void)
     if (global_flags.reversing_setup & REVERSING_SETUP_THROTTLE) {
         car_state |= CAR_STATE_REVERSING_SETUP_THROTTLE;
     }
+
+    environment.car_state = car_state;
+    environment.steering = channel[ST].normalized;
+    environment.throttle = channel[TH].normalized;
+    environment.gear = global_flags.gear;
 }
 
 
@@ -257,14 +576,10 @@ static void limit_light_switch_position_variable(void)
 
 
 // ****************************************************************************
-static int16_t get_cmp1(uint32_t instruction)
+static int16_t get_cmp1(uint8_t opcode, uint8_t id)
 {
-    uint8_t id;
-
-    id = (instruction >> 16) & 0xff;
-
     // Bit 2 in the opcode field is cleared for VARIABLE, set for LED
-    if (instruction & 0x02000000) {
+    if (opcode & 0x02) {
         return light_actual[id];
     }
     else {
@@ -274,23 +589,22 @@ static int16_t get_cmp1(uint32_t instruction)
 
 
 // ****************************************************************************
-static int16_t get_parameter_value(uint32_t instruction)
+static int16_t get_parameter_value(uint8_t opcode, uint16_t parameter)
 {
-    uint8_t type;
     // Odd numbered opcodes have an immediate as parameter
-    if (instruction & 0x01000000) {
-        return (int16_t)(instruction & 0xffff);
+    if (opcode & 0x01) {
+        return (int16_t)parameter;
     }
 
     // Even numbered opcodes have either variable, led or random as parameter,
-    // determined by param2 of the opcode
-    type = instruction >> 8;
-    switch (type) {
+    // determined by the high byte of the parameter. Unknown types have been
+    // rejected by verify_light_programs().
+    switch (parameter >> 8) {
         case PARAMETER_TYPE_VARIABLE:
-            return var[instruction & 0xff];
+            return var[parameter & 0xff];
 
         case PARAMETER_TYPE_LED:
-            return light_actual[instruction & 0xff] * 100 / 255;
+            return light_actual[parameter & 0xff] * 100 / 255;
 
         case PARAMETER_TYPE_RANDOM:
             return (int16_t)random_min_max(1, 0xffff);
@@ -302,87 +616,522 @@ static int16_t get_parameter_value(uint32_t instruction)
             return channel[TH].normalized;
 
         case PARAMETER_TYPE_GEAR:
+        default:
             return global_flags.gear;
+    }
+}
+
+
+// ****************************************************************************
+// Length in bytes of each instruction, indexed by the opcode.
+// A table is used as a chain of comparisons is considerably slower; the
+// length is needed for every instruction executed.
+static const uint8_t instruction_length[256] = {
+    4, 3, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 1, 5, 5,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 4, 4, 4, 4,
+    3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 1, 4,
+};
+
+
+// ****************************************************************************
+// Verification of the light programs
+//
+// The light programs are verified once in init_light_programs(), so that
+// execute_program() does not have to check opcodes, jump targets, variable
+// ids and LED indices for every instruction. tools/validate_image_file.py
+// performs the same checks on the firmware image.
+//
+// The programs, subroutines and pattern tables are stored as consecutive
+// blocks, starting at active_light_programs->programs. Each block starts at a
+// word boundary; the top-most byte of the first word identifies it:
+//
+//   0x00                   Light program (the priority state)
+//   OPCODE_SUBROUTINE      Subroutine
+//   OPCODE_PATTERN_TABLE   Pattern table
+//   OPCODE_END_OF_PROGRAMS End of the light programs
+// ****************************************************************************
+// Returns the first byte after the block, or NULL if the block is corrupt
+static const uint8_t *end_of_block(const uint32_t *block)
+{
+    const uint8_t *end;
+
+    switch (*block >> 24) {
+        case 0:
+            end = FIRST_OPCODE(block);
+            while ((uint32_t)(end - PROGRAMS_BASE) < programs_size  &&
+                    *end != OPCODE_END_OF_PROGRAM) {
+                end += instruction_length[*end];
+            }
+            ++end;
+            break;
+
+        case OPCODE_SUBROUTINE:
+            end = (const uint8_t *)(block + SUBROUTINE_FIRST_OPCODE_OFFSET) +
+                (*block & 0xffff);
+            break;
+
+        case OPCODE_PATTERN_TABLE:
+            end = (const uint8_t *)(block + PATTERN_TABLE_FIRST_BYTE_OFFSET) +
+                (*block & 0xffff);
+            break;
 
         default:
+            return NULL;
+    }
+
+    // There must be room for the header of the next block
+    if ((uint32_t)(end - PROGRAMS_BASE) > programs_size - 4) {
+        return NULL;
+    }
+    return end;
+}
+
+
+// ****************************************************************************
+static const uint32_t *next_block(const uint32_t *block)
+{
+    const uint8_t *end = end_of_block(block);
+
+    if (end == NULL) {
+        return NULL;
+    }
+    return (const uint32_t *)(PROGRAMS_BASE + ((end - PROGRAMS_BASE + 3) & ~3));
+}
+
+
+// ****************************************************************************
+// Returns true if header is the first word of a block of the given type
+static bool is_block(const uint8_t *header, uint8_t type)
+{
+    const uint32_t *block = active_light_programs->programs;
+
+    while ((const uint8_t *)block < header) {
+        if ((*block >> 24) == OPCODE_END_OF_PROGRAMS) {
+            return false;
+        }
+        block = next_block(block);
+        if (block == NULL) {
+            return false;
+        }
+    }
+    return ((const uint8_t *)block == header)  &&  ((*block >> 24) == type);
+}
+
+
+// ****************************************************************************
+// Returns true if target is the first byte of an instruction in first..end
+static bool is_instruction(
+    const uint8_t *first, const uint8_t *end, const uint8_t *target)
+{
+    const uint8_t *pc = first;
+
+    if (target < first  ||  target >= end) {
+        return false;
+    }
+
+    while (pc < target) {
+        pc += instruction_length[*pc];
+    }
+    return pc == target;
+}
+
+
+// ****************************************************************************
+static bool is_valid_parameter(uint8_t opcode, uint16_t parameter)
+{
+    // Odd numbered opcodes have an immediate as parameter
+    if (opcode & 0x01) {
+        return true;
+    }
+
+    switch (parameter >> 8) {
+        case PARAMETER_TYPE_VARIABLE:
+            return (parameter & 0xff) < MAX_LIGHT_PROGRAM_VARIABLES;
+
+        case PARAMETER_TYPE_LED:
+            return (parameter & 0xff) < MAX_LIGHTS;
+
+        case PARAMETER_TYPE_RANDOM:
+        case PARAMETER_TYPE_STEERING:
+        case PARAMETER_TYPE_THROTTLE:
+        case PARAMETER_TYPE_GEAR:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+// ****************************************************************************
+static bool is_valid_pattern(const uint8_t *table, uint8_t first_led)
+{
+    uint32_t length;
+
+    if (!is_block(table - 4 * PATTERN_TABLE_FIRST_BYTE_OFFSET,
+            OPCODE_PATTERN_TABLE)) {
+        return false;
+    }
+
+    // table[0] is the number of LEDs per frame, table[1] the number of frames
+    length = *(const uint32_t *)(table - 4 * PATTERN_TABLE_FIRST_BYTE_OFFSET) & 0xffff;
+    return table[1] != 0  &&
+        (uint32_t)(2 + table[0] * table[1]) <= length  &&
+        (first_led + table[0]) <= MAX_LIGHTS;
+}
+
+
+// ****************************************************************************
+// Verify the instructions of a light program or subroutine. end points to
+// the first byte after the last instruction, which is OPCODE_END_OF_PROGRAM
+// for light programs, and OPCODE_RETURN or OPCODE_GOTO for subroutines.
+static bool verify_code(const uint8_t *first, const uint8_t *end, bool subroutine)
+{
+    const uint8_t *pc = first;
+    const uint8_t *next;
+    uint8_t opcode = OPCODE_END_OF_PROGRAMS;
+
+    while (pc < end) {
+        uint8_t operand1;
+        uint8_t operand2;
+        uint8_t operand3;
+        uint16_t parameter;
+        bool valid;
+
+        opcode = pc[0];
+        operand1 = pc[1];
+        operand2 = pc[2];
+        operand3 = pc[3];
+        next = pc + instruction_length[opcode];
+        parameter = operand2 | (operand3 << 8);
+
+        if (next > end) {
+            return false;
+        }
+
+        if ((opcode >= FIRST_SKIP_IF_OPCODE  &&  opcode <= LAST_SKIP_IF_OPCODE)  ||
+            (opcode >= OPCODE_SKIP_IF_ANY  &&  opcode <= (OPCODE_SKIP_IF_NONE | 0x1f))) {
+
+            // There must be an instruction to skip, other than the end of
+            // the program. Subroutines have no OPCODE_END_OF_PROGRAM, so
+            // skipping their final RETURN or GOTO would run into the next
+            // block.
+            if (next >= end  ||  *next == OPCODE_END_OF_PROGRAM) {
+                return false;
+            }
+            if (subroutine  &&  next + instruction_length[*next] >= end) {
+                return false;
+            }
+
+            valid = true;
+            if (opcode <= LAST_SKIP_IF_OPCODE) {
+                // Bit 2 in the opcode field is cleared for VARIABLE, set for LED
+                valid = ((opcode & 0x02) ?
+                    (operand1 < MAX_LIGHTS) :
+                    (operand1 < MAX_LIGHT_PROGRAM_VARIABLES))  &&
+                    is_valid_parameter(opcode, parameter);
+            }
+        }
+        else {
+            switch (opcode) {
+                case OPCODE_SET:
+                case OPCODE_FADE:
+                    valid = (operand3 < MAX_LIGHT_PROGRAM_VARIABLES)  &&
+                        (operand1 <= operand2)  &&  (operand2 < MAX_LIGHTS);
+                    break;
+
+                case OPCODE_SET_I:
+                case OPCODE_FADE_I:
+                    valid = (operand1 <= operand2)  &&  (operand2 < MAX_LIGHTS);
+                    break;
+
+                case OPCODE_SET_LED:
+                case OPCODE_FADE_LED:
+                    valid = (operand2 < MAX_LIGHT_PROGRAM_VARIABLES)  &&
+                        (operand1 < MAX_LIGHTS);
+                    break;
+
+                case OPCODE_SET_LED_I:
+                case OPCODE_FADE_LED_I:
+                    valid = (operand1 < MAX_LIGHTS);
+                    break;
+
+                case OPCODE_SET_MASK:
+                case OPCODE_FADE_MASK:
+                    valid = (operand1 < MAX_LIGHT_PROGRAM_VARIABLES);
+                    break;
+
+                case OPCODE_SET_MASK_I:
+                case OPCODE_FADE_MASK_I:
+                    valid = true;
+                    break;
+
+                case OPCODE_PATTERN:
+                    valid = (pc[4] < MAX_LIGHT_PROGRAM_VARIABLES)  &&
+                        is_valid_pattern(
+                            next + (int16_t)(operand1 | (operand2 << 8)), operand3);
+                    break;
+
+                case OPCODE_PATTERN_I:
+                    valid = is_valid_pattern(
+                        next + (int16_t)(operand1 | (operand2 << 8)), operand3);
+                    break;
+
+                case OPCODE_SLEEP:
+                case OPCODE_SLEEP_I:
+                    valid = is_valid_parameter(opcode, operand1 | (operand2 << 8));
+                    break;
+
+                case OPCODE_GOTO:
+                    valid = is_instruction(first, end,
+                        next + (int16_t)(operand1 | (operand2 << 8)));
+                    break;
+
+                case OPCODE_CALL:
+                    // The target is the first instruction of a subroutine
+                    valid = is_block(next + (int16_t)(operand1 | (operand2 << 8)) -
+                        4 * SUBROUTINE_FIRST_OPCODE_OFFSET, OPCODE_SUBROUTINE);
+                    break;
+
+                case OPCODE_RETURN:
+                    valid = subroutine;
+                    break;
+
+                case OPCODE_ASSIGN:
+                case OPCODE_ASSIGN_I:
+                case OPCODE_ADD:
+                case OPCODE_ADD_I:
+                case OPCODE_SUBTRACT:
+                case OPCODE_SUBTRACT_I:
+                case OPCODE_MULTIPLY:
+                case OPCODE_MULTIPLY_I:
+                case OPCODE_DIVIDE:
+                case OPCODE_DIVIDE_I:
+                case OPCODE_AND:
+                case OPCODE_AND_I:
+                case OPCODE_OR:
+                case OPCODE_OR_I:
+                case OPCODE_XOR:
+                case OPCODE_XOR_I:
+                case OPCODE_ABS:
+                case OPCODE_ABS_I:
+                    valid = (operand1 < MAX_LIGHT_PROGRAM_VARIABLES)  &&
+                        is_valid_parameter(opcode, parameter);
+                    break;
+
+                case OPCODE_ASSIGN_S:
+                case OPCODE_ADD_S:
+                case OPCODE_SUBTRACT_S:
+                case OPCODE_MULTIPLY_S:
+                case OPCODE_DIVIDE_S:
+                case OPCODE_AND_S:
+                case OPCODE_OR_S:
+                case OPCODE_XOR_S:
+                    valid = (operand1 < MAX_LIGHT_PROGRAM_VARIABLES);
+                    break;
+
+                case OPCODE_END_OF_PROGRAM:
+                    valid = !subroutine;
+                    break;
+
+                default:
+                    valid = false;
+                    break;
+            }
+        }
+
+        if (!valid) {
+#ifndef NODEBUG
+            if (diagnostics_enabled()) {
+                uart0_send_cstring("INVALID LIGHT PROGRAM INSTRUCTION AT 0x");
+                uart0_send_uint16_hex((uint16_t)(pc - PROGRAMS_BASE));
+                uart0_send_linefeed();
+            }
+#endif
+            return false;
+        }
+
+        pc = next;
+    }
+
+    // The last instruction must not fall through to the following block
+    if (subroutine) {
+        return (opcode == OPCODE_RETURN)  ||  (opcode == OPCODE_GOTO);
+    }
+    return (opcode == OPCODE_END_OF_PROGRAM);
+}
+
+
+// ****************************************************************************
+// Returns true if all blocks of the light programs are valid, and the start
+// of each light program points to a light program block
+static bool verify_light_programs(void)
+{
+    const uint32_t *block = active_light_programs->programs;
+    const uint8_t *first;
+    int n = 0;
+
+    if (active_light_programs->magic.magic_value != ROM_MAGIC  ||
+        active_light_programs->magic.type != LIGHT_PROGRAMS  ||
+        active_light_programs->number_of_programs < 0  ||
+        active_light_programs->number_of_programs > MAX_LIGHT_PROGRAMS) {
+        return false;
+    }
+
+    while ((*block >> 24) != OPCODE_END_OF_PROGRAMS) {
+        const uint8_t *end = end_of_block(block);
+
+        if (end == NULL) {
+            return false;
+        }
+
+        switch (*block >> 24) {
+            case 0:
+                if (n >= active_light_programs->number_of_programs  ||
+                    active_light_programs->start[n] != block) {
+                    return false;
+                }
+                ++n;
+                if (VARIABLES_BASE(*block) + VARIABLES_COUNT(*block) >
+                        MAX_LIGHT_PROGRAM_VARIABLES) {
+                    return false;
+                }
+                if (!verify_code(FIRST_OPCODE(block), end, false)) {
+                    return false;
+                }
+                break;
+
+            case OPCODE_SUBROUTINE:
+                first = (const uint8_t *)(block + SUBROUTINE_FIRST_OPCODE_OFFSET);
+                if (!verify_code(first, end, true)) {
+                    return false;
+                }
+                break;
+
+            case OPCODE_PATTERN_TABLE:
+            default:
+                break;
+        }
+
+        block = next_block(block);
+    }
+
+    return n == active_light_programs->number_of_programs;
+}
+
+
+// ****************************************************************************
+// Use the light programs uploaded in maintenance mode if there are valid
+// ones. They can not have native code, as that is part of the firmware.
+static bool use_uploaded_light_programs(void)
+{
+#ifdef LIGHT_PROGRAM_UPLOAD
+    active_light_programs = (const LIGHT_PROGRAMS_T *)uploaded_light_programs;
+    programs_size = UPLOADED_LIGHT_PROGRAMS_SIZE -
+        offsetof(LIGHT_PROGRAMS_T, programs);
+
+    if (active_light_programs->magic.version == LIGHT_PROGRAMS_VERSION  &&
+        verify_light_programs()) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+
+// ****************************************************************************
+void init_light_programs(void)
+{
+    int i;
+
+    number_of_programs = 0;
+
+    // Prefer the uploaded light programs
+    if (!use_uploaded_light_programs()) {
+        active_light_programs = &light_programs;
+        programs_size = LIGHT_PROGRAMS_END - PROGRAMS_BASE;
+
+        if (!verify_light_programs()) {
 #ifndef NODEBUG
             if (diagnostics_enabled()) {
-                uart0_send_cstring("UNKNOWN PARAMETER TYPE ");
-                uart0_send_uint32(type);
+                uart0_send_cstring("LIGHT PROGRAMS DISABLED: VERIFICATION FAILED");
                 uart0_send_linefeed();
             }
 #endif
-            return 0;
+            return;
+        }
+    }
+
+    number_of_programs = active_light_programs->number_of_programs;
+    for (i = 0; i < number_of_programs; i++) {
+        reset_program(i);
     }
 }
 
 
-static void execute_skip_if(uint8_t opcode, uint32_t instruction,
-    LIGHT_PROGRAM_CPU_T *c)
+// ****************************************************************************
+// Returns true if the condition of the SKIP IF instruction is met, i.e. the
+// next instruction has to be skipped
+static bool skip_if_condition(uint8_t opcode, uint8_t id, uint16_t parameter)
 {
     int16_t cmp1;
     int16_t cmp2;
 
-    cmp1 = get_cmp1(instruction);
-    cmp2 = get_parameter_value(instruction);
+    cmp1 = get_cmp1(opcode, id);
+    cmp2 = get_parameter_value(opcode, parameter);
 
     switch (opcode) {
         case OPCODE_SKIP_IF_EQ_V:
         case OPCODE_SKIP_IF_EQ_VI:
         case OPCODE_SKIP_IF_EQ_L:
         case OPCODE_SKIP_IF_EQ_LI:
-            if (cmp1 == cmp2) {
-                ++c->PC;
-            }
-            break;
+            return (cmp1 == cmp2);
 
         case OPCODE_SKIP_IF_NE_V:
         case OPCODE_SKIP_IF_NE_VI:
         case OPCODE_SKIP_IF_NE_L:
         case OPCODE_SKIP_IF_NE_LI:
-            if (cmp1 != cmp2) {
-                ++c->PC;
-            }
-            break;
+            return (cmp1 != cmp2);
 
         case OPCODE_SKIP_IF_GT_V:
         case OPCODE_SKIP_IF_GT_VI:
         case OPCODE_SKIP_IF_GT_L:
         case OPCODE_SKIP_IF_GT_LI:
-            if (cmp1 > cmp2) {
-                ++c->PC;
-            }
-            break;
+            return (cmp1 > cmp2);
 
         case OPCODE_SKIP_IF_GE_V:
         case OPCODE_SKIP_IF_GE_VI:
         case OPCODE_SKIP_IF_GE_L:
         case OPCODE_SKIP_IF_GE_LI:
-            if (cmp1 >= cmp2) {
-                ++c->PC;
-            }
-            break;
+            return (cmp1 >= cmp2);
 
         case OPCODE_SKIP_IF_LT_V:
         case OPCODE_SKIP_IF_LT_VI:
         case OPCODE_SKIP_IF_LT_L:
         case OPCODE_SKIP_IF_LT_LI:
-            if (cmp1 < cmp2) {
-                ++c->PC;
-            }
-            break;
+            return (cmp1 < cmp2);
 
         case OPCODE_SKIP_IF_LE_V:
         case OPCODE_SKIP_IF_LE_VI:
         case OPCODE_SKIP_IF_LE_L:
         case OPCODE_SKIP_IF_LE_LI:
-            if (cmp1 <= cmp2) {
-                ++c->PC;
-            }
-            break;
+            return (cmp1 <= cmp2);
 
         default:
-            break;
+            return false;
     }
 }
 
@@ -404,194 +1153,449 @@ static uint8_t percent_to_uint8(int percentage)
 }
 
 
+// ****************************************************************************
+// Run a light program that the assembler compiled to native code. The
+// program keeps its own position in c->resume.
+static void execute_native_program(
+    const uint32_t *program, LIGHT_PROGRAM_CPU_T *c, uint32_t leds_already_used)
+{
+    environment.leds_already_used = leds_already_used;
+
+    switch (native_light_programs[c - cpu](&environment, c)) {
+        case LIGHT_PROGRAM_END:
+            c->event = 0;
+#ifdef LIGHT_PROGRAM_STATISTICS
+            count_yield(c, 0);
+#endif
+            break;
+
+        case LIGHT_PROGRAM_ERROR:
+#ifndef NODEBUG
+            if (diagnostics_enabled()) {
+                uart0_send_cstring("LIGHT PROGRAM STACK ERROR");
+                uart0_send_linefeed();
+            }
+#endif
+            restart_program(program, c);
+            break;
+
+        case LIGHT_PROGRAM_YIELD:
+#ifdef LIGHT_PROGRAM_STATISTICS
+            count_budget_exhausted(c, 0, 0xffff);
+#endif
+            break;
+
+        case LIGHT_PROGRAM_SLEEP:
+        default:
+#ifdef LIGHT_PROGRAM_STATISTICS
+            count_yield(c, 0);
+#endif
+            break;
+    }
+}
+
+
 // ****************************************************************************
 static void execute_program(
     const uint32_t *program, LIGHT_PROGRAM_CPU_T *c, uint32_t *leds_used)
 {
     uint32_t leds_already_used;
     int instructions_executed = 0;
+    const uint8_t *pc;
 
     leds_already_used = *leds_used;
     *leds_used |= *(program + LEDS_USED_OFFSET);
 
+#ifdef LIGHT_PROGRAM_DEBUGGER
+    debugger.leds_already_used[c - cpu] = leds_already_used;
+    if (debugger.halted  &&  c != debugger.stepping) {
+        return;
+    }
+#endif
+
     if (c->timer) {
         if (--c->timer) {
             return;
         }
     }
 
-    while (instructions_executed < MAX_INSTRUCTIONS_PER_SYSTICK) {
-        static uint32_t instruction;
-        static uint8_t opcode;
+#ifdef LIGHT_PROGRAM_STATISTICS
+    ++statistics[c - cpu].systicks;
+#endif
+
+    // Local variables that were used by another program since this program
+    // was reset start from 0
+    while (c->var_clear) {
+        --c->var_clear;
+        var[c->var_base + c->var_clear] = 0;
+    }
+
+    if (active_light_programs->magic.version & LIGHT_PROGRAMS_NATIVE) {
+        execute_native_program(program, c, leds_already_used);
+        return;
+    }
+
+    // Work on a local copy of the program counter so that it can be kept in
+    // a register
+    pc = c->PC;
+
+    while (instructions_executed < INSTRUCTION_BUDGET) {
+        uint8_t opcode;
+        uint8_t operand1;
+        uint8_t operand2;
+        uint8_t operand3;
 
-        static uint8_t min;
-        static uint8_t max;
-        static uint8_t value;
+        int16_t dividend;
 
-        static uint8_t var_id;
-        static int16_t dividend;
+        uint16_t parameter;
 
-        static uint16_t parameter;
+        const uint8_t *table;
+        uint16_t frame;
+        uint8_t width;
+
+        uint32_t mask;
+        uint8_t value;
+        uint8_t *destination;
 
         int i;
 
-        ++instructions_executed;
+#ifdef LIGHT_PROGRAM_DEBUGGER
+        if (hit_breakpoint(c, pc)) {
+            c->PC = pc;
+            return;
+        }
+#endif
+
+        // Fan out the instruction bytes. Depending on the instruction length
+        // not all of the operands are valid.
+        opcode = pc[0];
+        operand1 = pc[1];
+        operand2 = pc[2];
+        operand3 = pc[3];
+        pc += instruction_length[opcode];
 
-        instruction = *(c->PC++);
+        ++instructions_executed;
 
-        opcode = (instruction >> 24) & 0xff;
+        // Most instructions operate on a variable or LED (operand1) with a
+        // 16 bit parameter
+        parameter = operand2 | (operand3 << 8);
 
+        // Note: the length of the instruction to skip is fetched before
+        // evaluating the condition so that the compiler can skip without
+        // branching.
         if (opcode >= FIRST_SKIP_IF_OPCODE && opcode <= LAST_SKIP_IF_OPCODE) {
-            execute_skip_if(opcode, instruction, c);
-            continue;
-        }
+            uint8_t next_length = instruction_length[*pc];
 
-        if ((opcode & 0xe0) == OPCODE_SKIP_IF_ANY) {
-            if (instruction & car_state & 0x1fffffff) {
-                c->PC++;
+            if (skip_if_condition(opcode, operand1, parameter)) {
+                pc += next_length;
             }
             continue;
         }
-        else if ((opcode & 0xe0) == OPCODE_SKIP_IF_ALL) {
-            if ((instruction & car_state & 0x1fffffff) ==
-                    (instruction & 0x1fffffff)) {
-                c->PC++;
+
+        if (opcode >= OPCODE_SKIP_IF_ANY  &&  opcode <= (OPCODE_SKIP_IF_NONE | 0x1f)) {
+            uint8_t next_length = instruction_length[*pc];
+            uint32_t state;
+            bool skip;
+
+            state = ((opcode & 0x1f) << 24) | (operand3 << 16) |
+                (operand2 << 8) | operand1;
+
+            if ((opcode & 0xe0) == OPCODE_SKIP_IF_ANY) {
+                skip = (state & car_state) != 0;
             }
-            continue;
-        }
-        else if ((opcode & 0xe0) == OPCODE_SKIP_IF_NONE) {
-            if ((instruction & car_state & 0x1fffffff) == 0) {
-                c->PC++;
+            else if ((opcode & 0xe0) == OPCODE_SKIP_IF_ALL) {
+                skip = (state & car_state) == state;
+            }
+            else {
+                skip = (state & car_state) == 0;
+            }
+
+            if (skip) {
+                pc += next_length;
             }
             continue;
         }
 
-        // Fan out commonly used opcode parameters
-        max =  var_id = (instruction >> 16) & 0xff;
-        min = (instruction >> 8)  & 0xff;
-        value = (instruction >> 0)  & 0xff;
-
         switch (opcode) {
             case OPCODE_SET:
-                value = var[value];
+                operand3 = var[operand3];
                 // fall through
             case OPCODE_SET_I:
-                for (i = min; i <= max; i++) {
+                for (i = operand1; i <= operand2; i++) {
                     if ((leds_already_used & (1 << i)) == 0) {
-                        light_setpoint[i] = percent_to_uint8(value);
+                        light_setpoint[i] = percent_to_uint8(operand3);
                     }
                 }
                 break;
 
+            case OPCODE_SET_LED:
+                operand2 = var[operand2];
+                // fall through
+            case OPCODE_SET_LED_I:
+                if ((leds_already_used & (1 << operand1)) == 0) {
+                    light_setpoint[operand1] = percent_to_uint8(operand2);
+                }
+                break;
+
             case OPCODE_FADE:
-                value = var[value];
+                operand3 = var[operand3];
                 // fall through
             case OPCODE_FADE_I:
-                for (i = min; i <= max; i++) {
+                for (i = operand1; i <= operand2; i++) {
                     if ((leds_already_used & (1 << i)) == 0) {
-                        max_change_per_systick[i] = percent_to_uint8(value);
+                        max_change_per_systick[i] = percent_to_uint8(operand3);
+                    }
+                }
+                break;
+
+            case OPCODE_FADE_LED:
+                operand2 = var[operand2];
+                // fall through
+            case OPCODE_FADE_LED_I:
+                if ((leds_already_used & (1 << operand1)) == 0) {
+                    max_change_per_systick[operand1] = percent_to_uint8(operand2);
+                }
+                break;
+
+            case OPCODE_SET_MASK:
+            case OPCODE_SET_MASK_I:
+            case OPCODE_FADE_MASK:
+            case OPCODE_FADE_MASK_I:
+                // The LED mask is in the 3rd to 6th byte of the instruction.
+                // LEDs used by programs with higher priority are removed from
+                // the mask in one go, and the brightness is only calculated
+                // once for all LEDs. Like SET and SET_LED the variable is
+                // taken as uint8_t.
+                mask = (operand2 | (operand3 << 8) | (pc[-2] << 16) |
+                    ((uint32_t)pc[-1] << 24)) & ~leds_already_used;
+                value = (opcode & 0x01) ? operand1 :
+                    percent_to_uint8((uint8_t)var[operand1]);
+                destination = (opcode <= OPCODE_SET_MASK_I) ?
+                    light_setpoint : max_change_per_systick;
+                for (i = 0; mask; i++, mask >>= 1) {
+                    if (mask & 1) {
+                        destination[i] = value;
+                    }
+                }
+                break;
+
+            case OPCODE_PATTERN:
+            case OPCODE_PATTERN_I:
+                // The frame is in the 5th byte of the instruction. The frame
+                // number wraps around so that a counter can be used.
+                table = pc + (int16_t)(operand1 | (operand2 << 8));
+                frame = (opcode == OPCODE_PATTERN) ? var[pc[-1]] : pc[-1];
+                frame = frame % table[1];
+                width = table[0];
+                table += 2 + frame * width;
+                for (i = 0; i < width; i++) {
+                    if ((leds_already_used & (1 << (operand3 + i))) == 0) {
+                        light_setpoint[operand3 + i] = table[i];
                     }
                 }
                 break;
 
             case OPCODE_SLEEP:
             case OPCODE_SLEEP_I:
-                parameter = get_parameter_value(instruction);
+                parameter = get_parameter_value(opcode,
+                    operand1 | (operand2 << 8));
                 c->timer = (parameter > 0) ? (parameter / 20) : 0;
+                c->PC = pc;
+#ifdef LIGHT_PROGRAM_STATISTICS
+                count_yield(c, instructions_executed);
+#endif
                 return;
 
             case OPCODE_GOTO:
-                c->PC =
-                    program + FIRST_OPCODE_OFFSET + (instruction & 0x00ffffff);
+                pc += (int16_t)(operand1 | (operand2 << 8));
+                continue;
+
+            case OPCODE_CALL:
+                if (c->sp >= LIGHT_PROGRAM_STACK_DEPTH) {
+#ifndef NODEBUG
+                    if (diagnostics_enabled()) {
+                        uart0_send_cstring("LIGHT PROGRAM STACK OVERFLOW");
+                        uart0_send_linefeed();
+                    }
+#endif
+                    restart_program(program, c);
+                    return;
+                }
+                c->stack[c->sp++] = (uint16_t)(pc - PROGRAMS_BASE);
+                pc += (int16_t)(operand1 | (operand2 << 8));
+                continue;
+
+            // Subroutines can only be entered through OPCODE_CALL, so the
+            // stack can not underflow
+            case OPCODE_RETURN:
+                pc = PROGRAMS_BASE + c->stack[--c->sp];
                 continue;
 
             case OPCODE_ASSIGN:
             case OPCODE_ASSIGN_I:
-                var[var_id] = get_parameter_value(instruction);
+                var[operand1] = get_parameter_value(opcode, parameter);
                 break;
 
             case OPCODE_ADD:
             case OPCODE_ADD_I:
-                var[var_id] += get_parameter_value(instruction);
+                var[operand1] += get_parameter_value(opcode, parameter);
                 break;
 
             case OPCODE_SUBTRACT:
             case OPCODE_SUBTRACT_I:
-                var[var_id] -= get_parameter_value(instruction);
+                var[operand1] -= get_parameter_value(opcode, parameter);
                 break;
 
             case OPCODE_MULTIPLY:
             case OPCODE_MULTIPLY_I:
-                var[var_id] *= get_parameter_value(instruction);
+                var[operand1] *= get_parameter_value(opcode, parameter);
                 break;
 
             case OPCODE_DIVIDE:
             case OPCODE_DIVIDE_I:
-                dividend = get_parameter_value(instruction);
+                dividend = get_parameter_value(opcode, parameter);
                 if (dividend == 0) {
-                    var[var_id] = 0x7fff;   // int16_t max
+                    var[operand1] = 0x7fff;   // int16_t max
                 }
                 else {
-                    var[var_id] /= dividend;
+                    var[operand1] /= dividend;
                     }
                 break;
 
             case OPCODE_AND:
             case OPCODE_AND_I:
-                var[var_id] &= get_parameter_value(instruction);
+                var[operand1] &= get_parameter_value(opcode, parameter);
                 break;
 
             case OPCODE_OR:
             case OPCODE_OR_I:
-                var[var_id] |= get_parameter_value(instruction);
+                var[operand1] |= get_parameter_value(opcode, parameter);
                 break;
 
             case OPCODE_XOR:
             case OPCODE_XOR_I:
-                var[var_id] ^= get_parameter_value(instruction);
+                var[operand1] ^= get_parameter_value(opcode, parameter);
                 break;
 
             case OPCODE_ABS:
-                parameter = get_parameter_value(instruction);
+            case OPCODE_ABS_I:
+                parameter = get_parameter_value(opcode, parameter);
                 // int16_t requires special handling
                 if (parameter & 0x8000) {
                     parameter = ~parameter + 1;
                 }
-                var[var_id] = parameter;
+                var[operand1] = parameter;
                 break;
 
-            case OPCODE_END_OF_PROGRAM:
-                --c->PC;
-                c->event = 0;
-                return;
+            // Short forms with an int8_t immediate
+            case OPCODE_ASSIGN_S:
+                var[operand1] = (int8_t)operand2;
+                break;
 
-            default:
-#ifndef NODEBUG
-                if (diagnostics_enabled()) {
-                    uart0_send_cstring("UNKNOWN OPCODE 0x");
-                    uart0_send_uint8_hex(opcode);
-                    uart0_send_linefeed();
+            case OPCODE_ADD_S:
+                var[operand1] += (int8_t)operand2;
+                break;
+
+            case OPCODE_SUBTRACT_S:
+                var[operand1] -= (int8_t)operand2;
+                break;
+
+            case OPCODE_MULTIPLY_S:
+                var[operand1] *= (int8_t)operand2;
+                break;
+
+            case OPCODE_DIVIDE_S:
+                if (operand2 == 0) {
+                    var[operand1] = 0x7fff;   // int16_t max
                 }
-#endif
-                c->PC = program + FIRST_OPCODE_OFFSET;
+                else {
+                    var[operand1] /= (int8_t)operand2;
+                }
+                break;
+
+            case OPCODE_AND_S:
+                var[operand1] &= (int8_t)operand2;
+                break;
+
+            case OPCODE_OR_S:
+                var[operand1] |= (int8_t)operand2;
+                break;
+
+            case OPCODE_XOR_S:
+                var[operand1] ^= (int8_t)operand2;
+                break;
+
+            // Unknown opcodes have been rejected by verify_light_programs()
+            case OPCODE_END_OF_PROGRAM:
+            default:
+                c->PC = pc - 1;
                 c->event = 0;
+#ifdef LIGHT_PROGRAM_STATISTICS
+                count_yield(c, instructions_executed);
+#endif
                 return;
         }
     }
+
+    c->PC = pc;
+#ifdef LIGHT_PROGRAM_STATISTICS
+    count_budget_exhausted(c, instructions_executed, pc - PROGRAMS_BASE);
+#endif
+}
+
+
+// ****************************************************************************
+// Events that do not fit into the queue are dropped
+void post_light_program_event(LIGHT_PROGRAM_EVENT_T event)
+{
+    if (event_queue.count >= EVENT_QUEUE_SIZE) {
+        return;
+    }
+
+    event_queue.event[(event_queue.first + event_queue.count) %
+        EVENT_QUEUE_SIZE] = event;
+    ++event_queue.count;
+}
+
+
+// ****************************************************************************
+// Returns true if the light program runs on the given event. Programs
+// declared with "run when gear-changed" run on the gear changed event.
+static bool runs_on_event(int n, LIGHT_PROGRAM_EVENT_T event)
+{
+    const uint32_t *program = active_light_programs->start[n];
+
+    if (*(program + RUN_STATE_OFFSET) & RUN_ON_EVENTS_MASK & event) {
+        return true;
+    }
+
+    return event == RUN_ON_GEAR_CHANGED  &&
+        (*(program + PRIORITY_STATE_OFFSET) & RUN_WHEN_GEAR_CHANGED);
 }
 
 
 // ****************************************************************************
 void process_light_program_events(void)
 {
-    if (global_flags.gear_changed) {
-        int i;
-        for (i = 0; i < light_programs.number_of_programs; i++) {
-            if (*(light_programs.start[i] + PRIORITY_STATE_OFFSET)
-                & RUN_WHEN_GEAR_CHANGED) {
+    LIGHT_PROGRAM_EVENT_T event;
+    int i;
+
+#ifdef LIGHT_PROGRAM_DEBUGGER
+    // Events stay queued while the light programs are halted
+    if (debugger.halted) {
+        return;
+    }
+#endif
+
+    while (event_queue.count) {
+        event = event_queue.event[event_queue.first];
+        event_queue.first = (event_queue.first + 1) % EVENT_QUEUE_SIZE;
+        --event_queue.count;
+
+        for (i = 0; i < number_of_programs; i++) {
+            if (runs_on_event(i, event)) {
                 reset_program(i);
                 cpu[i].event = 1;
-                break;
             }
         }
     }
@@ -604,6 +1608,12 @@ uint32_t process_light_programs(void)
     int i;
     uint32_t leds_used;
 
+#ifdef LIGHT_PROGRAM_DEBUGGER
+    if (debugger.halted) {
+        return debugger.leds_used;
+    }
+#endif
+
     leds_used = 0;
     load_light_program_environment();
 
@@ -612,16 +1622,17 @@ uint32_t process_light_programs(void)
     var[GLOBAL_VAR_LIGHT_SWITCH_POSITION] = light_switch_position;
 
     // Run all programs that were triggered by an event
-    for (i = 0; i < light_programs.number_of_programs; i++) {
+    for (i = 0; i < number_of_programs; i++) {
         if (cpu[i].event) {
-            execute_program(light_programs.start[i], &cpu[i], &leds_used);
+            execute_program(active_light_programs->start[i], &cpu[i], &leds_used);
             limit_light_switch_position_variable();
         }
     }
 
     // Run all priority programs where the light controller state matches
-    for (i = 0; i < light_programs.number_of_programs; i++) {
-        if (*(light_programs.start[i] + PRIORITY_STATE_OFFSET) == RUN_WHEN_NORMAL_OPERATION) {
+    for (i = 0; i < number_of_programs; i++) {
+        if ((*(active_light_programs->start[i] + PRIORITY_STATE_OFFSET) &
+                PRIORITY_STATE_MASK) == RUN_WHEN_NORMAL_OPERATION) {
             continue;
         }
 
@@ -629,34 +1640,240 @@ uint32_t process_light_programs(void)
             continue;
         }
 
-        if (*(light_programs.start[i] + PRIORITY_STATE_OFFSET) &
+        if (*(active_light_programs->start[i] + PRIORITY_STATE_OFFSET) &
                 priority_run_state) {
-            execute_program(light_programs.start[i], &cpu[i], &leds_used);
+            execute_program(active_light_programs->start[i], &cpu[i], &leds_used);
             limit_light_switch_position_variable();
         }
         else {
-            reset_program(i);
+            stop_program(i);
         }
     }
 
     // Run all non-event and non-priority programs
-    for (i = 0; i < light_programs.number_of_programs; i++) {
-        if (*(light_programs.start[i] + PRIORITY_STATE_OFFSET) != RUN_WHEN_NORMAL_OPERATION) {
+    for (i = 0; i < number_of_programs; i++) {
+        if ((*(active_light_programs->start[i] + PRIORITY_STATE_OFFSET) &
+                PRIORITY_STATE_MASK) != RUN_WHEN_NORMAL_OPERATION) {
+            continue;
+        }
+
+        if (*(active_light_programs->start[i] + RUN_STATE_OFFSET) &
+                RUN_ON_EVENTS_MASK) {
             continue;
         }
 
-        if (*(light_programs.start[i] + RUN_STATE_OFFSET) & run_state) {
-            execute_program(light_programs.start[i], &cpu[i], &leds_used);
+        if (*(active_light_programs->start[i] + RUN_STATE_OFFSET) & run_state) {
+            execute_program(active_light_programs->start[i], &cpu[i], &leds_used);
             limit_light_switch_position_variable();
         }
         else {
-            reset_program(i);
+            stop_program(i);
         }
     }
 
     // Return the possibly modified value of light switch position
     light_switch_position = var[GLOBAL_VAR_LIGHT_SWITCH_POSITION];
 
+#ifdef LIGHT_PROGRAM_STATISTICS
+    output_statistics();
+#endif
+
+#ifdef LIGHT_PROGRAM_DEBUGGER
+    debugger.leds_used = leds_used;
+#endif
+
     return leds_used;
 }
 
+
+#ifdef LIGHT_PROGRAM_DEBUGGER
+// ****************************************************************************
+// Execute a single instruction of a halted program. A sleeping program
+// continues with the next instruction right away.
+static void step_program(int n)
+{
+    uint32_t leds_used = debugger.leds_already_used[n];
+
+    cpu[n].timer = 0;
+
+    debugger.stepping = &cpu[n];
+    debugger.instruction_budget = 1;
+    execute_program(active_light_programs->start[n], &cpu[n], &leds_used);
+    limit_light_switch_position_variable();
+    debugger.instruction_budget = MAX_INSTRUCTIONS_PER_SYSTICK;
+    debugger.stepping = NULL;
+}
+
+
+// ****************************************************************************
+// Response: PC (offset in programs[]), timer, sp, event, stack[sp]
+static void send_program_state(int n)
+{
+    uint8_t response[6 + 2 * LIGHT_PROGRAM_STACK_DEPTH];
+    uint16_t pc = NATIVE_PC;
+    int i;
+
+    if (!(active_light_programs->magic.version & LIGHT_PROGRAMS_NATIVE)) {
+        pc = cpu[n].PC - PROGRAMS_BASE;
+    }
+
+    response[0] = pc & 0xff;
+    response[1] = pc >> 8;
+    response[2] = cpu[n].timer & 0xff;
+    response[3] = cpu[n].timer >> 8;
+    response[4] = cpu[n].sp;
+    response[5] = cpu[n].event;
+    for (i = 0; i < cpu[n].sp; i++) {
+        response[6 + 2 * i] = cpu[n].stack[i] & 0xff;
+        response[7 + 2 * i] = cpu[n].stack[i] >> 8;
+    }
+
+    debugger_send_frame(RESPONSE_ACK, response, 6 + 2 * cpu[n].sp);
+}
+
+
+// ****************************************************************************
+static void send_nak(uint8_t error)
+{
+    debugger_send_frame(RESPONSE_NAK, &error, 1);
+}
+
+
+// ****************************************************************************
+// Handle a command frame of the light program debugger, see debugger.c for
+// the framing. The host sends a command and waits for the response, which
+// is either RESPONSE_ACK or RESPONSE_NAK with one of the ERROR_xxx codes.
+// Multi-byte values are little endian.
+//
+// STATUS
+//      ACK payload: DEBUGGER_PROTOCOL_VERSION, number of programs, 1 if the
+//      programs are native code, halted, halted_by, MAX_BREAKPOINTS,
+//      MAX_LIGHT_PROGRAM_VARIABLES, MAX_LIGHTS
+// HALT
+// RESUME
+// STEP program
+//      Execute one instruction; ACK payload as for PROGRAM
+// PROGRAM program
+//      ACK payload: PC (2 bytes), timer (2 bytes), sp, event, stack[sp]
+//      (2 bytes each)
+// BREAKPOINT index, PC (2 bytes)
+//      Set breakpoint 0..MAX_BREAKPOINTS-1; PC 0 clears it
+// READ_VARIABLES first, count
+//      ACK payload: var[first..first+count-1] (2 bytes each)
+// WRITE_VARIABLE index, value (2 bytes)
+// READ_LIGHTS
+//      ACK payload: light_setpoint[0..MAX_LIGHTS-1]
+// WRITE_LIGHT index, value
+//
+// When a program hits a breakpoint the light controller sends EVENT_HALTED
+// with the program and PC (2 bytes) as payload.
+// ****************************************************************************
+void light_program_debugger_command(
+    uint8_t command, const uint8_t *payload, uint8_t length)
+{
+    uint8_t response[2 * MAX_VARIABLES_PER_READ];
+    bool native = active_light_programs->magic.version & LIGHT_PROGRAMS_NATIVE;
+    int i;
+
+    switch (command) {
+        case COMMAND_STATUS:
+            response[0] = DEBUGGER_PROTOCOL_VERSION;
+            response[1] = number_of_programs;
+            response[2] = native;
+            response[3] = debugger.halted;
+            response[4] = debugger.halted_by;
+            response[5] = MAX_BREAKPOINTS;
+            response[6] = MAX_LIGHT_PROGRAM_VARIABLES;
+            response[7] = MAX_LIGHTS;
+            debugger_send_frame(RESPONSE_ACK, response, 8);
+            return;
+
+        case COMMAND_HALT:
+            if (!debugger.halted) {
+                debugger.halted = true;
+                debugger.halted_by = HALTED_BY_HOST;
+            }
+            break;
+
+        case COMMAND_RESUME:
+            if (debugger.halted  &&  debugger.halted_by != HALTED_BY_HOST) {
+                debugger.resuming = &cpu[debugger.halted_by];
+                debugger.resume_pc = cpu[debugger.halted_by].PC;
+            }
+            debugger.halted = false;
+            break;
+
+        case COMMAND_STEP:
+        case COMMAND_PROGRAM:
+            if (length != 1  ||  payload[0] >= number_of_programs) {
+                send_nak(ERROR_INVALID_PARAMETER);
+                return;
+            }
+            if (command == COMMAND_STEP) {
+                if (!debugger.halted) {
+                    send_nak(ERROR_NOT_HALTED);
+                    return;
+                }
+                if (native) {
+                    send_nak(ERROR_NATIVE_CODE);
+                    return;
+                }
+                step_program(payload[0]);
+            }
+            send_program_state(payload[0]);
+            return;
+
+        case COMMAND_BREAKPOINT:
+            if (length != 3  ||  payload[0] >= MAX_BREAKPOINTS) {
+                send_nak(ERROR_INVALID_PARAMETER);
+                return;
+            }
+            if (native) {
+                send_nak(ERROR_NATIVE_CODE);
+                return;
+            }
+            debugger.breakpoint[payload[0]] = payload[1] | (payload[2] << 8);
+            break;
+
+        case COMMAND_READ_VARIABLES:
+            if (length != 2  ||  payload[1] > MAX_VARIABLES_PER_READ  ||
+                payload[0] + payload[1] > MAX_LIGHT_PROGRAM_VARIABLES) {
+                send_nak(ERROR_INVALID_PARAMETER);
+                return;
+            }
+            for (i = 0; i < payload[1]; i++) {
+                response[2 * i] = var[payload[0] + i] & 0xff;
+                response[2 * i + 1] = (uint16_t)var[payload[0] + i] >> 8;
+            }
+            debugger_send_frame(RESPONSE_ACK, response, 2 * payload[1]);
+            return;
+
+        case COMMAND_WRITE_VARIABLE:
+            if (length != 3  ||  payload[0] >= MAX_LIGHT_PROGRAM_VARIABLES) {
+                send_nak(ERROR_INVALID_PARAMETER);
+                return;
+            }
+            var[payload[0]] = (int16_t)(payload[1] | (payload[2] << 8));
+            break;
+
+        case COMMAND_READ_LIGHTS:
+            debugger_send_frame(RESPONSE_ACK, light_setpoint, MAX_LIGHTS);
+            return;
+
+        case COMMAND_WRITE_LIGHT:
+            if (length != 2  ||  payload[0] >= MAX_LIGHTS) {
+                send_nak(ERROR_INVALID_PARAMETER);
+                return;
+            }
+            light_setpoint[payload[0]] = payload[1];
+            break;
+
+        default:
+            send_nak(ERROR_UNKNOWN_COMMAND);
+            return;
+    }
+
+    debugger_send_frame(RESPONSE_ACK, NULL, 0);
+}
+#endif
+
@@ -76,6 +76,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <LPC8xx.h>
 
 #include <globals.h>
@@ -84,9 +85,6 @@
 
 #define SLAVE_MAGIC_BYTE ((uint8_t)0x87)
 
-// 16 lights locally, another 16 potentially at a slave
-#define MAX_LIGHTS 32
-
 
 typedef enum {
     ALWAYS_ON,
@@ -112,6 +110,13 @@ LED_T light_setpoint[MAX_LIGHTS];
 LED_T light_actual[MAX_LIGHTS];
 uint8_t max_change_per_systick[MAX_LIGHTS];
 
+// State of the LEDs at the last update, see process_drive_mode_lights()
+static struct {
+    uint32_t leds_used;
+    unsigned int braking : 1;
+    unsigned int reversing : 1;
+} last_update;
+
 
 extern void init_light_programs(void);
 extern void process_light_program_events(void);
@@ -523,13 +528,69 @@ static void process_light(const CAR_LIGHT_T *light, LED_T *led, uint8_t *limit)
 }
 
 
+// ****************************************************************************
+static const CAR_LIGHT_T *get_car_light(int i)
+{
+    if (i < 16) {
+        if (i < local_leds.led_count) {
+            return &local_leds.car_lights[i];
+        }
+    }
+    else if (CONFIG_SLAVE_OUTPUT) {
+        if ((i - 16) < slave_leds.led_count) {
+            return &slave_leds.car_lights[i - 16];
+        }
+    }
+
+    return NULL;
+}
+
+
+// ****************************************************************************
+// Brake lights come on at full brightness, max_change_per_systick is only
+// applied when they go off
+static bool is_fade_bypassed(const CAR_LIGHT_T *light)
+{
+    return global_flags.braking  &&  !is_value_zero(light, BRAKE_LIGHT);
+}
+
+
+// ****************************************************************************
+static void output_lights(void)
+{
+    int i;
+    uint8_t slave_data[16];
+
+    send_light_data_to_tlc5940();
+    if (!CONFIG_SLAVE_OUTPUT) {
+        return;
+    }
+
+    for (i = 0; i < slave_leds.led_count ; i++) {
+        slave_data[i] = gamma_table.gamma_table[light_actual[16 + i]] >> 2;
+    }
+
+    if (CONFIG_UART_MULTIPLEX) {
+        uart_mux_send(UART_MUX_CHANNEL_SLAVE, slave_data, slave_leds.led_count);
+        return;
+    }
+
+    uart0_send_char(SLAVE_MAGIC_BYTE);
+    for (i = 0; i < slave_leds.led_count ; i++) {
+        uart0_send_char(slave_data[i]);
+    }
+}
+
+
 // ****************************************************************************
 static void process_car_lights(void)
 {
     int i;
-    uint32_t leds_used;
+    const CAR_LIGHT_T *light;
 
-    leds_used = process_light_programs();
+    last_update.leds_used = process_light_programs();
+    last_update.braking = global_flags.braking;
+    last_update.reversing = global_flags.reversing;
 
     if (diagnostics_enabled()) {
         static uint8_t old_light_switch_position = 0xff;
@@ -542,31 +603,25 @@ static void process_car_lights(void)
         }
     }
 
-    // Handle LEDs connected to the TLC5940 locally
-    for (i = 0; i < local_leds.led_count ; i++) {
-        if (leds_used & (1 << i)) {
+    // Handle LEDs connected to the TLC5940 locally (0..15) and to a slave
+    // light controller (16..31)
+    for (i = 0; i < MAX_LIGHTS ; i++) {
+        light = get_car_light(i);
+        if (light == NULL  ||  (last_update.leds_used & (1 << i))) {
             continue;
         }
-        process_light(&local_leds.car_lights[i], &light_setpoint[i],
-            &max_change_per_systick[i]);
-    }
-
-    if (config.flags.slave_output) {
-        // Handle LEDs connected to a slave light controller
-        for (i = 0; i < slave_leds.led_count ; i++) {
-            if (leds_used & (1 << (16 + i))) {
-                continue;
-            }
-
-            process_light(&slave_leds.car_lights[i], &light_setpoint[16 + i],
-                &max_change_per_systick[16 + i]);
-        }
+        process_light(light, &light_setpoint[i], &max_change_per_systick[i]);
     }
 
     // Apply max_change_per_systick while copying from light_setpoint to
     // light_actual
     for (i = 0; i < MAX_LIGHTS ; i++) {
-        if (max_change_per_systick[i] > 0) {
+        light = get_car_light(i);
+        if (light  &&  !(last_update.leds_used & (1 << i))  &&
+                is_fade_bypassed(light)) {
+            light_actual[i] = light_setpoint[i];
+        }
+        else if (max_change_per_systick[i] > 0) {
             light_actual[i] = calculate_step_value(
                 light_actual[i], light_setpoint[i], max_change_per_systick[i]);
         }
@@ -575,14 +630,70 @@ static void process_car_lights(void)
         }
     }
 
-    send_light_data_to_tlc5940();
-    if (config.flags.slave_output) {
-        uart0_send_char(SLAVE_MAGIC_BYTE);
+    output_lights();
+}
+
+
+// ****************************************************************************
+// Fast path for the brake and reversing lights.
+//
+// process_drive_mode() updates braking and reversing whenever a servo frame
+// is received, which happens asynchronously to the systick. Instead of
+// waiting up to a systick for process_car_lights(), only the LEDs that have
+// a brake or reversing light function are recomputed, and the TLC5940 is
+// updated right away.
+//
+// LEDs run by light programs are left alone, as are LEDs that fade: apart
+// from brake lights coming on they change at the next systick.
+//
+// Building with NO_LIGHTS_FAST_PATH removes the fast path, so that
+// tools/light-latency can compare both.
+static void process_drive_mode_lights(void)
+{
+#ifndef NO_LIGHTS_FAST_PATH
+    int i;
+    const CAR_LIGHT_T *light;
+    bool braking_changed;
+    bool reversing_changed;
+    bool changed = false;
+
+    braking_changed = (global_flags.braking != last_update.braking);
+    reversing_changed = (global_flags.reversing != last_update.reversing);
+
+    if (!braking_changed  &&  !reversing_changed) {
+        return;
+    }
+
+    last_update.braking = global_flags.braking;
+    last_update.reversing = global_flags.reversing;
 
-        for (i = 0; i < slave_leds.led_count ; i++) {
-            uart0_send_char(gamma_table.gamma_table[light_actual[16 + i]] >> 2);
+    for (i = 0; i < MAX_LIGHTS ; i++) {
+        light = get_car_light(i);
+        if (light == NULL  ||  (last_update.leds_used & (1 << i))) {
+            continue;
         }
+
+        if (!(braking_changed  &&  (!is_value_zero(light, BRAKE_LIGHT)  ||
+                    light->features.brake_light))  &&
+                !(reversing_changed  &&  (!is_value_zero(light, REVERSING_LIGHT)  ||
+                    light->features.reversing_light))) {
+            continue;
+        }
+
+        process_light(light, &light_setpoint[i], &max_change_per_systick[i]);
+
+        if (max_change_per_systick[i] == 0  ||  is_fade_bypassed(light)) {
+            if (light_actual[i] != light_setpoint[i]) {
+                light_actual[i] = light_setpoint[i];
+                changed = true;
+            }
+        }
+    }
+
+    if (changed) {
+        output_lights();
     }
+#endif
 }
 
 
@@ -591,10 +702,34 @@ static void process_slave(void)
 {
     uint8_t uart_byte;
     static int state = 0;
+    const UART_MUX_FRAME_T *frame;
+    int i;
 
     while (uart0_read_is_byte_pending()) {
         uart_byte = uart0_read_byte();
 
+        // A master with more than one UART output sends the LED values
+        // multiplexed with other frames, see uart_mux.c
+        switch (uart_mux_receive_byte(uart_byte, &frame)) {
+            case UART_MUX_FRAME_RECEIVED:
+                if (frame->channel == UART_MUX_CHANNEL_SLAVE) {
+                    for (i = 0; i < frame->length; i++) {
+                        light_setpoint[i] = frame->payload[i] << 2;
+                        light_actual[i] = frame->payload[i] << 2;
+                    }
+                    state = 0;
+                    send_light_data_to_tlc5940();
+                }
+                continue;
+
+            case UART_MUX_IN_FRAME:
+                continue;
+
+            case UART_MUX_NO_FRAME:
+            default:
+                break;
+        }
+
         // The slave/preprocessor protocol is designed such that only the first
         // byte can have the MAGIC value. This allows us to be in sync at all
         // times.
@@ -627,7 +762,7 @@ static void process_slave(void)
 // ****************************************************************************
 void process_lights(void)
 {
-    if (config.mode == SLAVE) {
+    if (CONFIG_MODE == SLAVE) {
         process_slave();
     }
     else {
@@ -635,5 +770,8 @@ void process_lights(void)
         if (global_flags.systick) {
             process_car_lights();
         }
+        else if (global_flags.new_channel_data) {
+            process_drive_mode_lights();
+        }
     }
 }
@@ -20,6 +20,7 @@ CHANNEL_T channel[3] = {
         .normalized = 0,
         .absolute = 0,
         .reversed = false,
+        .fine = 0,
         .endpoint = {
             .left = 1250,
             .centre = 1500,
@@ -30,6 +31,7 @@ CHANNEL_T channel[3] = {
         .normalized = 0,
         .absolute = 0,
         .reversed = false,
+        .fine = 0,
         .endpoint = {
             .left = 1250,
             .centre = 1500,
@@ -40,6 +42,7 @@ CHANNEL_T channel[3] = {
         .normalized = 0,
         .absolute = 0,
         .reversed = false,
+        .fine = 0,
         .endpoint = {
             .left = 1250,
             .centre = 1500,
@@ -51,6 +54,12 @@ CHANNEL_T channel[3] = {
 static volatile uint32_t systick_count;
 static bool diagnostics_output_enabled;
 
+#ifdef LIGHT_PROGRAM_UPLOAD
+// Time after power-up during which tools/upload_light_programs.py can request
+// the maintenance mode
+#define MAINTENANCE_REQUEST_TIME 100
+#endif
+
 // ****************************************************************************
 static void init_hardware(void)
 {
@@ -80,14 +89,14 @@ static void init_hardware(void)
 
     // Configure the UART input and output
     diagnostics_output_enabled = true;
-    if (config.flags.slave_output || config.flags.preprocessor_output ||
-            config.flags.winch_output) {
+    if (CONFIG_SLAVE_OUTPUT || CONFIG_PREPROCESSOR_OUTPUT ||
+            CONFIG_WINCH_OUTPUT) {
         diagnostics_output_enabled = false;
     }
-    if (config.mode == MASTER_WITH_SERVO_READER) {
+    if (CONFIG_MODE == MASTER_WITH_SERVO_READER) {
         // Turn the UART output on unless a servo output is requested
-        if (config.flags.steering_wheel_servo_output ||
-                config.flags.gearbox_servo_output) {
+        if (CONFIG_STEERING_WHEEL_SERVO_OUTPUT ||
+                CONFIG_GEARBOX_SERVO_OUTPUT) {
             diagnostics_output_enabled = false;
         }
         else {
@@ -98,6 +107,25 @@ static void init_hardware(void)
                                   (GPIO_BIT_OUT << 0);
         }
     }
+    else if (CONFIG_DUAL_SERVO_OUTPUT) {
+        // TH is the gearbox servo output, so there is no UART output.
+        // U0_RXD_I=PIO0_0 (ST)
+        diagnostics_output_enabled = false;
+        LPC_SWM->PINASSIGN0 = (0xff << 24) |
+                              (0xff << 16) |
+                              (GPIO_BIT_ST << 8) |
+                              (0xff << 0);
+    }
+    else if (CONFIG_MODE == MASTER_WITH_CPPM_READER  &&  CONFIG_WINCH_OUTPUT  &&
+            !config.flags.ch3_is_local_switch) {
+        // ST is the CPPM input, so the echoes of the winch controller are
+        // received on the unused CH3 pin (see winch.c).
+        // U0_TXT_O=PIO0_4 (TH), U0_RXD_I=PIO0_13 (CH3)
+        LPC_SWM->PINASSIGN0 = (0xff << 24) |
+                              (0xff << 16) |
+                              (GPIO_BIT_CH3 << 8) |
+                              (GPIO_BIT_TH << 0);
+    }
     else {
         // U0_TXT_O=PIO0_4 (TH), U0_RXD_I=PIO0_0 (ST)
         LPC_SWM->PINASSIGN0 = (0xff << 24) |
@@ -161,6 +189,31 @@ static void init_hardware(void)
 }
 
 
+#ifdef LIGHT_PROGRAM_UPLOAD
+// ****************************************************************************
+// Listen on the ST pin for a request to enter the maintenance mode, which
+// uploads light programs (see maintenance.c). Must be called before
+// init_hardware_final() as the switch matrix is reconfigured.
+static void check_for_maintenance_mode(void)
+{
+    uint32_t pinassign0 = LPC_SWM->PINASSIGN0;
+
+    // U0_RXD_I=PIO0_0 (ST)
+    LPC_SWM->PINASSIGN0 = (pinassign0 & ~(0xff << 8)) | (GPIO_BIT_ST << 8);
+
+    systick_count = 0;
+    while (systick_count < (MAINTENANCE_REQUEST_TIME / __SYSTICK_IN_MS)) {
+        if (maintenance_requested()) {
+            run_maintenance_mode();
+        }
+    }
+    systick_count = 0;
+
+    LPC_SWM->PINASSIGN0 = pinassign0;
+}
+#endif
+
+
 // ****************************************************************************
 static void init_hardware_final(void)
 {
@@ -242,6 +295,9 @@ static void check_no_signal(void)
     static uint16_t no_signal_timeout = 0;
 
     if (global_flags.new_channel_data) {
+        if (global_flags.no_signal  &&  !global_flags.initializing) {
+            post_light_program_event(RUN_ON_SIGNAL_RECOVERED);
+        }
         global_flags.no_signal = false;
         no_signal_timeout = config.no_signal_timeout;
     }
@@ -273,6 +329,9 @@ int main(void)
     global_flags.no_signal = true;
     init_hardware();
     init_uart0();
+#ifdef LIGHT_PROGRAM_UPLOAD
+    check_for_maintenance_mode();
+#endif
     load_persistent_storage();
     init_servo_reader();
     init_uart_reader();
@@ -299,6 +358,7 @@ int main(void)
         process_winch();
         process_lights();
         output_preprocessor();
+        process_uart_mux();
 
         if (diagnostics_enabled()) {
             if (global_flags.new_channel_data) {
@@ -0,0 +1,399 @@
+/******************************************************************************
+
+    Maintenance mode: upload of light programs over the UART
+
+    In a firmware built with LIGHT_PROGRAM_UPLOAD (see makefile),
+    tools/upload_light_programs.py uploads light programs into the flash region
+    uploaded_light_programs[] without re-flashing the firmware. The UART uses
+    the pins of the ISP header: RX on ST (PIO0_0), TX on TH (PIO0_4).
+
+    For a short time after power-up main() listens for a HELLO frame. When
+    received the light controller enters maintenance mode, which only handles
+    the upload protocol and ends with a reset.
+
+    All frames have the same format:
+
+        0xa5        Sync byte
+        command     See COMMAND_xxx
+        length      Number of bytes in the payload (0..MAX_PAYLOAD)
+        payload
+        crc low     CRC-16-CCITT (polynomial 0x1021, initial value 0xffff)
+        crc high    of command, length and payload
+
+    Multi-byte values in the payload are little endian. The host sends a
+    command and waits for the response, which is either ACK or NAK. Frames
+    with a wrong CRC are ignored, so the host retries after a timeout.
+
+    HELLO
+        ACK payload: protocol version, LIGHT_PROGRAMS_VERSION, address of
+        the flash region (4 bytes), size of the flash region (2 bytes),
+        FLASH_PAGE_SIZE.
+
+    BEGIN length (2 bytes), crc (2 bytes)
+        Starts the upload of a LIGHT_PROGRAMS_T with the given length and
+        CRC-16-CCITT. The first page of the flash region is erased, so that
+        the light programs built into the firmware are used until the upload
+        has been committed.
+
+    WRITE offset (2 bytes), data (FLASH_PAGE_SIZE bytes)
+        Writes a page of the light programs. The offset is relative to the
+        start of the flash region and a multiple of FLASH_PAGE_SIZE. The
+        first page, holding the magic value, is kept in RAM.
+
+    COMMIT
+        Checks the CRC of the uploaded light programs and writes the first
+        page. This makes the swap to the new light programs atomic: they are
+        either complete or the light programs of the firmware are used.
+
+    EXIT
+        Resets the light controller, which then runs the uploaded light
+        programs if they pass verification in init_light_programs().
+
+    NAK payload: one of the ERROR_xxx codes.
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <LPC8xx.h>
+
+#include <globals.h>
+#include <uart0.h>
+#include <utils.h>
+
+#ifdef LIGHT_PROGRAM_UPLOAD
+
+#define PROTOCOL_VERSION 1
+
+#define FRAME_SYNC 0xa5
+#define MAX_PAYLOAD (2 + FLASH_PAGE_SIZE)
+
+#define COMMAND_HELLO 0x01
+#define COMMAND_BEGIN 0x02
+#define COMMAND_WRITE 0x03
+#define COMMAND_COMMIT 0x04
+#define COMMAND_EXIT 0x05
+#define RESPONSE_ACK 0x06
+#define RESPONSE_NAK 0x15
+
+#define ERROR_UNKNOWN_COMMAND 1
+#define ERROR_INVALID_PARAMETER 2
+#define ERROR_NO_UPLOAD 3
+#define ERROR_FLASH_WRITE 4
+#define ERROR_CRC 5
+
+#define UART_STAT_TXIDLE (1 << 3)
+
+
+typedef enum {
+    STATE_WAIT_FOR_SYNC = 0,
+    STATE_COMMAND,
+    STATE_LENGTH,
+    STATE_PAYLOAD,
+    STATE_CRC_LOW,
+    STATE_CRC_HIGH
+} STATE_T;
+
+static struct {
+    uint8_t command;
+    uint8_t length;
+    uint8_t payload[MAX_PAYLOAD];
+} frame;
+
+// The first page is written on COMMIT. IAP requires RAM buffers to be on a
+// word boundary.
+static uint32_t first_page[FLASH_PAGE_SIZE / 4];
+static uint32_t page[FLASH_PAGE_SIZE / 4];
+
+static uint16_t upload_length;
+static uint16_t upload_crc;
+
+
+// ****************************************************************************
+static uint16_t get_uint16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+
+// ****************************************************************************
+// Returns true when a frame with valid CRC has been received
+static bool receive_frame(void)
+{
+    static STATE_T state = STATE_WAIT_FOR_SYNC;
+    static uint8_t index;
+    static uint16_t crc;
+    static uint8_t crc_low;
+
+    uint8_t uart_byte;
+
+    while (uart0_read_is_byte_pending()) {
+        uart_byte = uart0_read_byte();
+
+        switch (state) {
+            case STATE_WAIT_FOR_SYNC:
+                if (uart_byte == FRAME_SYNC) {
+                    crc = CRC16_INITIAL_VALUE;
+                    state = STATE_COMMAND;
+                }
+                break;
+
+            case STATE_COMMAND:
+                frame.command = uart_byte;
+                crc = crc16_ccitt(crc, uart_byte);
+                state = STATE_LENGTH;
+                break;
+
+            case STATE_LENGTH:
+                if (uart_byte > MAX_PAYLOAD) {
+                    state = STATE_WAIT_FOR_SYNC;
+                    break;
+                }
+                frame.length = uart_byte;
+                crc = crc16_ccitt(crc, uart_byte);
+                index = 0;
+                state = uart_byte ? STATE_PAYLOAD : STATE_CRC_LOW;
+                break;
+
+            case STATE_PAYLOAD:
+                frame.payload[index++] = uart_byte;
+                crc = crc16_ccitt(crc, uart_byte);
+                if (index >= frame.length) {
+                    state = STATE_CRC_LOW;
+                }
+                break;
+
+            case STATE_CRC_LOW:
+                crc_low = uart_byte;
+                state = STATE_CRC_HIGH;
+                break;
+
+            case STATE_CRC_HIGH:
+                state = STATE_WAIT_FOR_SYNC;
+                if ((crc_low | (uart_byte << 8)) == crc) {
+                    return true;
+                }
+                break;
+
+            default:
+                state = STATE_WAIT_FOR_SYNC;
+                break;
+        }
+    }
+
+    return false;
+}
+
+
+// ****************************************************************************
+static void send_frame(uint8_t command, const uint8_t *payload, uint8_t length)
+{
+    uint16_t crc;
+    int i;
+
+    uart0_send_char((char)FRAME_SYNC);
+    uart0_send_char(command);
+    uart0_send_char(length);
+    crc = crc16_ccitt(crc16_ccitt(CRC16_INITIAL_VALUE, command), length);
+
+    for (i = 0; i < length; i++) {
+        uart0_send_char(payload[i]);
+        crc = crc16_ccitt(crc, payload[i]);
+    }
+
+    uart0_send_char(crc & 0xff);
+    uart0_send_char(crc >> 8);
+}
+
+
+// ****************************************************************************
+static void send_ack(void)
+{
+    send_frame(RESPONSE_ACK, NULL, 0);
+}
+
+
+// ****************************************************************************
+static void send_nak(uint8_t error)
+{
+    send_frame(RESPONSE_NAK, &error, 1);
+}
+
+
+// ****************************************************************************
+static void hello(void)
+{
+    uint8_t info[9];
+    uint32_t address = (uint32_t)uploaded_light_programs;
+
+    info[0] = PROTOCOL_VERSION;
+    info[1] = LIGHT_PROGRAMS_VERSION;
+    info[2] = address & 0xff;
+    info[3] = (address >> 8) & 0xff;
+    info[4] = (address >> 16) & 0xff;
+    info[5] = address >> 24;
+    info[6] = UPLOADED_LIGHT_PROGRAMS_SIZE & 0xff;
+    info[7] = UPLOADED_LIGHT_PROGRAMS_SIZE >> 8;
+    info[8] = FLASH_PAGE_SIZE;
+
+    send_frame(RESPONSE_ACK, info, sizeof(info));
+}
+
+
+// ****************************************************************************
+static void begin(void)
+{
+    uint16_t length;
+    int i;
+
+    length = get_uint16(&frame.payload[0]);
+    if (frame.length != 4  ||
+        length <= offsetof(LIGHT_PROGRAMS_T, programs)  ||
+        length > UPLOADED_LIGHT_PROGRAMS_SIZE) {
+        send_nak(ERROR_INVALID_PARAMETER);
+        return;
+    }
+
+    // Erase the magic value of the previously uploaded light programs
+    for (i = 0; i < FLASH_PAGE_SIZE / 4; i++) {
+        first_page[i] = 0xffffffff;
+    }
+    if (!write_flash_page(uploaded_light_programs, first_page)) {
+        send_nak(ERROR_FLASH_WRITE);
+        return;
+    }
+
+    upload_length = length;
+    upload_crc = get_uint16(&frame.payload[2]);
+    send_ack();
+}
+
+
+// ****************************************************************************
+static void write_page(void)
+{
+    uint16_t offset;
+    uint8_t *destination;
+    int i;
+
+    if (upload_length == 0) {
+        send_nak(ERROR_NO_UPLOAD);
+        return;
+    }
+
+    offset = get_uint16(&frame.payload[0]);
+    if (frame.length != MAX_PAYLOAD  ||
+        (offset % FLASH_PAGE_SIZE) != 0  ||
+        offset >= upload_length) {
+        send_nak(ERROR_INVALID_PARAMETER);
+        return;
+    }
+
+    destination = (uint8_t *)((offset == 0) ? first_page : page);
+    for (i = 0; i < FLASH_PAGE_SIZE; i++) {
+        destination[i] = frame.payload[2 + i];
+    }
+
+    if (offset != 0  &&
+        !write_flash_page(&uploaded_light_programs[offset / 4], page)) {
+        send_nak(ERROR_FLASH_WRITE);
+        return;
+    }
+
+    send_ack();
+}
+
+
+// ****************************************************************************
+static void commit(void)
+{
+    const volatile uint8_t *uploaded = (const volatile uint8_t *)uploaded_light_programs;
+    uint16_t crc = CRC16_INITIAL_VALUE;
+    int i;
+
+    if (upload_length == 0) {
+        send_nak(ERROR_NO_UPLOAD);
+        return;
+    }
+
+    for (i = 0; i < upload_length; i++) {
+        crc = crc16_ccitt(crc, (i < FLASH_PAGE_SIZE) ?
+            ((const uint8_t *)first_page)[i] : uploaded[i]);
+    }
+
+    if (crc != upload_crc) {
+        send_nak(ERROR_CRC);
+        return;
+    }
+
+    if (!write_flash_page(uploaded_light_programs, first_page)) {
+        send_nak(ERROR_FLASH_WRITE);
+        return;
+    }
+
+    upload_length = 0;
+    send_ack();
+}
+
+
+// ****************************************************************************
+// Called during the power-up of the light controller, while the UART
+// receives on the ST pin
+bool maintenance_requested(void)
+{
+    return receive_frame()  &&  frame.command == COMMAND_HELLO;
+}
+
+
+// ****************************************************************************
+// Handle the upload protocol until the host sends EXIT, then reset the light
+// controller. Must be called before init_hardware_final() as the switch
+// matrix is reconfigured.
+void run_maintenance_mode(void)
+{
+    // U0_TXT_O=PIO0_4 (TH), U0_RXD_I=PIO0_0 (ST)
+    LPC_SWM->PINASSIGN0 = (0xff << 24) |
+                          (0xff << 16) |
+                          (GPIO_BIT_ST << 8) |
+                          (GPIO_BIT_TH << 0);
+
+    upload_length = 0;
+    hello();
+
+    while (1) {
+        if (!receive_frame()) {
+            continue;
+        }
+
+        switch (frame.command) {
+            case COMMAND_HELLO:
+                hello();
+                break;
+
+            case COMMAND_BEGIN:
+                begin();
+                break;
+
+            case COMMAND_WRITE:
+                write_page();
+                break;
+
+            case COMMAND_COMMIT:
+                commit();
+                break;
+
+            case COMMAND_EXIT:
+                send_ack();
+                while (!(LPC_USART0->STAT & UART_STAT_TXIDLE));
+                NVIC_SystemReset();
+                break;
+
+            default:
+                send_nak(ERROR_UNKNOWN_COMMAND);
+                break;
+        }
+    }
+}
+
+#endif
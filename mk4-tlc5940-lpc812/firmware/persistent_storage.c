@@ -18,7 +18,7 @@
 #include <globals.h>
 #include <uart0.h>
 
-#define PERSISTENT_DATA_VERSION 1
+#define PERSISTENT_DATA_VERSION 3
 #define NUMBER_OF_PERSISTENT_ELEMENTS 16
 
 __attribute__ ((section(".persistent_data")))
@@ -30,13 +30,30 @@ volatile const uint32_t persistent_data[NUMBER_OF_PERSISTENT_ELEMENTS];
 #define OFFSET_SERVO_LEFT 3
 #define OFFSET_SERVO_CENTRE 4
 #define OFFSET_SERVO_RIGHT 5
+#define OFFSET_GEARBOX_SERVO_LEFT 6
+#define OFFSET_GEARBOX_SERVO_CENTRE 7
+#define OFFSET_GEARBOX_SERVO_RIGHT 8
+#define OFFSET_STEERING_LEFT_DELTA 9
+#define OFFSET_STEERING_RIGHT_DELTA 10
+#define OFFSET_THROTTLE_LEFT_DELTA 11
+#define OFFSET_THROTTLE_RIGHT_DELTA 12
+#define NUMBER_OF_USED_ELEMENTS 13
+
+// Version 1 only stored the endpoints of the one servo output, at
+// OFFSET_SERVO_xxx. They are taken over for both servo output functions.
+#define PERSISTENT_DATA_VERSION_1 1
+
+// Version 2 did not have the learned endpoints of steering and throttle
+#define PERSISTENT_DATA_VERSION_2 2
 
 
 // ****************************************************************************
 void load_persistent_storage(void)
 {
-    uint32_t defaults[6];
+    uint32_t defaults[NUMBER_OF_USED_ELEMENTS];
     const volatile uint32_t *ptr;
+    const volatile uint32_t *gearbox;
+    const volatile uint32_t *learned;
 
     defaults[OFFSET_VERSION] = PERSISTENT_DATA_VERSION;
     defaults[OFFSET_STEERING_REVERSED] = false;
@@ -44,94 +61,145 @@ void load_persistent_storage(void)
     defaults[OFFSET_SERVO_LEFT] = 1000;
     defaults[OFFSET_SERVO_CENTRE] = 1500;
     defaults[OFFSET_SERVO_RIGHT] = 2000;
-
-    if (defaults[0] != persistent_data[0]) {
-        ptr = defaults;
+    defaults[OFFSET_GEARBOX_SERVO_LEFT] = 1000;
+    defaults[OFFSET_GEARBOX_SERVO_CENTRE] = 1500;
+    defaults[OFFSET_GEARBOX_SERVO_RIGHT] = 2000;
+    defaults[OFFSET_STEERING_LEFT_DELTA] = 0;
+    defaults[OFFSET_STEERING_RIGHT_DELTA] = 0;
+    defaults[OFFSET_THROTTLE_LEFT_DELTA] = 0;
+    defaults[OFFSET_THROTTLE_RIGHT_DELTA] = 0;
+
+    if (persistent_data[0] == PERSISTENT_DATA_VERSION) {
+        ptr = persistent_data;
+        gearbox = &persistent_data[OFFSET_GEARBOX_SERVO_LEFT];
+        learned = &persistent_data[OFFSET_STEERING_LEFT_DELTA];
     }
-    else {
+    else if (persistent_data[0] == PERSISTENT_DATA_VERSION_2) {
+        ptr = persistent_data;
+        gearbox = &persistent_data[OFFSET_GEARBOX_SERVO_LEFT];
+        learned = &defaults[OFFSET_STEERING_LEFT_DELTA];
+    }
+    else if (persistent_data[0] == PERSISTENT_DATA_VERSION_1) {
         ptr = persistent_data;
+        gearbox = &persistent_data[OFFSET_SERVO_LEFT];
+        learned = &defaults[OFFSET_STEERING_LEFT_DELTA];
+    }
+    else {
+        ptr = defaults;
+        gearbox = &defaults[OFFSET_GEARBOX_SERVO_LEFT];
+        learned = &defaults[OFFSET_STEERING_LEFT_DELTA];
     }
 
     channel[ST].reversed = ptr[OFFSET_STEERING_REVERSED];
     channel[TH].reversed = ptr[OFFSET_THROTTLE_REVERSED];
-    servo_output_endpoint.left = ptr[OFFSET_SERVO_LEFT];
-    servo_output_endpoint.centre = ptr[OFFSET_SERVO_CENTRE];
-    servo_output_endpoint.right = ptr[OFFSET_SERVO_RIGHT];
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].left = ptr[OFFSET_SERVO_LEFT];
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].centre = ptr[OFFSET_SERVO_CENTRE];
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].right = ptr[OFFSET_SERVO_RIGHT];
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].left = gearbox[0];
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].centre = gearbox[1];
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].right = gearbox[2];
+    learned_endpoint_delta[ST].left = learned[0];
+    learned_endpoint_delta[ST].right = learned[1];
+    learned_endpoint_delta[TH].left = learned[2];
+    learned_endpoint_delta[TH].right = learned[3];
 }
 
 
 // ****************************************************************************
-void write_persistent_storage(void)
+// Erase the 64 byte flash page and write data into it. data must be on a
+// word boundary.
+bool write_flash_page(volatile const uint32_t *page, const uint32_t *data)
 {
-    uint32_t new_data[6];
     unsigned int param[5];
+
+    param[0] = 50;
+    param[1] = ((unsigned int)page) >> 10;
+    param[2] = ((unsigned int)page) >> 10;
+    __disable_irq();
+    iap_entry(param, param);
+    __enable_irq();
+    if (param[0] != 0) {
+        if (diagnostics_enabled()) {
+            uart0_send_cstring("ERROR: prepare sector failed\n");
+        }
+        return false;
+    }
+
+    param[0] = 59;  // Erase page command
+    param[1] = ((unsigned int)page) >> 6;
+    param[2] = ((unsigned int)page) >> 6;
+    param[3] = __SYSTEM_CLOCK / 1000;
+    __disable_irq();
+    iap_entry(param, param);
+    __enable_irq();
+    if (param[0] != 0) {
+        if (diagnostics_enabled()) {
+            uart0_send_cstring("ERROR: erase page failed\n");
+        }
+        return false;
+    }
+
+    param[0] = 50;
+    param[1] = ((unsigned int)page) >> 10;
+    param[2] = ((unsigned int)page) >> 10;
+    __disable_irq();
+    iap_entry(param, param);
+    __enable_irq();
+    if (param[0] != 0) {
+        if (diagnostics_enabled()) {
+            uart0_send_cstring("ERROR: prepare sector failed\n");
+        }
+        return false;
+    }
+
+    param[0] = 51;  // Copy RAM to Flash command
+    param[1] = (unsigned int)page;
+    param[2] = (unsigned int)data;
+    param[3] = FLASH_PAGE_SIZE;
+    param[4] = __SYSTEM_CLOCK / 1000;
+    __disable_irq();
+    iap_entry(param, param);
+    __enable_irq();
+    if (param[0] != 0) {
+        if (diagnostics_enabled()) {
+            uart0_send_cstring("ERROR: copy RAM to flash failed\n");
+        }
+        return false;
+    }
+
+    return true;
+}
+
+
+// ****************************************************************************
+void write_persistent_storage(void)
+{
+    // write_flash_page() always writes a whole page
+    uint32_t new_data[NUMBER_OF_PERSISTENT_ELEMENTS];
     int i;
 
+    for (i = 0; i < NUMBER_OF_PERSISTENT_ELEMENTS; i++) {
+        new_data[i] = 0xffffffff;
+    }
+
     new_data[OFFSET_VERSION] = PERSISTENT_DATA_VERSION;
     new_data[OFFSET_STEERING_REVERSED] = channel[ST].reversed;
     new_data[OFFSET_THROTTLE_REVERSED] = channel[TH].reversed;
-    new_data[OFFSET_SERVO_LEFT] = servo_output_endpoint.left;
-    new_data[OFFSET_SERVO_CENTRE] = servo_output_endpoint.centre;
-    new_data[OFFSET_SERVO_RIGHT] = servo_output_endpoint.right;
-
-    for (i = 0; i < 6; i++) {
-        if (new_data[0] != persistent_data[0]) {
-
-            param[0] = 50;
-            param[1] = ((unsigned int)persistent_data) >> 10;
-            param[2] = ((unsigned int)persistent_data) >> 10;
-            __disable_irq();
-            iap_entry(param, param);
-            __enable_irq();
-            if (param[0] != 0) {
-                if (diagnostics_enabled()) {
-                    uart0_send_cstring("ERROR: prepare sector failed\n");
-                }
-                break;
-            }
-
-            param[0] = 59;  // Erase page command
-            param[1] = ((unsigned int)persistent_data) >> 6;
-            param[2] = ((unsigned int)persistent_data) >> 6;
-            param[3] = __SYSTEM_CLOCK / 1000;
-            __disable_irq();
-            iap_entry(param, param);
-            __enable_irq();
-            if (param[0] != 0) {
-                if (diagnostics_enabled()) {
-                    uart0_send_cstring("ERROR: erase page failed\n");
-                }
-                break;
-            }
-
-            param[0] = 50;
-            param[1] = ((unsigned int)persistent_data) >> 10;
-            param[2] = ((unsigned int)persistent_data) >> 10;
-            __disable_irq();
-            iap_entry(param, param);
-            __enable_irq();
-            if (param[0] != 0) {
-                if (diagnostics_enabled()) {
-                    uart0_send_cstring("ERROR: prepare sector failed\n");
-                }
-                break;
-            }
-
-            param[0] = 51;  // Copy RAM to Flash command
-            param[1] = (unsigned int)persistent_data;
-            param[2] = (unsigned int)new_data;
-            param[3] = 64;
-            param[4] = __SYSTEM_CLOCK / 1000;
-            __disable_irq();
-            iap_entry(param, param);
-            __enable_irq();
-            if (param[0] != 0) {
-                if (diagnostics_enabled()) {
-                    uart0_send_cstring("ERROR: copy RAM to flash failed\n");
-                }
-                break;
-            }
-
+    new_data[OFFSET_SERVO_LEFT] = servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].left;
+    new_data[OFFSET_SERVO_CENTRE] = servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].centre;
+    new_data[OFFSET_SERVO_RIGHT] = servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].right;
+    new_data[OFFSET_GEARBOX_SERVO_LEFT] = servo_output_endpoint[SERVO_OUTPUT_GEARBOX].left;
+    new_data[OFFSET_GEARBOX_SERVO_CENTRE] = servo_output_endpoint[SERVO_OUTPUT_GEARBOX].centre;
+    new_data[OFFSET_GEARBOX_SERVO_RIGHT] = servo_output_endpoint[SERVO_OUTPUT_GEARBOX].right;
+    new_data[OFFSET_STEERING_LEFT_DELTA] = learned_endpoint_delta[ST].left;
+    new_data[OFFSET_STEERING_RIGHT_DELTA] = learned_endpoint_delta[ST].right;
+    new_data[OFFSET_THROTTLE_LEFT_DELTA] = learned_endpoint_delta[TH].left;
+    new_data[OFFSET_THROTTLE_RIGHT_DELTA] = learned_endpoint_delta[TH].right;
+
+    // Only write the flash if something has changed
+    for (i = 0; i < NUMBER_OF_USED_ELEMENTS; i++) {
+        if (new_data[i] != persistent_data[i]) {
+            write_flash_page(persistent_data, new_data);
             break;
         }
     }
@@ -9,49 +9,197 @@
     There is also a flag sent out that indicates when the preprocessor is
     initializing and reading the 0-position of steering and throttle.
 
+    The 4 byte frames (see uart_reader.c) only carry the channels in percent
+    and CH3 as a single bit. With config.flags.preprocessor_output_v2 the
+    frames of protocol v2 are sent instead, once for every new set of channel
+    data:
+
+        0x83        Sync byte
+        sequence    Incremented for every frame
+        st low      Steering, int16 little endian: -2000..+2000, i.e. the
+        st high     fine value of the channel (see CHANNEL_FINE_SCALE)
+        th low      Throttle, same format
+        th high
+        ch3 low     CH3/AUX as analog value, same format
+        ch3 high
+        flags       Same as the fourth byte of the 4 byte frames: CH3 in
+                    bit 0 and the initializing flag in bit 4
+        crc low     CRC-16-CCITT (polynomial 0x1021, initial value 0xffff)
+        crc high    of sequence .. flags
+
+    Like in the multiplexed UART frames (see uart_mux.c) all bytes following
+    the sync byte that have a value of 0x80..0x87 are sent as 0x85 followed
+    by the value XOR 0x20. Receivers that only know the 4 byte frames
+    therefore never see their start byte 0x87 within a v2 frame. Light
+    controllers with this firmware accept both kinds of frames.
+
+    With other UART outputs the same fields, sequence .. flags, are the
+    payload of the frames of the preprocessor channel (see uart_mux.c).
+
 ******************************************************************************/
 #include <stdint.h>
 
 #include <globals.h>
 #include <uart0.h>
+#include <utils.h>
 
 #define SLAVE_MAGIC_BYTE 0x87
+#define V2_SYNC 0x83
+#define V2_ESCAPE 0x85
+#define V2_ESCAPE_XOR 0x20
 #define CH3_HYSTERESIS 5
 
+// Sync byte and payload plus CRC which may all be escaped
+#define V2_MAX_FRAME_SIZE (1 + 2 * (PREPROCESSOR_V2_PAYLOAD_SIZE + 2))
+
 static bool ch3_2pos = false;
-static uint8_t tx_data[4];
+static uint8_t tx_data[V2_MAX_FRAME_SIZE];
+static uint8_t tx_length = 4;
 static uint8_t next_tx_index = 0xff;
+static uint8_t sequence;
+static bool v2_pending;
+
+
+// ****************************************************************************
+static void update_ch3_2pos(void)
+{
+    if (ch3_2pos) {
+        if (channel[2].normalized < -CH3_HYSTERESIS) {
+            ch3_2pos = false;
+        }
+    }
+    else {
+        if (channel[2].normalized > CH3_HYSTERESIS) {
+            ch3_2pos = true;
+        }
+    }
+}
+
+
+// ****************************************************************************
+static uint8_t flags_byte(void)
+{
+    return (ch3_2pos ? (1 << 0) : 0) |
+           (global_flags.initializing ? (1 << 4) : 0);
+}
+
+
+// ****************************************************************************
+static void build_v2_payload(uint8_t *payload)
+{
+    payload[0] = sequence++;
+    payload[1] = (uint16_t)channel[ST].fine & 0xff;
+    payload[2] = (uint16_t)channel[ST].fine >> 8;
+    payload[3] = (uint16_t)channel[TH].fine & 0xff;
+    payload[4] = (uint16_t)channel[TH].fine >> 8;
+    payload[5] = (uint16_t)channel[CH3].fine & 0xff;
+    payload[6] = (uint16_t)channel[CH3].fine >> 8;
+    payload[7] = flags_byte();
+}
+
+
+// ****************************************************************************
+static void add_escaped(uint8_t data)
+{
+    if (data >= 0x80  &&  data <= SLAVE_MAGIC_BYTE) {
+        tx_data[tx_length++] = V2_ESCAPE;
+        data ^= V2_ESCAPE_XOR;
+    }
+    tx_data[tx_length++] = data;
+}
+
+
+// ****************************************************************************
+// A frame is only started when the previous one has been sent completely;
+// new channel data arriving in the meantime goes into the next frame
+static void output_v2(void)
+{
+    uint8_t payload[PREPROCESSOR_V2_PAYLOAD_SIZE];
+    uint16_t crc = CRC16_INITIAL_VALUE;
+    int i;
+
+    if (global_flags.new_channel_data) {
+        update_ch3_2pos();
+        v2_pending = true;
+    }
+
+    if (v2_pending  &&  next_tx_index >= tx_length) {
+        v2_pending = false;
+        build_v2_payload(payload);
+
+        tx_length = 0;
+        tx_data[tx_length++] = V2_SYNC;
+        for (i = 0; i < PREPROCESSOR_V2_PAYLOAD_SIZE; i++) {
+            add_escaped(payload[i]);
+            crc = crc16_ccitt(crc, payload[i]);
+        }
+        add_escaped(crc & 0xff);
+        add_escaped(crc >> 8);
+
+        next_tx_index = 0;
+    }
+
+    while (next_tx_index < tx_length  &&  uart0_send_is_ready()) {
+        uart0_send_char(tx_data[next_tx_index++]);
+    }
+}
+
+
+// ****************************************************************************
+// With other UART outputs the channels are sent as frames of the preprocessor
+// channel (see uart_mux.c), once for every new set of channel data
+static void output_multiplexed(void)
+{
+    uint8_t data[PREPROCESSOR_V2_PAYLOAD_SIZE];
+
+    if (!global_flags.new_channel_data) {
+        return;
+    }
+
+    update_ch3_2pos();
+
+    if (config.flags.preprocessor_output_v2) {
+        build_v2_payload(data);
+        uart_mux_send(UART_MUX_CHANNEL_PREPROCESSOR, data, sizeof(data));
+        return;
+    }
+
+    data[0] = channel[ST].normalized;
+    data[1] = channel[TH].normalized;
+    data[2] = flags_byte();
+    uart_mux_send(UART_MUX_CHANNEL_PREPROCESSOR, data, 3);
+}
 
 
 // ****************************************************************************
 void output_preprocessor(void)
 {
-    if (!config.flags.preprocessor_output) {
+    if (!CONFIG_PREPROCESSOR_OUTPUT) {
         return;
     }
 
-    if (!global_flags.new_channel_data) {
-        if (ch3_2pos) {
-            if (channel[2].normalized < -CH3_HYSTERESIS) {
-                ch3_2pos = false;
-            }
-        }
-        else {
-            if (channel[2].normalized > CH3_HYSTERESIS) {
-                ch3_2pos = true;
-            }
-        }
+    if (CONFIG_UART_MULTIPLEX) {
+        output_multiplexed();
+        return;
+    }
+
+    if (config.flags.preprocessor_output_v2) {
+        output_v2();
+        return;
+    }
+
+    if (global_flags.new_channel_data) {
+        update_ch3_2pos();
 
         tx_data[0] = SLAVE_MAGIC_BYTE;
         tx_data[1] = channel[ST].normalized;
         tx_data[2] = channel[TH].normalized;
-        tx_data[3] = (ch3_2pos ? (1 << 0) : 0) |
-                     (global_flags.initializing ? (1 << 4) : 0);
+        tx_data[3] = flags_byte();
 
         next_tx_index = 0;
     }
 
-    if (next_tx_index < sizeof(tx_data)  &&  uart0_send_is_ready()) {
+    if (next_tx_index < tx_length  &&  uart0_send_is_ready()) {
         uart0_send_char(tx_data[next_tx_index++]);
     }
 }
@@ -1,29 +1,137 @@
 /******************************************************************************
+
+    Servo outputs for a steering wheel servo and a gearbox servo.
+
+    SCTimer H runs at 1 MHz. Event 0 (match register 0, auto-limit) ends the
+    frame and starts the servo pulses. Each servo output has its own event
+    and match register that end its pulse:
+
+        Output      Pin             Event   Match register (H)
+        OUT         PIO0_12 (OUT)   4       4
+        TH          PIO0_4 (TH)     5       3
+
+    Events 1..3 and the L halves of match registers 1..3 capture the servo
+    inputs on SCTimer L (see servo_reader.c); they are not touched here. The
+    LPC812 has 6 events, so there is no room for a third servo output.
+
+    A single servo output function uses the OUT pin. When both the steering
+    wheel servo and the gearbox servo are enabled, the steering wheel servo
+    uses OUT and the gearbox servo uses TH. This is only possible in the
+    modes where TH is not a servo input and not used by a UART output (see
+    CONFIG_DUAL_SERVO_OUTPUT). Each function has its own endpoints, which the
+    servo output setup (8 CH3 clicks) configures one after the other.
+
+    The SCTimer reloads the match registers from MATCHREL at the limit, i.e.
+    at event 0. process_servo_output() writes the pulse widths into MATCHREL
+    as soon as the mainloop has new channel data, so every pulse uses the
+    newest steering value. The latency from a new steering value to the
+    servo pulse is therefore at most one output frame, plus the time the
+    mainloop takes to process the channels.
+
+    Digital servos accept higher frame rates than the 50 Hz of a receiver,
+    so the frame rate of the steering wheel servo is configurable
+    (config.servo_output_frame_rate) to reduce this latency. Gearbox servos
+    run at 50 Hz; as both outputs share counter H, the steering wheel servo
+    also runs at 50 Hz when a gearbox servo is used.
+    tools/servo-latency measures the resulting latency.
+
+    The gearbox servo does not jump to the endpoint of a new gear, which
+    draws peak current and makes the gearbox grind. The SCT interrupt of
+    event 0 moves it with a trapezoidal speed profile: it accelerates within
+    config.gearbox_servo_ramp_time to config.gearbox_servo_speed, and brakes
+    so that it stops at the endpoint. The mainloop only sets the target.
+    GEARBOX_SERVO_HOLD_FRAMES after the profile has completed the interrupt
+    switches the output off, until a gear change or the idle time
+    (config.gearbox_servo_idle_time) activates it again.
+
 ******************************************************************************/
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <LPC8xx.h>
 #include <globals.h>
 
+// SCTimer resources of a servo output
+typedef struct {
+    uint8_t pin;            // PIO0_n
+    uint8_t ctout;          // CTOUT_n
+    uint8_t event;          // Event that ends the pulse
+    uint8_t match;          // Match register (H) holding the pulse width
+} SERVO_OUTPUT_HARDWARE_T;
+
+// We've chosen CTOUT_1 and CTOUT_2 because CTOUT_0 resides in PINASSIGN6,
+// which changing may affect CTIN_1..3 that we need.
+// CTOUT_1 and CTOUT_2 are in PINASSIGN7, where no other function is needed
+// for our application.
+static const SERVO_OUTPUT_HARDWARE_T output_out = {
+    .pin = GPIO_BIT_OUT, .ctout = 1, .event = 4, .match = 4
+};
+
+static const SERVO_OUTPUT_HARDWARE_T output_th = {
+    .pin = GPIO_BIT_TH, .ctout = 2, .event = 5, .match = 3
+};
+
+// Frames the gearbox servo keeps receiving pulses after reaching its target,
+// giving it time to settle
+#define GEARBOX_SERVO_HOLD_FRAMES 5
+
+// Limit of config.gearbox_servo_speed, so that the braking distance
+// calculation does not overflow
+#define GEARBOX_SERVO_MAX_SPEED 255
+
 static bool next = false;
-static uint16_t servo_pulse;
+static SERVO_OUTPUT_FUNCTION_T setup_function;
+static uint16_t servo_pulse[NUMBER_OF_SERVO_OUTPUTS];
 
 static uint16_t gearbox_servo_counter;
-static bool gearbox_servo_active;
+
+// Set by the mainloop, the SCT interrupt moves the gearbox servo there
+static volatile uint16_t gearbox_servo_target;
+static volatile bool gearbox_servo_start;
+
+// Owned by the SCT interrupt. Position and speed are in 1/256 us.
+static volatile bool gearbox_servo_active;
+static uint32_t gearbox_servo_position;
+static int32_t gearbox_servo_speed;
+static uint8_t gearbox_servo_hold;
 
 static SERVO_ENDPOINTS_T servo_setup_endpoint;
-SERVO_ENDPOINTS_T servo_output_endpoint;
+SERVO_ENDPOINTS_T servo_output_endpoint[NUMBER_OF_SERVO_OUTPUTS];
+
+
+// ****************************************************************************
+// Returns the output the given function uses, or NULL if the function is not
+// used
+static const SERVO_OUTPUT_HARDWARE_T *servo_output(
+    SERVO_OUTPUT_FUNCTION_T function)
+{
+    if (CONFIG_DUAL_SERVO_OUTPUT) {
+        return (function == SERVO_OUTPUT_GEARBOX) ? &output_th : &output_out;
+    }
+
+    // Only one servo output on OUT. Should both functions be enabled in a
+    // mode where TH is not available, the gearbox servo takes precedence.
+    if (function == SERVO_OUTPUT_GEARBOX) {
+        return CONFIG_GEARBOX_SERVO_OUTPUT ? &output_out : NULL;
+    }
+
+    if (CONFIG_STEERING_WHEEL_SERVO_OUTPUT  &&  !CONFIG_GEARBOX_SERVO_OUTPUT) {
+        return &output_out;
+    }
+
+    return NULL;
+}
 
 
 // ****************************************************************************
 static bool servo_output_disabled(void)
 {
-    if (config.flags.gearbox_servo_output) {
+    if (servo_output(SERVO_OUTPUT_GEARBOX)) {
         return false;
     }
 
-    if (config.flags.steering_wheel_servo_output) {
+    if (servo_output(SERVO_OUTPUT_STEERING_WHEEL)) {
         return false;
     }
 
@@ -32,16 +140,65 @@ static bool servo_output_disabled(void)
 
 
 // ****************************************************************************
+// Have the SCT interrupt (re-)start the motion profile of the gearbox servo
 static void activate_gearbox_servo(void)
 {
-    gearbox_servo_active = true;
-    gearbox_servo_counter = config.gearbox_servo_active_time;
-    LPC_SCT->OUT[1].SET = (1 << 0);        // Re-enable event 0 to set CTOUT_1
+    gearbox_servo_start = true;
+}
+
+
+// ****************************************************************************
+// Duration of an output frame in microseconds. It must be longer than the
+// longest servo pulse.
+static uint16_t servo_output_frame_time(void)
+{
+    if (!servo_output(SERVO_OUTPUT_GEARBOX)) {
+        switch (config.servo_output_frame_rate) {
+            case 100:
+                return 10000;
+
+            case 200:
+                return 5000;
+
+            case 333:
+                return 3000;
+
+            default:
+                break;
+        }
+    }
+
+    return 20000;
+}
+
+
+// ****************************************************************************
+// Returns the value for PINASSIGN7 with the output assigned to its pin
+static uint32_t init_output(
+    const SERVO_OUTPUT_HARDWARE_T *output, uint32_t pinassign7)
+{
+    unsigned int shift = (output->ctout - 1) * 8;
+
+    LPC_SCT->MATCHREL[output->match].H = 1500;  // Servo pulse 1.5 ms intially
+
+    LPC_SCT->EVENT[output->event].STATE = 0xFFFF;   // Event happens in all states
+    LPC_SCT->EVENT[output->event].CTRL =
+        (output->match << 0) |                  // Match register of the output
+        (1 << 4) |                              // Select H counter
+        (0x1 << 12);                            // Match condition only
+
+    LPC_SCT->OUT[output->ctout].SET = (1 << 0);             // Event 0 sets the output
+    LPC_SCT->OUT[output->ctout].CLR = (1 << output->event); // Pulse event clears it
+
+    return (pinassign7 & ~(0xffu << shift)) | (output->pin << shift);
 }
 
 
 // ****************************************************************************
 void init_servo_output(void) {
+    const SERVO_OUTPUT_HARDWARE_T *output;
+    uint32_t pinassign7 = 0xffffffff;
+
     if (servo_output_disabled()) {
         return;
     }
@@ -49,28 +206,34 @@ void init_servo_output(void) {
     LPC_SCT->CONFIG |= (1 << 18);           // Auto-limit on counter H
     LPC_SCT->CTRL_H |= (1 << 3) |           // Clear the counter H
                        (11 << 5);           // PRE_H[12:5] = 12-1 (SCTimer H clock 1 MHz)
-    LPC_SCT->MATCHREL[0].H = 20000 - 1;     // 20 ms per overflow (50 Hz)
-    LPC_SCT->MATCHREL[4].H = 1500;          // Servo pulse 1.5 ms intially
+    LPC_SCT->MATCHREL[0].H = servo_output_frame_time() - 1;
 
     LPC_SCT->EVENT[0].STATE = 0xFFFF;       // Event 0 happens in all states
     LPC_SCT->EVENT[0].CTRL = (0 << 0) |     // Match register 0
                              (1 << 4) |     // Select H counter
                              (0x1 << 12);   // Match condition only
 
-    LPC_SCT->EVENT[4].STATE = 0xFFFF;       // Event 4 happens in all states
-    LPC_SCT->EVENT[4].CTRL = (4 << 0) |     // Match register 4
-                             (1 << 4) |     // Select H counter
-                             (0x1 << 12);   // Match condition only
+    output = servo_output(SERVO_OUTPUT_STEERING_WHEEL);
+    if (output) {
+        pinassign7 = init_output(output, pinassign7);
+    }
 
-    // We've chosen CTOUT_1 because CTOUT_0 resides in PINASSIGN6, which
-    // changing may affect CTIN_1..3 that we need.
-    // CTOUT_1 is in PINASSIGN7, where no other function is needed for our
-    // application.
-    LPC_SCT->OUT[1].SET = (1 << 0);        // Event 0 will set CTOUT_1
-    LPC_SCT->OUT[1].CLR = (1 << 4);        // Event 4 will clear CTOUT_1
+    output = servo_output(SERVO_OUTPUT_GEARBOX);
+    if (output) {
+        pinassign7 = init_output(output, pinassign7);
 
-    // CTOUT_1 = PIO0_12
-    LPC_SWM->PINASSIGN7 = 0xffffff0c;
+        // The gearbox servo position is unknown at power-up, so it jumps to
+        // the first gear
+        gearbox_servo_target = servo_output_endpoint[SERVO_OUTPUT_GEARBOX].left;
+        gearbox_servo_position = gearbox_servo_target << 8;
+        LPC_SCT->MATCHREL[output->match].H = gearbox_servo_target;
+
+        LPC_SCT->EVEN |= (1 << 0);          // Event 0 generates an interrupt
+        NVIC_EnableIRQ(SCT_IRQn);
+    }
+
+    // CTOUT_1 = PIO0_12 (OUT), CTOUT_2 = PIO0_4 (TH)
+    LPC_SWM->PINASSIGN7 = pinassign7;
 
     LPC_SCT->CTRL_H &= ~(1 << 2);          // Start the SCTimer H
 
@@ -83,7 +246,7 @@ void init_servo_output(void) {
 // ****************************************************************************
 void gearbox_action(uint8_t ch3_clicks)
 {
-    if (!config.flags.gearbox_servo_output) {
+    if (!CONFIG_GEARBOX_SERVO_OUTPUT) {
         return;
     }
 
@@ -117,12 +280,42 @@ void gearbox_action(uint8_t ch3_clicks)
         }
     }
 
-    // FIXME: we need to ensure this is active for one mainloop!
-    global_flags.gear_changed = true;
+    post_light_program_event(RUN_ON_GEAR_CHANGED);
     activate_gearbox_servo();
 }
 
 
+// ****************************************************************************
+// Start the setup of the endpoints of the given servo output function
+static void start_setup(SERVO_OUTPUT_FUNCTION_T function)
+{
+    setup_function = function;
+    servo_output_endpoint[function].left = 900;
+    servo_output_endpoint[function].centre = 1500;
+    servo_output_endpoint[function].right = 2100;
+    global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_LEFT;
+}
+
+
+// ****************************************************************************
+// The endpoints of the function in setup are complete. Continue with the
+// gearbox servo if both servo outputs are used, otherwise store the
+// endpoints.
+static void finish_setup(void)
+{
+    servo_output_endpoint[setup_function] = servo_setup_endpoint;
+
+    if (setup_function == SERVO_OUTPUT_STEERING_WHEEL  &&
+            servo_output(SERVO_OUTPUT_GEARBOX)) {
+        start_setup(SERVO_OUTPUT_GEARBOX);
+        return;
+    }
+
+    write_persistent_storage();
+    global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_OFF;
+}
+
+
 // ****************************************************************************
 void servo_output_setup_action(uint8_t ch3_clicks)
 {
@@ -131,10 +324,12 @@ void servo_output_setup_action(uint8_t ch3_clicks)
     }
 
     if (global_flags.servo_output_setup == SERVO_OUTPUT_SETUP_OFF) {
-        servo_output_endpoint.left = 900;
-        servo_output_endpoint.centre = 1500;
-        servo_output_endpoint.right = 2100;
-        global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_LEFT;
+        if (servo_output(SERVO_OUTPUT_STEERING_WHEEL)) {
+            start_setup(SERVO_OUTPUT_STEERING_WHEEL);
+        }
+        else {
+            start_setup(SERVO_OUTPUT_GEARBOX);
+        }
     }
     else {
         if (ch3_clicks == 1) {
@@ -167,122 +362,260 @@ void servo_output_setup_action(uint8_t ch3_clicks)
     removed e.g. if only a gearbox servo is used.
 
 ******************************************************************************/
-static void calculate_servo_pulse(void)
+static uint16_t calculate_servo_pulse(const SERVO_ENDPOINTS_T *endpoint)
 {
     if (channel[ST].normalized < 0) {
-        servo_pulse = servo_output_endpoint.centre -
-            (((servo_output_endpoint.centre - servo_output_endpoint.left) *
+        return endpoint->centre -
+            (((endpoint->centre - endpoint->left) *
                 channel[ST].absolute) / 100);
     }
     else {
-        servo_pulse = servo_output_endpoint.centre +
-            (((servo_output_endpoint.right - servo_output_endpoint.centre) *
+        return endpoint->centre +
+            (((endpoint->right - endpoint->centre) *
                 channel[ST].absolute) / 100);
     }
 }
 
 
+// ****************************************************************************
+static void process_servo_setup(void)
+{
+    uint16_t pulse;
+
+    pulse = calculate_servo_pulse(&servo_output_endpoint[setup_function]);
+    servo_pulse[setup_function] = pulse;
+
+    if (!next) {
+        return;
+    }
+    next = false;
+
+    switch (global_flags.servo_output_setup) {
+        case SERVO_OUTPUT_SETUP_LEFT:
+            servo_setup_endpoint.left = pulse;
+            global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_CENTRE;
+            break;
+
+        case SERVO_OUTPUT_SETUP_CENTRE:
+            servo_setup_endpoint.centre = pulse;
+
+            // In case we are dealing with a 2-speed gearbox we only
+            // configure left and center endpoint
+            if (setup_function == SERVO_OUTPUT_GEARBOX  &&
+                    config.number_of_gears == 2) {
+                servo_setup_endpoint.right =
+                    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].right;
+                finish_setup();
+            }
+            else {
+                global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_RIGHT;
+            }
+            break;
+
+        case SERVO_OUTPUT_SETUP_RIGHT:
+            servo_setup_endpoint.right = pulse;
+            finish_setup();
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+// ****************************************************************************
+static void process_gearbox_servo(void)
+{
+    const SERVO_ENDPOINTS_T *endpoint =
+        &servo_output_endpoint[SERVO_OUTPUT_GEARBOX];
+    uint16_t target = gearbox_servo_target;
+
+    if (global_flags.gear == GEAR_1) {
+        target = endpoint->left;
+    }
+    else if (global_flags.gear == GEAR_2) {
+        target = endpoint->centre;
+    }
+    else if (global_flags.gear == GEAR_3) {
+        target = endpoint->right;
+    }
+
+    if (target != gearbox_servo_target) {
+        gearbox_servo_target = target;
+        activate_gearbox_servo();
+    }
+
+    // Re-activate the servo when it has been idle for
+    // config.gearbox_servo_idle_time, so that it holds the gear
+    if (config.gearbox_servo_idle_time && global_flags.systick) {
+        if (gearbox_servo_active  ||  gearbox_servo_start) {
+            gearbox_servo_counter = config.gearbox_servo_idle_time;
+        }
+        else if (gearbox_servo_counter) {
+            --gearbox_servo_counter;
+        }
+        else {
+            activate_gearbox_servo();
+        }
+    }
+}
+
+
 // ****************************************************************************
 void process_servo_output(void)
 {
+    const SERVO_OUTPUT_HARDWARE_T *output;
+    bool setup_active;
+
     if (servo_output_disabled()) {
         return;
     }
 
+    setup_active = (global_flags.servo_output_setup != SERVO_OUTPUT_SETUP_OFF);
+    if (setup_active) {
+        process_servo_setup();
+    }
+
     // --------------------------------
-    // Servo output setup is active
-    if (global_flags.servo_output_setup != SERVO_OUTPUT_SETUP_OFF) {
-        calculate_servo_pulse();
-        if (next) {
-            next = false;
-
-            switch (global_flags.servo_output_setup) {
-                case SERVO_OUTPUT_SETUP_LEFT:
-                    servo_setup_endpoint.left = servo_pulse;
-                    global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_CENTRE;
-                    break;
-
-                case SERVO_OUTPUT_SETUP_CENTRE:
-                    servo_setup_endpoint.centre = servo_pulse;
-
-                    // In case we are dealing with a 2-speed gearbox we only
-                    // configure left and center endpoint
-                    if (config.flags.gearbox_servo_output &&
-                            config.number_of_gears == 2) {
-                        servo_output_endpoint.centre = servo_setup_endpoint.centre;
-                        servo_output_endpoint.left = servo_setup_endpoint.left;
-                        write_persistent_storage();
-
-                        global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_OFF;
-                    }
-                    else {
-                        global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_RIGHT;
-                    }
-                    break;
-
-                case SERVO_OUTPUT_SETUP_RIGHT:
-                    servo_setup_endpoint.right = servo_pulse;
-
-                    servo_output_endpoint.right = servo_setup_endpoint.right;
-                    servo_output_endpoint.centre = servo_setup_endpoint.centre;
-                    servo_output_endpoint.left = servo_setup_endpoint.left;
-                    write_persistent_storage();
-
-                    global_flags.servo_output_setup = SERVO_OUTPUT_SETUP_OFF;
-                    break;
-
-                default:
-                    break;
-            }
+    // Gearbox servo is active. The SCT interrupt outputs its pulse.
+    if (servo_output(SERVO_OUTPUT_GEARBOX)) {
+        if (setup_active  &&  setup_function == SERVO_OUTPUT_GEARBOX) {
+            // Follow the steering during setup and keep the servo powered
+            gearbox_servo_target = servo_pulse[SERVO_OUTPUT_GEARBOX];
+            activate_gearbox_servo();
+        }
+        else {
+            process_gearbox_servo();
         }
     }
 
     // --------------------------------
-    // Gearbox servo is active
-    else if (config.flags.gearbox_servo_output) {
-
-        if (config.gearbox_servo_idle_time && global_flags.systick) {
-            if (gearbox_servo_counter) {
-                --gearbox_servo_counter;
-            }
-            else {
-                if (gearbox_servo_active) {
-                    // Turn off the setting of CTOUT_1, so no pulse will be
-                    // generated. However, clearing of CTOUT_1 is still active
-                    // through event 0, so if a pulse is currently active
-                    // it will be nicely terminated, and from the next period
-                    // onwards the pulses will cease.
-                    LPC_SCT->OUT[1].SET = 0;
-                    gearbox_servo_counter = config.gearbox_servo_idle_time;
-                    gearbox_servo_active = false;
-                }
-                else {
-                    activate_gearbox_servo();
-                }
-            }
+    // Steering wheel servo output is active
+    output = servo_output(SERVO_OUTPUT_STEERING_WHEEL);
+    if (output) {
+        if (!setup_active  ||  setup_function != SERVO_OUTPUT_STEERING_WHEEL) {
+            servo_pulse[SERVO_OUTPUT_STEERING_WHEEL] = calculate_servo_pulse(
+                &servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL]);
         }
 
-        if (global_flags.gear == GEAR_1) {
-            servo_pulse = servo_output_endpoint.left;
+        // Put the servo pulse duration in microseconds into the match
+        // register to output the pulse of the given duration. The SCTimer
+        // takes it over at the start of the next frame.
+        LPC_SCT->MATCHREL[output->match].H =
+            servo_pulse[SERVO_OUTPUT_STEERING_WHEEL];
+    }
+}
+
+
+// ****************************************************************************
+// Advance the motion profile of the gearbox servo by one output frame.
+// Returns true when the servo has reached gearbox_servo_target.
+static bool move_gearbox_servo(void)
+{
+    uint32_t target = gearbox_servo_target << 8;
+    uint32_t distance;
+    uint32_t max_speed = config.gearbox_servo_speed;
+    uint32_t acceleration;
+    int32_t speed;
+
+    if (max_speed == 0) {
+        gearbox_servo_position = target;
+        gearbox_servo_speed = 0;
+        return true;
+    }
+
+    if (max_speed > GEARBOX_SERVO_MAX_SPEED) {
+        max_speed = GEARBOX_SERVO_MAX_SPEED;
+    }
+    max_speed <<= 8;
+
+    acceleration = max_speed;
+    if (config.gearbox_servo_ramp_time) {
+        acceleration = max_speed / config.gearbox_servo_ramp_time;
+        if (acceleration == 0) {
+            acceleration = 1;
         }
-        else if (global_flags.gear == GEAR_2) {
-            servo_pulse = servo_output_endpoint.centre;
+    }
+
+    // Work with the distance to the target and the speed towards it, which
+    // is negative while still moving away from it
+    if (target >= gearbox_servo_position) {
+        distance = target - gearbox_servo_position;
+        speed = gearbox_servo_speed;
+    }
+    else {
+        distance = gearbox_servo_position - target;
+        speed = -gearbox_servo_speed;
+    }
+
+    if (speed <= 0  ||
+            distance > ((uint32_t)speed * (uint32_t)speed) / (2 * acceleration)) {
+        speed += acceleration;
+        if (speed > (int32_t)max_speed) {
+            speed = max_speed;
         }
-        else if (global_flags.gear == GEAR_3) {
-            servo_pulse = servo_output_endpoint.right;
+    }
+    else {
+        // Brake, but keep a minimum speed to reach the target
+        speed -= acceleration;
+        if (speed < (int32_t)acceleration) {
+            speed = acceleration;
         }
     }
 
-    // --------------------------------
-    // Steering wheel servo output is avtive
-    else if (config.flags.steering_wheel_servo_output) {
-        calculate_servo_pulse();
+    if (speed > 0  &&  (uint32_t)speed >= distance) {
+        gearbox_servo_position = target;
+        gearbox_servo_speed = 0;
+        return true;
     }
 
-
-    // Put the servo pulse duration in milliseconds into the match register
-    // to output the pulse of the given duration.
-    LPC_SCT->MATCHREL[4].H = servo_pulse;
+    if (target >= gearbox_servo_position) {
+        gearbox_servo_position += speed;
+        gearbox_servo_speed = speed;
+    }
+    else {
+        gearbox_servo_position -= speed;
+        gearbox_servo_speed = -speed;
+    }
+    return false;
 }
 
 
+// ****************************************************************************
+// Called from the SCT interrupt at the start of every output frame (event 0)
+// when a gearbox servo is used
+void servo_output_irq_handler(void)
+{
+    const SERVO_OUTPUT_HARDWARE_T *output = servo_output(SERVO_OUTPUT_GEARBOX);
+
+    if (gearbox_servo_start) {
+        gearbox_servo_start = false;
+        gearbox_servo_active = true;
+        gearbox_servo_hold = GEARBOX_SERVO_HOLD_FRAMES;
+        LPC_SCT->OUT[output->ctout].SET = (1 << 0);    // Event 0 sets the output
+    }
+
+    if (!gearbox_servo_active) {
+        return;
+    }
+
+    if (move_gearbox_servo()) {
+        if (gearbox_servo_hold) {
+            --gearbox_servo_hold;
+        }
+        else {
+            // Turn off the setting of the output, so no pulse will be
+            // generated. However, clearing of the output is still active
+            // through its pulse event, so if a pulse is currently active
+            // it will be nicely terminated, and from the next period
+            // onwards the pulses will cease.
+            if (config.gearbox_servo_idle_time) {
+                LPC_SCT->OUT[output->ctout].SET = 0;
+            }
+            gearbox_servo_active = false;
+        }
+    }
+
+    // The SCTimer takes the pulse over at the start of the next frame
+    LPC_SCT->MATCHREL[output->match].H = (gearbox_servo_position + 128) >> 8;
+}
@@ -69,6 +69,43 @@
     function outputs the channels that have been received so far.
 
 
+    Input filter:
+    -------------
+    Receivers jitter by a few us, and some send the occasional glitch. Near
+    the centre thresholds of drive_mode.c this makes the brake lights
+    flicker. The mainloop therefore passes each new set of pulses through the
+    filter selected by config.servo_input_filter (see SERVO_INPUT_FILTER_T)
+    before normalizing them. The filters use integer math and take the same
+    few operations for every pulse. A missing channel (0) bypasses the filter
+    and restarts it with the next pulse. See tools/servo-filter for their
+    effect on noisy pulse trains.
+
+
+    Endpoint learning:
+    ------------------
+    At startup the endpoints of steering and throttle are set to the learned
+    distance from the centre (learned_endpoint_delta[], kept in persistent
+    storage), or to config.initial_endpoint_delta if nothing has been
+    learned yet. As before, normalize_channel() widens them whenever a pulse
+    goes beyond them.
+
+    A pulse that stays within ENDPOINT_STABLE_WINDOW for
+    ENDPOINT_STABLE_FRAMES frames has really been reached, unlike a glitch.
+    The widest of those pulses on each side are the extremes of the session.
+    The learned endpoints take over extremes that are wider right away.
+    Narrower extremes show that the endpoints of the transmitter have been
+    reduced; the learned endpoints decay towards them by
+    1/ENDPOINT_DECAY_DIVISOR per session. Extremes below
+    ENDPOINT_NARROW_MIN_PERCENT of the learned endpoints are partial travel
+    and do not count.
+
+    Writing the flash stops the interrupts for a few ms, so the learned
+    endpoints are only written when the car has been in neutral, and the
+    extremes have not changed, for ENDPOINT_COMMIT_IDLE_TIME; and when they
+    have changed by at least ENDPOINT_WRITE_THRESHOLD. This also keeps the
+    number of flash writes low. See tools/endpoint-learning.
+
+
 ******************************************************************************/
 #include <stdio.h>
 #include <stdbool.h>
@@ -80,6 +117,28 @@
 #define SERVO_PULSE_CLAMP_LOW 800
 #define SERVO_PULSE_CLAMP_HIGH 2300
 
+// The alpha-beta filter works in 1/ALPHA_BETA_SCALE us, with alpha = 1/4 and
+// beta = 1/64
+#define ALPHA_BETA_SCALE 16
+#define ALPHA_DIVISOR 4
+#define BETA_DIVISOR 64
+
+// Pulses that change by more than this (in us) are outliers
+#define OUTLIER_THRESHOLD 20
+
+// The outlier filter ignores changes of the pulse up to this many us, the
+// jitter of the receivers on our bench. The output follows the pulse with
+// this much play, so the jitter no longer crosses the centre thresholds.
+#define OUTLIER_DEADBAND 3
+
+// Parameters of the endpoint learning (see above); pulses in us
+#define ENDPOINT_STABLE_WINDOW 8
+#define ENDPOINT_STABLE_FRAMES 5
+#define ENDPOINT_NARROW_MIN_PERCENT 75
+#define ENDPOINT_DECAY_DIVISOR 2
+#define ENDPOINT_WRITE_THRESHOLD 4
+#define ENDPOINT_COMMIT_IDLE_TIME (3000 / __SYSTICK_IN_MS)
+
 
 static enum {
     WAIT_FOR_FIRST_PULSE,
@@ -98,12 +157,31 @@ typedef enum {
 static volatile bool new_raw_channel_data = false;
 static uint32_t servo_reader_timer;
 
+static struct {
+    bool running;
+    bool outlier;
+    uint32_t previous[2];
+    int32_t position;
+    int32_t velocity;
+} filter[3];
+
+static struct {
+    uint32_t previous;
+    uint8_t stable_frames;
+    ENDPOINT_DELTA_T boot;      // Learned endpoints at startup
+    ENDPOINT_DELTA_T session;   // Extremes reached since then
+} learner[2];
+
+static uint16_t commit_timer;
+
+ENDPOINT_DELTA_T learned_endpoint_delta[2];
+
 
 // ****************************************************************************
 void init_servo_reader(void)
 {
-    if (config.mode != MASTER_WITH_SERVO_READER  &&
-        config.mode != MASTER_WITH_CPPM_READER) {
+    if (CONFIG_MODE != MASTER_WITH_SERVO_READER  &&
+        CONFIG_MODE != MASTER_WITH_CPPM_READER) {
         return;
     }
 
@@ -121,7 +199,7 @@ void init_servo_reader(void)
                        (5 << 5);    // PRE_L[12:5] = 6-1 (SCTimer L clock 2 MHz)
 
 
-    if (config.mode == MASTER_WITH_SERVO_READER) {
+    if (CONFIG_MODE == MASTER_WITH_SERVO_READER) {
         int i;
 
         // Configure registers 1..3 to capture servo pulses on SCTimer L
@@ -187,7 +265,13 @@ void SCT_irq_handler(void)
     static uint8_t channel_flags = 0;
     uint16_t capture_value;
 
-    if (config.mode == MASTER_WITH_SERVO_READER) {
+    // Event 0: start of a servo output frame (see servo_output.c)
+    if (LPC_SCT->EVEN & LPC_SCT->EVFLAG & (1 << 0)) {
+        LPC_SCT->EVFLAG = (1 << 0);
+        servo_output_irq_handler();
+    }
+
+    if (CONFIG_MODE == MASTER_WITH_SERVO_READER) {
         int i;
 
         for (i = 1; i <= 3; i++) {
@@ -220,7 +304,7 @@ void SCT_irq_handler(void)
         }
     }
 
-    else { // MASTER_WITH_CPPM_READER
+    else if (LPC_SCT->EVFLAG & (1 << 1)) { // MASTER_WITH_CPPM_READER
         static CPPM_STATE_T cppm_mode = WAIT_FOR_ANY_PULSE;
 
         start[1] = capture_value = LPC_SCT->CAP[1].L;
@@ -280,12 +364,94 @@ void SCT_irq_handler(void)
 }
 
 
+// ****************************************************************************
+static uint32_t median_of_3(uint32_t a, uint32_t b, uint32_t c)
+{
+    uint32_t low = (a < b) ? a : b;
+    uint32_t high = (a < b) ? b : a;
+
+    if (c < low) {
+        return low;
+    }
+    if (c > high) {
+        return high;
+    }
+    return c;
+}
+
+
+// ****************************************************************************
+static void filter_channel(CHANNEL_T *c, uint8_t index)
+{
+    uint32_t pulse = c->raw_data;
+    int32_t residual;
+
+    if (pulse == 0  ||  !filter[index].running) {
+        filter[index].running = (pulse != 0);
+        filter[index].outlier = false;
+        filter[index].previous[0] = filter[index].previous[1] = pulse;
+        filter[index].position = (int32_t)pulse * ALPHA_BETA_SCALE;
+        filter[index].velocity = 0;
+        return;
+    }
+
+    switch (config.servo_input_filter) {
+        case SERVO_INPUT_FILTER_MEDIAN:
+            c->raw_data = median_of_3(pulse, filter[index].previous[0],
+                filter[index].previous[1]);
+            filter[index].previous[1] = filter[index].previous[0];
+            filter[index].previous[0] = pulse;
+            break;
+
+        case SERVO_INPUT_FILTER_ALPHA_BETA:
+            // Predict the pulse from the last position and speed, then
+            // correct both by a fraction of the prediction error
+            filter[index].position += filter[index].velocity;
+            residual = (int32_t)pulse * ALPHA_BETA_SCALE - filter[index].position;
+            filter[index].position += residual / ALPHA_DIVISOR;
+            filter[index].velocity += residual / BETA_DIVISOR;
+            if (filter[index].position < 0) {
+                filter[index].position = 0;
+            }
+            c->raw_data = (filter[index].position + ALPHA_BETA_SCALE / 2) /
+                ALPHA_BETA_SCALE;
+            break;
+
+        case SERVO_INPUT_FILTER_OUTLIER:
+            // Hold the previous output once; a second pulse far away from it
+            // is a real move. Otherwise the output only moves when the pulse
+            // leaves the deadband around it.
+            if (!filter[index].outlier  &&
+                (pulse > filter[index].previous[0] + OUTLIER_THRESHOLD  ||
+                 pulse + OUTLIER_THRESHOLD < filter[index].previous[0])) {
+                filter[index].outlier = true;
+            }
+            else {
+                filter[index].outlier = false;
+                if (pulse > filter[index].previous[0] + OUTLIER_DEADBAND) {
+                    filter[index].previous[0] = pulse - OUTLIER_DEADBAND;
+                }
+                else if (pulse + OUTLIER_DEADBAND < filter[index].previous[0]) {
+                    filter[index].previous[0] = pulse + OUTLIER_DEADBAND;
+                }
+            }
+            c->raw_data = filter[index].previous[0];
+            break;
+
+        case SERVO_INPUT_FILTER_NONE:
+        default:
+            break;
+    }
+}
+
+
 // ****************************************************************************
 static void normalize_channel(CHANNEL_T *c)
 {
     if (c->raw_data < config.servo_pulse_min  ||  c->raw_data > config.servo_pulse_max) {
         c->normalized = 0;
         c->absolute = 0;
+        c->fine = 0;
         return;
     }
 
@@ -297,8 +463,11 @@ static void normalize_channel(CHANNEL_T *c)
         c->raw_data = SERVO_PULSE_CLAMP_HIGH;
     }
 
+    // The percentage is calculated in steps of 1/CHANNEL_FINE_SCALE percent.
+    // Dividing by CHANNEL_FINE_SCALE gives exactly the same normalized value
+    // as calculating it in percent directly.
     if (c->raw_data == c->endpoint.centre) {
-        c->normalized = 0;
+        c->fine = 0;
     }
     else if (c->raw_data < c->endpoint.centre) {
         if (c->raw_data < c->endpoint.left) {
@@ -306,29 +475,31 @@ static void normalize_channel(CHANNEL_T *c)
         }
         // In order to acheive a stable 100% value we actually calculate the
         // percentage up to 101%, and then clamp to 100%.
-        c->normalized = (c->endpoint.centre - c->raw_data) * 101 /
+        c->fine = (c->endpoint.centre - c->raw_data) * 101 * CHANNEL_FINE_SCALE /
             (c->endpoint.centre - c->endpoint.left);
-        if (c->normalized > 100) {
-            c->normalized = 100;
+        if (c->fine > 100 * CHANNEL_FINE_SCALE) {
+            c->fine = 100 * CHANNEL_FINE_SCALE;
         }
         if (!c->reversed) {
-            c->normalized = -c->normalized;
+            c->fine = -c->fine;
         }
     }
     else {
         if (c->raw_data > c->endpoint.right) {
             c->endpoint.right = c->raw_data;
         }
-        c->normalized = (c->raw_data - c->endpoint.centre) * 101 /
+        c->fine = (c->raw_data - c->endpoint.centre) * 101 * CHANNEL_FINE_SCALE /
             (c->endpoint.right - c->endpoint.centre);
-        if (c->normalized > 100) {
-            c->normalized = 100;
+        if (c->fine > 100 * CHANNEL_FINE_SCALE) {
+            c->fine = 100 * CHANNEL_FINE_SCALE;
         }
         if (c->reversed) {
-            c->normalized = -c->normalized;
+            c->fine = -c->fine;
         }
     }
 
+    c->normalized = c->fine / CHANNEL_FINE_SCALE;
+
     if (c->normalized < 0) {
         c->absolute = -c->normalized;
     }
@@ -339,18 +510,131 @@ static void normalize_channel(CHANNEL_T *c)
 
 
 // ****************************************************************************
-static void initialize_channel(CHANNEL_T *c) {
+static void initialize_channel(CHANNEL_T *c, uint8_t index) {
+    ENDPOINT_DELTA_T *learned = &learned_endpoint_delta[index];
+
     c->endpoint.centre = c->raw_data;
-    c->endpoint.left = c->raw_data - config.initial_endpoint_delta;
-    c->endpoint.right = c->raw_data + config.initial_endpoint_delta;
+    c->endpoint.left = c->raw_data -
+        (learned->left ? learned->left : config.initial_endpoint_delta);
+    c->endpoint.right = c->raw_data +
+        (learned->right ? learned->right : config.initial_endpoint_delta);
+
+    learner[index].boot = *learned;
+    learner[index].session.left = 0;
+    learner[index].session.right = 0;
+    learner[index].stable_frames = 0;
+}
+
+
+// ****************************************************************************
+static void learn_endpoints(CHANNEL_T *c, uint8_t index)
+{
+    uint32_t pulse = c->raw_data;
+    uint32_t previous = learner[index].previous;
+    uint16_t delta;
+
+    learner[index].previous = pulse;
+
+    if (pulse < config.servo_pulse_min  ||  pulse > config.servo_pulse_max  ||
+        pulse > previous + ENDPOINT_STABLE_WINDOW  ||
+        pulse + ENDPOINT_STABLE_WINDOW < previous) {
+
+        learner[index].stable_frames = 0;
+        return;
+    }
+
+    if (learner[index].stable_frames < ENDPOINT_STABLE_FRAMES) {
+        ++learner[index].stable_frames;
+        return;
+    }
+
+    if (pulse < c->endpoint.centre) {
+        delta = c->endpoint.centre - pulse;
+        if (delta > learner[index].session.left) {
+            learner[index].session.left = delta;
+            commit_timer = ENDPOINT_COMMIT_IDLE_TIME;
+        }
+    }
+    else {
+        delta = pulse - c->endpoint.centre;
+        if (delta > learner[index].session.right) {
+            learner[index].session.right = delta;
+            commit_timer = ENDPOINT_COMMIT_IDLE_TIME;
+        }
+    }
+}
+
+
+// ****************************************************************************
+static uint16_t learned_delta(uint16_t boot, uint16_t session)
+{
+    uint16_t reference = boot ? boot : config.initial_endpoint_delta;
+
+    if (session == 0) {
+        return boot;
+    }
+
+    if (session >= reference) {
+        return session;
+    }
+
+    if ((uint32_t)session * 100 < (uint32_t)reference * ENDPOINT_NARROW_MIN_PERCENT) {
+        return boot;
+    }
+
+    return reference - (reference - session) / ENDPOINT_DECAY_DIVISOR;
+}
+
+
+// ****************************************************************************
+static bool differs(uint16_t a, uint16_t b)
+{
+    return (a > b + ENDPOINT_WRITE_THRESHOLD)  ||  (b > a + ENDPOINT_WRITE_THRESHOLD);
+}
+
+
+// ****************************************************************************
+static void commit_learned_endpoints(void)
+{
+    ENDPOINT_DELTA_T learned[2];
+    bool changed = false;
+    int i;
+
+    if (global_flags.forward  ||  global_flags.reversing  ||
+        global_flags.braking  ||
+        channel[TH].absolute >= config.centre_threshold_low) {
+
+        commit_timer = ENDPOINT_COMMIT_IDLE_TIME;
+        return;
+    }
+
+    if (commit_timer) {
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        learned[i].left = learned_delta(learner[i].boot.left, learner[i].session.left);
+        learned[i].right = learned_delta(learner[i].boot.right, learner[i].session.right);
+
+        if (differs(learned[i].left, learned_endpoint_delta[i].left)  ||
+            differs(learned[i].right, learned_endpoint_delta[i].right)) {
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        learned_endpoint_delta[ST] = learned[ST];
+        learned_endpoint_delta[TH] = learned[TH];
+        write_persistent_storage();
+    }
 }
 
 
 // ****************************************************************************
 void read_all_servo_channels(void)
 {
-    if (config.mode != MASTER_WITH_SERVO_READER  &&
-        config.mode != MASTER_WITH_CPPM_READER) {
+    if (CONFIG_MODE != MASTER_WITH_SERVO_READER  &&
+        CONFIG_MODE != MASTER_WITH_CPPM_READER) {
         return;
     }
 
@@ -358,6 +642,9 @@ void read_all_servo_channels(void)
         if (servo_reader_timer) {
             --servo_reader_timer;
         }
+        if (commit_timer) {
+            --commit_timer;
+        }
     }
 
     global_flags.new_channel_data = false;
@@ -367,6 +654,12 @@ void read_all_servo_channels(void)
     }
     new_raw_channel_data = false;
 
+    filter_channel(&channel[ST], ST);
+    filter_channel(&channel[TH], TH);
+    if (!config.flags.ch3_is_local_switch) {
+        filter_channel(&channel[CH3], CH3);
+    }
+
     switch (servo_reader_state) {
         case WAIT_FOR_FIRST_PULSE:
             servo_reader_timer = config.startup_time;
@@ -375,8 +668,9 @@ void read_all_servo_channels(void)
 
         case WAIT_FOR_TIMEOUT:
             if (servo_reader_timer == 0) {
-                initialize_channel(&channel[ST]);
-                initialize_channel(&channel[TH]);
+                initialize_channel(&channel[ST], ST);
+                initialize_channel(&channel[TH], TH);
+                commit_timer = ENDPOINT_COMMIT_IDLE_TIME;
                 normalize_channel(&channel[CH3]);
 
                 servo_reader_state = NORMAL_OPERATION;
@@ -391,6 +685,9 @@ void read_all_servo_channels(void)
             if (!config.flags.ch3_is_local_switch) {
                 normalize_channel(&channel[CH3]);
             }
+            learn_endpoints(&channel[ST], ST);
+            learn_endpoints(&channel[TH], TH);
+            commit_learned_endpoints();
             global_flags.new_channel_data = true;
             break;
 
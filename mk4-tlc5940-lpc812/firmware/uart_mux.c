@@ -0,0 +1,274 @@
+/******************************************************************************
+
+    Multiplexed UART output: slave, preprocessor and winch on one wire
+
+    A single UART output (slave, preprocessor or winch) sends its raw
+    protocol on TH/Tx. When more than one of them is configured (see
+    CONFIG_UART_MULTIPLEX) they hand their data to this module instead, which
+    sends it as frames on a channel per function:
+
+        0x84        Sync byte
+        channel     See UART_MUX_CHANNEL_T
+        length      Number of bytes in the payload (0..UART_MUX_MAX_PAYLOAD)
+        payload
+        crc low     CRC-16-CCITT (polynomial 0x1021, initial value 0xffff)
+        crc high    of channel, length and payload
+
+    Like in the frames of the light program debugger (see debugger.c) all
+    bytes following the sync byte that have a value of 0x80..0x87 are sent as
+    0x85 followed by the value XOR 0x20. The raw slave and preprocessor
+    protocols use 0x87 as start byte, so receivers can handle both; a 0x87
+    within a frame aborts the frame.
+
+    Payloads:
+
+        UART_MUX_CHANNEL_WINCH          Winch command, '0'..'3' (see winch.c)
+        UART_MUX_CHANNEL_PREPROCESSOR   Steering, throttle and CH3/initializing
+                                        bytes of the preprocessor protocol
+                                        (see uart_reader.c), or the 8 bytes
+                                        sequence .. flags of protocol v2 (see
+                                        preprocessor_output.c)
+        UART_MUX_CHANNEL_SLAVE          Brightness of the slave LEDs, 0..63,
+                                        as in the raw slave protocol
+
+    All payloads carry a state, not a change. Therefore each channel only
+    holds its latest frame: a frame that has not been sent yet is replaced by
+    a newer one.
+
+    Sending does not block the mainloop. The bandwidth of the UART is handed
+    out per systick: a frame may only start while there is credit left, and
+    its length is taken from the credit, which is refilled every systick.
+    The channels are served in order of their priority, so the winch
+    commands and preprocessor frames go out before the slave LEDs of the
+    same systick. The bytes are handed to the UART whenever the mainloop
+    finds it ready, so a frame goes out back-to-back as long as the mainloop
+    passes are short compared to the time of a byte (see tools/uart-mux).
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <globals.h>
+#include <uart0.h>
+#include <utils.h>
+
+#define FRAME_SYNC 0x84
+#define FRAME_ESCAPE 0x85
+#define ESCAPE_XOR 0x20
+#define PREPROCESSOR_MAGIC_BYTE 0x87
+
+// Sync byte, and channel, length, payload and CRC which may all be escaped
+#define MAX_FRAME_SIZE (1 + 2 * (2 + UART_MUX_MAX_PAYLOAD + 2))
+
+// 8n1: 10 bits per byte
+#define BYTES_PER_SYSTICK(baudrate) ((baudrate) / 10 * __SYSTICK_IN_MS / 1000)
+
+
+typedef enum {
+    STATE_WAIT_FOR_SYNC = 0,
+    STATE_CHANNEL,
+    STATE_LENGTH,
+    STATE_PAYLOAD,
+    STATE_CRC_LOW,
+    STATE_CRC_HIGH
+} STATE_T;
+
+// Latest frame of each channel, waiting to be sent
+static struct {
+    bool pending;
+    uint8_t length;
+    uint8_t payload[UART_MUX_MAX_PAYLOAD];
+} channel_frame[UART_MUX_NUMBER_OF_CHANNELS];
+
+// Frame being sent
+static uint8_t tx_frame[MAX_FRAME_SIZE];
+static uint8_t tx_length;
+static uint8_t tx_index;
+
+// Bytes that may still be sent in this systick
+static int16_t credit;
+
+static UART_MUX_FRAME_T rx_frame;
+
+
+// ****************************************************************************
+// init_uart0() uses 38400 Baud for all baudrates other than 115200
+static int16_t bytes_per_systick(void)
+{
+    if (config.baudrate == 115200) {
+        return BYTES_PER_SYSTICK(115200);
+    }
+    return BYTES_PER_SYSTICK(38400);
+}
+
+
+// ****************************************************************************
+static void add_escaped(uint8_t data)
+{
+    if (data >= 0x80  &&  data <= PREPROCESSOR_MAGIC_BYTE) {
+        tx_frame[tx_length++] = FRAME_ESCAPE;
+        data ^= ESCAPE_XOR;
+    }
+    tx_frame[tx_length++] = data;
+}
+
+
+// ****************************************************************************
+static void build_frame(uint8_t mux_channel, const uint8_t *payload, uint8_t length)
+{
+    uint16_t crc;
+    int i;
+
+    tx_index = 0;
+    tx_length = 0;
+
+    tx_frame[tx_length++] = FRAME_SYNC;
+    add_escaped(mux_channel);
+    add_escaped(length);
+    crc = crc16_ccitt(crc16_ccitt(CRC16_INITIAL_VALUE, mux_channel), length);
+
+    for (i = 0; i < length; i++) {
+        add_escaped(payload[i]);
+        crc = crc16_ccitt(crc, payload[i]);
+    }
+
+    add_escaped(crc & 0xff);
+    add_escaped(crc >> 8);
+}
+
+
+// ****************************************************************************
+// Replaces the frame of the channel that is waiting to be sent, if any
+void uart_mux_send(UART_MUX_CHANNEL_T mux_channel, const uint8_t *payload, uint8_t length)
+{
+    int i;
+
+    if (length > UART_MUX_MAX_PAYLOAD) {
+        length = UART_MUX_MAX_PAYLOAD;
+    }
+
+    for (i = 0; i < length; i++) {
+        channel_frame[mux_channel].payload[i] = payload[i];
+    }
+    channel_frame[mux_channel].length = length;
+    channel_frame[mux_channel].pending = true;
+}
+
+
+// ****************************************************************************
+void process_uart_mux(void)
+{
+    int i;
+
+    if (!CONFIG_UART_MULTIPLEX) {
+        return;
+    }
+
+    if (global_flags.systick) {
+        credit += bytes_per_systick();
+        if (credit > bytes_per_systick()) {
+            credit = bytes_per_systick();
+        }
+    }
+
+    if (tx_index >= tx_length  &&  credit > 0) {
+        for (i = 0; i < UART_MUX_NUMBER_OF_CHANNELS; i++) {
+            if (channel_frame[i].pending) {
+                channel_frame[i].pending = false;
+                build_frame(i, channel_frame[i].payload, channel_frame[i].length);
+                credit -= tx_length;
+                break;
+            }
+        }
+    }
+
+    while (tx_index < tx_length  &&  uart0_send_is_ready()) {
+        uart0_send_char(tx_frame[tx_index++]);
+    }
+}
+
+
+// ****************************************************************************
+// Called by the receivers of the slave and preprocessor protocols for every
+// byte received. When a frame has been received, *frame points to it until
+// the next call.
+UART_MUX_RESULT_T uart_mux_receive_byte(uint8_t uart_byte, const UART_MUX_FRAME_T **frame)
+{
+    static STATE_T state = STATE_WAIT_FOR_SYNC;
+    static bool escaped;
+    static uint8_t index;
+    static uint16_t crc;
+    static uint8_t crc_low;
+
+    if (uart_byte == FRAME_SYNC) {
+        crc = CRC16_INITIAL_VALUE;
+        escaped = false;
+        state = STATE_CHANNEL;
+        return UART_MUX_IN_FRAME;
+    }
+
+    if (state == STATE_WAIT_FOR_SYNC) {
+        return UART_MUX_NO_FRAME;
+    }
+
+    if (uart_byte == PREPROCESSOR_MAGIC_BYTE) {
+        state = STATE_WAIT_FOR_SYNC;
+        return UART_MUX_NO_FRAME;
+    }
+
+    if (uart_byte == FRAME_ESCAPE) {
+        escaped = true;
+        return UART_MUX_IN_FRAME;
+    }
+    if (escaped) {
+        uart_byte ^= ESCAPE_XOR;
+        escaped = false;
+    }
+
+    switch (state) {
+        case STATE_CHANNEL:
+            rx_frame.channel = uart_byte;
+            crc = crc16_ccitt(crc, uart_byte);
+            state = STATE_LENGTH;
+            break;
+
+        case STATE_LENGTH:
+            if (uart_byte > UART_MUX_MAX_PAYLOAD) {
+                state = STATE_WAIT_FOR_SYNC;
+                break;
+            }
+            rx_frame.length = uart_byte;
+            crc = crc16_ccitt(crc, uart_byte);
+            index = 0;
+            state = uart_byte ? STATE_PAYLOAD : STATE_CRC_LOW;
+            break;
+
+        case STATE_PAYLOAD:
+            rx_frame.payload[index++] = uart_byte;
+            crc = crc16_ccitt(crc, uart_byte);
+            if (index >= rx_frame.length) {
+                state = STATE_CRC_LOW;
+            }
+            break;
+
+        case STATE_CRC_LOW:
+            crc_low = uart_byte;
+            state = STATE_CRC_HIGH;
+            break;
+
+        case STATE_CRC_HIGH:
+            state = STATE_WAIT_FOR_SYNC;
+            if ((crc_low | (uart_byte << 8)) == crc) {
+                *frame = &rx_frame;
+                return UART_MUX_FRAME_RECEIVED;
+            }
+            break;
+
+        case STATE_WAIT_FOR_SYNC:
+        default:
+            state = STATE_WAIT_FOR_SYNC;
+            break;
+    }
+
+    return UART_MUX_IN_FRAME;
+}
@@ -34,15 +34,25 @@
     HK310 expansion protocol. This module ignores that value.
     TODO: describe this better, and define the range including both SYNC values
 
+
+    Frames of preprocessor protocol v2 start with 0x83 and carry steering,
+    throttle and an analog CH3/AUX value in steps of 1/CHANNEL_FINE_SCALE
+    percent, protected by a CRC (see preprocessor_output.c). They are
+    recognized automatically, so the preprocessor can send either protocol.
+
  *****************************************************************************/
 #include <stdint.h>
 #include <LPC8xx.h>
 
 #include <globals.h>
 #include <uart0.h>
+#include <utils.h>
 
 
 #define SLAVE_MAGIC_BYTE 0x87
+#define V2_SYNC 0x83
+#define V2_ESCAPE 0x85
+#define V2_ESCAPE_XOR 0x20
 #define CONSECUTIVE_BYTE_COUNTS 3
 
 
@@ -53,11 +63,17 @@ typedef enum {
     STATE_CH3
 } STATE_T;
 
+typedef enum {
+    V2_NO_FRAME = 0,
+    V2_IN_FRAME,
+    V2_FRAME_RECEIVED
+} V2_RESULT_T;
+
 
 // ****************************************************************************
 void init_uart_reader(void)
 {
-    if (config.mode != MASTER_WITH_UART_READER) {
+    if (CONFIG_MODE != MASTER_WITH_UART_READER) {
         return;
     }
 
@@ -85,11 +101,41 @@ static void normalize_channel(CHANNEL_T *c, uint8_t data)
     else {
         c->absolute = c->normalized;
     }
+
+    c->fine = c->normalized * CHANNEL_FINE_SCALE;
 }
 
 
 // ****************************************************************************
-static void publish_channels(uint8_t channel_data[])
+static void normalize_channel_fine(CHANNEL_T *c, const uint8_t data[])
+{
+    int16_t fine = (int16_t)(data[0] | (data[1] << 8));
+
+    if (fine > 100 * CHANNEL_FINE_SCALE) {
+        fine = 100 * CHANNEL_FINE_SCALE;
+    }
+    if (fine < -100 * CHANNEL_FINE_SCALE) {
+        fine = -100 * CHANNEL_FINE_SCALE;
+    }
+
+    if (c->reversed) {
+        fine = -fine;
+    }
+
+    c->fine = fine;
+    c->normalized = fine / CHANNEL_FINE_SCALE;
+
+    if (c->normalized < 0) {
+        c->absolute = -c->normalized;
+    }
+    else {
+        c->absolute = c->normalized;
+    }
+}
+
+
+// ****************************************************************************
+static void publish_channels(const uint8_t channel_data[])
 {
     normalize_channel(&channel[ST], channel_data[0]);
     normalize_channel(&channel[TH], channel_data[1]);
@@ -106,6 +152,87 @@ static void publish_channels(uint8_t channel_data[])
 }
 
 
+// ****************************************************************************
+// Fields of a protocol v2 frame: sequence, steering, throttle, CH3 and flags.
+// The sequence number is not needed here.
+static void publish_channels_v2(const uint8_t payload[])
+{
+    normalize_channel_fine(&channel[ST], &payload[1]);
+    normalize_channel_fine(&channel[TH], &payload[3]);
+
+    global_flags.initializing =
+        (payload[7] & 0x10) ? true : false;
+
+    if (!config.flags.ch3_is_local_switch) {
+        normalize_channel_fine(&channel[CH3], &payload[5]);
+    }
+
+    global_flags.new_channel_data = true;
+}
+
+
+// ****************************************************************************
+// Called for every byte received. When a protocol v2 frame with valid CRC has
+// been received, *payload points to its fields until the next call.
+static V2_RESULT_T receive_v2_byte(uint8_t uart_byte, const uint8_t **payload)
+{
+    static bool in_frame = false;
+    static bool escaped;
+    static uint8_t index;
+    static uint8_t data[PREPROCESSOR_V2_PAYLOAD_SIZE + 2];
+
+    uint16_t crc;
+    int i;
+
+    if (uart_byte == V2_SYNC) {
+        in_frame = true;
+        escaped = false;
+        index = 0;
+        return V2_IN_FRAME;
+    }
+
+    if (!in_frame) {
+        return V2_NO_FRAME;
+    }
+
+    if (uart_byte == V2_ESCAPE) {
+        escaped = true;
+        return V2_IN_FRAME;
+    }
+
+    // Any other value of 0x80..0x87, in particular the start byte of the 4
+    // byte frames, aborts the frame
+    if (uart_byte >= 0x80  &&  uart_byte <= SLAVE_MAGIC_BYTE) {
+        in_frame = false;
+        return V2_NO_FRAME;
+    }
+
+    if (escaped) {
+        uart_byte ^= V2_ESCAPE_XOR;
+        escaped = false;
+    }
+
+    data[index++] = uart_byte;
+    if (index < sizeof(data)) {
+        return V2_IN_FRAME;
+    }
+
+    in_frame = false;
+
+    crc = CRC16_INITIAL_VALUE;
+    for (i = 0; i < PREPROCESSOR_V2_PAYLOAD_SIZE; i++) {
+        crc = crc16_ccitt(crc, data[i]);
+    }
+    if ((data[PREPROCESSOR_V2_PAYLOAD_SIZE] |
+            (data[PREPROCESSOR_V2_PAYLOAD_SIZE + 1] << 8)) != crc) {
+        return V2_IN_FRAME;
+    }
+
+    *payload = data;
+    return V2_FRAME_RECEIVED;
+}
+
+
 // ****************************************************************************
 void read_preprocessor(void)
 {
@@ -113,8 +240,10 @@ void read_preprocessor(void)
     static uint8_t channel_data[3];
 
     uint8_t uart_byte;
+    const UART_MUX_FRAME_T *frame;
+    const uint8_t *payload;
 
-    if (config.mode != MASTER_WITH_UART_READER) {
+    if (CONFIG_MODE != MASTER_WITH_UART_READER) {
         return;
     }
 
@@ -123,6 +252,54 @@ void read_preprocessor(void)
     while (uart0_read_is_byte_pending()) {
         uart_byte = uart0_read_byte();
 
+#ifdef LIGHT_PROGRAM_DEBUGGER
+        // Frames of the light program debugger are multiplexed into the
+        // preprocessor protocol, see debugger.c
+        if (debugger_receive_byte(uart_byte)) {
+            continue;
+        }
+#endif
+
+        // A light controller with more than one UART output sends the
+        // preprocessor frames multiplexed with others, see uart_mux.c
+        switch (uart_mux_receive_byte(uart_byte, &frame)) {
+            case UART_MUX_FRAME_RECEIVED:
+                if (frame->channel == UART_MUX_CHANNEL_PREPROCESSOR  &&
+                        frame->length == sizeof(channel_data)) {
+                    publish_channels(frame->payload);
+                    state = STATE_WAIT_FOR_MAGIC_BYTE;
+                    return;
+                }
+                if (frame->channel == UART_MUX_CHANNEL_PREPROCESSOR  &&
+                        frame->length == PREPROCESSOR_V2_PAYLOAD_SIZE) {
+                    publish_channels_v2(frame->payload);
+                    state = STATE_WAIT_FOR_MAGIC_BYTE;
+                    return;
+                }
+                continue;
+
+            case UART_MUX_IN_FRAME:
+                continue;
+
+            case UART_MUX_NO_FRAME:
+            default:
+                break;
+        }
+
+        switch (receive_v2_byte(uart_byte, &payload)) {
+            case V2_FRAME_RECEIVED:
+                publish_channels_v2(payload);
+                state = STATE_WAIT_FOR_MAGIC_BYTE;
+                return;
+
+            case V2_IN_FRAME:
+                continue;
+
+            case V2_NO_FRAME:
+            default:
+                break;
+        }
+
         // The preprocessor protocol is designed such that only the first
         // byte can have the MAGIC value. This allows us to be in sync at all
         // times.
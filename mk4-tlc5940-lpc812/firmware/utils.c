@@ -57,3 +57,21 @@ uint16_t random_min_max(uint16_t min, uint16_t max)
     next16(&lfsr);
     return (uint16_t)(min + (lfsr % (max - min + 1)));
 }
+
+
+// ****************************************************************************
+// crc16_ccitt
+//
+// Adds a byte to a CRC-16-CCITT (polynomial 0x1021). The CRC starts with
+// CRC16_INITIAL_VALUE.
+// ****************************************************************************
+uint16_t crc16_ccitt(uint16_t crc, uint8_t data)
+{
+    int i;
+
+    crc ^= (uint16_t)data << 8;
+    for (i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+    return crc;
+}
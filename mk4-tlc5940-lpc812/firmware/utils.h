@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+#define CRC16_INITIAL_VALUE 0xffff
+
 uint16_t random_min_max(uint16_t min, uint16_t max);
+uint16_t crc16_ccitt(uint16_t crc, uint8_t data);
 
 #endif // __UTILS_H
\ No newline at end of file
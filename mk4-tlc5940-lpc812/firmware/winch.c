@@ -1,4 +1,34 @@
 /******************************************************************************
+
+    Winch output
+
+    The winch controller receives one ASCII character per command:
+
+        '0'     Winch disabled
+        '1'     Idle
+        '2'     Winch in
+        '3'     Winch out
+
+    A change of the winch mode is sent right away. Sending never blocks the
+    mainloop: when the UART is busy the command is sent in a later mainloop
+    pass.
+
+    A winch controller may acknowledge each command by echoing the
+    character back. The echo is received on the CH3 pin, which is only free
+    for it with the CPPM reader (and CH3 not being a local switch; see
+    init_hardware() in main.c).
+
+    Without echoes, e.g. with older winch controllers or no wire back, the
+    command is repeated every winch_command_repeat_time as a keep-alive.
+    Once an echo has been received the link is acknowledged:
+
+    - A command whose echo does not arrive within WINCH_ACK_TIMEOUT is sent
+      again.
+    - An acknowledged command is only refreshed every WINCH_KEEPALIVE_FACTOR
+      times winch_command_repeat_time.
+    - After WINCH_ACK_RETRIES commands in a row without echo the link falls
+      back to the unacknowledged mode.
+
 ******************************************************************************/
 #include <stdint.h>
 #include <stdbool.h>
@@ -6,18 +36,29 @@
 #include <uart0.h>
 #include <globals.h>
 
-static uint16_t winch_command_repeat_counter;
-
 #define WINCH_COMMAND_DISABLED '0'
 #define WINCH_COMMAND_IDLE '1'
 #define WINCH_COMMAND_IN '2'
 #define WINCH_COMMAND_OUT '3'
 
+#define WINCH_ACK_TIMEOUT (100 / __SYSTICK_IN_MS)
+#define WINCH_ACK_RETRIES 5
+#define WINCH_KEEPALIVE_FACTOR 10
+
+// Systicks until the current command is sent again
+static uint16_t winch_command_repeat_counter;
+
+static char sent_command;           // Last command handed to the UART
+static bool send_pending;           // Command waits for the UART
+static bool waiting_for_ack;
+static bool link_acknowledged;
+static uint8_t missing_acks;
+
 
 // ****************************************************************************
 void winch_action(uint8_t ch3_clicks)
 {
-    if (!config.flags.winch_output) {
+    if (!CONFIG_WINCH_OUTPUT) {
         return;
     }
 
@@ -25,13 +66,13 @@ void winch_action(uint8_t ch3_clicks)
         case 1:
             // 1 click: winch in
             global_flags.winch_mode = WINCH_IN;
-            winch_command_repeat_counter = 0;
+            post_light_program_event(RUN_ON_WINCH_STARTED);
             break;
 
         case 2:
             // 2 click: winch out
             global_flags.winch_mode = WINCH_OUT;
-            winch_command_repeat_counter = 0;
+            post_light_program_event(RUN_ON_WINCH_STARTED);
             break;
 
         case 5:
@@ -42,7 +83,6 @@ void winch_action(uint8_t ch3_clicks)
             else {
                 global_flags.winch_mode = WINCH_DISABLED;
             }
-            winch_command_repeat_counter = 0;
             break;
 
         default:
@@ -55,14 +95,13 @@ void winch_action(uint8_t ch3_clicks)
 // ****************************************************************************
 bool abort_winching(void)
 {
-    if (!config.flags.winch_output) {
+    if (!CONFIG_WINCH_OUTPUT) {
         return false;
     }
 
     if (global_flags.winch_mode == WINCH_IN ||
         global_flags.winch_mode == WINCH_OUT) {
         global_flags.winch_mode = WINCH_IDLE;
-        winch_command_repeat_counter = 0;
         return true;
     }
     return false;
@@ -70,44 +109,115 @@ bool abort_winching(void)
 
 
 // ****************************************************************************
+static char winch_command(void)
+{
+    switch (global_flags.winch_mode) {
+        case WINCH_IDLE:
+            return WINCH_COMMAND_IDLE;
+
+        case WINCH_IN:
+            return WINCH_COMMAND_IN;
+
+        case WINCH_OUT:
+            return WINCH_COMMAND_OUT;
+
+        case WINCH_DISABLED:
+        default:
+            return WINCH_COMMAND_DISABLED;
+    }
+}
+
+
 // ****************************************************************************
-void process_winch(void)
+// Echoes of the winch controller can only be received with the CPPM reader;
+// otherwise the UART receiver belongs to the preprocessor, or is not
+// connected at all.
+static void receive_acknowledgements(void)
 {
-    if (!config.flags.winch_output) {
+    uint8_t uart_byte;
+
+    if (CONFIG_MODE != MASTER_WITH_CPPM_READER  ||
+            config.flags.ch3_is_local_switch) {
         return;
     }
 
-    if (global_flags.systick) {
-        if (winch_command_repeat_counter) {
-            --winch_command_repeat_counter;
+    while (uart0_read_is_byte_pending()) {
+        uart_byte = uart0_read_byte();
+
+        if (uart_byte == (uint8_t)sent_command  &&  waiting_for_ack) {
+            waiting_for_ack = false;
+            link_acknowledged = true;
+            missing_acks = 0;
+            winch_command_repeat_counter =
+                config.winch_command_repeat_time * WINCH_KEEPALIVE_FACTOR;
         }
     }
+}
 
-    if (winch_command_repeat_counter == 0) {
-        char winch_command;
 
-        winch_command_repeat_counter = config.winch_command_repeat_time;
-        switch (global_flags.winch_mode) {
-            case WINCH_DISABLED:
-                winch_command = WINCH_COMMAND_DISABLED;
-                break;
+// ****************************************************************************
+static void ack_timeout(void)
+{
+    if (!waiting_for_ack) {
+        return;
+    }
 
-            case WINCH_IDLE:
-                winch_command = WINCH_COMMAND_IDLE;
-                break;
+    waiting_for_ack = false;
+    if (link_acknowledged) {
+        ++missing_acks;
+        if (missing_acks >= WINCH_ACK_RETRIES) {
+            link_acknowledged = false;
+            missing_acks = 0;
+        }
+    }
+}
 
-            case WINCH_IN:
-                winch_command = WINCH_COMMAND_IN;
-                break;
 
-            case WINCH_OUT:
-                winch_command = WINCH_COMMAND_OUT;
-                break;
+// ****************************************************************************
+// ****************************************************************************
+void process_winch(void)
+{
+    char command;
 
-            default:
-                return;
+    if (!CONFIG_WINCH_OUTPUT) {
+        return;
+    }
+
+    receive_acknowledgements();
 
+    if (global_flags.systick) {
+        if (winch_command_repeat_counter) {
+            --winch_command_repeat_counter;
         }
-        uart0_send_char(winch_command);
     }
+
+    command = winch_command();
+
+    if (command != sent_command) {
+        send_pending = true;
+    }
+    else if (winch_command_repeat_counter == 0) {
+        ack_timeout();
+        send_pending = true;
+    }
+
+    if (!send_pending) {
+        return;
+    }
+
+    if (CONFIG_UART_MULTIPLEX) {
+        uart_mux_send(UART_MUX_CHANNEL_WINCH, (uint8_t *)&command, 1);
+    }
+    else if (uart0_send_is_ready()) {
+        uart0_send_char(command);
+    }
+    else {
+        return;
+    }
+
+    send_pending = false;
+    sent_command = command;
+    waiting_for_ack = true;
+    winch_command_repeat_counter = link_acknowledged ?
+        WINCH_ACK_TIMEOUT : config.winch_command_repeat_time;
 }
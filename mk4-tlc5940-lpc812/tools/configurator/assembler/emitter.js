@@ -8,19 +8,63 @@ var emitter = (function () {
 
     var NUMBER_OF_LEDS = 32;
 
+    // LIGHT_PROGRAM_STACK_DEPTH in globals.h of the light controller firmware
+    var MAX_CALL_DEPTH = 4;
+
+    var MAX_PATTERN_FRAMES = 255;
+    var MAX_PATTERN_TABLES = 256;
+
     // Taken from globals.h of the light controller firmware:
+    var OPCODE_GOTO           = 0x01;
+    var OPCODE_SET            = 0x02;
+    var OPCODE_FADE_I         = 0x05;
+    var OPCODE_SLEEP          = 0x06;
+    var OPCODE_SLEEP_I        = 0x07;
+    var OPCODE_SET_LED        = 0x08;
+    var OPCODE_CALL           = 0x0c;
+    var OPCODE_RETURN         = 0x0d;
+    var OPCODE_PATTERN        = 0x0e;
+    var OPCODE_PATTERN_I      = 0x0f;
+    var OPCODE_ASSIGN_I       = 0x11;
+    var OPCODE_XOR_I          = 0x1f;
+    var OPCODE_SET_MASK       = 0x48;
+    var OPCODE_FADE_MASK_I    = 0x4b;
+    var OPCODE_ASSIGN_S       = 0x50;
+    var OPCODE_PATTERN_TABLE  = 0xfc;
+    var OPCODE_SUBROUTINE     = 0xfd;
+    var OPCODE_END_OF_PROGRAM = 0xfe;
     var FIRST_SKIP_IF_OPCODE  = 0x20;
     var LAST_SKIP_IF_OPCODE   = 0x37;
     var OPCODE_SKIP_IF_ANY    = 0x60;    // 011 + 29 bits run_state!
     var OPCODE_SKIP_IF_ALL    = 0x80;    // 100 + 29 bits run_state!
     var OPCODE_SKIP_IF_NONE   = 0xA0;    // 101 + 29 bits run_state!
 
+    var PRIORITY_STATE_OFFSET = 0;
     var LEDS_USED_OFFSET = 2;
-    var FIRST_INSTRUCTION_OFFSET = 3;
+
+    var RUN_ON_EVENTS_MASK = 0x7f800000;
+
+    // Firmware images built before the compact bytecode execute one 32-bit
+    // word per instruction, which is the format the parser generates. They
+    // know neither subroutines, pattern tables, events, SET and FADE with
+    // LED mask, nor the variable window in the priority word.
+    var LEGACY_LIGHT_PROGRAMS_VERSION = 1;
+    var legacy = false;
 
     var number_of_programs = 0;
     var start_offset = [];
+    var block_offset = [];
+    var subroutines = [];
+    var current_subroutine = null;
+    var pattern_tables = [];
+    var current_pattern_table = null;
+    var call_depth = 0;
     var instruction_list = [];
+    var program_code = [];
+    var program_lines = [];
+    var led_masks = {};
+    var statistics = [];
+    var source_map = [];
     var pc = 0;
     var led_list = [];
     var errors = [];
@@ -73,10 +117,25 @@ var emitter = (function () {
     };
 
 
+    // *************************************************************************
+    // Same as percent_to_uint8() in the firmware, so that pattern tables and
+    // SET with LED mask can store brightness values
+    var percent_to_uint8 = function (percentage) {
+        if (percentage < 0) {
+            return 0;
+        }
+
+        if (percentage >= 100) {
+            return 255;
+        }
+
+        return Math.floor(percentage * 255 / 100);
+    };
+
+
     // *************************************************************************
     var resolve_forward_declarations = function () {
         var i, f;
-        var offset;
         var forward_declarations = parser.yy.symbols.get_forward_declerations();
 
         for (i = 0; i < forward_declarations.length; i += 1) {
@@ -87,12 +146,8 @@ var emitter = (function () {
                     loc: f.location
                 });
             } else if (f.symbol.opcode !== f.pc) {
-                offset = start_offset[number_of_programs];
-                offset += FIRST_INSTRUCTION_OFFSET;
-                offset += f.pc;
-
-                instruction_list[offset] =
-                    (instruction_list[offset] & 0xff000000) |
+                program_code[f.pc] =
+                    (program_code[f.pc] & 0xff000000) |
                         (f.symbol.opcode & 0x00ffffff);
             }
         }
@@ -141,13 +196,54 @@ var emitter = (function () {
 
         last_location = location;
 
-        instruction_list.push(instruction);
+        program_code.push(instruction);
+        program_lines.push(location ? location.first_line : undefined);
         pc += 1;
     };
 
 
+    // ****************************************************************************
+    // Returns the bit-field of the LEDs that a SET or FADE instruction at
+    // program_code[index] operates on
+    var get_led_mask = function (instruction, index) {
+        var opcode = instruction >>> 24;
+        var start = (instruction >> 8) & 0xff;
+        var stop = (instruction >> 16) & 0xff;
+        var mask = 0;
+        var i;
+
+        if (opcode >= OPCODE_SET_MASK  &&  opcode <= OPCODE_FADE_MASK_I) {
+            return led_masks[index];
+        }
+
+        for (i = start; i <= stop; i += 1) {
+            mask = (mask | (1 << i)) >>> 0;
+        }
+        return mask;
+    };
+
+
+    // ****************************************************************************
+    // Returns the SET or FADE opcode (SET, SET_I, FADE, FADE_I) of an
+    // instruction, or undefined if it is not a SET or FADE
+    var get_led_opcode = function (instruction) {
+        var opcode = instruction >>> 24;
+
+        if (opcode >= OPCODE_SET  &&  opcode <= OPCODE_FADE_I) {
+            return opcode;
+        }
+        if (opcode >= OPCODE_SET_MASK  &&  opcode <= OPCODE_FADE_MASK_I) {
+            return opcode - OPCODE_SET_MASK + OPCODE_SET;
+        }
+        return undefined;
+    };
+
+
     // ****************************************************************************
     var emit_led_instruction = function (instruction, location) {
+        var opcode = instruction >>> 24;
+        var previous = program_code[pc - 1];
+        var mask = 0;
         var start;
         var stop;
         var i;
@@ -160,30 +256,316 @@ var emitter = (function () {
         }
 
         if (led_list.length > 1  &&  pc > 0  &&
-                is_skip_if(instruction_list[instruction_list.length - 1])) {
+                is_skip_if(program_code[pc - 1])) {
             yyerror("Commands using multiple LEDs can not follow 'skip if'", {
                 loc: location
             });
         }
 
-        // Step 1: sort the LEDs by their index.
-        led_list.sort(function (a, b) { return a - b; });
+        // The legacy bytecode has no LED mask: emit one instruction for each
+        // range of consecutive LEDs
+        if (legacy) {
+            led_list.sort(function (a, b) { return a - b; });
+
+            start = stop = led_list[0];
+            for (i = 1; i < led_list.length; i += 1) {
+                if (led_list[i] !== (stop + 1)) {
+                    emit(instruction | (stop << 16) | (start << 8), location);
+                    start = stop = led_list[i];
+                } else {
+                    stop += 1;
+                }
+            }
+            emit(instruction | (stop << 16) | (start << 8), location);
 
-        // Step 2: Iterate through all items. If discontinuity is found emit a
-        // single LED statement.
+            led_list = [];
+            return;
+        }
+
+        for (i = 0; i < led_list.length; i += 1) {
+            mask = (mask | (1 << led_list[i])) >>> 0;
+        }
+        led_list = [];
 
-        start = stop = led_list[0];
-        for (i = 1; i < led_list.length; i += 1) {
-            if (led_list[i] !== (stop + 1)) {
-                emit(instruction | (stop << 16) | (start << 8));
-                start = stop = led_list[i];
-            } else {
-                stop += 1;
+        // Merge with the previous instruction if it sets or fades other LEDs
+        // to the same value. This is not possible if the previous instruction
+        // depends on a 'skip if', or the current one is the target of a goto.
+        if (pc > 0  &&  get_led_opcode(previous) === opcode  &&
+                (previous & 0xff) === (instruction & 0xff)  &&
+                !(pc > 1  &&  is_skip_if(program_code[pc - 2]))  &&
+                !parser.yy.symbols.is_label(pc)) {
+            parser.yy.logger.log(MODULE, "INFO", "Merging with " + hex(previous));
+
+            mask = (mask | get_led_mask(previous, pc - 1)) >>> 0;
+            program_code.pop();
+            program_lines.pop();
+            delete led_masks[pc - 1];
+            pc -= 1;
+        }
+
+        // LEDs that form a consecutive range use SET or FADE with start and
+        // stop LED, all others the variant with the LED mask
+        start = 0;
+        while (!(mask & (1 << start))) {
+            start += 1;
+        }
+        stop = start;
+        while (stop < (NUMBER_OF_LEDS - 1)  &&  (mask & (1 << (stop + 1)))) {
+            stop += 1;
+        }
+
+        if (get_led_mask(instruction | (stop << 16) | (start << 8)) === mask) {
+            emit(instruction | (stop << 16) | (start << 8), location);
+        } else {
+            led_masks[pc] = mask;
+            emit(((opcode - OPCODE_SET + OPCODE_SET_MASK) * 0x1000000) +
+                (instruction & 0xff), location);
+        }
+    };
+
+
+    // *************************************************************************
+    // The parser generates 32-bit instructions where the opcode is in the
+    // top-most byte. This function returns the length in bytes of the
+    // instruction in the compact bytecode that the firmware executes.
+    var instruction_length = function (instruction) {
+        var opcode = instruction >>> 24;
+        var value;
+
+        if (opcode === OPCODE_END_OF_PROGRAM  ||  opcode === OPCODE_RETURN) {
+            return 1;
+        }
+
+        if (opcode === OPCODE_GOTO  ||  opcode === OPCODE_CALL  ||
+                opcode === OPCODE_SLEEP  ||  opcode === OPCODE_SLEEP_I) {
+            return 3;
+        }
+
+        if (opcode === OPCODE_PATTERN  ||  opcode === OPCODE_PATTERN_I) {
+            return 5;
+        }
+
+        if (opcode >= OPCODE_SET_MASK  &&  opcode <= OPCODE_FADE_MASK_I) {
+            return 6;
+        }
+
+        // SET and FADE of a single LED
+        if (opcode >= OPCODE_SET  &&  opcode <= OPCODE_FADE_I) {
+            if (((instruction >> 16) & 0xff) === ((instruction >> 8) & 0xff)) {
+                return 3;
             }
+            return 4;
         }
-        emit(instruction | (stop << 16) | (start << 8));
 
-        led_list = [];
+        // Variable operations with an immediate that fits into an int8_t
+        if (opcode >= OPCODE_ASSIGN_I  &&  opcode <= OPCODE_XOR_I  &&
+                (opcode & 0x01)) {
+            value = instruction & 0xffff;
+            if (value < 0x80  ||  value >= 0xff80) {
+                return 3;
+            }
+        }
+
+        return 4;
+    };
+
+
+    // *************************************************************************
+    // GOTO, CALL and PATTERN store the target as int16_t relative to the
+    // instruction following them
+    var encode_jump = function (opcode, target, next) {
+        var distance = target - next;
+
+        if (target === undefined  ||  distance < -0x8000  ||  distance > 0x7fff) {
+            throw new Error("Jump target out of range");
+        }
+        return [opcode, distance & 0xff, (distance >> 8) & 0xff];
+    };
+
+
+    // *************************************************************************
+    // Run the optimizer over the current program or subroutine, if the
+    // optimizer is available
+    var optimize_program_code = function () {
+        var result;
+
+        // The optimizer merges LEDs into SET and FADE with LED mask
+        if (parser.yy.optimizer === undefined  ||  legacy) {
+            return;
+        }
+
+        result = parser.yy.optimizer.optimize(program_code, led_masks,
+            program_lines);
+        program_code = result.code;
+        led_masks = result.led_masks;
+        program_lines = result.lines;
+    };
+
+
+    // *************************************************************************
+    // Determine the worst-case number of instructions the current program or
+    // subroutine executes per systick, if the analysis is available
+    var analyze_program_code = function (name) {
+        if (parser.yy.wcet === undefined) {
+            return;
+        }
+
+        if (current_subroutine) {
+            parser.yy.wcet.analyze_subroutine(program_code, name);
+        } else {
+            parser.yy.wcet.analyze_program(program_code, name, last_location);
+        }
+    };
+
+
+    // *************************************************************************
+    // Hand the final code of the current program or subroutine to the
+    // native code backend, if it is available
+    var compile_program_code = function (name) {
+        if (parser.yy.native === undefined) {
+            return;
+        }
+
+        if (current_subroutine) {
+            parser.yy.native.add_subroutine(program_code, led_masks, name);
+        } else {
+            parser.yy.native.add_program(program_code, led_masks, name);
+        }
+    };
+
+
+    // *************************************************************************
+    // Convert a 32-bit instruction as generated by the parser into the
+    // bytes of the compact bytecode. byte_offsets[] contains the location of
+    // each instruction in the program, which is needed to translate GOTO
+    // targets from instruction index to byte offset. base is the location of
+    // the program within the light programs, needed to reach subroutines.
+    var encode_instruction = function (instruction, byte_offsets, index, base) {
+        var opcode = instruction >>> 24;
+        var b2 = (instruction >> 16) & 0xff;
+        var b1 = (instruction >> 8) & 0xff;
+        var b0 = instruction & 0xff;
+        var next = byte_offsets[index] + instruction_length(instruction);
+        var mask;
+
+        if (opcode === OPCODE_END_OF_PROGRAM  ||  opcode === OPCODE_RETURN) {
+            return [opcode];
+        }
+
+        if (opcode === OPCODE_GOTO) {
+            return encode_jump(opcode, byte_offsets[instruction & 0xffffff], next);
+        }
+
+        if (opcode === OPCODE_CALL) {
+            return encode_jump(opcode,
+                subroutines[instruction & 0xffffff].position - base, next);
+        }
+
+        // PATTERN: table, first LED, frame
+        if (opcode === OPCODE_PATTERN  ||  opcode === OPCODE_PATTERN_I) {
+            return encode_jump(opcode,
+                pattern_tables[b2].position - base, next).concat([b1, b0]);
+        }
+
+        if (opcode === OPCODE_SLEEP  ||  opcode === OPCODE_SLEEP_I) {
+            return [opcode, b0, b1];
+        }
+
+        // SET and FADE with LED mask: var or brightness, 32-bit LED mask
+        if (opcode >= OPCODE_SET_MASK  &&  opcode <= OPCODE_FADE_MASK_I) {
+            mask = led_masks[index];
+            return [opcode, (opcode & 0x01) ? percent_to_uint8(b0) : b0,
+                mask & 0xff, (mask >>> 8) & 0xff, (mask >>> 16) & 0xff,
+                mask >>> 24];
+        }
+
+        // SET and FADE: start, stop, value; LED, value for the short form
+        if (opcode >= OPCODE_SET  &&  opcode <= OPCODE_FADE_I) {
+            if (instruction_length(instruction) === 3) {
+                return [opcode - OPCODE_SET + OPCODE_SET_LED, b1, b0];
+            }
+            return [opcode, b1, b2, b0];
+        }
+
+        if (instruction_length(instruction) === 3) {
+            return [OPCODE_ASSIGN_S + ((opcode - OPCODE_ASSIGN_I) >> 1), b2, b0];
+        }
+
+        // SKIP IF ANY/ALL/NONE: 29 bits of car state
+        if (((opcode & 0xe0) === OPCODE_SKIP_IF_ANY)  ||
+                ((opcode & 0xe0) === OPCODE_SKIP_IF_ALL)  ||
+                    ((opcode & 0xe0) === OPCODE_SKIP_IF_NONE)) {
+            return [opcode, b0, b1, b2];
+        }
+
+        // Variable operations and SKIP IF: var/LED, 16-bit parameter
+        return [opcode, b2, b0, b1];
+    };
+
+
+    // *************************************************************************
+    // Encode the program or subroutine that starts at the current end of the
+    // instruction list. The location of each instruction is recorded in the
+    // source map, as byte offset from the start of the light programs.
+    var encode_program = function (code, name) {
+        var i;
+        var bytes = [];
+        var byte_offsets = [];
+        var offset = 0;
+        var base = instruction_list.length * 4;
+        var lines = [];
+
+        for (i = 0; i < code.length; i += 1) {
+            byte_offsets.push(offset);
+            offset += legacy ? 4 : instruction_length(code[i]);
+        }
+
+        for (i = 0; i < code.length; i += 1) {
+            try {
+                bytes = bytes.concat(legacy ?
+                        [code[i] & 0xff, (code[i] >>> 8) & 0xff,
+                            (code[i] >>> 16) & 0xff, code[i] >>> 24] :
+                        encode_instruction(code[i], byte_offsets, i, base)
+                );
+            } catch (e) {
+                yyerror(e.message, {loc: last_location});
+            }
+        }
+
+        statistics.push({
+            "name": name,
+            "instructions": code.length,
+            "bytes": bytes.length
+        });
+
+        for (i = 0; i < code.length; i += 1) {
+            lines.push([base + byte_offsets[i], program_lines[i]]);
+        }
+        source_map.push({
+            "name": name,
+            "program": current_subroutine ? undefined : number_of_programs,
+            "offset": base,
+            "length": bytes.length,
+            "lines": lines
+        });
+
+        return bytes;
+    };
+
+
+    // *************************************************************************
+    // Pack the bytecode into little-endian 32-bit words, padded with zeros
+    var append_bytecode = function (bytes) {
+        var i;
+
+        for (i = 0; i < bytes.length; i += 4) {
+            instruction_list.push(
+                ((bytes[i + 3] || 0) * 0x1000000) +
+                    ((bytes[i + 2] || 0) << 16) +
+                        ((bytes[i + 1] || 0) << 8) +
+                            bytes[i]
+            );
+        }
     };
 
 
@@ -192,9 +574,15 @@ var emitter = (function () {
         parser.yy.logger.log(MODULE, "INFO", "PRIORITY code: " + hex(priority_run_condition));
         parser.yy.logger.log(MODULE, "INFO", "RUN code: " + hex(run_condition));
 
+        if (legacy  &&  (run_condition & RUN_ON_EVENTS_MASK)) {
+            yyerror("The firmware of this image does not support 'run on'");
+        }
+
         instruction_list.push(priority_run_condition);
         instruction_list.push(run_condition);
         instruction_list.push(0);   // Placeholder for "leds used"
+
+        parser.yy.symbols.set_run_condition(priority_run_condition, run_condition);
     };
 
 
@@ -202,14 +590,15 @@ var emitter = (function () {
     var emit_end_of_program = function () {
         parser.yy.logger.log(MODULE, "INFO", "emit_end_of_program()");
 
-        if (pc > 0  &&  is_skip_if(instruction_list[instruction_list.length - 1])) {
+        if (pc > 0  &&  is_skip_if(program_code[pc - 1])) {
             yyerror("Last operation in a program can not be 'skip if'.", {
                 loc: last_location
             });
         }
 
         // Add end-of-program instruction
-        instruction_list.push(0xfe000000);
+        program_code.push(0xfe000000);
+        program_lines.push(last_location ? last_location.first_line : undefined);
 
         parser.yy.symbols.dump_symbol_table();
 
@@ -218,15 +607,257 @@ var emitter = (function () {
             parser.yy.symbols.get_leds_used();
 
         resolve_forward_declarations();
+        optimize_program_code();
+        analyze_program_code("Program " + (number_of_programs + 1));
+        compile_program_code("Program " + (number_of_programs + 1));
+
+        append_bytecode(encode_program(program_code,
+            "Program " + (number_of_programs + 1)));
 
         // Prepare for the next program
         parser.yy.symbols.remove_local_symbols();
         number_of_programs += 1;
         pc = 0;
+        program_code = [];
+        program_lines = [];
+        led_masks = {};
+        call_depth = 0;
         start_offset[number_of_programs] = instruction_list.length;
     };
 
 
+    // *************************************************************************
+    var emit_subroutine_start = function (name, location) {
+        parser.yy.logger.log(MODULE, "INFO", "emit_subroutine_start(" + name + ")");
+
+        if (legacy) {
+            yyerror("The firmware of this image does not support subroutines", {
+                loc: location
+            });
+        }
+
+        current_subroutine = {
+            "name": name,
+            "location": location,
+            "header": instruction_list.length
+        };
+
+        block_offset.push(instruction_list.length);
+        instruction_list.push(OPCODE_SUBROUTINE * 0x1000000);
+        instruction_list.push(0);   // Placeholder for "leds used"
+    };
+
+
+    // *************************************************************************
+    var emit_end_of_subroutine = function () {
+        var s = current_subroutine;
+        var bytes;
+        var leds_used = parser.yy.symbols.get_leds_used();
+
+        parser.yy.logger.log(MODULE, "INFO", "emit_end_of_subroutine()");
+
+        if (pc > 0  &&  is_skip_if(program_code[pc - 1])) {
+            yyerror("Last operation in a subroutine can not be 'skip if'.", {
+                loc: last_location
+            });
+        }
+
+        // Return at the end of the subroutine
+        program_code.push(OPCODE_RETURN * 0x1000000);
+        program_lines.push(last_location ? last_location.first_line : undefined);
+
+        parser.yy.symbols.dump_symbol_table();
+
+        resolve_forward_declarations();
+        optimize_program_code();
+        analyze_program_code("Subroutine " + s.name);
+        compile_program_code("Subroutine " + s.name);
+
+        bytes = encode_program(program_code, "Subroutine " + s.name);
+
+        // Fill in the length and the LEDS_USED word
+        instruction_list[s.header] = OPCODE_SUBROUTINE * 0x1000000 + bytes.length;
+        instruction_list[s.header + 1] = leds_used;
+
+        append_bytecode(bytes);
+
+        // Prepare for the next program or subroutine. The subroutine itself
+        // is added to the symbol table only now to prevent recursion.
+        parser.yy.symbols.remove_local_symbols();
+        parser.yy.symbols.add_symbol(s.name, "SUBROUTINE", subroutines.length, s.location);
+        subroutines.push({
+            "name": s.name,
+            "position": (s.header + 2) * 4,
+            "leds_used": leds_used,
+            "depth": call_depth + 1
+        });
+
+        current_subroutine = null;
+        pc = 0;
+        program_code = [];
+        program_lines = [];
+        led_masks = {};
+        call_depth = 0;
+        start_offset[number_of_programs] = instruction_list.length;
+    };
+
+
+    // *************************************************************************
+    var emit_call = function (name, location) {
+        var index = parser.yy.symbols.get_symbol(name).opcode;
+        var subroutine = subroutines[index];
+        var depth = subroutine.depth + (current_subroutine ? 1 : 0);
+
+        if (depth > MAX_CALL_DEPTH) {
+            yyerror("Subroutine calls nested too deep (maximum is " +
+                MAX_CALL_DEPTH + ")", {
+                    loc: location
+                });
+        }
+        call_depth = Math.max(call_depth, subroutine.depth);
+
+        // The LEDs of the subroutine are used by the calling program
+        parser.yy.symbols.set_leds_used(
+            (parser.yy.symbols.get_leds_used() | subroutine.leds_used) >>> 0
+        );
+
+        emit(OPCODE_CALL * 0x1000000 + index, location);
+    };
+
+
+    // *************************************************************************
+    var emit_return = function (location) {
+        if (current_subroutine === null) {
+            yyerror("'return' can only be used in a subroutine", {
+                loc: location
+            });
+        }
+
+        emit(OPCODE_RETURN * 0x1000000, location);
+    };
+
+
+    // *************************************************************************
+    var emit_pattern_table_start = function (name, location) {
+        parser.yy.logger.log(MODULE, "INFO", "emit_pattern_table_start(" + name + ")");
+
+        if (legacy) {
+            yyerror("The firmware of this image does not support patterns", {
+                loc: location
+            });
+        }
+
+        current_pattern_table = {
+            "name": name,
+            "location": location,
+            "header": instruction_list.length,
+            "width": 0,
+            "frames": 0,
+            "frame": [],
+            "values": []
+        };
+
+        block_offset.push(instruction_list.length);
+        instruction_list.push(OPCODE_PATTERN_TABLE * 0x1000000);
+    };
+
+
+    // *************************************************************************
+    var add_pattern_value = function (percentage) {
+        current_pattern_table.frame.push(percent_to_uint8(percentage));
+    };
+
+
+    // *************************************************************************
+    var add_pattern_frame = function (location) {
+        var t = current_pattern_table;
+
+        if (t.frame.length > NUMBER_OF_LEDS) {
+            yyerror("A pattern frame can not have more than " +
+                NUMBER_OF_LEDS + " LEDs", {
+                    loc: location
+                });
+        }
+
+        if (t.frames === 0) {
+            t.width = t.frame.length;
+        } else if (t.frame.length !== t.width) {
+            yyerror("All frames of pattern " + t.name +
+                " must have the same number of LEDs", {
+                    loc: location
+                });
+        }
+
+        t.frames += 1;
+        t.values = t.values.concat(t.frame);
+        t.frame = [];
+    };
+
+
+    // *************************************************************************
+    var emit_end_of_pattern_table = function () {
+        var t = current_pattern_table;
+        var bytes = [t.width, t.frames].concat(t.values);
+
+        parser.yy.logger.log(MODULE, "INFO", "emit_end_of_pattern_table()");
+
+        if (t.frames > MAX_PATTERN_FRAMES) {
+            yyerror("Pattern " + t.name + " has more than " +
+                MAX_PATTERN_FRAMES + " frames", {
+                    loc: t.location
+                });
+        }
+
+        if (pattern_tables.length >= MAX_PATTERN_TABLES) {
+            yyerror("Too many pattern tables (maximum is " +
+                MAX_PATTERN_TABLES + ")", {
+                    loc: t.location
+                });
+        }
+
+        instruction_list[t.header] = OPCODE_PATTERN_TABLE * 0x1000000 + bytes.length;
+        append_bytecode(bytes);
+
+        if (parser.yy.native !== undefined) {
+            parser.yy.native.add_pattern_table(bytes);
+        }
+
+        parser.yy.symbols.add_symbol(t.name, "PATTERN_TABLE", pattern_tables.length, t.location);
+        pattern_tables.push({
+            "name": t.name,
+            "position": (t.header + 1) * 4,
+            "width": t.width
+        });
+
+        current_pattern_table = null;
+        start_offset[number_of_programs] = instruction_list.length;
+    };
+
+
+    // *************************************************************************
+    // Set the LEDs in led_list to a frame of a pattern table. The LEDs have to
+    // be consecutive, as the firmware applies the frame to a range of LEDs.
+    var emit_pattern_instruction = function (name, frame, location) {
+        var index = parser.yy.symbols.get_symbol(name).opcode;
+        var width = pattern_tables[index].width;
+
+        led_list.sort(function (a, b) { return a - b; });
+
+        if (led_list.length !== width  ||
+                led_list[led_list.length - 1] - led_list[0] !== width - 1) {
+            yyerror("Pattern " + name + " requires a range of " + width +
+                " consecutive LEDs", {
+                    loc: location
+                });
+        }
+
+        emit(OPCODE_PATTERN * 0x1000000 + (index << 16) + (led_list[0] << 8) +
+            frame, location);
+
+        led_list = [];
+    };
+
+
     // *************************************************************************
     var get_pc = function () {
         return pc;
@@ -255,14 +886,30 @@ var emitter = (function () {
             throw new Error("Errors occured while processing the light programs:");
         }
 
+        // Programs clear their local variables when they start. The priority
+        // word tells the firmware where they are: bits 8..15 hold the first
+        // slot, bits 16..23 the number of slots. The firmware uses them only
+        // for clearing; the instructions address var[] directly.
+        var windows = parser.yy.symbols.get_variable_windows();
+        for (i = 0; i < number_of_programs; i += 1) {
+            if (windows[i]  &&  !legacy) {
+                instruction_list[start_offset[i] + PRIORITY_STATE_OFFSET] +=
+                    (windows[i].count << 16) + (windows[i].base << 8);
+            }
+        }
+
         var light_switch_positions =
             parser.yy.symbols.get_number_of_light_switch_positions();
 
         var result = {
             "number_of_programs": number_of_programs,
             "start_offset": start_offset,
+            "block_offset": block_offset,
             "instructions": instruction_list,
-            "light_switch_positions": light_switch_positions
+            "light_switch_positions": light_switch_positions,
+            "statistics": statistics,
+            "variables": parser.yy.symbols.get_variable_statistics(),
+            "source_map": source_map
         };
 
         return result;
@@ -285,8 +932,39 @@ var emitter = (function () {
             start_offset.push(0);
         }
 
+        block_offset = [];
+        subroutines = [];
+        current_subroutine = null;
+        pattern_tables = [];
+        current_pattern_table = null;
+        call_depth = 0;
+
         instruction_list = [];
+        program_code = [];
+        program_lines = [];
+        led_masks = {};
+        statistics = [];
+        source_map = [];
+        pc = 0;
         errors = [];
+
+        if (parser !== undefined  &&  parser.yy.wcet !== undefined) {
+            parser.yy.wcet.reset();
+        }
+        if (parser !== undefined  &&  parser.yy.native !== undefined) {
+            parser.yy.native.reset();
+        }
+    };
+
+
+    // *************************************************************************
+    // Generate the light programs for the given version of the bytecode, see
+    // LEGACY_LIGHT_PROGRAMS_VERSION. Local variables only share slots of
+    // var[] in the compact bytecode, as the legacy firmware does not clear
+    // them when a program starts.
+    var set_light_programs_version = function (version) {
+        legacy = (version === LEGACY_LIGHT_PROGRAMS_VERSION);
+        parser.yy.symbols.set_variable_sharing(!legacy);
     };
 
 
@@ -302,12 +980,22 @@ var emitter = (function () {
     reset();
     return {
         set_parser: set_parser,
+        set_light_programs_version: set_light_programs_version,
         get_errors: get_errors,
         yyerror: yyerror,
         emit: emit,
         emit_run_condition: emit_run_condition,
         emit_led_instruction: emit_led_instruction,
         emit_end_of_program: emit_end_of_program,
+        emit_subroutine_start: emit_subroutine_start,
+        emit_end_of_subroutine: emit_end_of_subroutine,
+        emit_call: emit_call,
+        emit_return: emit_return,
+        emit_pattern_table_start: emit_pattern_table_start,
+        add_pattern_value: add_pattern_value,
+        add_pattern_frame: add_pattern_frame,
+        emit_end_of_pattern_table: emit_end_of_pattern_table,
+        emit_pattern_instruction: emit_pattern_instruction,
         add_led_to_list: add_led_to_list,
         pc: get_pc,
         output_programs: output_programs,
@@ -10,6 +10,9 @@ var path = require('path');
 var parser = require("./build/parser").parser;
 var symbols = require("./symbols").symbols;
 var emitter = require("./emitter").emitter;
+var optimizer = require("./optimizer").optimizer;
+var wcet = require("./wcet").wcet;
+var native = require("./native").native;
 var logger = require("./log").logger;
 
 var output_file = 1;    // File handle of stdout
@@ -26,8 +29,13 @@ var hex = function (number) {
 
 
 // *****************************************************************************
-function make_c_output(source_name, output_file, programs) {
+// native_code is the C code of the programs compiled to native code, or
+// undefined if the firmware should interpret the bytecode. version is the
+// light program version for firmware before the compact bytecode, or
+// undefined for the current one.
+function make_c_output(source_name, output_file, programs, native_code, version) {
     var i;
+    var block_start = {};
 
     var part0 = "// Auto-generated file. Do not modify.";
     var part0a = "\n// Source: ";
@@ -41,7 +49,8 @@ function make_c_output(source_name, output_file, programs) {
         "    .magic = {\n" +
         "        .magic_value = ROM_MAGIC,\n" +
         "        .type = LIGHT_PROGRAMS,\n" +
-        "        .version = CONFIG_VERSION\n" +
+        "        .version = " + (version || "LIGHT_PROGRAMS_VERSION") +
+        (native_code ? " | LIGHT_PROGRAMS_NATIVE" : "") + "\n" +
         "    },\n" +
         "\n" +
         "    .number_of_programs = ";
@@ -73,6 +82,15 @@ function make_c_output(source_name, output_file, programs) {
     var start_offset = programs.start_offset;
     var instructions = programs.instructions;
 
+    // Offsets where a program, a subroutine, a pattern table, or the end of
+    // programs marker begins, so that we can separate them with an empty line
+    for (i = 0; i <= number_of_programs; i += 1) {
+        block_start[start_offset[i]] = true;
+    }
+    for (i = 0; i < programs.block_offset.length; i += 1) {
+        block_start[programs.block_offset[i]] = true;
+    }
+
     fs.writeSync(output_file, part0);
     if (source_name !== '') {
         fs.writeSync(output_file, part0a);
@@ -96,12 +114,75 @@ function make_c_output(source_name, output_file, programs) {
         fs.writeSync(output_file, part4);
         fs.writeSync(output_file, hex(instructions[i]));
         fs.writeSync(output_file, part4b);
-        if (instructions[i] === 0xfe000000) {
+
+        // Separate the programs, subroutines and tables with an empty line
+        if (block_start[i + 1]) {
             fs.writeSync(output_file, "\n");
         }
     }
 
     fs.writeSync(output_file, part5);
+
+    if (native_code) {
+        fs.writeSync(output_file, native_code);
+    }
+}
+
+
+// *****************************************************************************
+// Print the size of each program in the compact bytecode, compared to the
+// size it would need if every instruction would occupy a 32-bit word
+function print_statistics(programs) {
+    var i;
+    var s;
+    var instructions = 0;
+    var bytes = 0;
+
+    for (i = 0; i < programs.statistics.length; i += 1) {
+        s = programs.statistics[i];
+        instructions += s.instructions;
+        bytes += s.bytes;
+
+        console.error(s.name + ": " + s.instructions +
+            " instructions, " + s.bytes + " bytes (" +
+            (s.instructions * 4) + " bytes with 32-bit instructions)");
+    }
+
+    if (instructions > 0) {
+        console.error("Total: " + instructions + " instructions, " + bytes +
+            " bytes (" + (instructions * 4) + " bytes with 32-bit " +
+            "instructions, " +
+            Math.round(100 - (bytes * 100 / (instructions * 4))) + "% saved)");
+    }
+
+    console.error("Variables: " + programs.variables.slots + " slots of var[] (" +
+        programs.variables.variables + " without sharing slots between " +
+        "programs that never run at the same time)");
+}
+
+
+// *****************************************************************************
+// Write the source map: for each program and subroutine the byte offset of
+// every instruction from the start of the light programs, and the line of
+// the source it was generated from. tools/light_program_statistics.py uses
+// it to map the program counters printed by the firmware to source lines.
+function write_source_map(file_name, source_name, programs) {
+    var source_map = {
+        "source": source_name,
+        "blocks": programs.source_map
+    };
+
+    fs.writeFileSync(file_name, JSON.stringify(source_map) + "\n");
+}
+
+
+// *****************************************************************************
+function print_warnings(warnings) {
+    var i;
+
+    for (i = 0; i < warnings.length; i += 1) {
+        console.error("Warning: " + warnings[i].str);
+    }
 }
 
 
@@ -117,16 +198,28 @@ function increaseVerbosity(v, total) {
 parser.yy = {
     symbols: symbols,
     emitter: emitter,
+    optimizer: optimizer,
+    wcet: wcet,
+    native: native,
     logger: logger
 };
 emitter.set_parser(parser);
 symbols.set_parser(parser);
+optimizer.set_parser(parser);
+wcet.set_parser(parser);
+native.set_parser(parser);
 
 program
     .version('1.0.0')
     .usage('[options] <source>')
     .option('-o, --output <value>', 'Output file. If omitted, output is printed to stdout.')
     .option('-i, --include-name', 'Include the source file name in the output as comment.')
+    .option('-s, --statistics', 'Print the size of each program to stderr.')
+    .option('-O, --optimize', 'Optimize the light programs.')
+    .option('-w, --wcet', 'Print the worst-case number of instructions per systick to stderr.')
+    .option('-n, --native', 'Compile the light programs to native code, to be built with the firmware.')
+    .option('-m, --source-map <value>', 'Write the source map of the light programs to the given file.')
+    .option('-l, --light-programs-version <n>', 'Light program version of the firmware. Use 1 for firmware before the compact bytecode.', parseInt)
     .option('-v, --verbose', 'Verbose output. Specify multiple times for more output.', increaseVerbosity, 0)
     .parse(process.argv);
 
@@ -143,6 +236,16 @@ if (program.verbose < 1) {
     logger.set_log_level("FATAL");
 }
 
+optimizer.set_enabled(program.optimize || false);
+
+if (program.lightProgramsVersion !== undefined) {
+    if (program.native) {
+        console.error("Native code requires the current light program version.");
+        process.exit(1);
+    }
+    emitter.set_light_programs_version(program.lightProgramsVersion);
+}
+
 if (program.output) {
     output_file = fs.openSync(program.output, "w");
 }
@@ -151,7 +254,20 @@ var sourcecode = fs.readFileSync(source_file_name, "utf8");
 
 try {
     var programs = parser.parse(sourcecode);
-    make_c_output(program.includeName ? source_file_name : "", output_file, programs);
+    make_c_output(program.includeName ? source_file_name : "", output_file,
+        programs, program.native ? native.get_c_code() : undefined,
+        program.lightProgramsVersion);
+    if (program.sourceMap) {
+        write_source_map(program.sourceMap, path.resolve(source_file_name),
+            programs);
+    }
+    print_warnings(wcet.get_warnings());
+    if (program.statistics) {
+        print_statistics(programs);
+    }
+    if (program.wcet) {
+        console.error(wcet.get_report());
+    }
 } catch (e) {
     var i;
     var msg = "Errors occured while processing the light programs:\n";
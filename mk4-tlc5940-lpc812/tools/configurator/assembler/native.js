@@ -0,0 +1,559 @@
+/*jslint bitwise: true, vars: true */
+
+// Ahead-of-time compilation of light programs to native code.
+//
+// Each light program is translated into a C function that is compiled
+// together with the firmware, so that the ARM compiler generates Thumb code
+// for it. The function implements the entry ABI described in globals.h
+// (LIGHT_PROGRAM_FUNCTION_T): it runs the program until it sleeps, ends, or
+// has executed MAX_INSTRUCTIONS_PER_SYSTICK instructions, exactly like the
+// bytecode interpreter does. Every instruction has a label so that the
+// program can resume where it stopped in the next systick.
+//
+// Subroutines are compiled into each program that calls them, as the labels
+// of a C function can not be reached from another function.
+//
+// The native code is several times larger than the bytecode, which stays in
+// the image. "make size" in tools/vm-benchmark and "make light-programs-size"
+// in the firmware print the size of both.
+
+var native = (function () {
+    "use strict";
+
+    // Taken from globals.h of the light controller firmware:
+    var OPCODE_GOTO           = 0x01;
+    var OPCODE_SET            = 0x02;
+    var OPCODE_SET_I          = 0x03;
+    var OPCODE_FADE           = 0x04;
+    var OPCODE_FADE_I         = 0x05;
+    var OPCODE_SLEEP          = 0x06;
+    var OPCODE_SLEEP_I        = 0x07;
+    var OPCODE_CALL           = 0x0c;
+    var OPCODE_RETURN         = 0x0d;
+    var OPCODE_PATTERN        = 0x0e;
+    var OPCODE_PATTERN_I      = 0x0f;
+    var OPCODE_ASSIGN         = 0x10;
+    var OPCODE_ADD            = 0x12;
+    var OPCODE_SUBTRACT       = 0x14;
+    var OPCODE_MULTIPLY       = 0x16;
+    var OPCODE_DIVIDE         = 0x18;
+    var OPCODE_AND            = 0x1a;
+    var OPCODE_OR             = 0x1c;
+    var OPCODE_XOR            = 0x1e;
+    var FIRST_SKIP_IF_OPCODE  = 0x20;
+    var LAST_SKIP_IF_OPCODE   = 0x37;
+    var OPCODE_ABS            = 0x40;
+    var OPCODE_SET_MASK       = 0x48;
+    var OPCODE_SET_MASK_I     = 0x49;
+    var OPCODE_FADE_MASK      = 0x4a;
+    var OPCODE_FADE_MASK_I    = 0x4b;
+    var OPCODE_SKIP_IF_ANY    = 0x60;    // 011 + 29 bits run_state!
+    var OPCODE_SKIP_IF_ALL    = 0x80;    // 100 + 29 bits run_state!
+    var OPCODE_SKIP_IF_NONE   = 0xA0;    // 101 + 29 bits run_state!
+    var OPCODE_END_OF_PROGRAM = 0xfe;
+
+    var PARAMETER_TYPE_VARIABLE = 0;
+    var PARAMETER_TYPE_LED = 1;
+    var PARAMETER_TYPE_RANDOM = 2;
+    var PARAMETER_TYPE_STEERING = 3;
+    var PARAMETER_TYPE_THROTTLE = 4;
+    var PARAMETER_TYPE_GEAR = 5;
+
+    // Comparison of SKIP IF, indexed by (opcode - FIRST_SKIP_IF_OPCODE) >> 2
+    var SKIP_IF_OPERATORS = ["==", "!=", ">=", ">", "<=", "<"];
+
+    var ASSIGNMENT_OPERATORS = {};
+    ASSIGNMENT_OPERATORS[OPCODE_ASSIGN] = "=";
+    ASSIGNMENT_OPERATORS[OPCODE_ADD] = "+=";
+    ASSIGNMENT_OPERATORS[OPCODE_SUBTRACT] = "-=";
+    ASSIGNMENT_OPERATORS[OPCODE_MULTIPLY] = "*=";
+    ASSIGNMENT_OPERATORS[OPCODE_AND] = "&=";
+    ASSIGNMENT_OPERATORS[OPCODE_OR] = "|=";
+    ASSIGNMENT_OPERATORS[OPCODE_XOR] = "^=";
+
+    // Code and constants are placed in sections of their own, as the compiler
+    // does not allow mixing them with the light programs data structure
+    var SECTION = "__attribute__ ((section(\".light_programs\")))\n";
+    var CODE_SECTION = "__attribute__ ((section(\".light_programs.text\")))\n";
+    var DATA_SECTION = "__attribute__ ((section(\".light_programs.rodata\")))\n";
+
+    var subroutines = [];
+    var programs = [];
+    var pattern_tables = [];
+
+    var parser;
+
+    var MODULE = "NATIVE";
+
+
+    // *************************************************************************
+    var percent_to_uint8 = function (percentage) {
+        if (percentage < 0) {
+            return 0;
+        }
+
+        if (percentage >= 100) {
+            return 255;
+        }
+
+        return Math.floor(percentage * 255 / 100);
+    };
+
+
+    // *************************************************************************
+    var hex = function (number) {
+        return "0x" + (number >>> 0).toString(16) + "UL";
+    };
+
+
+    // *************************************************************************
+    // C expression of the 16-bit parameter of variable operations, SKIP IF
+    // and SLEEP. Odd opcodes have an immediate, even opcodes a type and id.
+    var parameter_value = function (opcode, parameter) {
+        var id = parameter & 0xff;
+
+        if (opcode & 0x01) {
+            return "(int16_t)" + ((parameter << 16) >> 16);
+        }
+
+        switch (parameter >> 8) {
+        case PARAMETER_TYPE_VARIABLE:
+            return "var[" + id + "]";
+
+        case PARAMETER_TYPE_LED:
+            return "(int16_t)(env->light_actual[" + id + "] * 100 / 255)";
+
+        case PARAMETER_TYPE_RANDOM:
+            return "(int16_t)env->random_min_max(1, 0xffff)";
+
+        case PARAMETER_TYPE_STEERING:
+            return "env->steering";
+
+        case PARAMETER_TYPE_THROTTLE:
+            return "env->throttle";
+
+        case PARAMETER_TYPE_GEAR:
+            return "env->gear";
+
+        default:
+            return "(int16_t)0";
+        }
+    };
+
+
+    // *************************************************************************
+    // Mask of LEDs start..stop
+    var range_mask = function (start, stop) {
+        var i;
+        var mask = 0;
+
+        for (i = start; i <= stop; i += 1) {
+            mask = (mask | (1 << i)) >>> 0;
+        }
+        return mask;
+    };
+
+
+    // *************************************************************************
+    // The C statements of a single instruction. label(i) returns the label
+    // of instruction i of the same block, id is the resume point of the
+    // instruction following this one.
+    var translate_instruction = function (block, index, label, id, call) {
+        var instruction = block.code[index];
+        var opcode = instruction >>> 24;
+        var b2 = (instruction >> 16) & 0xff;
+        var b1 = (instruction >> 8) & 0xff;
+        var b0 = instruction & 0xff;
+        var parameter = instruction & 0xffff;
+        var destination;
+        var value;
+        var mask;
+        var table;
+        var state;
+        var cmp1;
+        var operator;
+
+        // SKIP IF ANY/ALL/NONE: 29 bits of car state
+        if (((opcode & 0xe0) === OPCODE_SKIP_IF_ANY)  ||
+                ((opcode & 0xe0) === OPCODE_SKIP_IF_ALL)  ||
+                    ((opcode & 0xe0) === OPCODE_SKIP_IF_NONE)) {
+            state = hex(((opcode & 0x1f) * 0x1000000) + (instruction & 0xffffff));
+
+            if ((opcode & 0xe0) === OPCODE_SKIP_IF_ANY) {
+                return "if ((" + state + " & env->car_state) != 0) goto " +
+                    label(index + 2) + ";";
+            }
+            if ((opcode & 0xe0) === OPCODE_SKIP_IF_ALL) {
+                return "if ((" + state + " & env->car_state) == " + state +
+                    ") goto " + label(index + 2) + ";";
+            }
+            return "if ((" + state + " & env->car_state) == 0) goto " +
+                label(index + 2) + ";";
+        }
+
+        // SKIP IF var or LED compared to a parameter
+        if (opcode >= FIRST_SKIP_IF_OPCODE  &&  opcode <= LAST_SKIP_IF_OPCODE) {
+            cmp1 = (opcode & 0x02) ?
+                    "(int16_t)env->light_actual[" + b2 + "]" : "var[" + b2 + "]";
+            operator = SKIP_IF_OPERATORS[(opcode - FIRST_SKIP_IF_OPCODE) >> 2];
+
+            // The compiler warns about comparing a variable with itself
+            if (cmp1 === parameter_value(opcode, parameter)) {
+                if (operator === "==" || operator === ">=" || operator === "<=") {
+                    return "goto " + label(index + 2) + ";";
+                }
+                return ";";
+            }
+
+            return "if (" + cmp1 + " " + operator + " " +
+                parameter_value(opcode, parameter) + ") goto " +
+                label(index + 2) + ";";
+        }
+
+        // Variable operations
+        if (ASSIGNMENT_OPERATORS[opcode & 0xfe] !== undefined) {
+            return "var[" + b2 + "] " + ASSIGNMENT_OPERATORS[opcode & 0xfe] +
+                " " + parameter_value(opcode, parameter) + ";";
+        }
+
+        switch (opcode) {
+        case OPCODE_DIVIDE:
+        case OPCODE_DIVIDE + 1:
+            return "divisor = " + parameter_value(opcode, parameter) + ";\n" +
+                "    var[" + b2 + "] = divisor ? var[" + b2 +
+                "] / divisor : 0x7fff;";
+
+        case OPCODE_ABS:
+        case OPCODE_ABS + 1:
+            return "magnitude = " + parameter_value(opcode, parameter) + ";\n" +
+                "    var[" + b2 + "] = (magnitude & 0x8000) ? " +
+                "~magnitude + 1 : magnitude;";
+
+        // SET and FADE of a range of LEDs. The interpreter takes the value of
+        // the variable as uint8_t.
+        case OPCODE_SET:
+        case OPCODE_SET_I:
+        case OPCODE_FADE:
+        case OPCODE_FADE_I:
+            destination = (opcode <= OPCODE_SET_I) ?
+                    "env->light_setpoint" : "env->max_change_per_systick";
+            value = (opcode & 0x01) ? percent_to_uint8(b0).toString() :
+                    "percent_to_uint8((uint8_t)var[" + b0 + "])";
+
+            if (b1 === b2) {
+                return "if ((env->leds_already_used & " +
+                    hex(range_mask(b1, b2)) + ") == 0) " + destination + "[" +
+                    b1 + "] = " + value + ";";
+            }
+            return "set_leds(" + destination + ", " + hex(range_mask(b1, b2)) +
+                " & ~env->leds_already_used, " + value + ");";
+
+        case OPCODE_SET_MASK:
+        case OPCODE_SET_MASK_I:
+        case OPCODE_FADE_MASK:
+        case OPCODE_FADE_MASK_I:
+            mask = block.led_masks[index];
+            destination = (opcode <= OPCODE_SET_MASK_I) ?
+                    "env->light_setpoint" : "env->max_change_per_systick";
+            value = (opcode & 0x01) ? percent_to_uint8(b0).toString() :
+                    "percent_to_uint8((uint8_t)var[" + b0 + "])";
+
+            return "set_leds(" + destination + ", " + hex(mask) +
+                " & ~env->leds_already_used, " + value + ");";
+
+        case OPCODE_PATTERN:
+        case OPCODE_PATTERN_I:
+            table = pattern_tables[b2];
+            value = (opcode === OPCODE_PATTERN) ?
+                    "(uint16_t)var[" + b0 + "] % " + table.frames :
+                    (b0 % table.frames).toString();
+
+            return "set_pattern(env, " + b1 + ", " + table.width +
+                ", &pattern_table_" + b2 + "[(" + value + ") * " +
+                table.width + "]);";
+
+        case OPCODE_SLEEP:
+            return "c->timer = (uint16_t)" + parameter_value(opcode, parameter) +
+                " / 20;\n" +
+                "    c->resume = " + id + ";\n" +
+                "    return LIGHT_PROGRAM_SLEEP;";
+
+        case OPCODE_SLEEP_I:
+            return "c->timer = " + Math.floor(parameter / 20) + ";\n" +
+                "    c->resume = " + id + ";\n" +
+                "    return LIGHT_PROGRAM_SLEEP;";
+
+        case OPCODE_GOTO:
+            return "goto " + label(instruction & 0xffffff) + ";";
+
+        case OPCODE_CALL:
+            return "if (c->sp >= LIGHT_PROGRAM_STACK_DEPTH) " +
+                "return LIGHT_PROGRAM_ERROR;\n" +
+                "    c->stack[c->sp++] = " + id + ";\n" +
+                "    goto " + call(instruction & 0xffffff) + ";";
+
+        case OPCODE_RETURN:
+            return "if (c->sp == 0) return LIGHT_PROGRAM_ERROR;\n" +
+                "    c->resume = c->stack[--c->sp];\n" +
+                "    goto dispatch;";
+
+        case OPCODE_END_OF_PROGRAM:
+            return "c->resume = " + (id - 1) + ";\n" +
+                "    return LIGHT_PROGRAM_END;";
+
+        default:
+            return "return LIGHT_PROGRAM_ERROR;";
+        }
+    };
+
+
+    // *************************************************************************
+    // Add subroutine s and all subroutines it calls to the list of blocks of
+    // a program, assigning each block the resume point of its first
+    // instruction
+    var add_block = function (blocks, block) {
+        var i;
+        var opcode;
+        var base = 0;
+
+        for (i = 0; i < blocks.length; i += 1) {
+            if (blocks[i].block === block) {
+                return;
+            }
+            base = blocks[i].base + blocks[i].block.code.length;
+        }
+
+        blocks.push({"block": block, "base": base});
+
+        for (i = 0; i < block.code.length; i += 1) {
+            opcode = block.code[i] >>> 24;
+            if (opcode === OPCODE_CALL) {
+                add_block(blocks, subroutines[block.code[i] & 0xffffff]);
+            }
+        }
+    };
+
+
+    // *************************************************************************
+    var translate_program = function (program, number) {
+        var blocks = [];
+        var i;
+        var j;
+        var b;
+        var id = 0;
+        var returns = false;
+        var body = "";
+        var dispatch = "";
+        var label;
+        var call;
+
+        add_block(blocks, program);
+
+        call = function (subroutine) {
+            var k;
+            for (k = 0; k < blocks.length; k += 1) {
+                if (blocks[k].block === subroutines[subroutine]) {
+                    return "i" + blocks[k].base;
+                }
+            }
+        };
+
+        for (j = 0; j < blocks.length; j += 1) {
+            b = blocks[j];
+            label = (function (base) {
+                return function (index) {
+                    return "i" + (base + index);
+                };
+            }(b.base));
+
+            if (j > 0) {
+                body += "\n    // " + b.block.name + "\n";
+            }
+
+            for (i = 0; i < b.block.code.length; i += 1) {
+                id = b.base + i;
+                dispatch += "        case " + id + ": goto i" + id + ";\n";
+
+                if ((b.block.code[i] >>> 24) === OPCODE_RETURN) {
+                    returns = true;
+                }
+
+                body += "i" + id + ": STEP(" + id + ");\n    " +
+                    translate_instruction(b.block, i, label, id + 1, call) +
+                    "\n";
+            }
+        }
+
+        return "\n\n" +
+            "// ****************************************************************************\n" +
+            "// " + program.name + "\n" +
+            CODE_SECTION +
+            "static uint8_t light_program_" + number +
+            "(const LIGHT_PROGRAM_ENVIRONMENT_T *env, LIGHT_PROGRAM_CPU_T *c)\n" +
+            "{\n" +
+            ((body.indexOf("var[") >= 0) ? "    int16_t *var = env->var;\n" : "") +
+            "    int executed = 0;\n" +
+            ((body.indexOf("divisor") >= 0) ? "    int16_t divisor;\n" : "") +
+            ((body.indexOf("magnitude") >= 0) ? "    uint16_t magnitude;\n" : "") +
+            "\n" +
+            (returns ? "dispatch:\n" : "") +
+            "    switch (c->resume) {\n" +
+            dispatch +
+            "        default: return LIGHT_PROGRAM_ERROR;\n" +
+            "    }\n\n" +
+            body +
+            "}\n";
+    };
+
+
+    // *************************************************************************
+    // The C code of all programs, to be appended to the light programs
+    // data structure
+    var get_c_code = function () {
+        var i;
+        var s = "";
+        var functions = "";
+
+        for (i = 0; i < programs.length; i += 1) {
+            functions += translate_program(programs[i], i + 1);
+        }
+
+        s += "\n\n" +
+            "// Light programs compiled to native code\n" +
+            "\n" +
+            "// Execute one instruction, unless the program has used up its\n" +
+            "// instructions for this systick\n" +
+            "#define STEP(i) \\\n" +
+            "    if (++executed > MAX_INSTRUCTIONS_PER_SYSTICK) { \\\n" +
+            "        c->resume = (i); \\\n" +
+            "        return LIGHT_PROGRAM_YIELD; \\\n" +
+            "    }\n";
+
+        // Only output the helper functions that are used, as the firmware
+        // is built with warnings for unused functions
+        if (functions.indexOf("percent_to_uint8(") >= 0) {
+            s += "\n\n" +
+                "// ****************************************************************************\n" +
+                CODE_SECTION +
+                "static uint8_t percent_to_uint8(int percentage)\n" +
+                "{\n" +
+                "    if (percentage < 0) {\n" +
+                "        return 0;\n" +
+                "    }\n" +
+                "\n" +
+                "    if (percentage >= 100) {\n" +
+                "        return 255;\n" +
+                "    }\n" +
+                "\n" +
+                "    return percentage * 255 / 100;\n" +
+                "}\n";
+        }
+
+        if (functions.indexOf("set_leds(") >= 0) {
+            s += "\n\n" +
+                "// ****************************************************************************\n" +
+                CODE_SECTION +
+                "static void set_leds(uint8_t *destination, uint32_t mask, uint8_t value)\n" +
+                "{\n" +
+                "    int i;\n" +
+                "\n" +
+                "    for (i = 0; mask; i++, mask >>= 1) {\n" +
+                "        if (mask & 1) {\n" +
+                "            destination[i] = value;\n" +
+                "        }\n" +
+                "    }\n" +
+                "}\n";
+        }
+
+        if (functions.indexOf("set_pattern(") >= 0) {
+            s += "\n\n" +
+                "// ****************************************************************************\n" +
+                CODE_SECTION +
+                "static void set_pattern(const LIGHT_PROGRAM_ENVIRONMENT_T *env,\n" +
+                "    uint8_t first, uint8_t width, const uint8_t *frame)\n" +
+                "{\n" +
+                "    int i;\n" +
+                "\n" +
+                "    for (i = 0; i < width; i++) {\n" +
+                "        if ((env->leds_already_used & (1UL << (first + i))) == 0) {\n" +
+                "            env->light_setpoint[first + i] = frame[i];\n" +
+                "        }\n" +
+                "    }\n" +
+                "}\n";
+
+            s += "\n";
+            for (i = 0; i < pattern_tables.length; i += 1) {
+                s += "\n" + DATA_SECTION +
+                    "static const uint8_t pattern_table_" + i + "[] = {" +
+                    pattern_tables[i].values.join(", ") + "};\n";
+            }
+        }
+
+        s += functions;
+
+        s += "\n\n" + SECTION +
+            "const LIGHT_PROGRAM_FUNCTION_T native_light_programs[] = {\n";
+        for (i = 0; i < programs.length; i += 1) {
+            s += "    light_program_" + (i + 1) + ",\n";
+        }
+        s += "};\n";
+
+        return s;
+    };
+
+
+    // *************************************************************************
+    var add_subroutine = function (code, led_masks, name) {
+        parser.yy.logger.log(MODULE, "INFO", "add_subroutine(" + name + ")");
+        subroutines.push({"name": name, "code": code, "led_masks": led_masks});
+    };
+
+
+    // *************************************************************************
+    var add_program = function (code, led_masks, name) {
+        parser.yy.logger.log(MODULE, "INFO", "add_program(" + name + ")");
+        programs.push({"name": name, "code": code, "led_masks": led_masks});
+    };
+
+
+    // *************************************************************************
+    // bytes is the pattern table as stored in the bytecode: width, number of
+    // frames, followed by the brightness values of all frames
+    var add_pattern_table = function (bytes) {
+        pattern_tables.push({
+            "width": bytes[0],
+            "frames": bytes[1] || 1,
+            "values": bytes.slice(2)
+        });
+    };
+
+
+    // *************************************************************************
+    var reset = function () {
+        subroutines = [];
+        programs = [];
+        pattern_tables = [];
+    };
+
+
+    // *************************************************************************
+    var set_parser = function (p) {
+        parser = p;
+        reset();
+    };
+
+
+    // *************************************************************************
+    return {
+        set_parser: set_parser,
+        reset: reset,
+        add_subroutine: add_subroutine,
+        add_program: add_program,
+        add_pattern_table: add_pattern_table,
+        get_c_code: get_c_code
+    };
+})();
+
+if (typeof exports !== 'undefined') {
+    exports.native = native;
+}
@@ -0,0 +1,608 @@
+/*jslint bitwise: true, vars: true */
+
+// Optimization passes for the light program assembler.
+//
+// The optimizer works on the 32-bit instructions that the emitter generates
+// for a program or subroutine, after the GOTO targets have been resolved to
+// instruction indexes, and before they are encoded into the compact bytecode.
+//
+// All passes preserve the behaviour of the light program. Instructions
+// following a 'skip if' are never removed or combined with others, as that
+// would change which instruction the 'skip if' skips.
+
+var optimizer = (function () {
+    "use strict";
+
+    // Taken from globals.h of the light controller firmware:
+    var OPCODE_GOTO           = 0x01;
+    var OPCODE_SET            = 0x02;
+    var OPCODE_FADE_I         = 0x05;
+    var OPCODE_RETURN         = 0x0d;
+    var OPCODE_ASSIGN         = 0x10;
+    var OPCODE_ASSIGN_I       = 0x11;
+    var OPCODE_ADD_I          = 0x13;
+    var OPCODE_SUBTRACT_I     = 0x15;
+    var OPCODE_MULTIPLY_I     = 0x17;
+    var OPCODE_DIVIDE_I       = 0x19;
+    var OPCODE_AND_I          = 0x1b;
+    var OPCODE_OR_I           = 0x1d;
+    var OPCODE_XOR_I          = 0x1f;
+    var OPCODE_ABS            = 0x40;
+    var OPCODE_ABS_I          = 0x41;
+    var OPCODE_SET_MASK       = 0x48;
+    var OPCODE_FADE_MASK_I    = 0x4b;
+    var OPCODE_END_OF_PROGRAM = 0xfe;
+    var FIRST_SKIP_IF_OPCODE  = 0x20;
+    var LAST_SKIP_IF_OPCODE   = 0x37;
+    var OPCODE_SKIP_IF_ANY    = 0x60;    // 011 + 29 bits run_state!
+    var OPCODE_SKIP_IF_ALL    = 0x80;    // 100 + 29 bits run_state!
+    var OPCODE_SKIP_IF_NONE   = 0xA0;    // 101 + 29 bits run_state!
+
+    var PARAMETER_TYPE_VARIABLE = 0;
+    var PARAMETER_TYPE_RANDOM = 2;
+
+    var NUMBER_OF_LEDS = 32;
+    var MAX_ITERATIONS = 20;
+
+    var enabled = false;
+    var parser;
+
+    var MODULE = "OPTIMIZE";
+
+
+    // *************************************************************************
+    var is_skip_if = function (instruction) {
+        var opcode = instruction >>> 24;
+
+        if (opcode >= FIRST_SKIP_IF_OPCODE  &&  opcode <= LAST_SKIP_IF_OPCODE) {
+            return true;
+        }
+
+        return ((opcode & 0xe0) === OPCODE_SKIP_IF_ANY)  ||
+            ((opcode & 0xe0) === OPCODE_SKIP_IF_ALL)  ||
+                ((opcode & 0xe0) === OPCODE_SKIP_IF_NONE);
+    };
+
+
+    // *************************************************************************
+    // An instruction is conditional if it follows a 'skip if'
+    var is_conditional = function (code, i) {
+        return i > 0  &&  is_skip_if(code[i - 1].instruction);
+    };
+
+
+    // *************************************************************************
+    var is_terminal = function (instruction) {
+        var opcode = instruction >>> 24;
+
+        return opcode === OPCODE_END_OF_PROGRAM  ||  opcode === OPCODE_RETURN;
+    };
+
+
+    // *************************************************************************
+    // Returns the indexes of the instructions that can be executed after the
+    // instruction at code[i]
+    var successors = function (code, i) {
+        var instruction = code[i].instruction;
+        var opcode = instruction >>> 24;
+
+        if (is_terminal(instruction)) {
+            return [];
+        }
+
+        if (opcode === OPCODE_GOTO) {
+            return [instruction & 0xffffff];
+        }
+
+        if (is_skip_if(instruction)) {
+            return [i + 1, i + 2];
+        }
+
+        return [i + 1];
+    };
+
+
+    // *************************************************************************
+    var get_jump_targets = function (code) {
+        var i;
+        var targets = {};
+
+        for (i = 0; i < code.length; i += 1) {
+            if ((code[i].instruction >>> 24) === OPCODE_GOTO) {
+                targets[code[i].instruction & 0xffffff] = true;
+            }
+        }
+        return targets;
+    };
+
+
+    // *************************************************************************
+    // Remove the instructions flagged in remove[] and adjust the GOTO targets.
+    // A GOTO to a removed instruction continues at the next instruction that
+    // is kept.
+    var remove_instructions = function (code, remove) {
+        var i;
+        var result = [];
+        var new_index = [];
+        var opcode;
+
+        for (i = 0; i <= code.length; i += 1) {
+            new_index.push(result.length);
+            if (i < code.length  &&  !remove[i]) {
+                result.push(code[i]);
+            }
+        }
+
+        for (i = 0; i < result.length; i += 1) {
+            opcode = result[i].instruction >>> 24;
+            if (opcode === OPCODE_GOTO) {
+                result[i] = {
+                    "instruction": ((OPCODE_GOTO << 24) |
+                        new_index[result[i].instruction & 0xffffff]) >>> 0,
+                    "line": result[i].line
+                };
+            }
+        }
+
+        return result;
+    };
+
+
+    // *************************************************************************
+    // Returns the bit-field of LEDs of a SET or FADE instruction
+    var get_led_mask = function (entry) {
+        var opcode = entry.instruction >>> 24;
+        var start = (entry.instruction >> 8) & 0xff;
+        var stop = (entry.instruction >> 16) & 0xff;
+        var mask = 0;
+        var i;
+
+        if (opcode >= OPCODE_SET_MASK  &&  opcode <= OPCODE_FADE_MASK_I) {
+            return entry.mask;
+        }
+
+        for (i = start; i <= stop; i += 1) {
+            mask = (mask | (1 << i)) >>> 0;
+        }
+        return mask;
+    };
+
+
+    // *************************************************************************
+    // Returns SET, SET_I, FADE or FADE_I for all variants of SET and FADE,
+    // or undefined for all other instructions
+    var get_led_opcode = function (instruction) {
+        var opcode = instruction >>> 24;
+
+        if (opcode >= OPCODE_SET  &&  opcode <= OPCODE_FADE_I) {
+            return opcode;
+        }
+        if (opcode >= OPCODE_SET_MASK  &&  opcode <= OPCODE_FADE_MASK_I) {
+            return opcode - OPCODE_SET_MASK + OPCODE_SET;
+        }
+        return undefined;
+    };
+
+
+    // *************************************************************************
+    // Build a SET or FADE instruction for the LEDs in mask, using the variant
+    // with start and stop LED if the LEDs are consecutive
+    var make_led_instruction = function (opcode, value, mask) {
+        var start = 0;
+        var stop;
+        var range = 0;
+        var i;
+
+        while (!(mask & (1 << start))) {
+            start += 1;
+        }
+        stop = start;
+        while (stop < (NUMBER_OF_LEDS - 1)  &&  (mask & (1 << (stop + 1)))) {
+            stop += 1;
+        }
+        for (i = start; i <= stop; i += 1) {
+            range = (range | (1 << i)) >>> 0;
+        }
+
+        if (range === mask) {
+            return {
+                "instruction": ((opcode << 24) | (stop << 16) | (start << 8) |
+                    value) >>> 0
+            };
+        }
+
+        return {
+            "instruction": (((opcode - OPCODE_SET + OPCODE_SET_MASK) << 24) |
+                value) >>> 0,
+            "mask": mask
+        };
+    };
+
+
+    // *************************************************************************
+    var to_int16 = function (value) {
+        value &= 0xffff;
+        return (value >= 0x8000) ? (value - 0x10000) : value;
+    };
+
+
+    // *************************************************************************
+    // Calculate var <op>= immediate the same way as the firmware does.
+    // Returns undefined if the result can not be determined.
+    var fold = function (value, opcode, immediate) {
+        switch (opcode) {
+        case OPCODE_ADD_I:
+            return to_int16(value + immediate);
+        case OPCODE_SUBTRACT_I:
+            return to_int16(value - immediate);
+        case OPCODE_MULTIPLY_I:
+            return to_int16(Math.imul(value, immediate));
+        case OPCODE_DIVIDE_I:
+            if (immediate === 0) {
+                return 0x7fff;
+            }
+            return to_int16((value / immediate) | 0);
+        case OPCODE_AND_I:
+            return to_int16(value & immediate);
+        case OPCODE_OR_I:
+            return to_int16(value | immediate);
+        case OPCODE_XOR_I:
+            return to_int16(value ^ immediate);
+        default:
+            return undefined;
+        }
+    };
+
+
+    // *************************************************************************
+    // A GOTO to a GOTO is replaced by a GOTO to the final target. A GOTO to
+    // the end of the program (or the return of a subroutine) is replaced by
+    // the end itself.
+    var thread_jumps = function (code) {
+        var i;
+        var target;
+        var visited;
+        var changed = false;
+
+        for (i = 0; i < code.length; i += 1) {
+            if ((code[i].instruction >>> 24) !== OPCODE_GOTO) {
+                continue;
+            }
+
+            target = code[i].instruction & 0xffffff;
+            visited = {};
+            visited[i] = true;
+            while ((code[target].instruction >>> 24) === OPCODE_GOTO  &&
+                    !visited[target]) {
+                visited[target] = true;
+                target = code[target].instruction & 0xffffff;
+            }
+
+            if (is_terminal(code[target].instruction)) {
+                code[i] = {"instruction": code[target].instruction};
+                changed = true;
+            } else if (target !== (code[i].instruction & 0xffffff)) {
+                code[i] = {"instruction": ((OPCODE_GOTO << 24) | target) >>> 0};
+                changed = true;
+            }
+        }
+
+        return changed;
+    };
+
+
+    // *************************************************************************
+    // Remove instructions that can not be reached, e.g. code following an
+    // unconditional GOTO, and GOTOs to the next instruction. The last
+    // instruction (end of program or return) is always kept as tools use it
+    // to find the end of the program.
+    var remove_dead_code = function (code) {
+        var i;
+        var n;
+        var reachable = {};
+        var remove = {};
+        var pending = [0];
+        var changed = false;
+
+        while (pending.length > 0) {
+            i = pending.pop();
+            if (i < code.length  &&  !reachable[i]) {
+                reachable[i] = true;
+                pending = pending.concat(successors(code, i));
+            }
+        }
+
+        for (i = 0; i < code.length - 1; i += 1) {
+            if (!reachable[i]) {
+                remove[i] = true;
+                changed = true;
+            }
+        }
+
+        for (i = 0; i < code.length - 1; i += 1) {
+            if (remove[i]  ||  (code[i].instruction >>> 24) !== OPCODE_GOTO  ||
+                    is_conditional(code, i)) {
+                continue;
+            }
+
+            // GOTO to the next instruction that is kept
+            n = i + 1;
+            while (remove[n]) {
+                n += 1;
+            }
+            if ((code[i].instruction & 0xffffff) === n) {
+                remove[i] = true;
+                changed = true;
+            }
+        }
+
+        return {"changed": changed, "remove": remove};
+    };
+
+
+    // *************************************************************************
+    // Combine an assignment of an immediate with the following arithmetic
+    // operations on the same variable, turn 'abs' of an immediate into an
+    // assignment, and remove operations that don't change the variable.
+    var fold_constants = function (code) {
+        var i;
+        var a;
+        var b;
+        var opcode;
+        var value;
+        var targets = get_jump_targets(code);
+        var remove = {};
+        var changed = false;
+
+        for (i = 0; i < code.length; i += 1) {
+            b = code[i].instruction;
+            opcode = b >>> 24;
+            value = to_int16(b);
+
+            if (opcode === OPCODE_ABS_I) {
+                code[i] = {"instruction": ((OPCODE_ASSIGN_I << 24) |
+                    (b & 0x00ff0000) | (Math.abs(value) & 0xffff)) >>> 0};
+                changed = true;
+                continue;
+            }
+
+            if (opcode < OPCODE_ADD_I  ||  opcode > OPCODE_XOR_I  ||
+                    !(opcode & 0x01)) {
+                continue;
+            }
+
+            // Operations that leave the variable unchanged
+            if (!is_conditional(code, i)  &&
+                    ((value === 0  &&  (opcode === OPCODE_ADD_I  ||
+                        opcode === OPCODE_SUBTRACT_I  ||  opcode === OPCODE_OR_I  ||
+                        opcode === OPCODE_XOR_I))  ||
+                    (value === 1  &&  (opcode === OPCODE_MULTIPLY_I  ||
+                        opcode === OPCODE_DIVIDE_I))  ||
+                    (value === -1  &&  opcode === OPCODE_AND_I))) {
+                remove[i] = true;
+                changed = true;
+                continue;
+            }
+
+            if (i === 0  ||  remove[i - 1]  ||  targets[i]  ||
+                    is_conditional(code, i - 1)) {
+                continue;
+            }
+
+            a = code[i - 1].instruction;
+            if ((a >>> 24) !== OPCODE_ASSIGN_I  ||
+                    (a & 0x00ff0000) !== (b & 0x00ff0000)) {
+                continue;
+            }
+
+            code[i - 1] = {"instruction": ((a & 0xffff0000) |
+                (fold(to_int16(a), opcode, value) & 0xffff)) >>> 0};
+            remove[i] = true;
+            changed = true;
+        }
+
+        return {"changed": changed, "remove": remove};
+    };
+
+
+    // *************************************************************************
+    // Returns true if the parameter of an instruction reads the given
+    // variable, or has side effects (random numbers)
+    var reads_variable = function (instruction, variable) {
+        var type = (instruction >> 8) & 0xff;
+
+        if ((instruction >>> 24) & 0x01) {
+            return false;
+        }
+        return type === PARAMETER_TYPE_RANDOM  ||
+            (type === PARAMETER_TYPE_VARIABLE  &&
+                (instruction & 0xff) === variable);
+    };
+
+
+    // *************************************************************************
+    // Remove a store that is immediately overwritten: SET or FADE of LEDs
+    // that the next SET or FADE covers completely, and assignments to a
+    // variable that is assigned again by the next instruction.
+    var remove_redundant_stores = function (code) {
+        var i;
+        var a;
+        var b;
+        var variable;
+        var remove = {};
+        var changed = false;
+
+        for (i = 1; i < code.length; i += 1) {
+            if (remove[i - 1]  ||  is_conditional(code, i - 1)) {
+                continue;
+            }
+
+            a = code[i - 1].instruction;
+            b = code[i].instruction;
+
+            if (get_led_opcode(a) !== undefined  &&
+                    get_led_opcode(b) !== undefined  &&
+                    (get_led_opcode(a) & 0xfe) === (get_led_opcode(b) & 0xfe)) {
+                if (((get_led_mask(code[i - 1]) & ~get_led_mask(code[i])) >>> 0) === 0) {
+                    remove[i - 1] = true;
+                    changed = true;
+                }
+                continue;
+            }
+
+            variable = (a >> 16) & 0xff;
+            if (((a >>> 24) === OPCODE_ASSIGN  ||  (a >>> 24) === OPCODE_ASSIGN_I  ||
+                    (a >>> 24) === OPCODE_ABS  ||  (a >>> 24) === OPCODE_ABS_I)  &&
+                    ((b >>> 24) === OPCODE_ASSIGN  ||  (b >>> 24) === OPCODE_ASSIGN_I  ||
+                    (b >>> 24) === OPCODE_ABS  ||  (b >>> 24) === OPCODE_ABS_I)  &&
+                    ((b >> 16) & 0xff) === variable  &&
+                    !reads_variable(a, -1)  &&  !reads_variable(b, variable)) {
+                remove[i - 1] = true;
+                changed = true;
+            }
+        }
+
+        return {"changed": changed, "remove": remove};
+    };
+
+
+    // *************************************************************************
+    // Merge consecutive SET or FADE instructions that assign the same value
+    // into a single instruction
+    var merge_led_instructions = function (code) {
+        var i;
+        var a;
+        var b;
+        var targets = get_jump_targets(code);
+        var remove = {};
+        var changed = false;
+
+        for (i = 1; i < code.length; i += 1) {
+            if (remove[i - 1]  ||  targets[i]  ||  is_conditional(code, i - 1)) {
+                continue;
+            }
+
+            a = code[i - 1].instruction;
+            b = code[i].instruction;
+            if (get_led_opcode(a) === undefined  ||
+                    get_led_opcode(a) !== get_led_opcode(b)  ||
+                    (a & 0xff) !== (b & 0xff)) {
+                continue;
+            }
+
+            code[i] = make_led_instruction(get_led_opcode(a), a & 0xff,
+                (get_led_mask(code[i - 1]) | get_led_mask(code[i])) >>> 0);
+            remove[i - 1] = true;
+            changed = true;
+        }
+
+        return {"changed": changed, "remove": remove};
+    };
+
+
+    // *************************************************************************
+    // The passes replace instructions in place by new ones, which carry no
+    // source line. Restore the line of the instruction at the same position.
+    var get_lines = function (code) {
+        var i;
+        var lines = [];
+
+        for (i = 0; i < code.length; i += 1) {
+            lines.push(code[i].line);
+        }
+        return lines;
+    };
+
+    var restore_lines = function (code, lines) {
+        var i;
+
+        for (i = 0; i < code.length; i += 1) {
+            code[i].line = lines[i];
+        }
+    };
+
+
+    // *************************************************************************
+    // Optimize the instructions of a program or subroutine. led_masks holds
+    // the LED mask of SET and FADE instructions with mask, and lines the
+    // source line of each instruction, both indexed by the position of the
+    // instruction. Returns the new instructions, LED masks and source lines.
+    var optimize = function (instructions, led_masks, lines) {
+        var i;
+        var code = [];
+        var result;
+        var passes = [
+            remove_dead_code,
+            fold_constants,
+            remove_redundant_stores,
+            merge_led_instructions
+        ];
+        var changed = true;
+        var iterations = 0;
+
+        lines = lines || [];
+
+        if (!enabled) {
+            return {"code": instructions, "led_masks": led_masks, "lines": lines};
+        }
+
+        for (i = 0; i < instructions.length; i += 1) {
+            code.push({"instruction": instructions[i], "mask": led_masks[i],
+                "line": lines[i]});
+        }
+
+        while (changed  &&  iterations < MAX_ITERATIONS) {
+            lines = get_lines(code);
+            changed = thread_jumps(code);
+            restore_lines(code, lines);
+            for (i = 0; i < passes.length; i += 1) {
+                lines = get_lines(code);
+                result = passes[i](code);
+                restore_lines(code, lines);
+                if (result.changed) {
+                    code = remove_instructions(code, result.remove);
+                    changed = true;
+                }
+            }
+            iterations += 1;
+        }
+
+        parser.yy.logger.log(MODULE, "INFO", "Optimized " + instructions.length +
+            " into " + code.length + " instructions");
+
+        result = {"code": [], "led_masks": {}, "lines": []};
+        for (i = 0; i < code.length; i += 1) {
+            result.code.push(code[i].instruction);
+            result.lines.push(code[i].line);
+            if (code[i].mask !== undefined) {
+                result.led_masks[i] = code[i].mask;
+            }
+        }
+        return result;
+    };
+
+
+    // *************************************************************************
+    var set_enabled = function (value) {
+        enabled = value;
+    };
+
+
+    // *************************************************************************
+    var set_parser = function (p) {
+        parser = p;
+    };
+
+
+    // *************************************************************************
+    return {
+        set_parser: set_parser,
+        set_enabled: set_enabled,
+        successors: successors,
+        optimize: optimize
+    };
+})();
+
+if (typeof exports !== 'undefined') {
+    exports.optimizer = optimizer;
+}
@@ -42,8 +42,14 @@ parse_entity
   ;
 
 programs
+  : block
+  | programs block
+  ;
+
+block
   : program END NEWLINE
-  | programs program END NEWLINE
+  | subroutine END NEWLINE
+  | pattern_table END NEWLINE
   ;
 
 program
@@ -53,6 +59,59 @@ program
       { yy.emitter.emit_end_of_program(); }
   ;
 
+subroutine
+  : subroutine_line decleration_lines code_lines
+      { yy.emitter.emit_end_of_subroutine(); }
+  | subroutine_line code_lines
+      { yy.emitter.emit_end_of_subroutine(); }
+  ;
+
+subroutine_line
+  : SUB UNDECLARED_SYMBOL NEWLINE
+      { yy.emitter.emit_subroutine_start($2, @2); }
+  | SUB SUBROUTINE NEWLINE
+      { yy.emitter.yyerror("Redefinition of subroutine " + $2, {loc: @2});
+        yy.emitter.emit_subroutine_start($2, @2);
+      }
+  ;
+
+pattern_table
+  : pattern_table_line frame_lines
+      { yy.emitter.emit_end_of_pattern_table(); }
+  ;
+
+pattern_table_line
+  : PATTERN UNDECLARED_SYMBOL NEWLINE
+      { yy.emitter.emit_pattern_table_start($2, @2); }
+  | PATTERN PATTERN_TABLE NEWLINE
+      { yy.emitter.yyerror("Redefinition of pattern " + $2, {loc: @2});
+        yy.emitter.emit_pattern_table_start($2, @2);
+      }
+  ;
+
+frame_lines
+  : frame_line
+  | frame_lines frame_line
+  ;
+
+frame_line
+  : frame NEWLINE
+      { yy.emitter.add_pattern_frame(@1); }
+  | error NEWLINE
+  ;
+
+frame
+  : frame_value
+  | frame ',' frame_value
+  ;
+
+frame_value
+  : NUMBER
+      { yy.emitter.add_pattern_value($1); }
+  | NUMBER '%'
+      { yy.emitter.add_pattern_value($1); }
+  ;
+
 condition_lines
   : priority_run_condition_lines
       { yy.emitter.emit_run_condition($1, 0); }
@@ -60,6 +119,8 @@ condition_lines
       { yy.emitter.emit_run_condition(0, $1); }
   | run_always_condition_line
       { yy.emitter.emit_run_condition(0, $1); }
+  | event_lines
+      { yy.emitter.emit_run_condition(0, $1); }
   ;
 
 priority_run_condition_lines
@@ -107,6 +168,26 @@ run_always_condition_line
       { $$ = yy.symbols.get_symbol($2, "EXPECTING_RUN_CONDITION").opcode; }
   ;
 
+event_lines
+  : event_line
+  | event_lines event_line
+      { $$ = $1 | $2; }
+  ;
+
+event_line
+  : RUN ON events NEWLINE
+      { $$ = $3; }
+  ;
+
+events
+  : EVENT
+      { $$ = yy.symbols.get_symbol($1, "EXPECTING_EVENT").opcode; }
+  | events EVENT
+      { $$ = $1 | yy.symbols.get_symbol($2, "EXPECTING_EVENT").opcode; }
+  | events OR EVENT
+      { $$ = $1 | yy.symbols.get_symbol($3, "EXPECTING_EVENT").opcode; }
+  ;
+
 decleration_lines
   : decleration_line
   | decleration_lines decleration_line
@@ -195,6 +276,15 @@ command
           INSTRUCTION_MODIFIER_IMMEDIATE +
           (yy.symbols.get_symbol($4).opcode & 0xff), @1);
       }
+  | CALL SUBROUTINE
+      { yy.emitter.emit_call($2, @2); }
+  | CALL UNDECLARED_SYMBOL
+      { yy.emitter.yyerror("Subroutine '" + $2 + "' must be defined before it is called", {
+          loc: @2
+        });
+      }
+  | RETURN
+      { yy.emitter.emit_return(@1); }
   | SLEEP parameter
       { yy.emitter.emit(yy.symbols.get_reserved_word($1).opcode + $2, @1); }
   | SKIP IF test_expression
@@ -253,15 +343,29 @@ expression
   : VARIABLE assignment_operator parameter
       { yy.emitter.emit(
           yy.symbols.get_reserved_word($2).opcode +
-          (yy.symbols.get_symbol($1).opcode * 65536) + $3);
+          (yy.symbols.get_symbol($1).opcode * 65536) + $3, @1);
       }
   | GLOBAL_VARIABLE assignment_operator parameter
       { yy.emitter.emit(
           yy.symbols.get_reserved_word($2).opcode +
-          (yy.symbols.get_symbol($1).opcode * 65536) | $3);
+          (yy.symbols.get_symbol($1).opcode * 65536) | $3, @1);
     }
   | leds '=' led_assignment_parameter
       { yy.emitter.emit_led_instruction(0x02000000 + $3, @1); }
+  | leds '=' PATTERN_TABLE '[' pattern_frame ']'
+      { yy.emitter.emit_pattern_instruction($3, $5, @3); }
+  ;
+
+pattern_frame
+  : NUMBER
+      /* All opcodes that work with immediates have the lowest bit set */
+      { $$ = INSTRUCTION_MODIFIER_IMMEDIATE + (Number($1) & 0xff); }
+  | CONSTANT
+      { $$ = INSTRUCTION_MODIFIER_IMMEDIATE + (yy.symbols.get_symbol($1).opcode & 0xff); }
+  | VARIABLE
+      { $$ = yy.symbols.get_symbol($1).opcode; }
+  | GLOBAL_VARIABLE
+      { $$ = yy.symbols.get_symbol($1).opcode; }
   ;
 
 leds
@@ -3,9 +3,31 @@
 var symbols = (function () {
     "use strict";
 
+    var MAX_LIGHT_PROGRAM_VARIABLES = 100;
+
+    // Groups of run conditions of which exactly one is set at any time. Two
+    // normal programs whose run conditions are different parts of the same
+    // group can never run at the same time, so their local variables can
+    // share storage in var[] of the firmware.
+    var EXCLUSIVE_RUN_CONDITIONS = [
+        0x000001ff,     // light-switch-position-0..8
+        0x00000e00      // neutral, forward, reversing
+    ];
+
     var symbol_table = [];
     var forward_declaration_table = [];
-    var next_variable_index = 0;
+
+    // For each slot of var[] the run conditions of the programs whose local
+    // variables use it, or null if it can not be shared
+    var variable_slots = [];
+    var variables_declared = 0;
+
+    // Run condition of the current program, null for subroutines
+    var run_condition = null;
+    var pending_variables = [];
+    var variable_window = null;
+    var variable_windows = [];
+    var variable_sharing = true;
     var leds_used = 0;
     var number_of_light_switch_positions = 0;
 
@@ -53,6 +75,20 @@ var symbols = (function () {
         "gear-changed": {"token": "PRIORITY_RUN_CONDITION", "opcode": (1 << 7)}
     };
 
+    // Events that start a program declared with "run on <event>". They use
+    // bits 23..30 of the run condition word, see LIGHT_PROGRAM_EVENT_T in
+    // globals.h of the firmware.
+    var event_tokens = {
+        "gear-changed": {"token": "EVENT", "opcode": (1 << 23)},
+        "light-switch-up": {"token": "EVENT", "opcode": (1 << 24)},
+        "light-switch-down": {"token": "EVENT", "opcode": (1 << 25)},
+        "clicks": {"token": "EVENT", "opcode": (1 << 26)},
+        "hazard-on": {"token": "EVENT", "opcode": (1 << 27)},
+        "hazard-off": {"token": "EVENT", "opcode": (1 << 28)},
+        "winch-started": {"token": "EVENT", "opcode": (1 << 29)},
+        "signal-recovered": {"token": "EVENT", "opcode": (1 << 30)}
+    };
+
     var car_state_tokens = {
         "light-switch-position-0": {"token": "CAR_STATE", "opcode": (1 << 0)},
         "light-switch-position-1": {"token": "CAR_STATE", "opcode": (1 << 1)},
@@ -115,6 +151,10 @@ var symbols = (function () {
         "abs": {"token": "ABS", "opcode": 0x40000000},
         "end": {"token": "END", "opcode": 0xfe000000},
         "use": {"token": "USE"},
+        "sub": {"token": "SUB"},
+        "call": {"token": "CALL", "opcode": 0x0c000000},
+        "return": {"token": "RETURN", "opcode": 0x0d000000},
+        "pattern": {"token": "PATTERN"},
 
         "=": {"token": "=", "opcode": 0x10000000},
         ">": {"token": "GT", "opcode": 0x2c000000},
@@ -209,14 +249,148 @@ var symbols = (function () {
 
         forward_declaration_table = [];
 
+        if (run_condition !== null) {
+            variable_windows.push(variable_window);
+        }
+        run_condition = null;
+        variable_window = null;
+        pending_variables = [];
+
+        // Global variables, subroutines and pattern tables are shared by all
+        // programs
         for (i = symbol_table.length - 1; i >= 0; i -= 1) {
-            if (symbol_table[i].token !== "GLOBAL_VARIABLE") {
+            if (symbol_table[i].token !== "GLOBAL_VARIABLE"  &&
+                    symbol_table[i].token !== "SUBROUTINE"  &&
+                    symbol_table[i].token !== "PATTERN_TABLE") {
                 symbol_table.splice(i, 1);
             }
         }
     };
 
 
+    // *************************************************************************
+    // Returns true if the programs with the given run conditions can never
+    // run at the same time. Priority programs run together with the normal
+    // programs, subroutines (null) are called by any program.
+    var are_exclusive = function (a, b) {
+        var i, group;
+
+        if (a === null  ||  b === null  ||  a.priority  ||  b.priority  ||
+                !a.run  ||  !b.run  ||  (a.run & b.run)) {
+            return false;
+        }
+
+        for (i = 0; i < EXCLUSIVE_RUN_CONDITIONS.length; i += 1) {
+            group = EXCLUSIVE_RUN_CONDITIONS[i];
+            if (!(a.run & ~group)  &&  !(b.run & ~group)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+
+    // *************************************************************************
+    // Returns true if the slot of var[] at index can hold a local variable
+    // of a program with the given run condition
+    var is_slot_available = function (index, condition) {
+        var i;
+        var users = variable_slots[index];
+
+        if (index >= variable_slots.length) {
+            return true;
+        }
+        if (users === null) {
+            return false;
+        }
+
+        for (i = 0; i < users.length; i += 1) {
+            if (!are_exclusive(users[i], condition)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+
+    // *************************************************************************
+    // Add a slot at the end of var[]. A condition of null means the slot can
+    // not be shared with other programs.
+    var allocate_slot = function (condition, location) {
+        var index = variable_slots.length;
+
+        if (index === MAX_LIGHT_PROGRAM_VARIABLES) {
+            parser.yy.emitter.yyerror("Too many variables (maximum is " +
+                MAX_LIGHT_PROGRAM_VARIABLES + ")", {
+                    loc: location
+                });
+        }
+
+        variable_slots.push(condition === null ? null : [condition]);
+        return index;
+    };
+
+
+    // *************************************************************************
+    // Allocate the local variables of the current program once they are
+    // declared, i.e. when the first of them is used. They occupy a window of
+    // consecutive slots in var[], so that the firmware can clear them when
+    // the program starts. The window may overlap with the windows of
+    // programs that can never run at the same time.
+    var allocate_local_variables = function () {
+        var i, index;
+        var count = pending_variables.length;
+        var base = variable_slots.length;
+        var shareable = (variable_sharing  &&  run_condition !== null  &&
+            variable_window === null);
+        var fits = function (start) {
+            var j;
+            for (j = 0; j < count; j += 1) {
+                if (!is_slot_available(start + j, run_condition)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        if (shareable) {
+            base = 0;
+            while (!fits(base)) {
+                base += 1;
+            }
+            variable_window = {"base": base, "count": count};
+        }
+
+        for (i = 0; i < count; i += 1) {
+            index = base + i;
+            if (index < variable_slots.length) {
+                variable_slots[index].push(run_condition);
+            } else {
+                allocate_slot(shareable ? run_condition : null,
+                    pending_variables[i].location);
+            }
+            pending_variables[i].symbol.opcode = index;
+
+            parser.yy.logger.log(MODULE, "INFO", "Variable '" +
+                pending_variables[i].symbol.name + "' at var[" + index + "]");
+        }
+
+        pending_variables = [];
+    };
+
+
+    // *************************************************************************
+    var set_variable_sharing = function (enabled) {
+        variable_sharing = enabled;
+    };
+
+
+    // *************************************************************************
+    var set_run_condition = function (priority_run_condition, run) {
+        run_condition = {"priority": priority_run_condition, "run": run};
+    };
+
+
     // *************************************************************************
     var set_symbol = function (name, token, opcode, location) {
         var i, s;
@@ -248,6 +422,10 @@ var symbols = (function () {
             return run_condition_tokens[name] || undeclared_symbol;
         }
 
+        if (parse_state === "EXPECTING_EVENT") {
+            return event_tokens[name] || undeclared_symbol;
+        }
+
         if (parse_state === "EXPECTING_CAR_STATE") {
             check_for_light_switch_position(name);
             return car_state_tokens[name] || undeclared_symbol;
@@ -262,6 +440,9 @@ var symbols = (function () {
             }
 
             if (s.name === name) {
+                if (s.token === "VARIABLE"  &&  s.opcode === -1) {
+                    allocate_local_variables();
+                }
                 if (s.token === "LABEL") {
                     if (s.opcode === -1) {
                         add_forward_declaration(s, parser.yy.emitter.pc(), location);
@@ -300,10 +481,17 @@ var symbols = (function () {
         };
 
         if (token === "GLOBAL_VARIABLE"  ||  token === "VARIABLE") {
-            if (opcode === -1) {
-                new_symbol.opcode = next_variable_index;
-                next_variable_index += 1;
-            }
+            variables_declared += 1;
+        }
+
+        if (token === "GLOBAL_VARIABLE"  &&  opcode === -1) {
+            new_symbol.opcode = allocate_slot(null, location);
+        }
+
+        // Local variables are allocated once all of them are declared, see
+        // allocate_local_variables()
+        if (token === "VARIABLE"  &&  opcode === -1) {
+            pending_variables.push({"symbol": new_symbol, "location": location});
         }
 
         if (token === "LED_ID") {
@@ -336,6 +524,22 @@ var symbols = (function () {
     };
 
 
+    // *************************************************************************
+    // Returns true if a label of the current program points to the
+    // instruction at pc
+    var is_label = function (pc) {
+        var i;
+
+        for (i = 0; i < symbol_table.length; i += 1) {
+            if (symbol_table[i].token === "LABEL"  &&
+                    symbol_table[i].opcode === pc) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+
     // *************************************************************************
     var get_leds_used = function () {
         return leds_used;
@@ -354,11 +558,36 @@ var symbols = (function () {
     };
 
 
+    // *************************************************************************
+    // Returns for each program the window of var[] holding its local
+    // variables, or null if it has none. Every program clears its window
+    // when it starts, whether or not it shares slots with other programs.
+    var get_variable_windows = function () {
+        return variable_windows.slice();
+    };
+
+
+    // *************************************************************************
+    // Number of slots of var[] used, and the number needed if every declared
+    // variable had its own slot
+    var get_variable_statistics = function () {
+        return {
+            "slots": variable_slots.length,
+            "variables": variables_declared
+        };
+    };
+
+
     // *************************************************************************
     var reset = function () {
         symbol_table = [];
         forward_declaration_table = [];
-        next_variable_index = 0;
+        variable_slots = [];
+        variables_declared = 0;
+        run_condition = null;
+        pending_variables = [];
+        variable_window = null;
+        variable_windows = [];
         leds_used = 0;
         number_of_light_switch_positions = 0;
 
@@ -367,10 +596,8 @@ var symbols = (function () {
             parser.yy.parse_state = "UNKNOWN_PARSE_STATE";
         }
 
-        add_symbol("clicks", "GLOBAL_VARIABLE", next_variable_index);
-        next_variable_index += 1;
-        add_symbol("light-switch-position", "GLOBAL_VARIABLE", next_variable_index);
-        next_variable_index += 1;
+        add_symbol("clicks", "GLOBAL_VARIABLE", -1);
+        add_symbol("light-switch-position", "GLOBAL_VARIABLE", -1);
     };
 
 
@@ -387,9 +614,14 @@ var symbols = (function () {
         add_symbol: add_symbol,
         get_symbol: get_symbol,
         set_symbol: set_symbol,
+        is_label: is_label,
         get_reserved_word: get_reserved_word,
         get_number_of_light_switch_positions: get_number_of_light_switch_positions,
         set_leds_used: set_leds_used,
+        set_run_condition: set_run_condition,
+        set_variable_sharing: set_variable_sharing,
+        get_variable_windows: get_variable_windows,
+        get_variable_statistics: get_variable_statistics,
         get_leds_used: get_leds_used,
         get_forward_declerations: get_forward_declerations,
         remove_local_symbols: remove_local_symbols,
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# Assemble all test cases that are expected to pass with and without -O,
+# and report the number of instructions and bytes per program.
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+logfile="test.log"
+logfile2="test2.log"
+dut=$1
+
+total_before=0
+total_after=0
+total_bytes_before=0
+total_bytes_after=0
+
+
+run_test() {
+    testcase=$1
+    echo "Running test ${testcase##$DIR/} ..."
+    $dut -s $testcase 2>$logfile >/dev/null || return 1
+    $dut -s -O $testcase 2>$logfile2 >/dev/null || return 1
+
+    # The assembler also prints warnings to stderr; keep only the statistics
+    statistics $logfile
+    statistics $logfile2
+}
+
+
+# Statistics lines look like this:
+#   Program 1: 12 instructions, 39 bytes (48 bytes with 32-bit instructions)
+statistics() {
+    grep -E '^[^:]+: [0-9]+ instructions, ' $1 >$1.tmp
+    mv $1.tmp $1
+}
+
+
+report() {
+    while IFS=: read -r name before && IFS=: read -r name2 after <&3
+    do
+        if [ "$name" == "Total" ]  ||  [ "$name" == "Variables" ]; then
+            continue
+        fi
+
+        set -- $before
+        i1=$1
+        b1=$3
+        set -- $after
+        i2=$1
+        b2=$3
+
+        echo "    $name: $i1 -> $i2 instructions, $b1 -> $b2 bytes"
+
+        total_before=$((total_before + i1))
+        total_after=$((total_after + i2))
+        total_bytes_before=$((total_bytes_before + b1))
+        total_bytes_after=$((total_bytes_after + b2))
+
+        if [ $b2 -gt $b1 ]; then
+            echo "ERROR: optimized $name is larger"
+            return 1
+        fi
+    done <$logfile 3<$logfile2
+}
+
+
+run_all_tests() {
+    for t in $DIR/passes/*
+    do
+        run_test $t
+        if [ $? -ne 0 ]; then
+            echo "ERROR: Test $t failed. Refer to $logfile and $logfile2"
+            exit 1
+        fi
+
+        report
+        if [ $? -ne 0 ]; then
+            exit 1
+        fi
+    done
+
+    echo "Total: $total_before -> $total_after instructions," \
+        "$total_bytes_before -> $total_bytes_after bytes"
+
+    rm -f $logfile $logfile2
+}
+
+
+run_all_tests
@@ -0,0 +1,284 @@
+/*jslint bitwise: true, vars: true */
+
+// Worst-case execution analysis of light programs.
+//
+// The firmware executes at most MAX_INSTRUCTIONS_PER_SYSTICK instructions of
+// each light program per systick. A program that executes more instructions
+// before it yields (sleep, end of program) is interrupted and continues in the
+// next systick, which changes its timing.
+//
+// For each program and subroutine the analysis walks the control flow graph
+// and determines the maximum number of instructions that can execute between
+// two yield points. Subroutines are summarized so that a CALL costs what the
+// subroutine costs. Loops that don't contain a sleep are unbounded.
+
+var wcet = (function () {
+    "use strict";
+
+    // Must match globals.h of the light controller firmware
+    var MAX_INSTRUCTIONS_PER_SYSTICK = 30;
+
+    // Taken from globals.h of the light controller firmware:
+    var OPCODE_GOTO           = 0x01;
+    var OPCODE_SLEEP          = 0x06;
+    var OPCODE_SLEEP_I        = 0x07;
+    var OPCODE_CALL           = 0x0c;
+    var OPCODE_RETURN         = 0x0d;
+    var OPCODE_END_OF_PROGRAM = 0xfe;
+    var FIRST_SKIP_IF_OPCODE  = 0x20;
+    var LAST_SKIP_IF_OPCODE   = 0x37;
+    var OPCODE_SKIP_IF_ANY    = 0x60;    // 011 + 29 bits run_state!
+    var OPCODE_SKIP_IF_ALL    = 0x80;    // 100 + 29 bits run_state!
+    var OPCODE_SKIP_IF_NONE   = 0xA0;    // 101 + 29 bits run_state!
+
+    var NONE = -Infinity;       // No such path
+    var UNBOUNDED = Infinity;   // Loop without yield
+
+    var ACTIVE = 1;
+    var DONE = 2;
+
+    var subroutines = [];
+    var programs = [];
+    var warnings = [];
+
+    var parser;
+
+    var MODULE = "WCET";
+
+
+    // *************************************************************************
+    var is_skip_if = function (opcode) {
+        if (opcode >= FIRST_SKIP_IF_OPCODE  &&  opcode <= LAST_SKIP_IF_OPCODE) {
+            return true;
+        }
+
+        return ((opcode & 0xe0) === OPCODE_SKIP_IF_ANY)  ||
+            ((opcode & 0xe0) === OPCODE_SKIP_IF_ALL)  ||
+                ((opcode & 0xe0) === OPCODE_SKIP_IF_NONE);
+    };
+
+
+    // *************************************************************************
+    // Length of a path that consists of two parts. If one part does not
+    // exist then neither does the whole path.
+    var add = function (a, b) {
+        if (a === NONE  ||  b === NONE) {
+            return NONE;
+        }
+        return a + b;
+    };
+
+
+    // *************************************************************************
+    // Analyze the instructions of a program or subroutine. For every
+    // instruction i, cost[i].yield is the maximum number of instructions
+    // executed from i until the program yields, and cost[i].exit the maximum
+    // number of instructions until the subroutine returns without yielding.
+    var analyze_code = function (code) {
+        var state = [];
+        var cost = [];
+        var resume = {"yield": NONE, "exit": NONE};
+        var entry;
+        var i;
+
+        var evaluate = function (i) {
+            var opcode;
+            var next;
+            var skip;
+            var sub;
+            var result;
+
+            if (i >= code.length) {
+                return {"yield": NONE, "exit": NONE};
+            }
+            if (state[i] === DONE) {
+                return cost[i];
+            }
+            if (state[i] === ACTIVE) {
+                return {"yield": UNBOUNDED, "exit": UNBOUNDED};
+            }
+            state[i] = ACTIVE;
+
+            opcode = code[i] >>> 24;
+
+            if (opcode === OPCODE_SLEEP  ||  opcode === OPCODE_SLEEP_I  ||
+                    opcode === OPCODE_END_OF_PROGRAM) {
+                result = {"yield": 1, "exit": NONE};
+            } else if (opcode === OPCODE_RETURN) {
+                result = {"yield": NONE, "exit": 1};
+            } else if (opcode === OPCODE_GOTO) {
+                next = evaluate(code[i] & 0xffffff);
+                result = {"yield": add(1, next.yield), "exit": add(1, next.exit)};
+            } else if (is_skip_if(opcode)) {
+                next = evaluate(i + 1);
+                skip = evaluate(i + 2);
+                result = {
+                    "yield": add(1, Math.max(next.yield, skip.yield)),
+                    "exit": add(1, Math.max(next.exit, skip.exit))
+                };
+            } else if (opcode === OPCODE_CALL) {
+                sub = subroutines[code[i] & 0xffffff];
+                next = evaluate(i + 1);
+                result = {
+                    "yield": add(1, Math.max(sub.yield, add(sub.exit, next.yield))),
+                    "exit": add(1, add(sub.exit, next.exit))
+                };
+            } else {
+                next = evaluate(i + 1);
+                result = {"yield": add(1, next.yield), "exit": add(1, next.exit)};
+            }
+
+            state[i] = DONE;
+            cost[i] = result;
+            return result;
+        };
+
+        entry = evaluate(0);
+
+        // Points where execution resumes in a later systick: after a sleep,
+        // at the end of the program, and after a subroutine that yields
+        for (i = 0; i < code.length; i += 1) {
+            var opcode = code[i] >>> 24;
+            var r = null;
+            var next;
+            var sub;
+
+            if (opcode === OPCODE_SLEEP  ||  opcode === OPCODE_SLEEP_I) {
+                r = evaluate(i + 1);
+            } else if (opcode === OPCODE_END_OF_PROGRAM) {
+                r = {"yield": 1, "exit": NONE};
+            } else if (opcode === OPCODE_CALL) {
+                sub = subroutines[code[i] & 0xffffff];
+                next = evaluate(i + 1);
+                r = {
+                    "yield": Math.max(sub.resume.yield,
+                        add(sub.resume.exit, next.yield)),
+                    "exit": add(sub.resume.exit, next.exit)
+                };
+            }
+
+            if (r !== null) {
+                resume.yield = Math.max(resume.yield, r.yield);
+                resume.exit = Math.max(resume.exit, r.exit);
+            }
+        }
+
+        return {"entry": entry, "resume": resume};
+    };
+
+
+    // *************************************************************************
+    var describe = function (instructions) {
+        if (instructions === UNBOUNDED) {
+            return "a loop without 'sleep'";
+        }
+        return "up to " + instructions + " instructions without 'sleep'";
+    };
+
+
+    // *************************************************************************
+    // Analyze a subroutine. Subroutines must be analyzed in the order they
+    // are emitted, as CALL refers to them by their index.
+    var analyze_subroutine = function (code, name) {
+        var result = analyze_code(code);
+
+        subroutines.push({
+            "name": name,
+            "yield": result.entry.yield,
+            "exit": result.entry.exit,
+            "resume": result.resume
+        });
+    };
+
+
+    // *************************************************************************
+    var analyze_program = function (code, name, location) {
+        var result = analyze_code(code);
+        var worst = Math.max(result.entry.yield, result.resume.yield);
+
+        parser.yy.logger.log(MODULE, "INFO", name + ": worst case " + worst);
+
+        programs.push({
+            "name": name,
+            "instructions": worst
+        });
+
+        if (worst > MAX_INSTRUCTIONS_PER_SYSTICK) {
+            warnings.push({
+                str: name + " contains " + describe(worst) +
+                    ". The light controller executes only " +
+                    MAX_INSTRUCTIONS_PER_SYSTICK +
+                    " instructions per program and systick, the program " +
+                    "continues in the next systick.",
+                hash: {loc: location}
+            });
+        }
+    };
+
+
+    // *************************************************************************
+    // Worst-case number of instructions per systick of each program, and of
+    // all programs together
+    var get_report = function () {
+        var i;
+        var p;
+        var per_systick;
+        var total = 0;
+        var lines = [
+            "Worst-case instructions per systick (limit " +
+                MAX_INSTRUCTIONS_PER_SYSTICK + " per program):"
+        ];
+
+        for (i = 0; i < programs.length; i += 1) {
+            p = programs[i];
+            per_systick = Math.min(p.instructions, MAX_INSTRUCTIONS_PER_SYSTICK);
+            total += per_systick;
+
+            lines.push(p.name + ": " + per_systick +
+                ((p.instructions > MAX_INSTRUCTIONS_PER_SYSTICK) ?
+                        (" (" + describe(p.instructions) + ")") : ""));
+        }
+
+        lines.push("Total: " + total + " instructions per systick for " +
+            programs.length + " programs (maximum " +
+            (programs.length * MAX_INSTRUCTIONS_PER_SYSTICK) + ")");
+
+        return lines.join("\n");
+    };
+
+
+    // *************************************************************************
+    var get_warnings = function () {
+        return warnings;
+    };
+
+
+    // *************************************************************************
+    var reset = function () {
+        subroutines = [];
+        programs = [];
+        warnings = [];
+    };
+
+
+    // *************************************************************************
+    var set_parser = function (p) {
+        parser = p;
+        reset();
+    };
+
+
+    // *************************************************************************
+    return {
+        set_parser: set_parser,
+        reset: reset,
+        analyze_subroutine: analyze_subroutine,
+        analyze_program: analyze_program,
+        get_report: get_report,
+        get_warnings: get_warnings
+    };
+})();
+
+if (typeof exports !== 'undefined') {
+    exports.wcet = wcet;
+}
@@ -16,6 +16,7 @@
     var directives = {
       "abs": "operator",
       "all": "qualifier",
+      "call": "keyword",
       "const": "def",
       "clicks": "built-in",
       "end": "keyword",
@@ -28,13 +29,16 @@
       "leds": "qualifier",
       "master": "qualifier",
       "or": "keyword",
+      "pattern": "def",
       "random": "built-in",
+      "return": "keyword",
       "run": "keyword",
       "skip": "keyword",
       "slave": "qualifier",
       "sleep": "keyword",
       "steering": "built-in",
       "stepsize": "keyword",
+      "sub": "def",
       "throttle": "built-in",
       "use": "keyword",
       "var": "def",
@@ -43,6 +47,7 @@
 
     var run_state_directives = {
       "always": "attribute",
+      "on": "keyword",
       "when": "keyword",
     };
 
@@ -81,6 +86,18 @@
       "winch-out": "attribute",
     };
 
+    var event_directives = {
+      "clicks": "attribute",
+      "gear-changed": "attribute",
+      "hazard-off": "attribute",
+      "hazard-on": "attribute",
+      "light-switch-down": "attribute",
+      "light-switch-up": "attribute",
+      "or": "keyword",
+      "signal-recovered": "attribute",
+      "winch-started": "attribute",
+    };
+
     var skip_if_directives_multiple = {
       "any": "keyword",
       "all": "keyword",
@@ -189,6 +206,26 @@
     }
 
 
+    // ***************************************************************************
+    function run_event(stream, state) {
+      var style, cur, ch;
+
+      ch = stream.next();
+
+      if (/[\w\-_]/.test(ch)) {
+        stream.eatWhile(/[\w\-_]/);
+        cur = stream.current();
+        style = event_directives[cur];
+        if (style) {
+          return style;
+        }
+      }
+
+      state.tokenize = anything_is_error;
+      return 'error';
+    }
+
+
     // ***************************************************************************
     function run_state(stream, state) {
       var style, cur, ch;
@@ -201,6 +238,8 @@
         style = run_state_directives[cur];
         if (cur === "when") {
           state.tokenize = run_condition;
+        } else if (cur === "on") {
+          state.tokenize = run_event;
         } else {
           state.tokenize = anything_is_error;
         }
@@ -331,7 +370,8 @@
         if (cur === "skip") {
           state.tokenize = skip;
         }
-        if (cur === "goto") {
+        if (cur === "goto"  ||  cur === "call"  ||  cur === "sub"  ||
+            cur === "pattern") {
           state.tokenize = goto_state;
         }
         style = directives[cur];
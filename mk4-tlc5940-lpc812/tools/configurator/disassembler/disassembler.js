@@ -7,6 +7,10 @@ var disassembler = (function () {
     var MAX_NUMBER_OF_INSTRUCTIONS = 16 * 1024 / 4;
     var NUMBER_OF_LEDS = 32;
 
+    // Firmware images built before the compact bytecode store one 32-bit
+    // word per instruction, which is what the disassembler works on
+    var LEGACY_LIGHT_PROGRAMS_VERSION = 1;
+
     var asm = [];
     (function initialize_asm() {
         var i;
@@ -18,8 +22,12 @@ var disassembler = (function () {
     var leds_used = 0;
     var leds_to_declare_offset;
     var variables = {};
+    var local_variables = {};
+    var variable_window = {'base': 0, 'count': 0};
     var var_offsets = [];
-    var current_program = 1;
+    var current_program = 0;
+    var pattern_tables = [];
+    var led_masks = [];
 
     var offset = 0;
     var pc = 0;
@@ -58,6 +66,27 @@ var disassembler = (function () {
         "XOR": 0x1e,
         "XOR_I": 0x1f,
         "ABS": 0x40,                // VAR = |VAR| (steering, throttle)
+        "ABS_I": 0x41,
+        "SET_MASK": 0x48,           // SET and FADE with 32-bit LED mask
+        "SET_MASK_I": 0x49,
+        "FADE_MASK": 0x4a,
+        "FADE_MASK_I": 0x4b,
+        "SET_LED": 0x08,            // Short forms for a single LED
+        "SET_LED_I": 0x09,
+        "FADE_LED": 0x0a,
+        "FADE_LED_I": 0x0b,
+        "CALL": 0x0c,
+        "RETURN": 0x0d,
+        "PATTERN": 0x0e,
+        "PATTERN_I": 0x0f,
+        "ASSIGN_S": 0x50,           // Short forms with int8_t immediate
+        "ADD_S": 0x51,
+        "SUBTRACT_S": 0x52,
+        "MULTIPLY_S": 0x53,
+        "DIVIDE_S": 0x54,
+        "AND_S": 0x55,
+        "OR_S": 0x56,
+        "XOR_S": 0x57,
         "SKIP_IF_EQ_V": 0x20,       // ==       var, type, id
         "SKIP_IF_EQ_VI": 0x21,      // ==       var, immediate
         "SKIP_IF_EQ_L": 0x22,       // ==       led, type, id
@@ -82,6 +111,8 @@ var disassembler = (function () {
         "SKIP_IF_LT_VI": 0x35,      // >        var, immediate
         "SKIP_IF_LT_L": 0x36,       // >        led, type, id
         "SKIP_IF_LT_LI": 0x37,      // >        led, immediate
+        "PATTERN_TABLE": 0xfc,
+        "SUBROUTINE": 0xfd,
         "END_OF_PROGRAM": 0xfe,
         "END_OF_PROGRAMS": 0xff
     };
@@ -136,6 +167,15 @@ var disassembler = (function () {
     var RUN_WHEN_WINCH_IN                   = (1 << 21);
     var RUN_WHEN_WINCH_OUT                  = (1 << 22);
 
+    var RUN_ON_GEAR_CHANGED                 = (1 << 23);
+    var RUN_ON_LIGHT_SWITCH_UP              = (1 << 24);
+    var RUN_ON_LIGHT_SWITCH_DOWN            = (1 << 25);
+    var RUN_ON_CLICKS                       = (1 << 26);
+    var RUN_ON_HAZARD_ON                    = (1 << 27);
+    var RUN_ON_HAZARD_OFF                   = (1 << 28);
+    var RUN_ON_WINCH_STARTED                = (1 << 29);
+    var RUN_ON_SIGNAL_RECOVERED             = (1 << 30);
+
     var RUN_ALWAYS                          = 0x80000000;
 
     var CAR_STATE_LIGHT_SWITCH_POSITION_0   = (1 << 0);
@@ -175,11 +215,24 @@ var disassembler = (function () {
         }
 
         variables[index][current_program] = 1;
+
+        // Local variables of programs that never run at the same time share
+        // the same slots
+        if (index >= variable_window.base  &&
+                index < variable_window.base + variable_window.count) {
+            local_variables[index] = true;
+        }
     };
 
 
     // *************************************************************************
     var decode_priority_run_condition = function (instruction) {
+        variable_window = {
+            'base': (instruction >> 8) & 0xff,
+            'count': (instruction >> 16) & 0xff
+        };
+        instruction &= 0xff;
+
         if (instruction === RUN_WHEN_NORMAL_OPERATION) {
             return;
         }
@@ -291,6 +344,63 @@ var disassembler = (function () {
         if (instruction & RUN_WHEN_WINCH_OUT) {
             asm[offset++].decleration = "run when winch-out";
         }
+        if (instruction & RUN_ON_GEAR_CHANGED) {
+            asm[offset++].decleration = "run on gear-changed";
+        }
+        if (instruction & RUN_ON_LIGHT_SWITCH_UP) {
+            asm[offset++].decleration = "run on light-switch-up";
+        }
+        if (instruction & RUN_ON_LIGHT_SWITCH_DOWN) {
+            asm[offset++].decleration = "run on light-switch-down";
+        }
+        if (instruction & RUN_ON_CLICKS) {
+            asm[offset++].decleration = "run on clicks";
+        }
+        if (instruction & RUN_ON_HAZARD_ON) {
+            asm[offset++].decleration = "run on hazard-on";
+        }
+        if (instruction & RUN_ON_HAZARD_OFF) {
+            asm[offset++].decleration = "run on hazard-off";
+        }
+        if (instruction & RUN_ON_WINCH_STARTED) {
+            asm[offset++].decleration = "run on winch-started";
+        }
+        if (instruction & RUN_ON_SIGNAL_RECOVERED) {
+            asm[offset++].decleration = "run on signal-recovered";
+        }
+    };
+
+
+    // *************************************************************************
+    var decode_subroutine = function (instruction) {
+        variable_window = {'base': 0, 'count': 0};
+        asm[offset++].decleration = "sub subroutine" + (instruction & 0xffffff);
+        asm[offset++].decleration = '';  // Empty line
+    };
+
+
+    // *************************************************************************
+    // Pattern tables and SET with LED mask store the brightness (0..255);
+    // convert back to the percentage that the assembler converted it from
+    var decode_brightness = function (value) {
+        return Math.ceil(value * 100 / 255) + "%";
+    };
+
+
+    // *************************************************************************
+    var decode_pattern_table = function (instruction) {
+        var number = instruction & 0xffffff;
+        var table = pattern_tables[number];
+        var i;
+        var frame;
+
+        asm[offset++].decleration = "pattern pattern" + number;
+        for (i = 0; i < table.frames.length; i++) {
+            frame = table.frames[i].map(decode_brightness);
+            asm[offset++].decleration = "    " + frame.join(", ");
+        }
+        asm[offset++].decleration = 'end';
+        asm[offset++].decleration = '';  // Empty line
     };
 
 
@@ -299,7 +409,7 @@ var disassembler = (function () {
         var i;
         var any_led = false;
 
-        leds_used = parseInt(instruction, 16);
+        leds_used = instruction;
         leds_to_declare_offset = offset++;
         asm[leds_to_declare_offset].leds_to_declare = leds_used;
 
@@ -326,22 +436,25 @@ var disassembler = (function () {
 
 
     // *************************************************************************
-    var decode_leds = function (instruction) {
-        var stop = (instruction & 0x00ff0000) >> 16;
-        var start = (instruction & 0x0000ff00) >> 8;
+    var decode_led_mask = function (mask) {
+        var i;
         var result = '';
         var led_bit_mask = 0;
 
         // If all used LEDs are used in the instruction then output "all leds"
         // instead of a giant list of leds.
-        if (start === 0  &&  stop === (NUMBER_OF_LEDS - 1)) {
+        if (mask === (Math.pow(2, NUMBER_OF_LEDS) - 1)) {
             return "all leds";
         }
 
-        while (start <= stop) {
+        for (i = 0; i < NUMBER_OF_LEDS; i++) {
+            led_bit_mask = Math.pow(2, i);
+            if (!(mask & led_bit_mask)) {
+                continue;
+            }
+
             // Remember which LEDs are used here so that we can weed out unused
             // leds in the decleration later
-            led_bit_mask = Math.pow(2, start);
             if (!(asm[leds_to_declare_offset].leds_to_declare & led_bit_mask)) {
                 asm[leds_to_declare_offset].leds_to_declare += led_bit_mask;
             }
@@ -349,13 +462,27 @@ var disassembler = (function () {
             if (result !== '') {
                 result += ', ';
             }
-            result += 'led' + start++;
+            result += 'led' + i;
         }
 
         return result;
     };
 
 
+    // *************************************************************************
+    var decode_leds = function (instruction) {
+        var stop = (instruction & 0x00ff0000) >> 16;
+        var start = (instruction & 0x0000ff00) >> 8;
+        var mask = 0;
+
+        while (start <= stop) {
+            mask += Math.pow(2, start++);
+        }
+
+        return decode_led_mask(mask);
+    };
+
+
     // *************************************************************************
     var decode_right_parameter = function (instruction) {
         var parameter_type;
@@ -702,6 +829,29 @@ var disassembler = (function () {
             asm[offset + pc++].code = 'goto ' + asm[offset + address].label;
             break;
 
+        case opcodes.CALL:
+            asm[offset + pc++].code = 'call subroutine' + (instruction & 0xffffff);
+            break;
+
+        case opcodes.RETURN:
+            asm[offset + pc++].code = 'return';
+            break;
+
+        case opcodes.PATTERN:
+        case opcodes.PATTERN_I:
+            // Build a SET-style instruction with start and stop LED so that
+            // decode_leds() can be used
+            var table = (instruction >> 16) & 0xff;
+            var start = (instruction >> 8) & 0xff;
+            var stop = start + pattern_tables[table].width - 1;
+
+            asm[offset + pc++].code =
+                decode_leds((stop << 16) | (start << 8)) + ' = pattern' +
+                    table + '[' + ((opcode === opcodes.PATTERN) ?
+                            decode_right_parameter(instruction & 0xff) :
+                            (instruction & 0xff)) + ']';
+            break;
+
         case opcodes.SET:
             asm[offset + pc++].code =
                 decode_leds(instruction) + ' = ' +
@@ -716,6 +866,30 @@ var disassembler = (function () {
                 decode_leds(instruction) + ' = ' + (instruction & 0xff) + "%";
             break;
 
+        case opcodes.SET_MASK:
+            asm[offset + pc++].code =
+                decode_led_mask(led_masks[(instruction >> 8) & 0xffff]) +
+                    ' = ' + decode_right_parameter(instruction & 0xff);
+            break;
+
+        case opcodes.SET_MASK_I:
+            asm[offset + pc++].code =
+                decode_led_mask(led_masks[(instruction >> 8) & 0xffff]) +
+                    ' = ' + decode_brightness(instruction & 0xff);
+            break;
+
+        case opcodes.FADE_MASK:
+            asm[offset + pc++].code = 'fade ' +
+                decode_led_mask(led_masks[(instruction >> 8) & 0xffff]) +
+                    ' stepsize ' + decode_right_parameter(instruction & 0xff);
+            break;
+
+        case opcodes.FADE_MASK_I:
+            asm[offset + pc++].code = 'fade ' +
+                decode_led_mask(led_masks[(instruction >> 8) & 0xffff]) +
+                    ' stepsize ' + decode_brightness(instruction & 0xff);
+            break;
+
         case opcodes.SLEEP:
             asm[offset + pc++].code = 'sleep ' + decode_right_parameter(instruction);
             break;
@@ -812,6 +986,17 @@ var disassembler = (function () {
 
         switch (state) {
         case STATE_PRIORITY:
+            if (opcode === opcodes.PATTERN_TABLE) {
+                decode_pattern_table(instruction);
+                state = STATE_END_OF_PROGRAM;
+                break;
+            }
+            ++current_program;
+            if (opcode === opcodes.SUBROUTINE) {
+                decode_subroutine(instruction);
+                state = STATE_LEDS_USED;
+                break;
+            }
             decode_priority_run_condition(instruction);
             state = STATE_RUN;
             break;
@@ -839,8 +1024,18 @@ var disassembler = (function () {
                 offset += pc;
                 pc = 0;
 
+                if (opcode === opcodes.PATTERN_TABLE) {
+                    decode_pattern_table(instruction);
+                    break;
+                }
+
                 ++current_program;
 
+                if (opcode === opcodes.SUBROUTINE) {
+                    decode_subroutine(instruction);
+                    state = STATE_LEDS_USED;
+                    break;
+                }
                 decode_priority_run_condition(instruction);
                 state = STATE_RUN;
             }
@@ -868,7 +1063,9 @@ var disassembler = (function () {
                     }
                 }
 
-                variables[index].type = usage_count > 1 ? 'global var' : 'var';
+                variables[index].type =
+                    (usage_count > 1  &&  !local_variables[index]) ?
+                        'global var' : 'var';
             }
         }
     };
@@ -946,7 +1143,228 @@ var disassembler = (function () {
 
 
     // *************************************************************************
-    var disassemble = function (instructions) {
+    // Returns the length in bytes of a light program instruction
+    var instruction_length = function (opcode) {
+        if (opcode === opcodes.END_OF_PROGRAM  ||  opcode === opcodes.RETURN) {
+            return 1;
+        }
+
+        if (opcode === opcodes.PATTERN  ||  opcode === opcodes.PATTERN_I) {
+            return 5;
+        }
+
+        if (opcode >= opcodes.SET_MASK  &&  opcode <= opcodes.FADE_MASK_I) {
+            return 6;
+        }
+
+        if (opcode === opcodes.GOTO  ||  opcode === opcodes.CALL  ||
+                (opcode >= opcodes.SLEEP  &&  opcode <= opcodes.FADE_LED_I)  ||
+                (opcode >= opcodes.ASSIGN_S  &&  opcode <= opcodes.XOR_S)) {
+            return 3;
+        }
+
+        return 4;
+    };
+
+
+    // *************************************************************************
+    // Convert an instruction of the compact bytecode into the 32-bit
+    // representation with the opcode in the top-most byte, which is what the
+    // decode functions operate on
+    var expand_instruction = function (opcode, b1, b2, b3) {
+        var value;
+
+        if (opcode === opcodes.GOTO  ||  opcode === opcodes.CALL  ||
+                opcode === opcodes.SLEEP  ||  opcode === opcodes.SLEEP_I) {
+            return ((opcode << 24) | (b2 << 8) | b1) >>> 0;
+        }
+
+        if (opcode >= opcodes.SET  &&  opcode <= opcodes.FADE_I) {
+            return ((opcode << 24) | (b2 << 16) | (b1 << 8) | b3) >>> 0;
+        }
+
+        if (opcode >= opcodes.SET_LED  &&  opcode <= opcodes.FADE_LED_I) {
+            opcode = opcode - opcodes.SET_LED + opcodes.SET;
+            return ((opcode << 24) | (b1 << 16) | (b1 << 8) | b2) >>> 0;
+        }
+
+        if (opcode >= opcodes.ASSIGN_S  &&  opcode <= opcodes.XOR_S) {
+            opcode = opcodes.ASSIGN_I + ((opcode - opcodes.ASSIGN_S) << 1);
+            value = (b2 & 0x80) ? (b2 | 0xff00) : b2;
+            return ((opcode << 24) | (b1 << 16) | value) >>> 0;
+        }
+
+        if (((opcode & 0xe0) === OPCODE_SKIP_IF_ANY)  ||
+                ((opcode & 0xe0) === OPCODE_SKIP_IF_ALL)  ||
+                    ((opcode & 0xe0) === OPCODE_SKIP_IF_NONE)) {
+            return ((opcode << 24) | (b3 << 16) | (b2 << 8) | b1) >>> 0;
+        }
+
+        return ((opcode << 24) | (b1 << 16) | (b3 << 8) | b2) >>> 0;
+    };
+
+
+    // *************************************************************************
+    // The instructions of each light program and subroutine are stored as a
+    // stream of bytes, padded to the next 32-bit word. Expand them to one
+    // 32-bit word per instruction, translate GOTO targets from relative byte
+    // offsets into instruction indexes, and CALL and PATTERN targets into the
+    // number of the subroutine or pattern table. Pattern tables are stored in
+    // pattern_tables[], the LED masks of SET and FADE in led_masks[].
+    //
+    // Subroutines end with the RETURN that the assembler appends; it is
+    // replaced by an end-of-program instruction so that the end of the
+    // subroutine shows up in the output.
+    var expand_programs = function (instructions) {
+        var words = [];
+        var result = [];
+        var code;
+        var next_offsets;
+        var byte_offsets;
+        var subroutines = {};
+        var number_of_subroutines = 0;
+        var tables = {};
+        var table;
+        var frame;
+        var k;
+        var n;
+        var is_subroutine;
+        var length;
+        var base;
+        var i = 0;
+        var index;
+        var opcode;
+
+        var get_byte = function (n) {
+            var word = words[i + (n >> 2)];
+            if (word === undefined) {
+                return 0;
+            }
+            return (word >>> ((n & 3) * 8)) & 0xff;
+        };
+
+        var relative_target = function (instruction, k) {
+            var distance = instruction & 0xffff;
+            if (distance >= 0x8000) {
+                distance -= 0x10000;
+            }
+            return next_offsets[k] + distance;
+        };
+
+        instructions.forEach(function (instruction) {
+            words.push(Number(instruction) >>> 0);
+        });
+
+        pattern_tables = [];
+        led_masks = [];
+
+        while (i < words.length) {
+            opcode = words[i] >>> 24;
+            if (opcode === opcodes.END_OF_PROGRAMS) {
+                result.push(words[i]);
+                break;
+            }
+
+            // Pattern table: header with length, number of LEDs per frame,
+            // number of frames, frames
+            if (opcode === opcodes.PATTERN_TABLE) {
+                length = words[i] & 0xffff;
+                result.push(((opcodes.PATTERN_TABLE << 24) |
+                    pattern_tables.length) >>> 0);
+                i += 1;
+
+                table = {"width": get_byte(0), "frames": []};
+                index = 2;
+                for (k = 0; k < get_byte(1); k++) {
+                    frame = [];
+                    for (n = 0; n < table.width; n++) {
+                        frame.push(get_byte(index++));
+                    }
+                    table.frames.push(frame);
+                }
+                tables[i * 4] = pattern_tables.length;
+                pattern_tables.push(table);
+
+                i += (length + 3) >> 2;
+                continue;
+            }
+
+            // Subroutine: header with length, and LEDs used.
+            // Program: priority run condition, run condition and LEDs used.
+            is_subroutine = (opcode === opcodes.SUBROUTINE);
+            if (is_subroutine) {
+                number_of_subroutines += 1;
+                length = words[i] & 0xffff;
+                result.push(((opcodes.SUBROUTINE << 24) |
+                    number_of_subroutines) >>> 0, words[i + 1]);
+                i += 2;
+                subroutines[i * 4] = number_of_subroutines;
+            } else {
+                result.push(words[i], words[i + 1], words[i + 2]);
+                i += 3;
+            }
+            base = i * 4;
+
+            code = [];
+            next_offsets = [];
+            byte_offsets = {};
+            index = 0;
+            do {
+                opcode = get_byte(index);
+                byte_offsets[index] = code.length;
+                if (opcode === opcodes.PATTERN  ||  opcode === opcodes.PATTERN_I) {
+                    k = get_byte(index + 1) | (get_byte(index + 2) << 8);
+                    if (k >= 0x8000) {
+                        k -= 0x10000;
+                    }
+                    code.push(((opcode << 24) |
+                        ((tables[base + index + 5 + k] || 0) << 16) |
+                        (get_byte(index + 3) << 8) | get_byte(index + 4)) >>> 0);
+                } else if (opcode >= opcodes.SET_MASK  &&
+                        opcode <= opcodes.FADE_MASK_I) {
+                    code.push(((opcode << 24) | (led_masks.length << 8) |
+                        get_byte(index + 1)) >>> 0);
+                    led_masks.push((get_byte(index + 2) |
+                        (get_byte(index + 3) << 8) |
+                        (get_byte(index + 4) << 16) |
+                        (get_byte(index + 5) << 24)) >>> 0);
+                } else {
+                    code.push(expand_instruction(opcode, get_byte(index + 1),
+                        get_byte(index + 2), get_byte(index + 3)));
+                }
+                index += instruction_length(opcode);
+                next_offsets.push(index);
+            } while ((is_subroutine ? (index < length) :
+                    (opcode !== opcodes.END_OF_PROGRAM))  &&
+                        (i + (index >> 2)) < words.length);
+
+            if (is_subroutine) {
+                code[code.length - 1] = (opcodes.END_OF_PROGRAM << 24) >>> 0;
+            }
+
+            code.forEach(function (instruction, k) {
+                if ((instruction >>> 24) === opcodes.GOTO) {
+                    code[k] = ((opcodes.GOTO << 24) |
+                        (byte_offsets[relative_target(instruction, k)] || 0)) >>> 0;
+                }
+                if ((instruction >>> 24) === opcodes.CALL) {
+                    code[k] = ((opcodes.CALL << 24) |
+                        (subroutines[base + relative_target(instruction, k)] || 0)) >>> 0;
+                }
+            });
+
+            result = result.concat(code);
+            i += (index + 3) >> 2;
+        }
+
+        return result;
+    };
+
+
+    // *************************************************************************
+    // version is the light program version of the firmware image; the
+    // compact bytecode is assumed if it is not given
+    var disassemble = function (instructions, version) {
         var i;
 
         for (i = 0; i < asm.length; i++) {
@@ -955,13 +1373,19 @@ var disassembler = (function () {
         }
 
         variables = {};
+        local_variables = {};
+        variable_window = {'base': 0, 'count': 0};
         var_offsets = [];
-        current_program = 1;
+        current_program = 0;
 
         offset = 0;
         pc = 0;
         state = STATE_PRIORITY;
 
+        if (version !== LEGACY_LIGHT_PROGRAMS_VERSION) {
+            instructions = expand_programs(instructions);
+        }
+
         instructions.forEach(function (instruction) {
             process_instruction(instruction);
         });
@@ -999,7 +1423,9 @@ var disassembler = (function () {
     // *************************************************************************
     return {
         disassemble: disassemble,
-        parse_c_code: parse_c_code
+        parse_c_code: parse_c_code,
+        opcodes: opcodes,
+        instruction_length: instruction_length
     };
 }());
 
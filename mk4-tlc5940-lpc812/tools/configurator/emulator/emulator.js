@@ -0,0 +1,1139 @@
+"use strict";
+/*jslint browser: true, node: true, bitwise: true, vars: true, plusplus: true */
+/*global disassembler */
+
+// Host-side emulator of the light program VM of the light controller.
+//
+// Executes the bytecode in the light_programs data structure (LIGHT_PROGRAMS_T)
+// the same way as execute_program() and process_light_programs() in
+// firmware/light_programs.c do: at most MAX_INSTRUCTIONS_PER_SYSTICK
+// instructions per program and systick, LEDs of programs with higher priority
+// can not be overwritten, sleep in multiples of the systick, and the run
+// conditions are evaluated from the car state every systick.
+//
+// The car state is driven by a scenario, a list of timed input changes.
+// For every systick the emulator records light_actual[] of the LEDs used by
+// the light programs, including fading (max_change_per_systick).
+//
+// The car light functions of the firmware (tail light, indicators, ...) are
+// not emulated: LEDs that are not driven by a running light program are off.
+
+var emulator = (function () {
+    var dasm = (typeof require !== "undefined") ?
+            require("../disassembler/disassembler.js").disassembler :
+                disassembler;
+
+    var op = dasm.opcodes;
+
+    // Must match globals.h and config.c of the light controller firmware
+    var __SYSTICK_IN_MS = 20;
+    var MAX_INSTRUCTIONS_PER_SYSTICK = 30;
+    var MAX_LIGHTS = 32;
+    var LIGHT_PROGRAM_STACK_DEPTH = 4;
+    var DEFAULT_LIGHT_SWITCH_POSITIONS = 5;
+    var DEFAULT_BLINK_COUNTER_VALUE = 340 / __SYSTICK_IN_MS;
+
+    // The firmware has 100 variables; the assembler never uses more, but the
+    // bytecode can address 256
+    var NUMBER_OF_VARIABLES = 256;
+
+    var GLOBAL_VAR_CLICKS = 0;
+    var GLOBAL_VAR_LIGHT_SWITCH_POSITION = 1;
+
+    var PRIORITY_STATE_OFFSET = 0;
+    var PRIORITY_STATE_MASK = 0xff;
+    var RUN_STATE_OFFSET = 1;
+    var LEDS_USED_OFFSET = 2;
+    var FIRST_OPCODE_OFFSET = 3;
+
+    var FIRST_SKIP_IF_OPCODE = 0x20;
+    var LAST_SKIP_IF_OPCODE = 0x37;
+    var OPCODE_SKIP_IF_ANY = 0x60;      // 011 + 29 bits run_state!
+    var OPCODE_SKIP_IF_ALL = 0x80;      // 100 + 29 bits run_state!
+    var OPCODE_SKIP_IF_NONE = 0xA0;     // 101 + 29 bits run_state!
+
+    var PARAMETER_TYPE_VARIABLE = 0;
+    var PARAMETER_TYPE_LED = 1;
+    var PARAMETER_TYPE_RANDOM = 2;
+    var PARAMETER_TYPE_STEERING = 3;
+    var PARAMETER_TYPE_THROTTLE = 4;
+    var PARAMETER_TYPE_GEAR = 5;
+
+    var RUN_WHEN_NORMAL_OPERATION           = 0;
+    var RUN_WHEN_NO_SIGNAL                  = (1 << 0);
+    var RUN_WHEN_INITIALIZING               = (1 << 1);
+    var RUN_WHEN_SERVO_OUTPUT_SETUP_CENTRE  = (1 << 2);
+    var RUN_WHEN_SERVO_OUTPUT_SETUP_LEFT    = (1 << 3);
+    var RUN_WHEN_SERVO_OUTPUT_SETUP_RIGHT   = (1 << 4);
+    var RUN_WHEN_REVERSING_SETUP_STEERING   = (1 << 5);
+    var RUN_WHEN_REVERSING_SETUP_THROTTLE   = (1 << 6);
+    var RUN_WHEN_GEAR_CHANGED               = (1 << 7);
+
+    var RUN_WHEN_LIGHT_SWITCH_POSITION      = (1 << 0);
+    var RUN_WHEN_NEUTRAL                    = (1 << 9);
+    var RUN_WHEN_FORWARD                    = (1 << 10);
+    var RUN_WHEN_REVERSING                  = (1 << 11);
+    var RUN_WHEN_BRAKING                    = (1 << 12);
+    var RUN_WHEN_INDICATOR_LEFT             = (1 << 13);
+    var RUN_WHEN_INDICATOR_RIGHT            = (1 << 14);
+    var RUN_WHEN_HAZARD                     = (1 << 15);
+    var RUN_WHEN_BLINK_FLAG                 = (1 << 16);
+    var RUN_WHEN_BLINK_LEFT                 = (1 << 17);
+    var RUN_WHEN_BLINK_RIGHT                = (1 << 18);
+
+    var RUN_ON_EVENTS_MASK                  = (0xff << 23);
+    var RUN_ON_GEAR_CHANGED                 = (1 << 23);
+
+    // Events of the scenario and the run word bit of the programs that run
+    // on them
+    var EVENTS = {
+        "gear-changed": RUN_ON_GEAR_CHANGED,
+        "light-switch-up": (1 << 24),
+        "light-switch-down": (1 << 25),
+        "clicks": (1 << 26),
+        "hazard-on": (1 << 27),
+        "hazard-off": (1 << 28),
+        "winch-started": (1 << 29),
+        "signal-recovered": (1 << 30)
+    };
+
+    var RUN_ALWAYS                          = 0x80000000;
+
+    var CAR_STATE_SERVO_OUTPUT_SETUP_CENTRE = (1 << 24);
+    var CAR_STATE_SERVO_OUTPUT_SETUP_LEFT   = (1 << 25);
+    var CAR_STATE_SERVO_OUTPUT_SETUP_RIGHT  = (1 << 26);
+    var CAR_STATE_REVERSING_SETUP_STEERING  = (1 << 27);
+    var CAR_STATE_REVERSING_SETUP_THROTTLE  = (1 << 28);
+
+    // Inputs of the scenario, and the value they have after reset
+    var DEFAULT_INPUTS = {
+        "no_signal": false,
+        "initializing": false,
+        "servo_output_setup": "",       // "centre", "left", "right"
+        "reversing_setup": "",          // "steering", "throttle", "both"
+        "forward": false,
+        "reversing": false,
+        "braking": false,
+        "indicator_left": false,
+        "indicator_right": false,
+        "hazard": false,
+        "steering": 0,
+        "throttle": 0,
+        "gear": 0
+    };
+
+    // Byte-wise copy of light_programs.programs[], and the word index of each
+    // program
+    var memory;
+    var words;
+    var start = [];
+    var instruction_length = new Uint8Array(256);
+
+    // State of the VM, as in light_programs.c
+    var cpu = [];
+    var var_ = new Int16Array(NUMBER_OF_VARIABLES);
+    var car_state = 0;
+    var run_state = 0;
+    var priority_run_state = 0;
+
+    // State of the rest of the firmware
+    var light_setpoint = new Uint8Array(MAX_LIGHTS);
+    var light_actual = new Uint8Array(MAX_LIGHTS);
+    var max_change_per_systick = new Uint8Array(MAX_LIGHTS);
+    var light_switch_position = 0;
+    var light_switch_positions = DEFAULT_LIGHT_SWITCH_POSITIONS;
+    var blink_counter_value = DEFAULT_BLINK_COUNTER_VALUE;
+    var blink_counter = 0;
+    var blink_flag = false;
+    var blink_flag_given = false;
+    var entropy = 0;
+    var lfsr = 0;
+    var inputs = {};
+
+
+    (function initialize_instruction_length() {
+        var i;
+        for (i = 0; i < 256; i++) {
+            instruction_length[i] = dasm.instruction_length(i);
+        }
+    }());
+
+
+    // *************************************************************************
+    // Extract the program start offsets and the instructions from the C
+    // source code the assembler generates. Only the light_programs data
+    // structure is parsed; native code the assembler may append is ignored.
+    var parse_c_code = function (input) {
+        var end = input.indexOf("\n};");
+        var result = {"start": [], "instructions": []};
+        var re = /&light_programs\.programs\[(\d+)\]/g;
+        var match;
+
+        if (end >= 0) {
+            input = input.substring(0, end);
+        }
+
+        match = re.exec(input);
+        while (match !== null) {
+            result.start.push(parseInt(match[1], 10));
+            match = re.exec(input);
+        }
+
+        result.instructions = dasm.parse_c_code(input.substring(
+            input.indexOf(".programs = {")));
+
+        return result;
+    };
+
+
+    // *************************************************************************
+    // Load the light programs. The instructions are kept as 32-bit words for
+    // the program headers, and as little-endian bytes for the bytecode, which
+    // is how the LPC812 sees them.
+    var load = function (light_programs) {
+        var i;
+        var w;
+
+        words = new Uint32Array(light_programs.instructions.length + 2);
+        memory = new Uint8Array(words.length * 4);
+        for (i = 0; i < light_programs.instructions.length; i++) {
+            w = Number(light_programs.instructions[i]) >>> 0;
+            words[i] = w;
+            memory[i * 4] = w & 0xff;
+            memory[i * 4 + 1] = (w >>> 8) & 0xff;
+            memory[i * 4 + 2] = (w >>> 16) & 0xff;
+            memory[i * 4 + 3] = w >>> 24;
+        }
+
+        start = light_programs.start.slice();
+        cpu = [];
+        for (i = 0; i < start.length; i++) {
+            cpu.push({"pc": 0, "timer": 0, "sp": 0, "event": 0,
+                "var_base": 0, "var_clear": 0,
+                "stack": new Uint16Array(LIGHT_PROGRAM_STACK_DEPTH)});
+        }
+    };
+
+
+    // *************************************************************************
+    var reset_program = function (n) {
+        var priority = words[start[n] + PRIORITY_STATE_OFFSET];
+
+        cpu[n].pc = (start[n] + FIRST_OPCODE_OFFSET) * 4;
+        cpu[n].timer = 0;
+        cpu[n].sp = 0;
+        cpu[n].event = 0;
+        cpu[n].var_base = (priority >>> 8) & 0xff;
+        cpu[n].var_clear = (priority >>> 16) & 0xff;
+    };
+
+
+    // *************************************************************************
+    var restart_program = function (n) {
+        cpu[n].pc = (start[n] + FIRST_OPCODE_OFFSET) * 4;
+        cpu[n].sp = 0;
+        cpu[n].event = 0;
+    };
+
+
+    // *************************************************************************
+    // Feedback polynomial: x^16 + x^14 + x^13 + x^11 + 1, as in utils.c
+    var next16 = function () {
+        var bit = (lfsr ^ (lfsr >> 2) ^ (lfsr >> 3) ^ (lfsr >> 5)) & 1;
+        lfsr = (lfsr >> 1) | (bit << 15);
+    };
+
+
+    // *************************************************************************
+    var random_min_max = function (min, max) {
+        if (min === 0) {
+            min = 1;
+        }
+        if (min >= max) {
+            return min;
+        }
+
+        if (lfsr === 0) {
+            lfsr = (entropy ^ (entropy >>> 16)) & 0xffff;
+            if (lfsr === 0) {
+                lfsr = 1;
+            }
+            next16();
+            entropy = ((entropy & 0xffff0000) | lfsr) >>> 0;
+        }
+
+        next16();
+        return (min + (lfsr % (max - min + 1))) & 0xffff;
+    };
+
+
+    // *************************************************************************
+    var percent_to_uint8 = function (percentage) {
+        if (percentage < 0) {
+            return 0;
+        }
+        if (percentage >= 100) {
+            return 255;
+        }
+        return (percentage * 255 / 100) | 0;
+    };
+
+
+    // *************************************************************************
+    var calculate_step_value = function (current, value, max_change) {
+        if (value > current) {
+            return Math.min(value, current + Math.min(max_change, 0xff - current));
+        }
+        return Math.max(value, current - Math.min(max_change, current));
+    };
+
+
+    // *************************************************************************
+    // Returns the value as int16_t
+    var get_parameter_value = function (opcode, parameter) {
+        if (opcode & 0x01) {
+            return (parameter << 16) >> 16;
+        }
+
+        switch (parameter >> 8) {
+        case PARAMETER_TYPE_VARIABLE:
+            return var_[parameter & 0xff];
+
+        case PARAMETER_TYPE_LED:
+            return (light_actual[parameter & 0xff] * 100 / 255) | 0;
+
+        case PARAMETER_TYPE_RANDOM:
+            return (random_min_max(1, 0xffff) << 16) >> 16;
+
+        case PARAMETER_TYPE_STEERING:
+            return inputs.steering;
+
+        case PARAMETER_TYPE_THROTTLE:
+            return inputs.throttle;
+
+        case PARAMETER_TYPE_GEAR:
+            return inputs.gear;
+
+        default:
+            return 0;
+        }
+    };
+
+
+    // *************************************************************************
+    var skip_if_condition = function (opcode, id, parameter) {
+        var cmp1 = (opcode & 0x02) ? light_actual[id] : var_[id];
+        var cmp2 = get_parameter_value(opcode, parameter);
+
+        switch (opcode & 0xfc) {
+        case op.SKIP_IF_EQ_V:
+            return cmp1 === cmp2;
+        case op.SKIP_IF_NE_V:
+            return cmp1 !== cmp2;
+        case op.SKIP_IF_GT_V:
+            return cmp1 > cmp2;
+        case op.SKIP_IF_GE_V:
+            return cmp1 >= cmp2;
+        case op.SKIP_IF_LT_V:
+            return cmp1 < cmp2;
+        case op.SKIP_IF_LE_V:
+            return cmp1 <= cmp2;
+        default:
+            return false;
+        }
+    };
+
+
+    // *************************************************************************
+    // Port of execute_program() in light_programs.c. pc is a byte offset into
+    // memory[].
+    var execute_program = function (n, leds_already_used) {
+        var c = cpu[n];
+        var instructions_executed = 0;
+        var pc;
+        var opcode;
+        var operand1;
+        var operand2;
+        var operand3;
+        var parameter;
+        var next_length;
+        var state;
+        var skip;
+        var mask;
+        var value;
+        var destination;
+        var table;
+        var frame;
+        var frames;
+        var width;
+        var dividend;
+        var i;
+
+        if (c.timer) {
+            c.timer -= 1;
+            if (c.timer) {
+                return;
+            }
+        }
+
+        // Local variables that were used by another program since this
+        // program was reset start from 0
+        while (c.var_clear) {
+            c.var_clear -= 1;
+            var_[c.var_base + c.var_clear] = 0;
+        }
+
+        pc = c.pc;
+
+        while (instructions_executed < MAX_INSTRUCTIONS_PER_SYSTICK) {
+            opcode = memory[pc];
+            operand1 = memory[pc + 1];
+            operand2 = memory[pc + 2];
+            operand3 = memory[pc + 3];
+            pc += instruction_length[opcode];
+
+            ++instructions_executed;
+
+            parameter = operand2 | (operand3 << 8);
+
+            if (opcode >= FIRST_SKIP_IF_OPCODE && opcode <= LAST_SKIP_IF_OPCODE) {
+                next_length = instruction_length[memory[pc]];
+                if (skip_if_condition(opcode, operand1, parameter)) {
+                    pc += next_length;
+                }
+                continue;
+            }
+
+            if (opcode >= OPCODE_SKIP_IF_ANY && opcode <= (OPCODE_SKIP_IF_NONE | 0x1f)) {
+                next_length = instruction_length[memory[pc]];
+                state = ((opcode & 0x1f) << 24) | (operand3 << 16) |
+                    (operand2 << 8) | operand1;
+
+                if ((opcode & 0xe0) === OPCODE_SKIP_IF_ANY) {
+                    skip = (state & car_state) !== 0;
+                } else if ((opcode & 0xe0) === OPCODE_SKIP_IF_ALL) {
+                    skip = (state & car_state) === state;
+                } else {
+                    skip = (state & car_state) === 0;
+                }
+
+                if (skip) {
+                    pc += next_length;
+                }
+                continue;
+            }
+
+            switch (opcode) {
+            case op.SET:
+            case op.SET_I:
+            case op.FADE:
+            case op.FADE_I:
+                if (!(opcode & 0x01)) {
+                    operand3 = var_[operand3] & 0xff;
+                }
+                destination = (opcode <= op.SET_I) ?
+                        light_setpoint : max_change_per_systick;
+                value = percent_to_uint8(operand3);
+                for (i = operand1; i <= operand2; i++) {
+                    if ((leds_already_used & (1 << i)) === 0) {
+                        destination[i] = value;
+                    }
+                }
+                break;
+
+            case op.SET_LED:
+            case op.SET_LED_I:
+            case op.FADE_LED:
+            case op.FADE_LED_I:
+                if (!(opcode & 0x01)) {
+                    operand2 = var_[operand2] & 0xff;
+                }
+                destination = (opcode <= op.SET_LED_I) ?
+                        light_setpoint : max_change_per_systick;
+                if ((leds_already_used & (1 << operand1)) === 0) {
+                    destination[operand1] = percent_to_uint8(operand2);
+                }
+                break;
+
+            case op.SET_MASK:
+            case op.SET_MASK_I:
+            case op.FADE_MASK:
+            case op.FADE_MASK_I:
+                mask = (operand2 | (operand3 << 8) | (memory[pc - 2] << 16) |
+                    (memory[pc - 1] << 24)) & ~leds_already_used;
+                value = (opcode & 0x01) ? operand1 :
+                        percent_to_uint8(var_[operand1] & 0xff);
+                destination = (opcode <= op.SET_MASK_I) ?
+                        light_setpoint : max_change_per_systick;
+                for (i = 0; mask; i++, mask >>>= 1) {
+                    if (mask & 1) {
+                        destination[i] = value;
+                    }
+                }
+                break;
+
+            case op.PATTERN:
+            case op.PATTERN_I:
+                table = pc + (((operand1 | (operand2 << 8)) << 16) >> 16);
+                frame = (opcode === op.PATTERN) ?
+                        (var_[memory[pc - 1]] & 0xffff) : memory[pc - 1];
+                frames = memory[table + 1];
+                if (frames) {
+                    frame = frame % frames;
+                }
+                width = memory[table];
+                table += 2 + frame * width;
+                for (i = 0; i < width; i++) {
+                    if ((leds_already_used & (1 << (operand3 + i))) === 0) {
+                        light_setpoint[operand3 + i] = memory[table + i];
+                    }
+                }
+                break;
+
+            case op.SLEEP:
+            case op.SLEEP_I:
+                parameter = get_parameter_value(opcode,
+                    operand1 | (operand2 << 8)) & 0xffff;
+                c.timer = (parameter / __SYSTICK_IN_MS) | 0;
+                c.pc = pc;
+                return;
+
+            case op.GOTO:
+                pc += ((operand1 | (operand2 << 8)) << 16) >> 16;
+                continue;
+
+            case op.CALL:
+                if (c.sp >= LIGHT_PROGRAM_STACK_DEPTH) {
+                    restart_program(n);
+                    return;
+                }
+                c.stack[c.sp++] = pc;
+                pc += ((operand1 | (operand2 << 8)) << 16) >> 16;
+                continue;
+
+            case op.RETURN:
+                if (c.sp === 0) {
+                    restart_program(n);
+                    return;
+                }
+                pc = c.stack[--c.sp];
+                continue;
+
+            case op.ASSIGN:
+            case op.ASSIGN_I:
+                var_[operand1] = get_parameter_value(opcode, parameter);
+                break;
+
+            case op.ADD:
+            case op.ADD_I:
+                var_[operand1] += get_parameter_value(opcode, parameter);
+                break;
+
+            case op.SUBTRACT:
+            case op.SUBTRACT_I:
+                var_[operand1] -= get_parameter_value(opcode, parameter);
+                break;
+
+            case op.MULTIPLY:
+            case op.MULTIPLY_I:
+                var_[operand1] *= get_parameter_value(opcode, parameter);
+                break;
+
+            case op.DIVIDE:
+            case op.DIVIDE_I:
+                dividend = get_parameter_value(opcode, parameter);
+                if (dividend === 0) {
+                    var_[operand1] = 0x7fff;
+                } else {
+                    var_[operand1] = (var_[operand1] / dividend) | 0;
+                }
+                break;
+
+            case op.AND:
+            case op.AND_I:
+                var_[operand1] &= get_parameter_value(opcode, parameter);
+                break;
+
+            case op.OR:
+            case op.OR_I:
+                var_[operand1] |= get_parameter_value(opcode, parameter);
+                break;
+
+            case op.XOR:
+            case op.XOR_I:
+                var_[operand1] ^= get_parameter_value(opcode, parameter);
+                break;
+
+            case op.ABS:
+            case op.ABS_I:
+                parameter = get_parameter_value(opcode, parameter) & 0xffff;
+                if (parameter & 0x8000) {
+                    parameter = (~parameter + 1) & 0xffff;
+                }
+                var_[operand1] = parameter;
+                break;
+
+            case op.ASSIGN_S:
+                var_[operand1] = (operand2 << 24) >> 24;
+                break;
+
+            case op.ADD_S:
+                var_[operand1] += (operand2 << 24) >> 24;
+                break;
+
+            case op.SUBTRACT_S:
+                var_[operand1] -= (operand2 << 24) >> 24;
+                break;
+
+            case op.MULTIPLY_S:
+                var_[operand1] *= (operand2 << 24) >> 24;
+                break;
+
+            case op.DIVIDE_S:
+                if (operand2 === 0) {
+                    var_[operand1] = 0x7fff;
+                } else {
+                    var_[operand1] = (var_[operand1] / ((operand2 << 24) >> 24)) | 0;
+                }
+                break;
+
+            case op.AND_S:
+                var_[operand1] &= (operand2 << 24) >> 24;
+                break;
+
+            case op.OR_S:
+                var_[operand1] |= (operand2 << 24) >> 24;
+                break;
+
+            case op.XOR_S:
+                var_[operand1] ^= (operand2 << 24) >> 24;
+                break;
+
+            case op.END_OF_PROGRAM:
+                c.pc = pc - 1;
+                c.event = 0;
+                return;
+
+            default:
+                restart_program(n);
+                return;
+            }
+        }
+
+        c.pc = pc;
+    };
+
+
+    // *************************************************************************
+    var load_light_program_environment = function () {
+        var servo_output_setup = inputs.servo_output_setup;
+        var reversing_setup = inputs.reversing_setup;
+        var setup_steering = (reversing_setup === "steering" ||
+                reversing_setup === "both");
+        var setup_throttle = (reversing_setup === "throttle" ||
+                reversing_setup === "both");
+
+        priority_run_state = 0;
+        if (inputs.no_signal) {
+            priority_run_state |= RUN_WHEN_NO_SIGNAL;
+        }
+        if (inputs.initializing) {
+            priority_run_state |= RUN_WHEN_INITIALIZING;
+        }
+        if (servo_output_setup === "centre") {
+            priority_run_state |= RUN_WHEN_SERVO_OUTPUT_SETUP_CENTRE;
+        }
+        if (servo_output_setup === "left") {
+            priority_run_state |= RUN_WHEN_SERVO_OUTPUT_SETUP_LEFT;
+        }
+        if (servo_output_setup === "right") {
+            priority_run_state |= RUN_WHEN_SERVO_OUTPUT_SETUP_RIGHT;
+        }
+        if (setup_steering) {
+            priority_run_state |= RUN_WHEN_REVERSING_SETUP_STEERING;
+        }
+        if (setup_throttle) {
+            priority_run_state |= RUN_WHEN_REVERSING_SETUP_THROTTLE;
+        }
+
+        run_state = RUN_ALWAYS;
+        run_state |= (RUN_WHEN_LIGHT_SWITCH_POSITION << light_switch_position);
+        if (inputs.forward) {
+            run_state |= RUN_WHEN_FORWARD;
+        } else if (inputs.reversing) {
+            run_state |= RUN_WHEN_REVERSING;
+        } else {
+            run_state |= RUN_WHEN_NEUTRAL;
+        }
+        if (inputs.braking) {
+            run_state |= RUN_WHEN_BRAKING;
+        }
+        if (blink_flag) {
+            run_state |= RUN_WHEN_BLINK_FLAG;
+        }
+        if (inputs.indicator_left) {
+            run_state |= RUN_WHEN_INDICATOR_LEFT;
+            if (blink_flag) {
+                run_state |= RUN_WHEN_BLINK_LEFT;
+            }
+        }
+        if (inputs.indicator_right) {
+            run_state |= RUN_WHEN_INDICATOR_RIGHT;
+            if (blink_flag) {
+                run_state |= RUN_WHEN_BLINK_RIGHT;
+            }
+        }
+        if (inputs.hazard) {
+            run_state |= RUN_WHEN_HAZARD;
+            if (blink_flag) {
+                run_state |= RUN_WHEN_BLINK_LEFT;
+                run_state |= RUN_WHEN_BLINK_RIGHT;
+            }
+        }
+
+        car_state = run_state & ~RUN_ALWAYS;
+        if (servo_output_setup === "centre") {
+            car_state |= CAR_STATE_SERVO_OUTPUT_SETUP_CENTRE;
+        }
+        if (servo_output_setup === "left") {
+            car_state |= CAR_STATE_SERVO_OUTPUT_SETUP_LEFT;
+        }
+        if (servo_output_setup === "right") {
+            car_state |= CAR_STATE_SERVO_OUTPUT_SETUP_RIGHT;
+        }
+        if (setup_steering) {
+            car_state |= CAR_STATE_REVERSING_SETUP_STEERING;
+        }
+        if (setup_throttle) {
+            car_state |= CAR_STATE_REVERSING_SETUP_THROTTLE;
+        }
+    };
+
+
+    // *************************************************************************
+    var limit_light_switch_position_variable = function () {
+        if (var_[GLOBAL_VAR_LIGHT_SWITCH_POSITION] < 0) {
+            var_[GLOBAL_VAR_LIGHT_SWITCH_POSITION] = 0;
+        }
+        if (var_[GLOBAL_VAR_LIGHT_SWITCH_POSITION] > light_switch_positions) {
+            var_[GLOBAL_VAR_LIGHT_SWITCH_POSITION] = light_switch_positions;
+        }
+    };
+
+
+    // *************************************************************************
+    var run_program = function (n, leds_used) {
+        var leds_already_used = leds_used;
+
+        leds_used |= words[start[n] + LEDS_USED_OFFSET];
+        execute_program(n, leds_already_used);
+        limit_light_switch_position_variable();
+        return leds_used;
+    };
+
+
+    // *************************************************************************
+    // Port of runs_on_event()
+    var runs_on_event = function (n, event) {
+        if (words[start[n] + RUN_STATE_OFFSET] & RUN_ON_EVENTS_MASK & event) {
+            return true;
+        }
+
+        return event === RUN_ON_GEAR_CHANGED  &&
+            (words[start[n] + PRIORITY_STATE_OFFSET] & RUN_WHEN_GEAR_CHANGED) !== 0;
+    };
+
+
+    // *************************************************************************
+    // Port of process_light_program_events() for a single event; the
+    // firmware handles posted events before the next systick too
+    var process_light_program_events = function (event) {
+        var i;
+
+        for (i = 0; i < start.length; i++) {
+            if (runs_on_event(i, event)) {
+                reset_program(i);
+                cpu[i].event = 1;
+            }
+        }
+    };
+
+
+    // *************************************************************************
+    // Port of process_light_programs()
+    var process_light_programs = function () {
+        var i;
+        var priority;
+        var leds_used = 0;
+
+        load_light_program_environment();
+
+        var_[GLOBAL_VAR_LIGHT_SWITCH_POSITION] = light_switch_position;
+
+        for (i = 0; i < start.length; i++) {
+            if (cpu[i].event) {
+                leds_used = run_program(i, leds_used);
+            }
+        }
+
+        for (i = 0; i < start.length; i++) {
+            priority = words[start[i] + PRIORITY_STATE_OFFSET] & PRIORITY_STATE_MASK;
+            if (priority === RUN_WHEN_NORMAL_OPERATION  ||  cpu[i].event) {
+                continue;
+            }
+
+            if (priority & priority_run_state) {
+                leds_used = run_program(i, leds_used);
+            } else {
+                reset_program(i);
+            }
+        }
+
+        for (i = 0; i < start.length; i++) {
+            if ((words[start[i] + PRIORITY_STATE_OFFSET] & PRIORITY_STATE_MASK) !==
+                    RUN_WHEN_NORMAL_OPERATION) {
+                continue;
+            }
+
+            if (words[start[i] + RUN_STATE_OFFSET] & RUN_ON_EVENTS_MASK) {
+                continue;
+            }
+
+            if (words[start[i] + RUN_STATE_OFFSET] & run_state) {
+                leds_used = run_program(i, leds_used);
+            } else {
+                reset_program(i);
+            }
+        }
+
+        light_switch_position = var_[GLOBAL_VAR_LIGHT_SWITCH_POSITION];
+
+        return leds_used;
+    };
+
+
+    // *************************************************************************
+    // The blink flag toggles freely; switching the indicators or hazard
+    // lights on restarts it (process_indicators() in indicators.c)
+    var process_blink_flag = function () {
+        if (blink_flag_given) {
+            return;
+        }
+
+        if (blink_counter === 0) {
+            blink_counter = blink_counter_value;
+            blink_flag = !blink_flag;
+        } else {
+            --blink_counter;
+        }
+    };
+
+
+    // *************************************************************************
+    var apply_input = function (name, value) {
+        var i;
+        var indicators = inputs.indicator_left || inputs.indicator_right ||
+                inputs.hazard;
+
+        if (name === "clicks") {
+            for (i = 0; i < value; i++) {
+                ++var_[GLOBAL_VAR_CLICKS];
+            }
+            if (value) {
+                process_light_program_events(EVENTS.clicks);
+            }
+            return;
+        }
+
+        if (name === "gear_changed") {
+            if (value) {
+                process_light_program_events(RUN_ON_GEAR_CHANGED);
+            }
+            return;
+        }
+
+        if (name === "event") {
+            if (!EVENTS.hasOwnProperty(value)) {
+                throw new Error("Unknown event '" + value + "'");
+            }
+            process_light_program_events(EVENTS[value]);
+            return;
+        }
+
+        if (name === "light_switch_position") {
+            light_switch_position = value;
+            return;
+        }
+
+        // Once given by the scenario, the blink flag no longer toggles freely
+        if (name === "blink_flag") {
+            blink_flag = Boolean(value);
+            blink_flag_given = true;
+            return;
+        }
+
+        if (name === "steering"  ||  name === "throttle"  ||  name === "gear") {
+            value = (value << 16) >> 16;
+        }
+
+        if (!DEFAULT_INPUTS.hasOwnProperty(name)) {
+            throw new Error("Unknown input '" + name + "'");
+        }
+
+        if (!indicators  &&  value  &&  !blink_flag_given  &&
+                (name === "indicator_left"  ||
+                name === "indicator_right"  ||  name === "hazard")) {
+            blink_counter = blink_counter_value;
+            blink_flag = true;
+        }
+
+        inputs[name] = value;
+    };
+
+
+    // *************************************************************************
+    var reset = function (options) {
+        var i;
+        var name;
+
+        options = options || {};
+
+        var_ = new Int16Array(NUMBER_OF_VARIABLES);
+        light_setpoint = new Uint8Array(MAX_LIGHTS);
+        light_actual = new Uint8Array(MAX_LIGHTS);
+        max_change_per_systick = new Uint8Array(MAX_LIGHTS);
+        light_switch_position = 0;
+        light_switch_positions = (options.light_switch_positions !== undefined) ?
+                options.light_switch_positions : DEFAULT_LIGHT_SWITCH_POSITIONS;
+        blink_counter_value = (options.blink_counter_value !== undefined) ?
+                options.blink_counter_value : DEFAULT_BLINK_COUNTER_VALUE;
+        blink_counter = 0;
+        blink_flag = false;
+        blink_flag_given = false;
+        entropy = (options.entropy || 0) >>> 0;
+        lfsr = 0;
+
+        inputs = {};
+        for (name in DEFAULT_INPUTS) {
+            if (DEFAULT_INPUTS.hasOwnProperty(name)) {
+                inputs[name] = DEFAULT_INPUTS[name];
+            }
+        }
+
+        for (i = 0; i < start.length; i++) {
+            reset_program(i);
+        }
+    };
+
+
+    // *************************************************************************
+    // LEDs used by any of the light programs
+    var get_leds_used = function () {
+        var i;
+        var leds_used = 0;
+        var result = [];
+
+        for (i = 0; i < start.length; i++) {
+            leds_used |= words[start[i] + LEDS_USED_OFFSET];
+        }
+        for (i = 0; i < MAX_LIGHTS; i++) {
+            if (leds_used & (1 << i)) {
+                result.push(i);
+            }
+        }
+        return result;
+    };
+
+
+    // *************************************************************************
+    // Run the light programs through a scenario.
+    //
+    // scenario.inputs is a list of {"time": ms, <input>: value, ...}, sorted
+    // by time. The inputs of an entry are applied before the systick that
+    // starts at the given time.
+    //
+    // Returns {"systick": ms, "leds": [LED numbers], "light_actual": [[...]],
+    // "leds_used": [...]} with one row of brightness values (0..255) and the
+    // bit mask of the LEDs driven by light programs per systick.
+    var run = function (light_programs, scenario, options) {
+        var i;
+        var k;
+        var systick;
+        var systicks;
+        var steps;
+        var step;
+        var name;
+        var leds_used;
+        var leds;
+        var row;
+        var trace = [];
+        var masks = [];
+        var next = 0;
+
+        options = options || {};
+        steps = scenario.inputs || [];
+
+        load(light_programs);
+        reset({
+            "entropy": (options.entropy !== undefined) ?
+                    options.entropy : scenario.entropy,
+            "light_switch_positions": scenario.light_switch_positions,
+            "blink_counter_value": scenario.blink_counter_value
+        });
+
+        systicks = options.duration || scenario.duration;
+        if (!systicks) {
+            systicks = (steps.length ? steps[steps.length - 1].time : 0) + 5000;
+        }
+        systicks = Math.ceil(systicks / __SYSTICK_IN_MS);
+
+        leds = options.all_leds ? null : get_leds_used();
+        if (leds === null) {
+            leds = [];
+            for (i = 0; i < MAX_LIGHTS; i++) {
+                leds.push(i);
+            }
+        }
+
+        for (systick = 0; systick < systicks; systick++) {
+            process_blink_flag();
+
+            while (next < steps.length  &&
+                    steps[next].time <= systick * __SYSTICK_IN_MS) {
+                step = steps[next++];
+                for (name in step) {
+                    if (step.hasOwnProperty(name)  &&  name !== "time") {
+                        apply_input(name, step[name]);
+                    }
+                }
+            }
+
+            // Incremented in every mainloop of the firmware
+            entropy = (entropy + 1) >>> 0;
+
+            leds_used = process_light_programs();
+            masks.push(leds_used >>> 0);
+
+            for (i = 0; i < MAX_LIGHTS; i++) {
+                if (!(leds_used & (1 << i))) {
+                    light_setpoint[i] = 0;
+                    max_change_per_systick[i] = 0;
+                }
+
+                if (max_change_per_systick[i] > 0) {
+                    light_actual[i] = calculate_step_value(light_actual[i],
+                        light_setpoint[i], max_change_per_systick[i]);
+                } else {
+                    light_actual[i] = light_setpoint[i];
+                }
+            }
+
+            row = new Array(leds.length);
+            for (k = 0; k < leds.length; k++) {
+                row[k] = light_actual[leds[k]];
+            }
+            trace.push(row);
+        }
+
+        return {
+            "systick": __SYSTICK_IN_MS,
+            "leds": leds,
+            "light_actual": trace,
+            "leds_used": masks
+        };
+    };
+
+
+    // *************************************************************************
+    var to_csv = function (result) {
+        var lines = [];
+        var i;
+
+        lines.push(["time"].concat(result.leds.map(function (led) {
+            return "led" + led;
+        })).join(","));
+
+        for (i = 0; i < result.light_actual.length; i++) {
+            lines.push([i * result.systick].concat(result.light_actual[i]).join(","));
+        }
+
+        return lines.join("\n") + "\n";
+    };
+
+
+    // *************************************************************************
+    var to_json = function (result) {
+        var rows = result.light_actual.map(function (row) {
+            return "    [" + row.join(", ") + "]";
+        });
+
+        return "{\n" +
+            "  \"systick\": " + result.systick + ",\n" +
+            "  \"leds\": [" + result.leds.join(", ") + "],\n" +
+            "  \"light_actual\": [\n" + rows.join(",\n") + "\n  ]\n" +
+            "}\n";
+    };
+
+
+    // *************************************************************************
+    // Same format as tools/light-trace with the -e option: one line per
+    // systick in which an LED driven by the light programs changed, LEDs not
+    // driven by light programs are "--"
+    var to_trace = function (result) {
+        var lines = [];
+        var last = null;
+        var row;
+        var n;
+
+        var format = function (n) {
+            var led;
+            var k;
+            var hex = "";
+
+            for (led = 0; led < MAX_LIGHTS; led++) {
+                k = result.leds.indexOf(led);
+                if (k < 0  ||  !(result.leds_used[n] & (1 << led))) {
+                    hex += "--";
+                } else {
+                    hex += ("0" + result.light_actual[n][k].toString(16)).slice(-2);
+                }
+            }
+            return hex;
+        };
+
+        for (n = 0; n < result.light_actual.length; n++) {
+            row = format(n);
+            if (row !== last) {
+                lines.push(n + " " + row);
+                last = row;
+            }
+        }
+
+        // The last line contains the systick in which the scenario ended
+        n = result.light_actual.length;
+        if (n) {
+            lines.push(n + " " + format(n - 1));
+        }
+
+        return lines.join("\n") + "\n";
+    };
+
+
+    // *************************************************************************
+    // API of this module:
+    // *************************************************************************
+    return {
+        parse_c_code: parse_c_code,
+        run: run,
+        to_csv: to_csv,
+        to_json: to_json,
+        to_trace: to_trace
+    };
+}());
+
+
+// node.js exports; hide from browser where exports is undefined and use strict
+// would trigger.
+if (typeof exports !== "undefined") {
+    exports.emulator = emulator;
+}
@@ -0,0 +1,67 @@
+#!/usr/bin/env node
+
+/*jslint node: true, vars: true, stupid: true, unparam: true */
+"use strict";
+
+var program = require('commander');
+var fs = require('fs');
+
+var emulator = require("./emulator").emulator;
+
+
+program
+    .version('1.0.0')
+    .usage('[options] <light_programs.c> [scenario.json]')
+    .option('-o, --output <value>', 'Output file. If omitted, output is printed to stdout.')
+    .option('-f, --format <value>', 'Output format: csv (default), json or trace.', 'csv')
+    .option('-d, --duration <ms>', 'Duration of the emulation in milliseconds.', parseInt)
+    .option('-e, --entropy <value>', 'Seed of the random number generator.', parseInt)
+    .option('-a, --all-leds', 'Output all 32 LEDs, not only the LEDs used by the light programs.')
+    .parse(process.argv);
+
+var sources = program.args;
+
+if (sources.length < 1  ||  sources.length > 2) {
+    console.error("No light programs given.");
+    process.exit(1);
+}
+
+if (program.format !== "csv"  &&  program.format !== "json"  &&
+        program.format !== "trace") {
+    console.error("Unknown output format '" + program.format + "'.");
+    process.exit(1);
+}
+
+try {
+    var light_programs = emulator.parse_c_code(fs.readFileSync(sources[0], "utf8"));
+    var scenario = {};
+
+    if (sources.length > 1) {
+        scenario = JSON.parse(fs.readFileSync(sources[1], "utf8"));
+    }
+
+    var result = emulator.run(light_programs, scenario, {
+        duration: program.duration,
+        entropy: program.entropy,
+        all_leds: program.allLeds
+    });
+
+    var output;
+
+    if (program.format === "json") {
+        output = emulator.to_json(result);
+    } else if (program.format === "trace") {
+        output = emulator.to_trace(result);
+    } else {
+        output = emulator.to_csv(result);
+    }
+
+    if (program.output) {
+        fs.writeFileSync(program.output, output);
+    } else {
+        process.stdout.write(output);
+    }
+} catch (e) {
+    console.error("Error: " + e.message);
+    process.exit(1);
+}
@@ -12,6 +12,7 @@ var hardware_test_configuration = {
     "ch3_is_momentary": false,
     "auto_brake_lights_forward_enabled": true,
     "auto_brake_lights_reverse_enabled": true,
+    "preprocessor_output_v2": false,
     "auto_brake_counter_value_forward_min": 25,
     "auto_brake_counter_value_forward_max": 125,
     "auto_brake_counter_value_reverse_min": 25,
@@ -37,7 +38,11 @@ var hardware_test_configuration = {
     "gearbox_servo_idle_time": 450,
     "servo_pulse_min": 600,
     "servo_pulse_max": 2500,
-    "startup_time": 100
+    "startup_time": 100,
+    "servo_output_frame_rate": 50,
+    "gearbox_servo_speed": 50,
+    "gearbox_servo_ramp_time": 5,
+    "servo_input_filter": 0
   },
   "local_leds": {
     "0": {
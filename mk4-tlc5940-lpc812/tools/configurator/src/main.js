@@ -23,6 +23,16 @@ var app = (function () {
     var MAX_LIGHT_PROGRAMS = 25;
     // var MAX_LIGHT_PROGRAM_VARIABLES = 100;
 
+    // Must match CONFIG_VERSION and LIGHT_PROGRAMS_VERSION in globals.h
+    var CONFIG_VERSION = 3;
+    var LIGHT_PROGRAMS_VERSION = 7;
+    var LIGHT_PROGRAMS_NATIVE = 0x8000;
+
+    // Firmware images before the compact bytecode; the assembler and the
+    // disassembler still support them
+    var LEGACY_LIGHT_PROGRAMS_VERSION = 1;
+    var light_programs_version;
+
     var light_switch_positions;
 
     var SECTION_CONFIG = "Configuration";
@@ -276,6 +286,7 @@ var app = (function () {
         new_config.ch3_is_momentary = get_flag(0x0080);
         new_config.auto_brake_lights_forward_enabled = get_flag(0x0100);
         new_config.auto_brake_lights_reverse_enabled = get_flag(0x0200);
+        new_config.preprocessor_output_v2 = get_flag(0x0400);
 
         new_config.auto_brake_counter_value_forward_min =
             get_uint16(data, offset + 8);
@@ -313,6 +324,25 @@ var app = (function () {
         new_config.servo_pulse_max = get_uint16(data, offset + 58);
         new_config.startup_time = get_uint16(data, offset + 60);
 
+        // Images built before the frame rate was configurable have 0 here
+        new_config.servo_output_frame_rate =
+            get_uint16(data, offset + 62) || 50;
+
+        // Fields added in later configuration versions get the defaults of
+        // config.c when loading an older firmware image
+        new_config.gearbox_servo_speed = 50;
+        new_config.gearbox_servo_ramp_time = 100 / SYSTICK_IN_MS;
+        new_config.servo_input_filter = 0;
+
+        if (config_version >= 2) {
+            new_config.gearbox_servo_speed = get_uint16(data, offset + 64);
+            new_config.gearbox_servo_ramp_time = get_uint16(data, offset + 66);
+        }
+
+        if (config_version >= 3) {
+            new_config.servo_input_filter = get_uint16(data, offset + 68);
+        }
+
         return new_config;
     };
 
@@ -328,7 +358,7 @@ var app = (function () {
         var instructions =
             uint8_array_to_uint32(data.slice(first_program_offset));
 
-        return disassembler.disassemble(instructions);
+        return disassembler.disassemble(instructions, light_programs_version);
     };
 
 
@@ -341,23 +371,46 @@ var app = (function () {
         var result = {};
         var section_id;
         var section;
+        var version;
 
         for (i = 0; i < image_data.length; i += 1) {
             if (image_data.slice(i, i + ROM_MAGIC_LENGTH).join() ===
                     ROM_MAGIC.join()) {
 
                 section_id = (image_data[i + 5] * 256) + image_data[i + 4];
-                config_version = (image_data[i + 7] * 256) + image_data[i + 6];
+                version = (image_data[i + 7] * 256) + image_data[i + 6];
 
                 if (SECTIONS[section_id] === undefined) {
                     console.log("Warning: unknown section " + i);
                 } else {
-                    if (config_version !== 1) {
-                        throw new Error("Unknown configuration version " +
-                            config_version);
+                    section = SECTIONS[section_id];
+
+                    // The light programs have their own version as the
+                    // bytecode format changes independently of the
+                    // configuration
+                    if (section === SECTION_LIGHT_PROGRAMS) {
+                        if (version & LIGHT_PROGRAMS_NATIVE) {
+                            throw new Error("The light programs of this " +
+                                "firmware are compiled to native code and " +
+                                "can not be edited");
+                        }
+                        if (version !== LIGHT_PROGRAMS_VERSION  &&
+                                version !== LEGACY_LIGHT_PROGRAMS_VERSION) {
+                            throw new Error("Unknown light program version " +
+                                version);
+                        }
+                        light_programs_version = version;
+                    } else {
+                        // Older configuration versions are loaded with
+                        // defaults for the fields they do not have
+                        config_version = version;
+                        if (config_version < 1  ||
+                                config_version > CONFIG_VERSION) {
+                            throw new Error("Unknown configuration version " +
+                                config_version);
+                        }
                     }
 
-                    section = SECTIONS[section_id];
                     result[section] = i + 8;
                 }
             }
@@ -447,14 +500,56 @@ var app = (function () {
 
 
     // *************************************************************************
-    var update_section_visibility = function () {
-        function set_name(elements, name) {
-            var i;
+    var uart_output_group = function () {
+        // The slave, pre-processor and winch outputs share the pin with the
+        // radio buttons of OUT/ISP (servo reader) or TH/Tx (UART and CPPM)
+        if (parseInt(el.mode.value, 10) === MODE.MASTER_WITH_SERVO_READER) {
+            return "output_out";
+        }
+        return "output_th";
+    };
+
+
+    // *************************************************************************
+    var count_uart_outputs = function () {
+        var i;
+        var count = 0;
+
+        for (i = 0; i < el.dual_output_th.length; i += 1) {
+            if (el.dual_output_th[i].checked) {
+                count += 1;
+            }
+        }
+        return count;
+    };
+
+
+    // *************************************************************************
+    var update_uart_outputs = function (event) {
+        // The UART outputs are check boxes as they can be combined, but they
+        // exclude the servo outputs on the same pin
+        var i;
+        var elements = document.getElementsByName(uart_output_group());
+
+        if (!event.target.checked) {
+            return;
+        }
+
+        if (event.target.name === uart_output_group()) {
+            for (i = 0; i < el.dual_output_th.length; i += 1) {
+                el.dual_output_th[i].checked = false;
+            }
+        }
+        else if (event.target.className === "dual_output_th") {
             for (i = 0; i < elements.length; i += 1) {
-                elements[i].name = name;
+                elements[i].checked = false;
             }
         }
+    };
+
 
+    // *************************************************************************
+    var update_section_visibility = function () {
         function set_visibility(elements, value) {
             var i;
             for (i = 0; i < elements.length; i += 1) {
@@ -465,6 +560,14 @@ var app = (function () {
         function ensure_one_is_checked(name) {
             var i;
             var elements = document.getElementsByName(name);
+
+            if (count_uart_outputs()  &&  name === uart_output_group()) {
+                for (i = 0; i < elements.length; i += 1) {
+                    elements[i].checked = false;
+                }
+                return;
+            }
+
             for (i = 0; i < elements.length; i += 1) {
                 if (elements[i].checked) {
                     return;
@@ -493,7 +596,6 @@ var app = (function () {
             el.config_advanced.style.display = "";
             set_visibility(el.single_output, "");
             set_visibility(el.dual_output, "none");
-            set_name(el.dual_output_th, "output_out");
             config.mode = new_mode;
             break;
 
@@ -513,7 +615,6 @@ var app = (function () {
             el.config_advanced.style.display = "";
             set_visibility(el.single_output, "none");
             set_visibility(el.dual_output, "");
-            set_name(el.dual_output_th, "output_th");
             config.mode = new_mode;
             break;
 
@@ -533,7 +634,6 @@ var app = (function () {
             el.config_advanced.style.display = "";
             set_visibility(el.single_output, "none");
             set_visibility(el.dual_output, "");
-            set_name(el.dual_output_th, "output_th");
             config.mode = new_mode;
             break;
 
@@ -572,6 +672,15 @@ var app = (function () {
 
         el.leds_slave.style.display =
             el.slave_output.checked ? "" : "none";
+
+        el.winch_shared_warning.style.display = (el.winch_output.checked  &&
+            (el.slave_output.checked  ||  el.preprocessor_output.checked)) ?
+                "" : "none";
+
+        // Firmware before configuration version 3 drives only one of the
+        // UART outputs
+        el.uart_multiplex_warning.style.display =
+            (config_version < 3  &&  count_uart_outputs() > 1) ? "" : "none";
     };
 
 
@@ -654,8 +763,14 @@ var app = (function () {
             Boolean(config.gearbox_servo_output);
         el.steering_wheel_servo_output.checked =
             Boolean(config.steering_wheel_servo_output);
+        el.gearbox_servo_output_th.checked =
+            config.mode !== MODE.MASTER_WITH_SERVO_READER  &&
+            Boolean(config.steering_wheel_servo_output)  &&
+            Boolean(config.gearbox_servo_output);
         el.preprocessor_output.checked =
             Boolean(config.preprocessor_output);
+        el.preprocessor_output_v2.checked =
+            Boolean(config.preprocessor_output_v2);
         el.slave_output.checked = Boolean(config.slave_output);
 
         // CH3/AUX type
@@ -715,8 +830,9 @@ var app = (function () {
             config.no_signal_timeout * SYSTICK_IN_MS;
 
         el.number_of_gears.value = config.number_of_gears;
-        el.gearbox_servo_active_time.value =
-            config.gearbox_servo_active_time * SYSTICK_IN_MS;
+        el.gearbox_servo_speed.value = config.gearbox_servo_speed;
+        el.gearbox_servo_ramp_time.value =
+            config.gearbox_servo_ramp_time * SYSTICK_IN_MS;
         el.gearbox_servo_idle_time.value =
             config.gearbox_servo_idle_time * SYSTICK_IN_MS;
 
@@ -726,6 +842,13 @@ var app = (function () {
         el.servo_pulse_min.value = config.servo_pulse_min;
         el.servo_pulse_max.value = config.servo_pulse_max;
         el.startup_time.value = config.startup_time * SYSTICK_IN_MS;
+        el.servo_output_frame_rate.value = config.servo_output_frame_rate;
+        el.servo_input_filter.value = config.servo_input_filter;
+
+        // The firmware of older images does not have these settings
+        el.gearbox_servo_speed.disabled = (config_version < 2);
+        el.gearbox_servo_ramp_time.disabled = (config_version < 2);
+        el.servo_input_filter.disabled = (config_version < 3);
 
 
         el.gamma_value.value = gamma_object.gamma_value;
@@ -796,6 +919,7 @@ var app = (function () {
         // especially if there was an error before.
         symbols.reset();
         emitter.reset();
+        emitter.set_light_programs_version(light_programs_version);
 
         ui.update_errors([]);
 
@@ -948,6 +1072,7 @@ var app = (function () {
         flags |= (config.ch3_is_momentary << 7);
         flags |= (config.auto_brake_lights_forward_enabled << 8);
         flags |= (config.auto_brake_lights_reverse_enabled << 9);
+        flags |= (config.preprocessor_output_v2 << 10);
         set_uint32(data, offset + 4, flags);
 
         set_uint16(data, offset + 8,  config.auto_brake_counter_value_forward_min);
@@ -981,6 +1106,17 @@ var app = (function () {
         set_uint16(data, offset + 58, config.servo_pulse_max);
 
         set_uint16(data, offset + 60, config.startup_time);
+        set_uint16(data, offset + 62, config.servo_output_frame_rate);
+
+        // Older firmware images end the configuration before these fields
+        if (config_version >= 2) {
+            set_uint16(data, offset + 64, config.gearbox_servo_speed);
+            set_uint16(data, offset + 66, config.gearbox_servo_ramp_time);
+        }
+
+        if (config_version >= 3) {
+            set_uint16(data, offset + 68, config.servo_input_filter);
+        }
     };
 
 
@@ -1230,16 +1366,26 @@ var app = (function () {
         if (config.mode === MODE.SLAVE) {
             // Force all output functions to OFF in slave mode
             config.preprocessor_output = false;
+            config.preprocessor_output_v2 = false;
             config.slave_output = false;
             config.steering_wheel_servo_output = false;
             config.gearbox_servo_output = false;
             config.winch_output = false;
         } else {
             update_boolean('preprocessor_output');
+            update_boolean('preprocessor_output_v2');
             update_boolean('slave_output');
             update_boolean('steering_wheel_servo_output');
             update_boolean('gearbox_servo_output');
             update_boolean('winch_output');
+
+            // Gearbox servo on TH/Tx in addition to the steering wheel servo
+            // on OUT/ISP
+            if (config.mode !== MODE.MASTER_WITH_SERVO_READER  &&
+                    config.steering_wheel_servo_output  &&
+                    el.gearbox_servo_output_th.checked) {
+                config.gearbox_servo_output = true;
+            }
         }
 
 
@@ -1288,7 +1434,8 @@ var app = (function () {
         update_time("winch_command_repeat_time");
         update_time("no_signal_timeout");
         update_int("number_of_gears");
-        update_time("gearbox_servo_active_time");
+        update_int("gearbox_servo_speed");
+        update_time("gearbox_servo_ramp_time");
         update_time("gearbox_servo_idle_time");
 
         update_int("initial_light_switch_position");
@@ -1296,6 +1443,8 @@ var app = (function () {
         update_int("servo_pulse_min");
         update_int("servo_pulse_max");
         update_time("startup_time");
+        update_int("servo_output_frame_rate");
+        update_int("servo_input_filter");
 
 
         if (config.mode === MODE.SLAVE) {
@@ -1548,11 +1697,19 @@ var app = (function () {
         el.slave_output = document.getElementById("slave_output");
         el.preprocessor_output =
             document.getElementById("preprocessor_output");
+        el.preprocessor_output_v2 =
+            document.getElementById("preprocessor_output_v2");
         el.steering_wheel_servo_output =
             document.getElementById("steering_wheel_servo_output");
         el.gearbox_servo_output =
             document.getElementById("gearbox_servo_output");
+        el.gearbox_servo_output_th =
+            document.getElementById("gearbox_servo_output_th");
         el.winch_output = document.getElementById("winch_output");
+        el.winch_shared_warning =
+            document.getElementById("winch_shared_warning");
+        el.uart_multiplex_warning =
+            document.getElementById("uart_multiplex_warning");
 
         el.leds_clear = document.getElementById("leds_clear");
 
@@ -1613,8 +1770,10 @@ var app = (function () {
         el.no_signal_timeout = document.getElementById("no_signal_timeout");
 
         el.number_of_gears = document.getElementById("number_of_gears");
-        el.gearbox_servo_active_time =
-            document.getElementById("gearbox_servo_active_time");
+        el.gearbox_servo_speed =
+            document.getElementById("gearbox_servo_speed");
+        el.gearbox_servo_ramp_time =
+            document.getElementById("gearbox_servo_ramp_time");
         el.gearbox_servo_idle_time =
             document.getElementById("gearbox_servo_idle_time");
 
@@ -1625,12 +1784,17 @@ var app = (function () {
         el.servo_pulse_max = document.getElementById("servo_pulse_max");
 
         el.startup_time = document.getElementById("startup_time");
+        el.servo_output_frame_rate =
+            document.getElementById("servo_output_frame_rate");
+        el.servo_input_filter = document.getElementById("servo_input_filter");
 
         el.gamma_value = document.getElementById("gamma_value");
 
 
         el.mode.addEventListener("change", update_section_visibility, false);
 
+        el.config_basic_output.addEventListener("change", update_uart_outputs,
+            false);
         el.config_basic_output.addEventListener("change",
             update_section_visibility, false
             );
@@ -0,0 +1,474 @@
+/******************************************************************************
+
+    Endpoint learning test
+
+    Runs servo_reader.c and drive_mode.c of the firmware on the build host
+    and feeds them driving sessions through a model of the SCTimer L in CPPM
+    mode. Each session is a power cycle; the learned endpoints that the
+    firmware writes to the persistent storage are loaded again at the start
+    of the next session.
+
+    A session has the format of the traces of tools/servo-filter: a line per
+    receiver frame of 20 ms with the steering, throttle and CH3/AUX pulses in
+    us. A comment line
+
+        # transmitter: ST left centre right TH left centre right
+
+    gives the endpoints of the transmitter (see generate_sessions.py).
+
+    After every frame the mainloop calls read_all_servo_channels() and
+    process_drive_mode(), with a systick per frame.
+
+    For each session the learned endpoints at startup and after the session
+    are reported, the number of writes to the persistent storage, and the
+    average and maximum error of the steering and throttle percentage while
+    the stick is out of neutral. The error is the difference to the
+    percentage calculated with the endpoints of the transmitter.
+
+    The test fails if the persistent storage is written while the throttle
+    is out of neutral, or more than twice per session; or if a session moves
+    the learned endpoints away from the endpoints of the transmitter.
+
+    Every session starts the firmware afresh in a child process, as the
+    modules keep their state in static variables.
+
+    Usage: endpoint_learning_test session-file...
+
+******************************************************************************/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <LPC8xx.h>
+#include <globals.h>
+
+#define FRAME 20000
+#define MAX_FRAMES 30000
+
+// Errors are only counted while the stick is out of neutral by this much
+#define NEUTRAL_PERCENT 10
+
+// Allowed deviation of the learned endpoints, for jitter and the centre
+// taken from a single pulse at startup
+#define TOLERANCE 8
+
+#define MAX_WRITES_PER_SESSION 2
+
+extern void init_servo_reader(void);
+extern void read_all_servo_channels(void);
+extern void process_drive_mode(void);
+extern void SCT_irq_handler(void);
+
+
+typedef struct {
+    long frames;
+    SERVO_ENDPOINTS_T transmitter[2];
+    uint16_t pulse[MAX_FRAMES][3];
+} SESSION_T;
+
+typedef struct {
+    ENDPOINT_DELTA_T flash[2];      // Persistent storage after the session
+    long writes;
+    long unsafe_writes;
+    long samples[2];
+    long long error_sum[2];         // In 1/CHANNEL_FINE_SCALE percent
+    long error_max[2];
+} RESULT_T;
+
+
+// Environment servo_reader.c and drive_mode.c expect from the rest of the
+// firmware
+GLOBAL_FLAGS_T global_flags;
+CHANNEL_T channel[3];
+
+LPC_SWM_TypeDef host_swm;
+LPC_SCT_TypeDef host_sct;
+
+// The defaults of config.c
+const LIGHT_CONTROLLER_CONFIG_T config = {
+    .mode = MASTER_WITH_CPPM_READER,
+    .esc_mode = ESC_FORWARD_BRAKE_REVERSE_TIMEOUT,
+    .flags = {
+        .auto_brake_lights_forward_enabled = true,
+        .auto_brake_lights_reverse_enabled = true
+    },
+    .auto_brake_counter_value_forward_min = (500 / __SYSTICK_IN_MS),
+    .auto_brake_counter_value_forward_max = (2500 / __SYSTICK_IN_MS),
+    .auto_brake_counter_value_reverse_min = (500 / __SYSTICK_IN_MS),
+    .auto_brake_counter_value_reverse_max = (2500 / __SYSTICK_IN_MS),
+    .auto_reverse_counter_value_min = (800 / __SYSTICK_IN_MS),
+    .auto_reverse_counter_value_max = (2000 / __SYSTICK_IN_MS),
+    .brake_disarm_counter_value = (1000 / __SYSTICK_IN_MS),
+    .centre_threshold_low = 8,
+    .centre_threshold_high = 12,
+    .initial_endpoint_delta = 250,
+    .servo_pulse_min = 600,
+    .servo_pulse_max = 2500,
+    .startup_time = (2000 / __SYSTICK_IN_MS),
+    .servo_input_filter = SERVO_INPUT_FILTER_NONE
+};
+
+static SESSION_T session;
+static RESULT_T result;
+static const RESULT_T no_result;
+
+// Persistent storage, kept across sessions
+static ENDPOINT_DELTA_T flash[2];
+
+// Percentage of steering and throttle the driver intended in the current
+// frame, in 1/CHANNEL_FINE_SCALE percent
+static long intended[2];
+
+
+// ****************************************************************************
+// Utilities (utils.c)
+uint16_t random_min_max(uint16_t min, uint16_t max)
+{
+    return (min + max) / 2;
+}
+
+
+// ****************************************************************************
+// Servo output (servo_output.c) is not used by this test
+void servo_output_irq_handler(void)
+{
+}
+
+
+// ****************************************************************************
+// Persistent storage (persistent_storage.c), holding only the learned
+// endpoints
+void load_persistent_storage(void)
+{
+    learned_endpoint_delta[ST] = flash[ST];
+    learned_endpoint_delta[TH] = flash[TH];
+}
+
+
+// ****************************************************************************
+void write_persistent_storage(void)
+{
+    flash[ST] = learned_endpoint_delta[ST];
+    flash[TH] = learned_endpoint_delta[TH];
+
+    ++result.writes;
+    if (labs(intended[TH]) >= config.centre_threshold_low * CHANNEL_FINE_SCALE) {
+        ++result.unsafe_writes;
+    }
+}
+
+
+// ****************************************************************************
+static bool load_session(const char *filename)
+{
+    FILE *f;
+    char line[200];
+    uint16_t *p;
+    SERVO_ENDPOINTS_T *st = &session.transmitter[ST];
+    SERVO_ENDPOINTS_T *th = &session.transmitter[TH];
+    int n;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return false;
+    }
+
+    session.frames = 0;
+    st->centre = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') {
+            sscanf(line, "# transmitter: ST %hu %hu %hu TH %hu %hu %hu",
+                &st->left, &st->centre, &st->right,
+                &th->left, &th->centre, &th->right);
+            continue;
+        }
+        if (line[0] == '\n') {
+            continue;
+        }
+        if (session.frames >= MAX_FRAMES) {
+            fprintf(stderr, "%s: more than %d frames\n", filename, MAX_FRAMES);
+            break;
+        }
+
+        p = session.pulse[session.frames];
+        n = sscanf(line, "%hu %hu %hu", &p[0], &p[1], &p[2]);
+        if (n != 3) {
+            fprintf(stderr, "%s: invalid line: %s", filename, line);
+            fclose(f);
+            return false;
+        }
+        ++session.frames;
+    }
+
+    fclose(f);
+
+    if (st->centre == 0) {
+        fprintf(stderr, "%s: transmitter endpoints missing\n", filename);
+        return false;
+    }
+    return true;
+}
+
+
+// ****************************************************************************
+// Falling edge of the CPPM signal at time t (in us). CAP is read-only for
+// the firmware.
+static void cppm_edge(long t)
+{
+    *(volatile uint16_t *)&host_sct.CAP[1].L = (uint16_t)(t * 2);
+    host_sct.EVFLAG = (1 << 1);
+    SCT_irq_handler();
+}
+
+
+// ****************************************************************************
+static long percentage(uint16_t pulse, const SERVO_ENDPOINTS_T *e)
+{
+    long value;
+
+    if (pulse < e->centre) {
+        value = -((long)(e->centre - pulse) * 100 * CHANNEL_FINE_SCALE /
+            (e->centre - e->left));
+    }
+    else {
+        value = (long)(pulse - e->centre) * 100 * CHANNEL_FINE_SCALE /
+            (e->right - e->centre);
+    }
+
+    if (value > 100 * CHANNEL_FINE_SCALE) {
+        return 100 * CHANNEL_FINE_SCALE;
+    }
+    if (value < -100 * CHANNEL_FINE_SCALE) {
+        return -100 * CHANNEL_FINE_SCALE;
+    }
+    return value;
+}
+
+
+// ****************************************************************************
+static void simulate(void)
+{
+    long frame;
+    long t;
+    long error;
+    uint16_t *p;
+    int i;
+
+    load_persistent_storage();
+
+    // The SCTimer L wraps around at 0xffff
+    host_sct.MATCHREL[0].L = 0xffff;
+    init_servo_reader();
+
+    for (frame = 0; frame < session.frames; frame++) {
+        p = session.pulse[frame];
+        t = frame * FRAME;
+
+        for (i = 0; i < 2; i++) {
+            intended[i] = percentage(p[i], &session.transmitter[i]);
+        }
+
+        cppm_edge(t);
+        cppm_edge(t + p[0]);
+        cppm_edge(t + p[0] + p[1]);
+        cppm_edge(t + p[0] + p[1] + p[2]);
+
+        global_flags.systick = 1;
+        read_all_servo_channels();
+        process_drive_mode();
+
+        if (global_flags.initializing  ||  !global_flags.new_channel_data) {
+            continue;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (labs(intended[i]) < NEUTRAL_PERCENT * CHANNEL_FINE_SCALE) {
+                continue;
+            }
+            error = labs(channel[i].normalized * CHANNEL_FINE_SCALE - intended[i]);
+            result.error_sum[i] += error;
+            ++result.samples[i];
+            if (error > result.error_max[i]) {
+                result.error_max[i] = error;
+            }
+        }
+    }
+
+    result.flash[ST] = flash[ST];
+    result.flash[TH] = flash[TH];
+}
+
+
+// ****************************************************************************
+// Runs the session in a child process, which passes the result back
+static bool run_session(void)
+{
+    int fds[2];
+    pid_t pid;
+    size_t done = 0;
+    ssize_t n;
+    int status;
+
+    result = no_result;
+
+    if (pipe(fds) != 0) {
+        return false;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        simulate();
+        while (done < sizeof(result)) {
+            n = write(fds[1], (char *)&result + done, sizeof(result) - done);
+            if (n <= 0) {
+                _exit(1);
+            }
+            done += n;
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    while (done < sizeof(result)) {
+        n = read(fds[0], (char *)&result + done, sizeof(result) - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    return done == sizeof(result)  &&  WIFEXITED(status)  &&
+        WEXITSTATUS(status) == 0;
+}
+
+
+// ****************************************************************************
+// Distance of a learned endpoint to the one of the transmitter; 0 is what
+// the firmware uses when nothing has been learned yet
+static long deviation(uint16_t learned, uint16_t transmitter)
+{
+    if (learned == 0) {
+        learned = config.initial_endpoint_delta;
+    }
+    return labs((long)learned - (long)transmitter);
+}
+
+
+// ****************************************************************************
+static int check_endpoints(const ENDPOINT_DELTA_T *before, const ENDPOINT_DELTA_T *after, const SERVO_ENDPOINTS_T *transmitter, const char *name)
+{
+    uint16_t left = transmitter->centre - transmitter->left;
+    uint16_t right = transmitter->right - transmitter->centre;
+
+    if (deviation(after->left, left) > deviation(before->left, left) + TOLERANCE  ||
+        deviation(after->right, right) > deviation(before->right, right) + TOLERANCE) {
+
+        printf("        FAIL: learned %s endpoints moved away from the "
+            "transmitter\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+
+// ****************************************************************************
+static void print_error(int i, const char *name)
+{
+    if (result.samples[i] == 0) {
+        printf(" %s -", name);
+        return;
+    }
+    printf(" %s avg %.1f%% max %.1f%%", name,
+        (double)result.error_sum[i] / result.samples[i] / CHANNEL_FINE_SCALE,
+        (double)result.error_max[i] / CHANNEL_FINE_SCALE);
+}
+
+
+// ****************************************************************************
+static int test_session(const char *filename)
+{
+    ENDPOINT_DELTA_T boot[2];
+    const SERVO_ENDPOINTS_T *st = &session.transmitter[ST];
+    const SERVO_ENDPOINTS_T *th = &session.transmitter[TH];
+    int failures = 0;
+
+    if (!load_session(filename)) {
+        return 1;
+    }
+
+    boot[ST] = flash[ST];
+    boot[TH] = flash[TH];
+
+    if (!run_session()) {
+        printf("%s:\n    FAIL: simulation failed\n", filename);
+        return 1;
+    }
+    flash[ST] = result.flash[ST];
+    flash[TH] = result.flash[TH];
+
+    printf("%s: %ld frames, transmitter ST -%u/+%u TH -%u/+%u us\n",
+        filename, session.frames, st->centre - st->left,
+        st->right - st->centre, th->centre - th->left,
+        th->right - th->centre);
+    printf("    startup  ST -%u/+%u TH -%u/+%u us\n",
+        boot[ST].left, boot[ST].right, boot[TH].left, boot[TH].right);
+    printf("    learned  ST -%u/+%u TH -%u/+%u us, %ld writes\n",
+        flash[ST].left, flash[ST].right, flash[TH].left, flash[TH].right,
+        result.writes);
+    printf("    error   ");
+    print_error(ST, "ST");
+    print_error(TH, "TH");
+    printf("\n");
+
+    if (result.unsafe_writes) {
+        printf("        FAIL: persistent storage written while driving\n");
+        ++failures;
+    }
+    if (result.writes > MAX_WRITES_PER_SESSION) {
+        printf("        FAIL: persistent storage written more than %d "
+            "times\n", MAX_WRITES_PER_SESSION);
+        ++failures;
+    }
+    failures += check_endpoints(&boot[ST], &flash[ST], st, "steering");
+    failures += check_endpoints(&boot[TH], &flash[TH], th, "throttle");
+
+    return failures;
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    int i;
+    int failures = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s session-file...\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        failures += test_session(argv[i]);
+    }
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
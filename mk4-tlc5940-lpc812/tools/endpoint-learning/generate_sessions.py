@@ -0,0 +1,136 @@
+#!/usr/bin/env python
+'''
+generate_sessions.py
+
+Writes the sessions of the endpoint learning test: pulse traces of driving
+sessions, one per power cycle, in the format of tools/servo-filter. A
+comment line gives the endpoints of the transmitter, which the test uses to
+calculate the percentages the driver intended.
+
+The first sessions use the full endpoints of the transmitter, one of them
+only up to 60% of the travel. In the later sessions the endpoints of the
+transmitter have been reduced.
+
+The receiver adds jitter of up to +/-JITTER us to every pulse, and in
+GLITCH_PERMILLE of the frames a glitch of 15..60 us on one channel. A fixed
+seed makes the sessions reproducible.
+
+Author:         Werner Lane
+E-mail:         laneboysrc@gmail.com
+'''
+
+from __future__ import print_function
+
+import math
+import os
+import sys
+
+FRAME_MS = 20
+CENTRE = 1500
+JITTER = 3
+GLITCH_PERMILLE = 3
+
+# Left and right endpoints of steering and throttle in us
+FULL_TRAVEL = ((1150, 1850), (1100, 1900))
+REDUCED_TRAVEL = ((1200, 1800), (1180, 1820))
+
+# Steering and throttle in percent: (time in ms, percent) points, with
+# linear moves in between. The session ends with 10 s in neutral.
+STEERING = [
+    (0, 0), (4000, 0), (4300, -100), (5300, -100), (5800, 100), (6800, 100),
+    (7100, 0), (24000, 0), (24500, -40), (26000, 70), (28000, 70),
+    (28300, 0), (40000, 0)]
+
+THROTTLE = [
+    (0, 0), (8000, 0), (8500, 50), (10000, 50), (10300, 100), (12000, 100),
+    (12300, 0), (14000, -100), (15000, -100), (15200, 0), (19000, 0),
+    (19300, -60), (22000, -60), (22300, 0), (25000, 0), (25500, 70),
+    (29000, 70), (29500, 0), (40000, 0)]
+
+SESSIONS = [
+    ('01-first-drive', 'First drive after flashing the firmware',
+        FULL_TRAVEL, 100),
+    ('02-second-drive', 'Same transmitter, next power cycle',
+        FULL_TRAVEL, 100),
+    ('03-gentle-drive', 'Same transmitter, only up to 60% of the travel',
+        FULL_TRAVEL, 60),
+    ('04-reduced-endpoints', 'Endpoints of the transmitter reduced',
+        REDUCED_TRAVEL, 100),
+    ('05-reduced-endpoints', 'Reduced endpoints, next power cycle',
+        REDUCED_TRAVEL, 100),
+    ('06-reduced-endpoints', 'Reduced endpoints, next power cycle',
+        REDUCED_TRAVEL, 100),
+]
+
+
+class Random(object):
+    ''' Same LCG as the host tests, so that Python 2 and 3 give the same
+        sessions '''
+    def __init__(self, seed):
+        self.state = seed
+
+    def next(self, modulo):
+        self.state = (self.state * 1103515245 + 12345) & 0xffffffff
+        return ((self.state >> 16) & 0x7fff) % modulo
+
+
+def percent(points, t):
+    for (t0, p0), (t1, p1) in zip(points, points[1:]):
+        if t0 <= t <= t1:
+            return p0 + (p1 - p0) * (t - t0) / float(t1 - t0)
+    return points[-1][1]
+
+
+def pulse(value, endpoints):
+    ''' Rounds alike in Python 2 and 3 '''
+    if value < 0:
+        delta = CENTRE - endpoints[0]
+    else:
+        delta = endpoints[1] - CENTRE
+    return int(math.floor(CENTRE + value * delta / 100.0 + 0.5))
+
+
+def write_session(name, description, travel, scale, directory):
+    rnd = Random(sum(ord(c) for c in name))
+    duration = STEERING[-1][0]
+
+    with open(os.path.join(directory, name + '.trace'), 'w') as f:
+        f.write('# %s\n' % description)
+        f.write('# Generated by generate_sessions.py: jitter +/-%d us, '
+            'glitches in %d per mille of the frames\n' % (JITTER,
+                GLITCH_PERMILLE))
+        f.write('# transmitter: ST %d %d %d TH %d %d %d\n' % (travel[0][0],
+            CENTRE, travel[0][1], travel[1][0], CENTRE, travel[1][1]))
+        f.write('# ST TH CH3 as received\n')
+
+        for frame in range(duration // FRAME_MS):
+            t = frame * FRAME_MS
+            received = [
+                pulse(percent(STEERING, t) * scale / 100.0, travel[0]),
+                pulse(percent(THROTTLE, t) * scale / 100.0, travel[1]),
+                1000]
+
+            for i in range(len(received)):
+                received[i] += (rnd.next(JITTER + 1) + rnd.next(JITTER + 1) -
+                    JITTER)
+
+            if rnd.next(1000) < GLITCH_PERMILLE:
+                glitch = 15 + rnd.next(46)
+                if rnd.next(2):
+                    glitch = -glitch
+                received[rnd.next(3)] += glitch
+
+            f.write('%d %d %d\n' % tuple(received))
+
+
+def main():
+    directory = os.path.join(os.path.dirname(sys.argv[0]), 'sessions')
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    for name, description, travel, scale in SESSIONS:
+        write_session(name, description, travel, scale, directory)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,48 @@
+###############################################################################
+# Build setup shared by the tools that run firmware modules on the build host
+#
+# Include this file after setting BUILD_DIR, FIRMWARE_PATH and HOST_PATH.
+# HOST_PATH is the directory holding the LPC8xx.h of the build host, which
+# must be found before the device header of the firmware. Tools append their
+# own settings to CFLAGS after the include.
+
+
+###############################################################################
+# Pretty-print setup
+V ?= $(VERBOSE)
+ifneq ($(V), 1)
+QUIET := @
+ECHO := @echo
+else
+QUIET :=
+ECHO := @true
+endif
+
+
+###############################################################################
+# Toolchain setup (host compiler). Optimize for size like the firmware does.
+CC := cc
+MKDIR_P = mkdir -p
+
+CFLAGS = -std=c99 -Os
+CFLAGS += -W -Wall -Wextra
+CFLAGS += -I$(HOST_PATH) -I$(FIRMWARE_PATH) -isystem$(FIRMWARE_PATH)/LPC8xx
+CFLAGS += -fpack-struct=4
+CFLAGS += -D__SYSTEM_CLOCK=12000000
+CFLAGS += -DNODEBUG
+
+# The linker script of the light controller defines the end of the light
+# programs; on the build host they end with the light_programs variable
+CFLAGS += -D'LIGHT_PROGRAMS_END=((const uint8_t *)(&light_programs + 1))'
+
+# Rebuild when the shared setup changes
+DEPENDENCIES += $(lastword $(MAKEFILE_LIST))
+
+$(shell $(MKDIR_P) $(BUILD_DIR))   # Always create the build directory
+
+
+###############################################################################
+# Clean all generated files
+clean:
+	$(ECHO) [RM] $(BUILD_DIR)
+	$(QUIET) $(RM) -rf $(BUILD_DIR)/*
@@ -0,0 +1,364 @@
+/******************************************************************************
+
+    Brake and reversing light latency measurement
+
+    Runs the light related modules of the firmware on the build host, with
+    the default configuration and light programs of the firmware, together
+    with a model of the receiver, the systick and the mainloop, and reports
+    the latency of the brake and reversing lights.
+
+    The simulation is event driven with a resolution of 1 us:
+
+    - The receiver sends a throttle value every receiver frame, cycling
+      through forward, brake, neutral, reverse and neutral (see throttle()).
+      The "input edge" is the end of the servo pulses of the frame that
+      switches the brake or reversing lights on, when the servo reader flags
+      new channel data.
+    - The systick fires every __SYSTICK_IN_MS.
+    - The mainloop runs every mainloop period, half a period after the end
+      of the first receiver frame. It takes over the newest throttle value
+      and calls the same functions as main.c.
+    - Sending the LED data to the TLC5940 takes SPI_TRANSFER_TIME. The
+      TLC5940 latches the data at the end of the transfer (XLAT), which is
+      when the LED changes.
+
+    The latency is the time from the input edge until the first brake
+    (reversing) light reaches the brightness configured for its brake
+    (reversing) light function.
+
+    lights.c is built with and without its fast path (see makefile).
+
+    Usage: light_latency [receiver frame in us [mainloop period in us]]
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <LPC8xx.h>
+#include <globals.h>
+#include <uart0.h>
+
+#define DEFAULT_RECEIVER_FRAME 18000
+#define DEFAULT_MAINLOOP_PERIOD 1000
+#define SIMULATION_TIME 600000000L
+
+#define SYSTICK_PERIOD (__SYSTICK_IN_MS * 1000L)
+
+// 16 LEDs of 6 bit at 2 MHz SPI clock, see init_lights()
+#define SPI_TRANSFER_TIME 50
+
+// Throttle cycle, in us. The cycle length is not a multiple of the systick
+// so that the input edges cover all phases of the systick.
+#define CYCLE_FORWARD 0
+#define CYCLE_BRAKE 500000
+#define CYCLE_NEUTRAL 1000000
+#define CYCLE_REVERSE 2000000
+#define CYCLE_NEUTRAL_AGAIN 2500000
+#define CYCLE_LENGTH 5501000
+
+extern LED_T light_actual[MAX_LIGHTS];
+
+typedef struct {
+    const char *name;
+    int led;
+    LED_T value;
+    long edge;                      // Input edge being measured, or -1
+    long min;
+    long max;
+    long long sum;
+    long count;
+} MEASUREMENT_T;
+
+
+// Environment the firmware modules expect from main.c, crt0.c and the
+// hardware drivers
+GLOBAL_FLAGS_T global_flags;
+CHANNEL_T channel[3];
+uint32_t entropy = 0x12345678;
+
+LPC_GPIO_PORT_TypeDef host_gpio_port;
+LPC_SWM_TypeDef host_swm;
+LPC_SCT_TypeDef host_sct;
+static LPC_SPI_TypeDef host_spi;
+
+static int16_t input;
+static bool input_pending;
+
+
+// ****************************************************************************
+LPC_SPI_TypeDef *host_spi0(void)
+{
+    host_spi.STAT = 0xffffffff;
+    return &host_spi;
+}
+
+
+// ****************************************************************************
+bool diagnostics_enabled(void)
+{
+    return false;
+}
+
+
+// ****************************************************************************
+// UART driver (uart0.c): nothing is connected
+bool uart0_send_is_ready(void) { return true; }
+void uart0_send_char(const char c) { (void)c; }
+void uart0_send_cstring(const char *cstring) { (void)cstring; }
+void uart0_send_int32(int32_t number) { (void)number; }
+void uart0_send_uint32(uint32_t number) { (void)number; }
+void uart0_send_uint32_hex(uint32_t number) { (void)number; }
+void uart0_send_uint16_hex(uint16_t number) { (void)number; }
+void uart0_send_uint8_hex(uint8_t number) { (void)number; }
+void uart0_send_linefeed(void) { }
+bool uart0_read_is_byte_pending(void) { return false; }
+uint8_t uart0_read_byte(void) { return 0; }
+
+
+// ****************************************************************************
+// Persistent storage (persistent_storage.c): the defaults of an erased flash
+void load_persistent_storage(void)
+{
+    channel[ST].reversed = false;
+    channel[TH].reversed = false;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].left = 1000;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].centre = 1500;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].right = 2000;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].left = 1000;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].centre = 1500;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].right = 2000;
+}
+
+
+// ****************************************************************************
+void write_persistent_storage(void)
+{
+}
+
+
+// ****************************************************************************
+// The receiver is running since power-up, so the servo reader is already
+// initialized
+void read_all_servo_channels(void)
+{
+    global_flags.new_channel_data = false;
+
+    if (input_pending) {
+        input_pending = false;
+        channel[TH].normalized = input;
+        channel[TH].absolute = (input < 0) ? -input : input;
+        global_flags.new_channel_data = true;
+    }
+}
+
+
+// ****************************************************************************
+// Throttle value of the receiver frame ending at time t
+static int16_t throttle(long t)
+{
+    long phase = t % CYCLE_LENGTH;
+
+    if (phase >= CYCLE_NEUTRAL_AGAIN) {
+        return 0;
+    }
+    if (phase >= CYCLE_REVERSE) {
+        return -50;
+    }
+    if (phase >= CYCLE_NEUTRAL) {
+        return 0;
+    }
+    if (phase >= CYCLE_BRAKE) {
+        return -50;
+    }
+    return 50;
+}
+
+
+// ****************************************************************************
+// Brightness of the brake (reversing) light function of LED i
+static LED_T light_function_value(int i, bool reversing)
+{
+    const CAR_LIGHT_T *light = &local_leds.car_lights[i];
+
+    return reversing ? light->reversing_light : light->brake_light;
+}
+
+
+// ****************************************************************************
+// The first LED that has a brake (reversing) light function, or -1
+static int find_led(bool reversing)
+{
+    int i;
+
+    for (i = 0; i < local_leds.led_count; i++) {
+        if (light_function_value(i, reversing)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// ****************************************************************************
+static void start_measurement(MEASUREMENT_T *m, long edge)
+{
+    if (m->led >= 0  &&  m->edge < 0  &&  light_actual[m->led] != m->value) {
+        m->edge = edge;
+    }
+}
+
+
+// ****************************************************************************
+static void check_measurement(MEASUREMENT_T *m, long t)
+{
+    long latency;
+
+    if (m->edge < 0  ||  light_actual[m->led] != m->value) {
+        return;
+    }
+
+    latency = t - m->edge;
+    m->edge = -1;
+
+    m->sum += latency;
+    ++m->count;
+    if (m->count == 1  ||  latency < m->min) {
+        m->min = latency;
+    }
+    if (latency > m->max) {
+        m->max = latency;
+    }
+}
+
+
+// ****************************************************************************
+static void print_measurement(const MEASUREMENT_T *m)
+{
+    printf("    %s light: latency min %ld us, avg %lld us, max %ld us "
+        "(%ld samples)\n", m->name, m->min,
+        m->count ? m->sum / m->count : 0, m->max, m->count);
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    long receiver_frame = DEFAULT_RECEIVER_FRAME;
+    long mainloop_period = DEFAULT_MAINLOOP_PERIOD;
+
+    long t;
+    long next_frame;
+    long next_mainloop;
+    long next_systick = SYSTICK_PERIOD;
+    long frame_time = 0;
+    int systicks_pending = 0;
+    bool braking;
+    bool reversing;
+
+    MEASUREMENT_T brake = {.name = "Brake", .edge = -1};
+    MEASUREMENT_T reversing_light = {.name = "Reversing", .edge = -1};
+
+    if (argc > 1) {
+        receiver_frame = atol(argv[1]);
+    }
+    if (argc > 2) {
+        mainloop_period = atol(argv[2]);
+    }
+    if (receiver_frame <= 0  ||  mainloop_period <= 0) {
+        fprintf(stderr, "Usage: %s [receiver frame in us [mainloop period "
+            "in us]]\n", argv[0]);
+        return 1;
+    }
+    next_frame = receiver_frame - 1;
+
+    // The mainloop runs half a period after the receiver frame ends, the
+    // average wait for the mainloop
+    next_mainloop = receiver_frame + mainloop_period / 2;
+
+    brake.led = find_led(false);
+    if (brake.led >= 0) {
+        brake.value = light_function_value(brake.led, false);
+    }
+    reversing_light.led = find_led(true);
+    if (reversing_light.led >= 0) {
+        reversing_light.value = light_function_value(reversing_light.led, true);
+    }
+
+    // Same initialization sequence as main.c; the servo signal is present
+    // from the start
+    load_persistent_storage();
+    init_servo_output();
+    init_lights();
+    global_flags.no_signal = false;
+    global_flags.initializing = 0;
+
+    for (t = 0; t < SIMULATION_TIME; ) {
+        // Receiver
+        if (t == next_frame) {
+            input = throttle(t);
+            input_pending = true;
+            frame_time = t;
+            next_frame += receiver_frame;
+        }
+
+        // Systick interrupt
+        if (t == next_systick) {
+            ++systicks_pending;
+            next_systick += SYSTICK_PERIOD;
+        }
+
+        // Mainloop
+        if (t == next_mainloop) {
+            next_mainloop += mainloop_period;
+
+            ++entropy;
+            global_flags.systick = 0;
+            if (systicks_pending) {
+                --systicks_pending;
+                global_flags.systick = 1;
+            }
+
+            braking = global_flags.braking;
+            reversing = global_flags.reversing;
+
+            read_all_servo_channels();
+            process_ch3_clicks();
+            process_drive_mode();
+            process_indicators();
+            process_channel_reversing_setup();
+            process_servo_output();
+            process_winch();
+
+            if (global_flags.new_channel_data) {
+                if (global_flags.braking  &&  !braking) {
+                    start_measurement(&brake, frame_time);
+                }
+                if (global_flags.reversing  &&  !reversing) {
+                    start_measurement(&reversing_light, frame_time);
+                }
+            }
+
+            process_lights();
+
+            check_measurement(&brake, t + SPI_TRANSFER_TIME);
+            check_measurement(&reversing_light, t + SPI_TRANSFER_TIME);
+        }
+
+        t = next_frame;
+        if (next_systick < t) {
+            t = next_systick;
+        }
+        if (next_mainloop < t) {
+            t = next_mainloop;
+        }
+    }
+
+    printf("Receiver frame %ld us, mainloop %ld us, systick %ld us:\n",
+        receiver_frame, mainloop_period, SYSTICK_PERIOD);
+    print_measurement(&brake);
+    print_measurement(&reversing_light);
+
+    return 0;
+}
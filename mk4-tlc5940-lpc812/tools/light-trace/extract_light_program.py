@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+'''
+extract_light_program.py
+
+Writes the light program source contained in a configuration file saved by
+the web-based configurator (JSON format), or in a JavaScript file created
+by text2js.py (such as default_firmware_image.js of the configurator).
+Any other file is considered to be a light program source and written
+unchanged, so that all light programs can be processed alike.
+
+Author:         Werner Lane
+E-mail:         laneboysrc@gmail.com
+'''
+
+from __future__ import print_function
+
+import argparse
+import json
+import sys
+
+
+def parse_commandline():
+    ''' Command line option parsing '''
+    parser = argparse.ArgumentParser(
+        description='''\
+Extract the light program source from a configurator JSON file or a
+JavaScript file created by text2js.py.''')
+
+    parser.add_argument("input_file", nargs=1, type=argparse.FileType('r'),
+        help="the configuration, JavaScript or light program file")
+
+    parser.add_argument("-v", "--var-name", default="default_light_program",
+        help="the JavaScript variable holding the light program. "
+            "Default is default_light_program")
+
+    parser.add_argument("-o", "--output", type=argparse.FileType('w'),
+        default=sys.stdout,
+        help="the light program file to write. Default is stdout")
+
+    return parser.parse_args()
+
+
+def from_javascript(lines, var_name):
+    ''' Concatenate the string literals following "var <var_name> =".
+        Returns None if the variable is not found. '''
+    result = []
+    found = False
+
+    for line in lines:
+        line = line.strip()
+        if not found:
+            found = (line == "var {} =".format(var_name))
+            continue
+
+        if line.endswith("+"):
+            result.append(json.loads(line[:-1].strip()))
+        elif line.endswith(";"):
+            result.append(json.loads(line[:-1].strip()))
+            return "".join(result)
+        else:
+            break
+
+    if found:
+        print("ERROR: {} is not a string created by text2js.py".format(var_name),
+            file=sys.stderr)
+        sys.exit(1)
+
+    return None
+
+
+def extract_light_program(args):
+    ''' Output the light program source '''
+    content = args.input_file[0].read()
+
+    try:
+        light_program = json.loads(content)['light_programs']
+    except (ValueError, KeyError, TypeError):
+        light_program = from_javascript(content.splitlines(), args.var_name)
+
+    if light_program is None:
+        light_program = content
+
+    args.output.write(light_program)
+
+
+def main():
+    ''' Program start '''
+    args = parse_commandline()
+    extract_light_program(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,9 @@
+// Configuration for the light trace scenarios that need a gearbox servo
+// output, so that CH3 clicks change gears (see specialize_config.py)
+
+#define FIXED_CONFIG_MODE MASTER_WITH_SERVO_READER
+#define FIXED_CONFIG_SLAVE_OUTPUT false
+#define FIXED_CONFIG_PREPROCESSOR_OUTPUT false
+#define FIXED_CONFIG_WINCH_OUTPUT false
+#define FIXED_CONFIG_STEERING_WHEEL_SERVO_OUTPUT false
+#define FIXED_CONFIG_GEARBOX_SERVO_OUTPUT true
@@ -0,0 +1,38 @@
+/******************************************************************************
+
+    LPC8xx.h for building the firmware on the build host
+
+    Includes the real device header for the register definitions, but maps
+    the peripherals used by the light controller modules to variables of the
+    host program (see light_trace.c).
+
+    The SPI status reads back with all flags set, so that the loops in
+    lights.c that wait for the transmitter to become ready terminate.
+
+    Interrupts are never raised on the build host, so enabling them in the
+    NVIC does nothing.
+
+******************************************************************************/
+#ifndef __HOST_LPC8XX_H
+#define __HOST_LPC8XX_H
+
+#include_next <LPC8xx.h>
+
+extern LPC_SPI_TypeDef *host_spi0(void);
+extern LPC_GPIO_PORT_TypeDef host_gpio_port;
+extern LPC_SWM_TypeDef host_swm;
+extern LPC_SCT_TypeDef host_sct;
+
+#undef LPC_SPI0
+#undef LPC_GPIO_PORT
+#undef LPC_SWM
+#undef LPC_SCT
+
+#define LPC_SPI0 (host_spi0())
+#define LPC_GPIO_PORT (&host_gpio_port)
+#define LPC_SWM (&host_swm)
+#define LPC_SCT (&host_sct)
+
+#define NVIC_EnableIRQ(irq) ((void)(irq))
+
+#endif // __HOST_LPC8XX_H
@@ -0,0 +1,14 @@
+/******************************************************************************
+
+    light_programs.c of the firmware, built for light_trace
+
+    The makefile renames post_light_program_event() and
+    process_light_programs() for all modules, so that the firmware modules
+    call the functions in light_trace.c, which record the events and the LEDs
+    used by the light programs before calling the ones defined here.
+
+******************************************************************************/
+#undef post_light_program_event
+#undef process_light_programs
+
+#include <light_programs.c>
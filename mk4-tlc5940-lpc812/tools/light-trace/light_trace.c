@@ -0,0 +1,633 @@
+/******************************************************************************
+
+    Light trace
+
+    Runs the light related modules of the firmware on the build host, driven
+    by a recorded input scenario, and prints the LED brightness
+    (light_actual[]) whenever it changes.
+
+    Usage: light_trace [-e <emulator scenario>] <scenario>
+
+    The mainloop below calls the same functions as main.c, once per systick.
+    Everything that talks to hardware is replaced:
+
+    - read_all_servo_channels() follows the state machine of servo_reader.c,
+      but takes the normalized channel values from the scenario. A servo
+      frame is received every systick while the signal is on.
+    - Persistent storage contains the defaults of an erased flash.
+    - The UART is not connected; diagnostics output is disabled.
+    - The peripheral registers written by lights.c and servo_output.c are
+      plain variables (see host/LPC8xx.h).
+
+    Scenario file format, one event per line:
+
+        <time in ms> signal on|off  Servo signal is received (initially off)
+        <time in ms> st <value>     Steering -100..100
+        <time in ms> th <value>     Throttle -100..100
+        <time in ms> ch3 <value>    CH3 -100..100
+        <time in ms> click <n>      Operate CH3 n times, 40 ms apart
+        <time in ms> end            End of the scenario
+
+    Times must not decrease. Everything after '#' is a comment.
+
+    Trace format, one line per systick in which light_actual[] changed:
+
+        <systick> <light_actual[0..31] as 2 hex digits each>
+
+    The last line contains the systick in which the scenario ended.
+
+    With -e, the inputs of the light programs are written to the given file
+    as a scenario of the light program emulator (tools/configurator/emulator)
+    and the trace shows only the LEDs driven by light programs; the others are
+    printed as "--". The emulator prints the same trace, so both can be
+    compared. Like in the emulator, the car light functions are switched off,
+    so a light program takes over its LEDs from 0 rather than from the car
+    lights. host/light_programs_trace.c makes post_light_program_event() and
+    process_light_programs() observable for this.
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <LPC8xx.h>
+#include <globals.h>
+#include <uart0.h>
+
+// Number of systicks between two CH3 operations of a click sequence
+#define CLICK_INTERVAL (40 / __SYSTICK_IN_MS)
+
+#define MAX_LINE_LENGTH 200
+
+extern LED_T light_setpoint[MAX_LIGHTS];
+extern LED_T light_actual[MAX_LIGHTS];
+extern uint8_t max_change_per_systick[MAX_LIGHTS];
+extern uint8_t light_switch_position;
+
+typedef enum {
+    WAIT_FOR_FIRST_PULSE,
+    WAIT_FOR_TIMEOUT,
+    NORMAL_OPERATION
+} SERVO_READER_STATE_T;
+
+
+// Environment the firmware modules expect from main.c, crt0.c and the
+// hardware drivers
+GLOBAL_FLAGS_T global_flags;
+CHANNEL_T channel[3];
+uint32_t entropy = 0x12345678;
+
+LPC_GPIO_PORT_TypeDef host_gpio_port;
+LPC_SWM_TypeDef host_swm;
+LPC_SCT_TypeDef host_sct;
+static LPC_SPI_TypeDef host_spi;
+
+static const char *scenario_name;
+static FILE *scenario;
+static FILE *emulator_scenario;
+static uint32_t leds_used = 0xffffffff;
+static uint32_t scenario_line;
+static uint32_t systick;
+
+static bool signal_present;
+static int16_t input[3];
+static uint8_t clicks_pending;
+static uint8_t click_timer;
+
+static SERVO_READER_STATE_T servo_reader_state = WAIT_FOR_FIRST_PULSE;
+static uint32_t servo_reader_timer;
+
+
+// ****************************************************************************
+// Add an input to the entry of the current systick in the emulator scenario.
+// A new entry is started when requested, as the emulator takes only one
+// event per entry.
+static void emulator_input(const char *name, const char *value, bool new_entry)
+{
+    static uint32_t entry_systick = 0xffffffff;
+
+    if (new_entry  ||  entry_systick != systick) {
+        fprintf(emulator_scenario, "%s\n        {\"time\": %u",
+            (entry_systick == 0xffffffff) ? "" : "},",
+            systick * __SYSTICK_IN_MS);
+        entry_systick = systick;
+    }
+
+    fprintf(emulator_scenario, ", \"%s\": %s", name, value);
+}
+
+
+// ****************************************************************************
+// Write the state the light programs read whenever it changes. The blink
+// flag is given as well, so that the emulator does not need to follow the
+// indicator logic of the firmware.
+static void emulator_state(void)
+{
+    static const char *servo_output_setup[] = {
+        "\"\"", "\"centre\"", "\"left\"", "\"\"", "\"right\""
+    };
+    static const char *reversing_setup[] = {
+        "\"\"", "\"steering\"", "\"throttle\"", "\"both\""
+    };
+    static const char *names[] = {
+        "no_signal", "initializing", "forward", "reversing", "braking",
+        "indicator_left", "indicator_right", "hazard", "blink_flag",
+        "light_switch_position", "steering", "throttle", "gear",
+        "servo_output_setup", "reversing_setup"
+    };
+    static int last[15];
+    static bool first = true;
+    int state[15];
+    char value[12];
+    int i;
+
+    state[0] = global_flags.no_signal;
+    state[1] = global_flags.initializing;
+    state[2] = global_flags.forward;
+    state[3] = global_flags.reversing;
+    state[4] = global_flags.braking;
+    state[5] = global_flags.blink_indicator_left;
+    state[6] = global_flags.blink_indicator_right;
+    state[7] = global_flags.blink_hazard;
+    state[8] = global_flags.blink_flag;
+    state[9] = light_switch_position;
+    state[10] = channel[ST].normalized;
+    state[11] = channel[TH].normalized;
+    state[12] = global_flags.gear;
+    state[13] = global_flags.servo_output_setup;
+    state[14] = global_flags.reversing_setup;
+
+    for (i = 0; i < 15; i++) {
+        if (first  ||  state[i] != last[i]) {
+            if (i == 13) {
+                emulator_input(names[i], servo_output_setup[state[i]], false);
+            }
+            else if (i == 14) {
+                emulator_input(names[i], reversing_setup[state[i]], false);
+            }
+            else if (i < 9) {
+                emulator_input(names[i], state[i] ? "true" : "false", false);
+            }
+            else {
+                snprintf(value, sizeof(value), "%d", state[i]);
+                emulator_input(names[i], value, false);
+            }
+        }
+        last[i] = state[i];
+    }
+    first = false;
+}
+
+
+// ****************************************************************************
+LPC_SPI_TypeDef *host_spi0(void)
+{
+    host_spi.STAT = 0xffffffff;
+    return &host_spi;
+}
+
+
+// ****************************************************************************
+bool diagnostics_enabled(void)
+{
+    return false;
+}
+
+
+// ****************************************************************************
+// UART driver (uart0.c): nothing is connected
+bool uart0_send_is_ready(void) { return true; }
+void uart0_send_char(const char c) { (void)c; }
+void uart0_send_cstring(const char *cstring) { (void)cstring; }
+void uart0_send_int32(int32_t number) { (void)number; }
+void uart0_send_uint32(uint32_t number) { (void)number; }
+void uart0_send_uint32_hex(uint32_t number) { (void)number; }
+void uart0_send_uint16_hex(uint16_t number) { (void)number; }
+void uart0_send_uint8_hex(uint8_t number) { (void)number; }
+void uart0_send_linefeed(void) { }
+bool uart0_read_is_byte_pending(void) { return false; }
+uint8_t uart0_read_byte(void) { return 0; }
+
+
+// ****************************************************************************
+// Persistent storage (persistent_storage.c): the defaults of an erased flash
+void load_persistent_storage(void)
+{
+    channel[ST].reversed = false;
+    channel[TH].reversed = false;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].left = 1000;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].centre = 1500;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].right = 2000;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].left = 1000;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].centre = 1500;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].right = 2000;
+}
+
+
+// ****************************************************************************
+void write_persistent_storage(void)
+{
+}
+
+
+// ****************************************************************************
+static void set_channel(CHANNEL_T *c, int16_t value)
+{
+    c->normalized = value;
+    c->absolute = (value < 0) ? -value : value;
+}
+
+
+// ****************************************************************************
+// Same state machine as in servo_reader.c, with the scenario as receiver
+void read_all_servo_channels(void)
+{
+    if (global_flags.systick) {
+        if (servo_reader_timer) {
+            --servo_reader_timer;
+        }
+    }
+
+    global_flags.new_channel_data = false;
+
+    if (!signal_present) {
+        return;
+    }
+
+    switch (servo_reader_state) {
+        case WAIT_FOR_FIRST_PULSE:
+            servo_reader_timer = config.startup_time;
+            servo_reader_state = WAIT_FOR_TIMEOUT;
+            break;
+
+        case WAIT_FOR_TIMEOUT:
+            if (servo_reader_timer == 0) {
+                set_channel(&channel[CH3], input[CH3]);
+
+                servo_reader_state = NORMAL_OPERATION;
+                global_flags.initializing = 0;
+            }
+            global_flags.new_channel_data = true;
+            break;
+
+        case NORMAL_OPERATION:
+            set_channel(&channel[ST], input[ST]);
+            set_channel(&channel[TH], input[TH]);
+            set_channel(&channel[CH3], input[CH3]);
+            global_flags.new_channel_data = true;
+            break;
+
+        default:
+            servo_reader_state = WAIT_FOR_FIRST_PULSE;
+            break;
+    }
+}
+
+
+// ****************************************************************************
+// Same as in main.c
+static void check_no_signal(void)
+{
+    static uint16_t no_signal_timeout = 0;
+
+    if (global_flags.new_channel_data) {
+        if (global_flags.no_signal  &&  !global_flags.initializing) {
+            post_light_program_event(RUN_ON_SIGNAL_RECOVERED);
+        }
+        global_flags.no_signal = false;
+        no_signal_timeout = config.no_signal_timeout;
+    }
+
+    if (global_flags.systick) {
+        --no_signal_timeout;
+        if (no_signal_timeout == 0) {
+            global_flags.no_signal = true;
+        }
+    }
+}
+
+
+// ****************************************************************************
+static void scenario_error(const char *message)
+{
+    fprintf(stderr, "%s:%u: %s\n", scenario_name, scenario_line, message);
+    exit(1);
+}
+
+
+// ****************************************************************************
+static int16_t parse_channel_value(const char *value)
+{
+    char *end;
+    long result = strtol(value, &end, 10);
+
+    if (*value == '\0'  ||  *end != '\0'  ||  result < -100  ||  result > 100) {
+        scenario_error("Channel value must be in the range -100..100");
+    }
+    return (int16_t)result;
+}
+
+
+// ****************************************************************************
+// Operate CH3 for the pending clicks. A two-position switch changes its
+// position once per click; a momentary switch is pushed and released.
+static void process_clicks(void)
+{
+    if (click_timer) {
+        --click_timer;
+        return;
+    }
+
+    if (config.flags.ch3_is_momentary) {
+        if (input[CH3] > 0) {
+            input[CH3] = -100;
+            --clicks_pending;
+        }
+        else if (clicks_pending) {
+            input[CH3] = 100;
+        }
+    }
+    else if (clicks_pending) {
+        input[CH3] = (input[CH3] > 0) ? -100 : 100;
+        --clicks_pending;
+    }
+
+    click_timer = CLICK_INTERVAL - 1;
+}
+
+
+// ****************************************************************************
+// Apply all events of the scenario that are due at the current systick.
+// Returns false when the end of the scenario is reached.
+static bool process_scenario(void)
+{
+    static char line[MAX_LINE_LENGTH];
+    static bool pending = false;
+    static uint32_t time;
+    static char command[MAX_LINE_LENGTH];
+    static char value[MAX_LINE_LENGTH];
+    static uint32_t last_time = 0;
+
+    while (1) {
+        if (!pending) {
+            char *comment;
+            int count;
+
+            if (!fgets(line, sizeof(line), scenario)) {
+                scenario_error("Missing 'end'");
+            }
+            ++scenario_line;
+
+            comment = strchr(line, '#');
+            if (comment) {
+                *comment = '\0';
+            }
+
+            value[0] = '\0';
+            count = sscanf(line, "%u %s %s", &time, command, value);
+            if (count <= 0) {
+                continue;
+            }
+            if (count < 2) {
+                scenario_error("Expected '<time in ms> <command> [<value>]'");
+            }
+            if (time < last_time) {
+                scenario_error("Time must not decrease");
+            }
+            last_time = time;
+            pending = true;
+        }
+
+        if (time / __SYSTICK_IN_MS > systick) {
+            return true;
+        }
+        pending = false;
+
+        if (strcmp(command, "end") == 0) {
+            return false;
+        }
+        else if (strcmp(command, "signal") == 0) {
+            if (strcmp(value, "on") == 0) {
+                signal_present = true;
+            }
+            else if (strcmp(value, "off") == 0) {
+                signal_present = false;
+            }
+            else {
+                scenario_error("Expected 'signal on' or 'signal off'");
+            }
+        }
+        else if (strcmp(command, "st") == 0) {
+            input[ST] = parse_channel_value(value);
+        }
+        else if (strcmp(command, "th") == 0) {
+            input[TH] = parse_channel_value(value);
+        }
+        else if (strcmp(command, "ch3") == 0) {
+            input[CH3] = parse_channel_value(value);
+        }
+        else if (strcmp(command, "click") == 0) {
+            int clicks = atoi(value);
+
+            if (clicks < 1  ||  clicks > 20) {
+                scenario_error("Number of clicks must be in the range 1..20");
+            }
+            clicks_pending = (uint8_t)clicks;
+            click_timer = 0;
+        }
+        else {
+            scenario_error("Unknown command");
+        }
+    }
+}
+
+
+// ****************************************************************************
+// The light program emulator does not know the car light functions and treats
+// them as off
+static void switch_off_car_lights(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_LIGHTS; i++) {
+        if (!(leds_used & (1 << i))) {
+            light_setpoint[i] = 0;
+            light_actual[i] = 0;
+            max_change_per_systick[i] = 0;
+        }
+    }
+}
+
+
+// ****************************************************************************
+static void output_trace(bool force)
+{
+    static char last[MAX_LIGHTS * 2 + 1];
+    static bool first = true;
+    char line[MAX_LIGHTS * 2 + 1];
+    int i;
+
+    for (i = 0; i < MAX_LIGHTS; i++) {
+        if (leds_used & (1 << i)) {
+            sprintf(&line[i * 2], "%02x", light_actual[i]);
+        }
+        else {
+            sprintf(&line[i * 2], "--");
+        }
+    }
+
+    if (!force  &&  !first  &&  strcmp(last, line) == 0) {
+        return;
+    }
+    first = false;
+    strcpy(last, line);
+
+    printf("%u %s\n", systick, line);
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    if (argc == 4  &&  strcmp(argv[1], "-e") == 0) {
+        emulator_scenario = fopen(argv[2], "w");
+        if (!emulator_scenario) {
+            perror(argv[2]);
+            return 1;
+        }
+        fprintf(emulator_scenario, "{\n    \"entropy\": %u,\n    \"inputs\": [",
+            entropy);
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s [-e <emulator scenario>] <scenario>\n",
+            argv[0]);
+        return 1;
+    }
+
+    scenario_name = argv[1];
+    scenario = fopen(scenario_name, "r");
+    if (!scenario) {
+        perror(scenario_name);
+        return 1;
+    }
+
+    // Same initialization sequence as main.c
+    global_flags.no_signal = true;
+    load_persistent_storage();
+    global_flags.initializing = 1;
+    init_servo_output();
+    init_lights();
+
+    for (systick = 0; ; systick++) {
+        if (!process_scenario()) {
+            break;
+        }
+        if (clicks_pending  ||  (config.flags.ch3_is_momentary && input[CH3] > 0)) {
+            process_clicks();
+        }
+
+        ++entropy;
+        global_flags.systick = 1;
+
+        read_all_servo_channels();
+        process_ch3_clicks();
+        process_drive_mode();
+        process_indicators();
+        process_channel_reversing_setup();
+        check_no_signal();
+        process_servo_output();
+        process_winch();
+        process_lights();
+
+        if (emulator_scenario) {
+            switch_off_car_lights();
+        }
+
+        output_trace(false);
+    }
+
+    output_trace(true);
+    fclose(scenario);
+
+    if (emulator_scenario) {
+        fprintf(emulator_scenario, "}\n    ],\n    \"duration\": %u\n}\n",
+            systick * __SYSTICK_IN_MS);
+        fclose(emulator_scenario);
+    }
+    return 0;
+}
+
+
+// ****************************************************************************
+// The firmware modules, and the code above, call the functions below instead
+// of the ones in light_programs.c (see the makefile and
+// host/light_programs_trace.c)
+#undef post_light_program_event
+#undef process_light_programs
+
+extern void post_light_program_event(LIGHT_PROGRAM_EVENT_T event);
+extern uint32_t process_light_programs(void);
+
+
+// ****************************************************************************
+void light_trace_post_light_program_event(LIGHT_PROGRAM_EVENT_T event)
+{
+    if (emulator_scenario) {
+        switch (event) {
+            case RUN_ON_GEAR_CHANGED:
+                emulator_input("gear_changed", "true", true);
+                break;
+
+            case RUN_ON_CLICKS:
+                emulator_input("clicks", "1", true);
+                break;
+
+            case RUN_ON_LIGHT_SWITCH_UP:
+                emulator_input("event", "\"light-switch-up\"", true);
+                break;
+
+            case RUN_ON_LIGHT_SWITCH_DOWN:
+                emulator_input("event", "\"light-switch-down\"", true);
+                break;
+
+            case RUN_ON_HAZARD_ON:
+                emulator_input("event", "\"hazard-on\"", true);
+                break;
+
+            case RUN_ON_HAZARD_OFF:
+                emulator_input("event", "\"hazard-off\"", true);
+                break;
+
+            case RUN_ON_WINCH_STARTED:
+                emulator_input("event", "\"winch-started\"", true);
+                break;
+
+            case RUN_ON_SIGNAL_RECOVERED:
+                emulator_input("event", "\"signal-recovered\"", true);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    post_light_program_event(event);
+}
+
+
+// ****************************************************************************
+uint32_t light_trace_process_light_programs(void)
+{
+    if (emulator_scenario) {
+        emulator_state();
+        leds_used = process_light_programs();
+        return leds_used;
+    }
+
+    return process_light_programs();
+}
@@ -0,0 +1,470 @@
+#!/usr/bin/env python
+'''
+light_program_debugger.py
+
+Interactive debugger for the light programs of a firmware built with
+LIGHT_PROGRAM_DEBUGGER (see the makefile of the firmware). It halts and
+resumes the light programs, single-steps a program, sets breakpoints, and
+reads or writes the variables and LED brightness values. The source map
+written by the light program assembler (option -m) maps the program counters
+to lines of the light program source.
+
+The light controller must be configured as master with UART reader. Connect
+a USB-to-serial adapter instead of the preprocessor: RX of the light
+controller is the ST pin, TX is the TH pin. This tool takes the place of the
+preprocessor and sends the steering, throttle and CH3 values set with the
+st, th and ch3 commands, so that the light controller keeps operating while
+the light programs are halted. See debugger.c of the firmware for the
+protocol.
+
+The diagnostics output of the light controller is printed as it arrives.
+
+Usage example:
+
+    light_program_assembler.js -m my.map -o light_programs_data.c my.light_program
+    light_program_debugger.py -p /dev/ttyUSB0 my.map
+
+Author:         Werner Lane
+E-mail:         laneboysrc@gmail.com
+'''
+
+from __future__ import print_function
+
+import argparse
+import cmd
+import json
+import struct
+import sys
+import threading
+import time
+
+try:
+    import Queue as queue
+except ImportError:
+    import queue
+
+import serial
+
+from light_program_statistics import SourceMap
+
+
+PROTOCOL_VERSION = 1
+
+PREPROCESSOR_MAGIC_BYTE = 0x87
+PREPROCESSOR_INTERVAL = 0.02
+
+FRAME_SYNC = 0x86
+FRAME_ESCAPE = 0x85
+ESCAPE_XOR = 0x20
+
+COMMAND_STATUS = 0x20
+COMMAND_HALT = 0x21
+COMMAND_RESUME = 0x22
+COMMAND_STEP = 0x23
+COMMAND_PROGRAM = 0x24
+COMMAND_BREAKPOINT = 0x25
+COMMAND_READ_VARIABLES = 0x26
+COMMAND_WRITE_VARIABLE = 0x27
+COMMAND_READ_LIGHTS = 0x28
+COMMAND_WRITE_LIGHT = 0x29
+EVENT_HALTED = 0x30
+RESPONSE_ACK = 0x06
+RESPONSE_NAK = 0x15
+
+ERRORS = {1: "unknown command", 2: "invalid parameter", 3: "not halted",
+    4: "light programs are native code"}
+
+HALTED_BY_HOST = 0xff
+NO_BREAKPOINT = 0
+MAX_VARIABLES_PER_READ = 30
+
+RETRIES = 5
+RESPONSE_TIMEOUT = 0.2
+
+
+def parse_commandline():
+    ''' Command line option parsing '''
+    parser = argparse.ArgumentParser(
+        description='''\
+Debug the light programs of a light controller connected to the UART.''')
+
+    parser.add_argument("source_map", nargs=1, type=argparse.FileType('r'),
+        help="the source map written by the light program assembler")
+
+    parser.add_argument("-p", "--port", default="/dev/ttyUSB0",
+        help="the serial port the light controller is connected to. "
+            "Default is /dev/ttyUSB0")
+
+    parser.add_argument("-b", "--baudrate", type=int, default=115200,
+        help="the baudrate of the light controller. Default is 115200")
+
+    return parser.parse_args()
+
+
+def crc16(data, crc=0xffff):
+    ''' CRC-16-CCITT, same as crc16_ccitt() in utils.c of the firmware '''
+    for byte in bytearray(data):
+        crc ^= byte << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xffff
+            else:
+                crc = (crc << 1) & 0xffff
+    return crc
+
+
+class DebuggerError(Exception):
+    ''' The light controller did not respond, or responded with NAK '''
+    pass
+
+
+class LightController(object):
+    ''' Debug frames multiplexed with preprocessor frames over a serial port '''
+
+    def __init__(self, port, baudrate):
+        try:
+            self.port = serial.Serial(port, baudrate, timeout=0.1)
+        except serial.SerialException as error:
+            print('ERROR: Unable to open port {}: {}'.format(port, error))
+            sys.exit(1)
+
+        self.channels = {'st': 0, 'th': 0, 'ch3': 0}
+        self.responses = queue.Queue()
+        self.write_lock = threading.Lock()
+        self.frame = None
+        self.escaped = False
+        self.text = bytearray()
+
+        for target in (self.reader, self.writer):
+            thread = threading.Thread(target=target)
+            thread.daemon = True
+            thread.start()
+
+    def write(self, data):
+        ''' Write a complete frame, so that preprocessor and debug frames do
+            not interleave '''
+        with self.write_lock:
+            self.port.write(bytes(data))
+
+    def writer(self):
+        ''' Background thread sending preprocessor frames '''
+        while True:
+            ch3 = 0x01 if self.channels['ch3'] > 0 else 0x00
+            self.write(bytearray([PREPROCESSOR_MAGIC_BYTE,
+                self.channels['st'] & 0xff, self.channels['th'] & 0xff, ch3]))
+            time.sleep(PREPROCESSOR_INTERVAL)
+
+    def reader(self):
+        ''' Background thread separating the debug frames from the
+            diagnostics output '''
+        while True:
+            for byte in bytearray(self.port.read(100)):
+                self.receive_byte(byte)
+
+    def receive_byte(self, byte):
+        ''' Feed a byte received from the light controller '''
+        if byte == FRAME_SYNC:
+            self.frame = bytearray()
+            self.escaped = False
+            return
+
+        if self.frame is None:
+            if byte == ord('\n'):
+                print(self.text.decode('ascii', 'replace'))
+                self.text = bytearray()
+            elif byte != ord('\r'):
+                self.text.append(byte)
+            return
+
+        if byte == FRAME_ESCAPE:
+            self.escaped = True
+            return
+        if self.escaped:
+            byte ^= ESCAPE_XOR
+            self.escaped = False
+
+        self.frame.append(byte)
+        if len(self.frame) < 2 or len(self.frame) < self.frame[1] + 4:
+            return
+
+        frame, self.frame = self.frame, None
+        crc = frame[-2] | (frame[-1] << 8)
+        if crc16(frame[:-2]) != crc:
+            return
+
+        payload = frame[2:-2]
+        if frame[0] == EVENT_HALTED:
+            program, pc = struct.unpack('<BH', bytes(payload))
+            self.halted(program, pc)
+        else:
+            self.responses.put((frame[0], payload))
+
+    def halted(self, program, pc):
+        ''' Called by the reader thread when a program hits a breakpoint '''
+        pass
+
+    def send(self, command, payload=b''):
+        ''' Send a command frame '''
+        frame = bytearray([command, len(payload)]) + bytearray(payload)
+        crc = crc16(frame)
+        frame += bytearray([crc & 0xff, crc >> 8])
+
+        data = bytearray([FRAME_SYNC])
+        for byte in frame:
+            if 0x80 <= byte <= PREPROCESSOR_MAGIC_BYTE:
+                data += bytearray([FRAME_ESCAPE, byte ^ ESCAPE_XOR])
+            else:
+                data.append(byte)
+        self.write(data)
+
+    def execute(self, command, payload=b''):
+        ''' Send a command and return the payload of the ACK. Retries on
+            timeout. '''
+        for _ in range(RETRIES):
+            while not self.responses.empty():
+                self.responses.get()
+
+            self.send(command, payload)
+            try:
+                response, result = self.responses.get(
+                    timeout=RESPONSE_TIMEOUT)
+            except queue.Empty:
+                continue
+
+            if response == RESPONSE_ACK:
+                return result
+            if response == RESPONSE_NAK:
+                raise DebuggerError('Light controller responded with NAK: '
+                    '{}'.format(ERRORS.get(result[0], result[0])
+                        if result else ''))
+
+        raise DebuggerError('No response from the light controller')
+
+
+class DebuggerShell(cmd.Cmd):
+    ''' Command line interface of the debugger '''
+
+    intro = 'Light program debugger. Type help or ? to list commands.'
+    prompt = '(lpd) '
+
+    def __init__(self, controller, source_map):
+        cmd.Cmd.__init__(self)
+        self.controller = controller
+        self.source_map = source_map
+        self.breakpoints = {}
+        self.current = 0
+
+        controller.halted = self.halted
+
+        status = self.status()
+        if status['version'] != PROTOCOL_VERSION:
+            print('ERROR: Unsupported protocol version {}'.format(
+                status['version']))
+            sys.exit(1)
+        self.max_breakpoints = status['max_breakpoints']
+        self.max_variables = status['max_variables']
+
+    def onecmd(self, line):
+        try:
+            return cmd.Cmd.onecmd(self, line)
+        except DebuggerError as error:
+            print('ERROR: {}'.format(error))
+        except ValueError:
+            print('ERROR: Invalid parameter')
+        return False
+
+    def emptyline(self):
+        pass
+
+    def halted(self, program, pc):
+        ''' A program hit a breakpoint '''
+        self.current = program
+        print('\nProgram {} halted at {}'.format(program,
+            self.source_map.describe(pc)))
+
+    def status(self):
+        ''' Return the status of the light programs '''
+        result = self.controller.execute(COMMAND_STATUS)
+        keys = ('version', 'programs', 'native', 'halted', 'halted_by',
+            'max_breakpoints', 'max_variables', 'max_lights')
+        return dict(zip(keys, struct.unpack('<8B', bytes(result))))
+
+    def show_program(self, n, state):
+        ''' Print the state of a program as returned by PROGRAM and STEP '''
+        pc, timer, sp, event = struct.unpack('<HHBB', bytes(state[:6]))
+        stack = struct.unpack('<{}H'.format(sp), bytes(state[6:]))
+
+        print('Program {}: {}'.format(n, self.source_map.describe(pc)))
+        if timer:
+            print('    Sleeping for {} systicks'.format(timer))
+        if event:
+            print('    Running because of an event')
+        for return_address in reversed(stack):
+            print('    Called from {}'.format(
+                self.source_map.describe(return_address)))
+
+    def program_number(self, arg):
+        ''' Return the program given as argument, default is the current '''
+        if arg.strip():
+            self.current = int(arg, 0)
+        return self.current
+
+    def do_status(self, arg):
+        ''' status: show whether the light programs are halted '''
+        status = self.status()
+        print('{} light programs{}, {}'.format(status['programs'],
+            ' (native code)' if status['native'] else '',
+            'halted' if status['halted'] else 'running'))
+        if status['halted'] and status['halted_by'] != HALTED_BY_HOST:
+            print('Halted by a breakpoint in program {}'.format(
+                status['halted_by']))
+
+    def do_halt(self, arg):
+        ''' halt: stop executing the light programs '''
+        self.controller.execute(COMMAND_HALT)
+
+    def do_continue(self, arg):
+        ''' continue: resume executing the light programs '''
+        self.controller.execute(COMMAND_RESUME)
+
+    def do_step(self, arg):
+        ''' step [program]: execute one instruction of a halted program '''
+        n = self.program_number(arg)
+        self.show_program(n, self.controller.execute(COMMAND_STEP,
+            struct.pack('<B', n)))
+
+    def do_where(self, arg):
+        ''' where [program]: show the program counter and call stack of a
+        program, or of all programs '''
+        if arg.strip():
+            programs = [self.program_number(arg)]
+        else:
+            programs = range(self.status()['programs'])
+
+        for n in programs:
+            self.show_program(n, self.controller.execute(COMMAND_PROGRAM,
+                struct.pack('<B', n)))
+
+    def do_break(self, arg):
+        ''' break <line>|<0xoffset>: set a breakpoint at a source line or
+        program offset; without argument list the breakpoints '''
+        if arg.strip():
+            if arg.strip().lower().startswith('0x'):
+                pc = int(arg, 16)
+            else:
+                pc = self.source_map.line_to_pc(int(arg))
+                if pc is None:
+                    print('ERROR: No instruction at line {}'.format(arg))
+                    return
+
+            free = [i for i in range(self.max_breakpoints)
+                if i not in self.breakpoints]
+            if not free:
+                print('ERROR: All {} breakpoints are in use'.format(
+                    self.max_breakpoints))
+                return
+
+            self.controller.execute(COMMAND_BREAKPOINT,
+                struct.pack('<BH', free[0], pc))
+            self.breakpoints[free[0]] = pc
+
+        for index, pc in sorted(self.breakpoints.items()):
+            print('Breakpoint {}: {}'.format(index,
+                self.source_map.describe(pc)))
+
+    def do_delete(self, arg):
+        ''' delete <breakpoint>: remove a breakpoint '''
+        index = int(arg)
+        self.controller.execute(COMMAND_BREAKPOINT,
+            struct.pack('<BH', index, NO_BREAKPOINT))
+        self.breakpoints.pop(index, None)
+
+    def do_var(self, arg):
+        ''' var <index> [count]: show variables
+        var <index> = <value>: set a variable '''
+        if '=' in arg:
+            index, value = arg.split('=')
+            self.controller.execute(COMMAND_WRITE_VARIABLE,
+                struct.pack('<Bh', int(index, 0), int(value, 0)))
+            return
+
+        args = arg.split()
+        first = int(args[0], 0)
+        count = int(args[1], 0) if len(args) > 1 else 1
+        count = min(count, self.max_variables - first)
+        while count > 0:
+            chunk = min(count, MAX_VARIABLES_PER_READ)
+            values = self.controller.execute(COMMAND_READ_VARIABLES,
+                struct.pack('<BB', first, chunk))
+            for i, value in enumerate(struct.unpack('<{}h'.format(chunk),
+                    bytes(values))):
+                print('var[{}] = {}'.format(first + i, value))
+            first += chunk
+            count -= chunk
+
+    def do_led(self, arg):
+        ''' led: show the brightness of all LEDs
+        led <index> = <value>: set the brightness (0..255) of an LED. LEDs
+        that are not used by a light program follow the car lights. '''
+        if '=' in arg:
+            index, value = arg.split('=')
+            self.controller.execute(COMMAND_WRITE_LIGHT,
+                struct.pack('<BB', int(index, 0), int(value, 0)))
+            return
+
+        values = self.controller.execute(COMMAND_READ_LIGHTS)
+        for i in range(0, len(values), 8):
+            print('led[{:2}..{:2}]: {}'.format(i, i + 7,
+                ' '.join('{:3}'.format(v) for v in values[i:i + 8])))
+
+    def set_channel(self, name, arg):
+        ''' Set a channel value sent in the preprocessor frames '''
+        value = int(arg)
+        if not -100 <= value <= 100:
+            raise ValueError
+        self.controller.channels[name] = value
+
+    def do_st(self, arg):
+        ''' st <value>: set steering to -100..100 '''
+        self.set_channel('st', arg)
+
+    def do_th(self, arg):
+        ''' th <value>: set throttle to -100..100 '''
+        self.set_channel('th', arg)
+
+    def do_ch3(self, arg):
+        ''' ch3 <value>: set CH3 to -100 or 100 '''
+        self.set_channel('ch3', arg)
+
+    def do_quit(self, arg):
+        ''' quit: leave the debugger; the light programs keep their state '''
+        return True
+
+    do_EOF = do_quit
+
+
+def light_program_debugger(args):
+    ''' Run the debugger '''
+    try:
+        source_map = SourceMap(json.load(args.source_map[0]))
+    except (ValueError, KeyError):
+        print('ERROR: {} is not a source map'.format(args.source_map[0].name))
+        sys.exit(1)
+
+    controller = LightController(args.port, args.baudrate)
+    try:
+        shell = DebuggerShell(controller, source_map)
+    except DebuggerError as error:
+        print('ERROR: {}'.format(error))
+        sys.exit(1)
+    shell.cmdloop()
+
+
+def main():
+    ''' Program start '''
+    args = parse_commandline()
+    light_program_debugger(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,176 @@
+#!/usr/bin/env python
+'''
+light_program_statistics.py
+
+Maps the execution counters of the light programs, which a firmware built
+with LIGHT_PROGRAM_STATISTICS prints on the diagnostics output, back to the
+light program source.
+
+The firmware prints one line per light program every 10 seconds:
+
+    LP <n> instructions <i> systicks <t> exhausted <e> resets <r>
+        since_yield <y> max_since_yield <m> pc <hex> exhausted_pc <hex>
+
+The program counters are byte offsets into the light programs. The source
+map written by the light program assembler (option -m) maps them to lines
+of the light program source.
+
+Usage example:
+
+    light_program_assembler.js -m my.map -o light_programs_data.c my.light_program
+    cat /dev/ttyUSB0 | light_program_statistics.py my.map
+
+Author:         Werner Lane
+E-mail:         laneboysrc@gmail.com
+'''
+
+from __future__ import print_function
+
+import argparse
+import json
+import sys
+
+NATIVE_PC = 0xffff
+
+FIELDS = ('instructions', 'systicks', 'exhausted', 'resets', 'since_yield',
+    'max_since_yield', 'pc', 'exhausted_pc')
+
+
+def parse_commandline():
+    ''' Command line option parsing '''
+    parser = argparse.ArgumentParser(
+        description='''\
+Map the light program execution counters printed by the firmware to the
+light program source.''')
+
+    parser.add_argument("source_map", nargs=1, type=argparse.FileType('r'),
+        help="the source map written by the light program assembler")
+
+    parser.add_argument("log_file", nargs='?', type=argparse.FileType('r'),
+        default=sys.stdin,
+        help="the diagnostics output of the light controller. "
+            "Default is stdin")
+
+    return parser.parse_args()
+
+
+class SourceMap(object):
+    ''' Byte offsets of the instructions and their source lines '''
+
+    def __init__(self, source_map):
+        self.blocks = source_map['blocks']
+        self.source = []
+        try:
+            with open(source_map['source']) as source_file:
+                self.source = source_file.read().splitlines()
+        except (IOError, KeyError):
+            pass
+
+    def program(self, n):
+        ''' Return the block of light program n, or None '''
+        for block in self.blocks:
+            if block.get('program') == n:
+                return block
+        return None
+
+    def describe(self, pc):
+        ''' Return a description of the instruction at offset pc '''
+        if pc == NATIVE_PC:
+            return 'native code'
+
+        for block in self.blocks:
+            if not block['offset'] <= pc < block['offset'] + block['length']:
+                continue
+
+            line = None
+            for offset, instruction_line in block['lines']:
+                if offset > pc:
+                    break
+                line = instruction_line
+
+            result = '0x{:04x} {}'.format(pc, block['name'])
+            if line is not None:
+                result += ', line {}'.format(line)
+                if 0 < line <= len(self.source):
+                    result += ': ' + self.source[line - 1].strip()
+            return result
+
+        return '0x{:04x} unknown location'.format(pc)
+
+    def line_to_pc(self, line):
+        ''' Return the offset of the first instruction of a source line, or
+            None '''
+        for block in self.blocks:
+            for offset, instruction_line in block['lines']:
+                if instruction_line == line:
+                    return offset
+        return None
+
+
+def parse_statistics_line(line):
+    ''' Return (program, counters) of an LP line, or (None, None) '''
+    words = line.split()
+    if len(words) != 2 + 2 * len(FIELDS) or words[0] != 'LP':
+        return None, None
+
+    try:
+        program = int(words[1])
+        counters = {}
+        for i in range(2, len(words), 2):
+            base = 16 if words[i].endswith('pc') else 10
+            counters[words[i]] = int(words[i + 1], base)
+    except ValueError:
+        return None, None
+
+    if set(counters) != set(FIELDS):
+        return None, None
+    return program, counters
+
+
+def print_statistics(source_map, program, counters):
+    ''' Print the counters of a light program '''
+    block = source_map.program(program)
+    name = block['name'] if block else 'Program {}'.format(program + 1)
+
+    per_systick = 0.0
+    if counters['systicks']:
+        per_systick = float(counters['instructions']) / counters['systicks']
+
+    print('{}: {} instructions in {} systicks ({:.1f} per systick), '
+        '{} resets'.format(name, counters['instructions'],
+        counters['systicks'], per_systick, counters['resets']))
+    print('    Budget used up in {} systicks, {} in a row at most, '
+        '{} now'.format(counters['exhausted'], counters['max_since_yield'],
+        counters['since_yield']))
+    print('    PC: {}'.format(source_map.describe(counters['pc'])))
+    if counters['exhausted']:
+        print('    Budget last used up at: {}'.format(
+            source_map.describe(counters['exhausted_pc'])))
+
+
+def light_program_statistics(args):
+    ''' Translate the statistics lines of the log '''
+    try:
+        source_map = SourceMap(json.load(args.source_map[0]))
+    except (ValueError, KeyError):
+        print('ERROR: {} is not a source map'.format(args.source_map[0].name))
+        sys.exit(1)
+
+    for line in iter(args.log_file.readline, ''):
+        program, counters = parse_statistics_line(line)
+        if program is None:
+            continue
+        if program == 0:
+            print()
+        print_statistics(source_map, program, counters)
+        sys.stdout.flush()
+
+
+def main():
+    ''' Program start '''
+    args = parse_commandline()
+    light_program_statistics(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -119,6 +119,10 @@ def get_category(section):
     if strip_directory(section['module_name']) == 'crt0.o':
         return '(C runtime)'
 
+    # With -flto all modules are merged into temporary partitions
+    if re.search(r'\.ltrans\d*\.ltrans\.o$', section['module_name']):
+        return '(link-time optimized)'
+
     if re.match(r'.+\.o$', section['module_name']):
         return section['module_name']
 
@@ -204,14 +208,62 @@ def print_summary(totals, sort):
     print('------------------------------------+-----------+-----------')
 
 
-def map_file_parser(args):
-    ''' Parse the map file and print FLASH and RAM summary information '''
-    map_data = args.mapfile[0].read()
+def print_comparison(baseline, totals):
+    ''' Output the difference in memory usage between two map files, e.g.
+        the generic firmware and a specialized build
+    '''
+    # Compare by file name only as the builds use different directories
+    for memory_totals in (baseline, totals):
+        for memory in (FLASH, RAM):
+            renamed = defaultdict(int)
+            for module, size in memory_totals[memory].items():
+                renamed[strip_directory(module)] += size
+            memory_totals[memory] = renamed
+
+    modules = set()
+    for memory in (FLASH, RAM):
+        modules.update(baseline[memory].keys())
+        modules.update(totals[memory].keys())
+
+    print('Module                              | FLASH diff |  RAM diff')
+    print('------------------------------------+------------+-----------')
+
+    for module in sorted(modules):
+        flash = totals[FLASH][module] - baseline[FLASH][module]
+        ram = totals[RAM][module] - baseline[RAM][module]
+        if flash or ram:
+            print('{:35} | {:+10} | {:+9}'.format(module, flash, ram))
+
+    flash_before = sum(baseline[FLASH].values())
+    flash_after = sum(totals[FLASH].values())
+    ram_before = sum(baseline[RAM].values())
+    ram_after = sum(totals[RAM].values())
+
+    print('------------------------------------+------------+-----------')
+    print('{:35} | {:+10} | {:+9}'.format(
+        'TOTAL:', flash_after - flash_before, ram_after - ram_before))
+    print('------------------------------------+------------+-----------')
+    print('FLASH: {} -> {} bytes, RAM: {} -> {} bytes'.format(
+        flash_before, flash_after, ram_before, ram_after))
+
+
+def read_totals(mapfile):
+    ''' Parse the given map file and return FLASH and RAM usage per module '''
+    map_data = mapfile.read()
 
     memory_sections = parse_memory_sections(map_data)
     memory_map = parse_memory_map(map_data)
-    totals = process_sections(memory_map, memory_sections)
-    print_summary(totals, args.sort)
+    return process_sections(memory_map, memory_sections)
+
+
+def map_file_parser(args):
+    ''' Parse the map file and print FLASH and RAM summary information '''
+    totals = read_totals(args.mapfile[0])
+
+    if args.compare:
+        print_comparison(read_totals(args.compare), totals)
+    else:
+        print_summary(totals, args.sort)
 
 
 def parse_commandline():
@@ -224,6 +276,12 @@ def parse_commandline():
         help="""sort the output by flash or ram size. Default is sort by
         module name""")
 
+    parser.add_argument("-c", "--compare", type=argparse.FileType('r'),
+        metavar="BASELINE_MAPFILE",
+        help="""print the difference in FLASH and RAM usage against the
+        given map file (e.g. that of the generic firmware) instead of the
+        summary""")
+
     parser.add_argument("mapfile", nargs=1, type=argparse.FileType('r'),
         help="the filename of the map file to summarize")
 
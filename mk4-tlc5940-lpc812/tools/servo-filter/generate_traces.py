@@ -0,0 +1,116 @@
+#!/usr/bin/env python
+'''
+generate_traces.py
+
+Writes the pulse traces of the servo input filter test: for every frame of
+20 ms the steering, throttle and CH3/AUX pulse in us as a receiver sends
+them, followed by the pulses the driver intended.
+
+The receiver adds jitter of up to +/-JITTER us to every pulse, a slow drift
+of its centre, and in GLITCH_PERMILLE of the frames a glitch of 15..60 us
+on one channel, which is what the receivers on our bench do. A fixed seed
+makes the traces reproducible.
+
+Author:         Werner Lane
+E-mail:         laneboysrc@gmail.com
+'''
+
+from __future__ import print_function
+
+import os
+import sys
+
+FRAME_MS = 20
+CENTRE = 1500
+JITTER = 4
+GLITCH_PERMILLE = 5
+
+
+class Random(object):
+    ''' Same LCG as the host tests, so that Python 2 and 3 give the same
+        traces '''
+    def __init__(self, seed):
+        self.state = seed
+
+    def next(self, modulo):
+        self.state = (self.state * 1103515245 + 12345) & 0xffffffff
+        return ((self.state >> 16) & 0x7fff) % modulo
+
+
+# Throttle of each scenario: (time in ms, pulse in us) points, with linear
+# moves in between. Steering and CH3/AUX stay in neutral.
+SCENARIOS = {
+    'neutral': (
+        'The car stands in neutral for a minute',
+        [(0, 1500), (60000, 1500)]),
+
+    'crawl': (
+        'Crawling forward and backward with the throttle just past the '
+        'centre threshold',
+        [(0, 1500), (4000, 1500), (5000, 1527), (20000, 1527),
+         (21000, 1500), (25000, 1500), (26000, 1474), (40000, 1474),
+         (41000, 1500), (45000, 1500), (46000, 1528), (58000, 1528),
+         (59000, 1500), (60000, 1500)]),
+
+    'drive': (
+        'Driving: accelerate, brake, reverse and back, with fast throttle '
+        'moves',
+        [(0, 1500), (4000, 1500), (4100, 1800), (8000, 1800),
+         (8200, 1500), (9000, 1500), (9100, 1250), (10000, 1250),
+         (10100, 1500), (13000, 1500), (13100, 1300), (17000, 1300),
+         (17100, 1500), (20000, 1500), (20200, 1700), (22000, 1700),
+         (22500, 1600), (26000, 1600), (26100, 1500), (30000, 1500)]),
+}
+
+
+def throttle(points, t):
+    for (t0, p0), (t1, p1) in zip(points, points[1:]):
+        if t0 <= t <= t1:
+            if t1 == t0:
+                return p1
+            return p0 + (p1 - p0) * (t - t0) // (t1 - t0)
+    return points[-1][1]
+
+
+def write_trace(name, description, points, directory):
+    rnd = Random(sum(ord(c) for c in name))
+    duration = points[-1][0]
+
+    with open(os.path.join(directory, name + '.trace'), 'w') as f:
+        f.write('# %s\n' % description)
+        f.write('# Generated by generate_traces.py: jitter +/-%d us, '
+            'glitches in %d per mille of the frames\n' % (JITTER,
+                GLITCH_PERMILLE))
+        f.write('# ST TH CH3 as received, ST TH CH3 as intended\n')
+
+        for frame in range(duration // FRAME_MS):
+            t = frame * FRAME_MS
+            drift = 2 if (t // 7000) % 2 else 0
+            intended = [CENTRE, throttle(points, t), 1000]
+            received = []
+            for pulse in intended:
+                noise = (rnd.next(JITTER + 1) + rnd.next(JITTER + 1) -
+                    JITTER)
+                received.append(pulse + drift + noise)
+
+            if rnd.next(1000) < GLITCH_PERMILLE:
+                glitch = 15 + rnd.next(46)
+                if rnd.next(2):
+                    glitch = -glitch
+                received[rnd.next(3)] += glitch
+
+            f.write('%d %d %d %d %d %d\n' % tuple(received + intended))
+
+
+def main():
+    directory = os.path.join(os.path.dirname(sys.argv[0]), 'traces')
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    for name in sorted(SCENARIOS):
+        description, points = SCENARIOS[name]
+        write_trace(name, description, points, directory)
+
+
+if __name__ == '__main__':
+    main()
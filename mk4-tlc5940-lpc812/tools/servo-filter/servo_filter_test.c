@@ -0,0 +1,419 @@
+/******************************************************************************
+
+    Servo input filter test
+
+    Runs servo_reader.c and drive_mode.c of the firmware on the build host
+    and feeds them pulse traces through a model of the SCTimer L in CPPM
+    mode, once for each servo input filter.
+
+    A trace has a line per receiver frame of 20 ms with the steering,
+    throttle and CH3/AUX pulses in us as received, optionally followed by
+    the same three pulses as the driver intended them (see
+    generate_traces.py). Lines starting with # are comments.
+
+    After every frame the mainloop calls read_all_servo_channels() and
+    process_drive_mode(), with a systick per frame. Every change of the
+    forward, braking and reversing flags counts as a change of the drive
+    state. The auto brake and reverse timeouts are fixed at the middle of
+    their range so that runs can be compared.
+
+    For each trace and filter the changes of the drive state are reported,
+    and how many of them are false: more than the intended pulses give
+    without a filter. Running the filter on the intended pulses shows the
+    delay it adds to the changes.
+
+    The test fails if a filter gives more false changes than no filter,
+    or if it changes the drive states of the intended pulses.
+
+    Every run starts the firmware afresh in a child process, as the modules
+    keep their state in static variables. The makefile builds the firmware
+    with config defined as *test_config so that each run can use its own
+    configuration.
+
+    Usage: servo_filter_test trace-file...
+
+******************************************************************************/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <LPC8xx.h>
+#include <globals.h>
+
+#define FRAME 20000
+#define MAX_FRAMES 30000
+#define MAX_CHANGES 2000
+
+#define NUMBER_OF_FILTERS 4
+
+#define RECEIVED 0
+#define INTENDED 3
+
+extern void init_servo_reader(void);
+extern void read_all_servo_channels(void);
+extern void process_drive_mode(void);
+extern void SCT_irq_handler(void);
+
+
+typedef struct {
+    long frames;
+    bool has_intended;
+    uint16_t pulse[MAX_FRAMES][6];
+} TRACE_T;
+
+typedef struct {
+    long changes;
+    long time[MAX_CHANGES];
+    uint8_t state[MAX_CHANGES];
+} RUN_T;
+
+
+// Environment servo_reader.c and drive_mode.c expect from the rest of the
+// firmware
+GLOBAL_FLAGS_T global_flags;
+CHANNEL_T channel[3];
+
+LPC_SWM_TypeDef host_swm;
+LPC_SCT_TypeDef host_sct;
+
+const LIGHT_CONTROLLER_CONFIG_T *test_config;
+
+#define TEST_CONFIG(filter) { \
+    .mode = MASTER_WITH_CPPM_READER, \
+    .esc_mode = ESC_FORWARD_BRAKE_REVERSE_TIMEOUT, \
+    .flags = { \
+        .auto_brake_lights_forward_enabled = true, \
+        .auto_brake_lights_reverse_enabled = true \
+    }, \
+    .auto_brake_counter_value_forward_min = (500 / __SYSTICK_IN_MS), \
+    .auto_brake_counter_value_forward_max = (2500 / __SYSTICK_IN_MS), \
+    .auto_brake_counter_value_reverse_min = (500 / __SYSTICK_IN_MS), \
+    .auto_brake_counter_value_reverse_max = (2500 / __SYSTICK_IN_MS), \
+    .auto_reverse_counter_value_min = (800 / __SYSTICK_IN_MS), \
+    .auto_reverse_counter_value_max = (2000 / __SYSTICK_IN_MS), \
+    .brake_disarm_counter_value = (1000 / __SYSTICK_IN_MS), \
+    .centre_threshold_low = 8, \
+    .centre_threshold_high = 12, \
+    .initial_endpoint_delta = 250, \
+    .servo_pulse_min = 600, \
+    .servo_pulse_max = 2500, \
+    .startup_time = (2000 / __SYSTICK_IN_MS), \
+    .servo_input_filter = (filter) \
+}
+
+// The defaults of config.c, with each of the filters
+static const LIGHT_CONTROLLER_CONFIG_T configs[NUMBER_OF_FILTERS] = {
+    TEST_CONFIG(SERVO_INPUT_FILTER_NONE),
+    TEST_CONFIG(SERVO_INPUT_FILTER_MEDIAN),
+    TEST_CONFIG(SERVO_INPUT_FILTER_ALPHA_BETA),
+    TEST_CONFIG(SERVO_INPUT_FILTER_OUTLIER)
+};
+
+static const char *filter_names[NUMBER_OF_FILTERS] = {
+    "none", "median", "alpha-beta", "outlier"
+};
+
+static TRACE_T trace;
+static RUN_T reference;
+static RUN_T received_run;
+static RUN_T intended_run;
+
+
+// ****************************************************************************
+// Utilities (utils.c): the middle of the range, so that runs are comparable
+uint16_t random_min_max(uint16_t min, uint16_t max)
+{
+    return (min + max) / 2;
+}
+
+
+// ****************************************************************************
+// Servo output (servo_output.c) is not used by this test
+void servo_output_irq_handler(void)
+{
+}
+
+
+// ****************************************************************************
+// Persistent storage (persistent_storage.c): learned endpoints are not kept
+void write_persistent_storage(void)
+{
+}
+
+
+// ****************************************************************************
+static bool load_trace(const char *filename)
+{
+    FILE *f;
+    char line[200];
+    uint16_t *p;
+    int n;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return false;
+    }
+
+    trace.frames = 0;
+    trace.has_intended = true;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#'  ||  line[0] == '\n') {
+            continue;
+        }
+        if (trace.frames >= MAX_FRAMES) {
+            fprintf(stderr, "%s: more than %d frames\n", filename, MAX_FRAMES);
+            break;
+        }
+
+        p = trace.pulse[trace.frames];
+        n = sscanf(line, "%hu %hu %hu %hu %hu %hu",
+            &p[0], &p[1], &p[2], &p[3], &p[4], &p[5]);
+        if (n != 3  &&  n != 6) {
+            fprintf(stderr, "%s: invalid line: %s", filename, line);
+            fclose(f);
+            return false;
+        }
+        if (n == 3) {
+            trace.has_intended = false;
+        }
+        ++trace.frames;
+    }
+
+    fclose(f);
+    return true;
+}
+
+
+// ****************************************************************************
+// Falling edge of the CPPM signal at time t (in us). CAP is read-only for
+// the firmware.
+static void cppm_edge(long t)
+{
+    *(volatile uint16_t *)&host_sct.CAP[1].L = (uint16_t)(t * 2);
+    host_sct.EVFLAG = (1 << 1);
+    SCT_irq_handler();
+}
+
+
+// ****************************************************************************
+static uint8_t drive_state(void)
+{
+    return (global_flags.forward ? 1 : 0) |
+        (global_flags.braking ? 2 : 0) |
+        (global_flags.reversing ? 4 : 0);
+}
+
+
+// ****************************************************************************
+static void simulate(int column, RUN_T *run)
+{
+    long frame;
+    long t;
+    uint16_t *p;
+    uint8_t state = 0;
+
+    // The SCTimer L wraps around at 0xffff
+    host_sct.MATCHREL[0].L = 0xffff;
+    init_servo_reader();
+
+    run->changes = 0;
+
+    for (frame = 0; frame < trace.frames; frame++) {
+        p = &trace.pulse[frame][column];
+        t = frame * FRAME;
+
+        cppm_edge(t);
+        cppm_edge(t + p[0]);
+        cppm_edge(t + p[0] + p[1]);
+        cppm_edge(t + p[0] + p[1] + p[2]);
+
+        global_flags.systick = 1;
+        read_all_servo_channels();
+        process_drive_mode();
+
+        if (drive_state() != state  &&  run->changes < MAX_CHANGES) {
+            state = drive_state();
+            run->time[run->changes] = t / 1000;
+            run->state[run->changes] = state;
+            ++run->changes;
+        }
+    }
+}
+
+
+// ****************************************************************************
+// Runs the trace with the given filter in a child process
+static bool run_trace(int column, int filter, RUN_T *run)
+{
+    int fds[2];
+    pid_t pid;
+    size_t done = 0;
+    ssize_t n;
+    int status;
+
+    if (pipe(fds) != 0) {
+        return false;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        test_config = &configs[filter];
+        simulate(column, run);
+        while (done < sizeof(*run)) {
+            n = write(fds[1], (char *)run + done, sizeof(*run) - done);
+            if (n <= 0) {
+                _exit(1);
+            }
+            done += n;
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    while (done < sizeof(*run)) {
+        n = read(fds[0], (char *)run + done, sizeof(*run) - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    return done == sizeof(*run)  &&  WIFEXITED(status)  &&
+        WEXITSTATUS(status) == 0;
+}
+
+
+// ****************************************************************************
+static bool same_states(const RUN_T *a, const RUN_T *b)
+{
+    long i;
+
+    if (a->changes != b->changes) {
+        return false;
+    }
+    for (i = 0; i < a->changes; i++) {
+        if (a->state[i] != b->state[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// ****************************************************************************
+static int test_trace(const char *filename)
+{
+    int filter;
+    int failures = 0;
+    long false_changes;
+    long none_false_changes = 0;
+    long delay;
+    long delay_max;
+    long delay_sum;
+    long i;
+
+    if (!load_trace(filename)) {
+        return 1;
+    }
+
+    printf("%s: %ld frames\n", filename, trace.frames);
+
+    if (trace.has_intended  &&
+            !run_trace(INTENDED, SERVO_INPUT_FILTER_NONE, &reference)) {
+        printf("    FAIL: simulation failed\n");
+        return 1;
+    }
+
+    for (filter = 0; filter < NUMBER_OF_FILTERS; filter++) {
+        if (!run_trace(RECEIVED, filter, &received_run)) {
+            printf("    FAIL: simulation failed\n");
+            return 1;
+        }
+
+        printf("    %-10s %4ld changes", filter_names[filter],
+            received_run.changes);
+
+        if (!trace.has_intended) {
+            printf("\n");
+            continue;
+        }
+
+        false_changes = received_run.changes - reference.changes;
+        if (false_changes < 0) {
+            false_changes = 0;
+        }
+        if (filter == SERVO_INPUT_FILTER_NONE) {
+            none_false_changes = false_changes;
+        }
+        printf(" (%4ld false)", false_changes);
+
+        if (!run_trace(INTENDED, filter, &intended_run)) {
+            printf("\n    FAIL: simulation failed\n");
+            return 1;
+        }
+
+        if (!same_states(&intended_run, &reference)) {
+            printf("\n        FAIL: intended pulses give %ld changes instead "
+                "of %ld\n", intended_run.changes, reference.changes);
+            ++failures;
+            continue;
+        }
+
+        delay_max = 0;
+        delay_sum = 0;
+        for (i = 0; i < reference.changes; i++) {
+            delay = intended_run.time[i] - reference.time[i];
+            delay_sum += delay;
+            if (delay > delay_max) {
+                delay_max = delay;
+            }
+        }
+        printf(", delay avg %ld ms, max %ld ms\n",
+            reference.changes ? delay_sum / reference.changes : 0, delay_max);
+
+        if (false_changes > none_false_changes) {
+            printf("        FAIL: more false changes than without filter\n");
+            ++failures;
+        }
+    }
+
+    return failures;
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    int i;
+    int failures = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s trace-file...\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        failures += test_trace(argv[i]);
+    }
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
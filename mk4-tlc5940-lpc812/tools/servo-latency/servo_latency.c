@@ -0,0 +1,210 @@
+/******************************************************************************
+
+    Servo output latency measurement
+
+    Runs servo_output.c of the firmware on the build host, together with a
+    model of the SCTimer H, a receiver and the mainloop, and reports the
+    latency of the steering wheel servo output.
+
+    The simulation runs in steps of 1 us:
+
+    - The receiver sends a new steering value every receiver frame. Every
+      frame carries a different value. The "input edge" is the end of the
+      servo pulses, when the servo reader flags new channel data.
+    - The mainloop runs every mainloop period. It takes over the newest
+      steering value and calls process_servo_output(), like main.c does.
+    - The SCTimer H counts to MATCH[0] and wraps around (auto-limit). At the
+      limit it reloads MATCH[0] and MATCH[4] from MATCHREL and starts the
+      output pulse, which ends when the counter reaches MATCH[4].
+
+    The latency is the time from the input edge to the end of the first
+    output pulse carrying the new value, as the servo can only measure the
+    pulse once it has ended. Frames that are replaced by a newer value before
+    they reach the output are counted as superseded.
+
+    The output frame rate is config.servo_output_frame_rate, given at
+    compile time with -DSERVO_OUTPUT_FRAME_RATE (see makefile).
+
+    Usage: servo_latency [receiver frame in us [mainloop period in us]]
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <LPC8xx.h>
+#include <globals.h>
+
+#define DEFAULT_RECEIVER_FRAME 18000
+#define DEFAULT_MAINLOOP_PERIOD 1000
+#define SIMULATION_TIME 60000000
+
+extern void init_servo_output(void);
+extern void process_servo_output(void);
+
+
+// Environment servo_output.c expects from the rest of the firmware
+GLOBAL_FLAGS_T global_flags;
+CHANNEL_T channel[3];
+
+LPC_SWM_TypeDef host_swm;
+LPC_SCT_TypeDef host_sct;
+
+const LIGHT_CONTROLLER_CONFIG_T config = {
+    .mode = MASTER_WITH_SERVO_READER,
+    .flags = {
+        .steering_wheel_servo_output = true
+    },
+    .servo_output_frame_rate = SERVO_OUTPUT_FRAME_RATE
+};
+
+
+// ****************************************************************************
+// Persistent storage (persistent_storage.c): the defaults of an erased flash
+void load_persistent_storage(void)
+{
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].left = 1000;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].centre = 1500;
+    servo_output_endpoint[SERVO_OUTPUT_STEERING_WHEEL].right = 2000;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].left = 1000;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].centre = 1500;
+    servo_output_endpoint[SERVO_OUTPUT_GEARBOX].right = 2000;
+}
+
+
+// ****************************************************************************
+void write_persistent_storage(void)
+{
+}
+
+
+// ****************************************************************************
+// Light programs (light_programs.c): gear changes do not affect the latency
+void post_light_program_event(LIGHT_PROGRAM_EVENT_T event)
+{
+    (void)event;
+}
+
+
+// ****************************************************************************
+// Steering value of receiver frame n: a triangle wave where consecutive
+// frames never have the same value
+static int16_t steering(long n)
+{
+    long phase = (n * 7) % 400;
+
+    return (int16_t)((phase < 200) ? (phase - 100) : (300 - phase));
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    long receiver_frame = DEFAULT_RECEIVER_FRAME;
+    long mainloop_period = DEFAULT_MAINLOOP_PERIOD;
+
+    long t;
+    long input_frame = -1;          // Last frame sent by the receiver
+    long mainloop_frame = -1;       // Last frame taken over by the mainloop
+    long pulse_frame = -1;          // Frame of the output pulse in progress
+    long output_frame = -1;         // Last frame that reached the servo
+    long *input_time;
+
+    uint16_t counter = 0;
+    uint16_t match_limit;
+    uint16_t match_pulse;
+    bool pulse_active = false;
+
+    long latency;
+    long latency_min = -1;
+    long latency_max = 0;
+    long long latency_sum = 0;
+    long updates = 0;
+    long superseded = 0;
+
+    if (argc > 1) {
+        receiver_frame = atol(argv[1]);
+    }
+    if (argc > 2) {
+        mainloop_period = atol(argv[2]);
+    }
+    if (receiver_frame <= 0  ||  mainloop_period <= 0) {
+        fprintf(stderr, "Usage: %s [receiver frame in us [mainloop period "
+            "in us]]\n", argv[0]);
+        return 1;
+    }
+
+    input_time = malloc(sizeof(long) * (SIMULATION_TIME / receiver_frame + 1));
+    if (input_time == NULL) {
+        return 1;
+    }
+
+    load_persistent_storage();
+    init_servo_output();
+    match_limit = host_sct.MATCHREL[0].H;
+    match_pulse = host_sct.MATCHREL[4].H;
+
+    for (t = 0; t < SIMULATION_TIME; t++) {
+        // Receiver
+        if ((t % receiver_frame) == receiver_frame - 1) {
+            ++input_frame;
+            input_time[input_frame] = t;
+        }
+
+        // Mainloop
+        if ((t % mainloop_period) == 0) {
+            if (mainloop_frame != input_frame) {
+                mainloop_frame = input_frame;
+                channel[ST].normalized = steering(mainloop_frame);
+                channel[ST].absolute = (channel[ST].normalized < 0) ?
+                    -channel[ST].normalized : channel[ST].normalized;
+            }
+            process_servo_output();
+        }
+
+        // SCTimer H
+        if (counter == match_limit) {
+            counter = 0;
+            match_limit = host_sct.MATCHREL[0].H;
+            match_pulse = host_sct.MATCHREL[4].H;
+            pulse_active = true;
+            pulse_frame = mainloop_frame;
+        }
+        else {
+            ++counter;
+        }
+
+        if (pulse_active  &&  counter == match_pulse) {
+            pulse_active = false;
+
+            if (pulse_frame > output_frame  &&  pulse_frame >= 0) {
+                if (output_frame >= 0) {
+                    superseded += pulse_frame - output_frame - 1;
+
+                    latency = t - input_time[pulse_frame];
+                    latency_sum += latency;
+                    ++updates;
+                    if (latency_min < 0  ||  latency < latency_min) {
+                        latency_min = latency;
+                    }
+                    if (latency > latency_max) {
+                        latency_max = latency;
+                    }
+                }
+                output_frame = pulse_frame;
+            }
+        }
+    }
+
+    printf("Output %u Hz (frame %u us), receiver frame %ld us, mainloop "
+        "%ld us:\n", config.servo_output_frame_rate, match_limit + 1,
+        receiver_frame, mainloop_period);
+    printf("    latency min %ld us, avg %lld us, max %ld us; "
+        "%ld of %ld frames superseded\n", latency_min,
+        updates ? latency_sum / updates : 0, latency_max, superseded,
+        updates + superseded);
+
+    free(input_time);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+'''
+specialize_config.py
+
+Creates a C header file that fixes the operating mode and the UART/servo
+outputs of the light controller at compile time, based on a configuration
+file saved by the web-based configurator (JSON format).
+
+The firmware makefile uses this tool when building with
+SPECIALIZED_CONFIG=<configuration file>. The resulting image only contains
+the code that the given configuration actually needs.
+
+Author:         Werner Lane
+E-mail:         laneboysrc@gmail.com
+'''
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import sys
+
+
+# Must match MASTER_MODE_T in globals.h
+MODES = {
+    0: 'MASTER_WITH_SERVO_READER',
+    1: 'MASTER_WITH_UART_READER',
+    2: 'MASTER_WITH_CPPM_READER',
+    3: 'SLAVE',
+}
+
+UART_OUTPUTS = ('slave_output', 'preprocessor_output', 'winch_output')
+SERVO_OUTPUTS = ('steering_wheel_servo_output', 'gearbox_servo_output')
+
+
+def parse_commandline():
+    ''' Command line option parsing '''
+    parser = argparse.ArgumentParser(
+        description='''\
+Create a C header that fixes the light controller mode and outputs at
+compile time, based on a configurator JSON file.''')
+
+    parser.add_argument("config_file", nargs=1, type=argparse.FileType('r'),
+        help="the configuration file saved by the configurator")
+
+    parser.add_argument("-o", "--output", type=argparse.FileType('w'),
+        default=sys.stdout,
+        help="the header file to write. Default is stdout")
+
+    return parser.parse_args()
+
+
+def get_config(args):
+    ''' Load the configuration and check that it is consistent '''
+    try:
+        data = json.load(args.config_file[0])
+        config = data['config']
+        mode = MODES[config['mode']]
+        outputs = dict((name, bool(config[name]))
+            for name in UART_OUTPUTS + SERVO_OUTPUTS)
+    except (ValueError, KeyError, TypeError):
+        print("ERROR: {} is not a light controller configuration file".format(
+            args.config_file[0].name), file=sys.stderr)
+        sys.exit(1)
+
+    uart_outputs = [name for name in UART_OUTPUTS if outputs[name]]
+    servo_outputs = [name for name in SERVO_OUTPUTS if outputs[name]]
+
+    # The servo reader uses the UART pin as servo output, so servo outputs
+    # are mutually exclusive with each other and the UART outputs in that
+    # mode. Several UART outputs share the UART pin (see uart_mux.c).
+    if mode == 'MASTER_WITH_SERVO_READER':
+        if len(servo_outputs) > 1 or (servo_outputs and uart_outputs):
+            print("ERROR: only one servo output, or UART outputs, allowed "
+                "with servo inputs", file=sys.stderr)
+            sys.exit(1)
+
+    # Both servo outputs use the TH pin for the gearbox servo, which is
+    # otherwise the UART output
+    elif len(servo_outputs) > 1 and uart_outputs:
+        print("ERROR: both servo outputs can not be combined with a UART "
+            "output", file=sys.stderr)
+        sys.exit(1)
+
+    return mode, outputs
+
+
+def specialize_config(args):
+    ''' Output the header file '''
+    mode, outputs = get_config(args)
+    out = args.output
+
+    print("// Auto-generated file. Do not modify.", file=out)
+    print("//", file=out)
+    print("// Generated from file {file} by {tool}".format(
+        tool=os.path.basename(sys.argv[0]),
+        file=args.config_file[0].name), file=out)
+    print("", file=out)
+    print("#define FIXED_CONFIG_MODE {}".format(mode), file=out)
+
+    for name in UART_OUTPUTS + SERVO_OUTPUTS:
+        print("#define FIXED_CONFIG_{} {}".format(
+            name.upper(), 'true' if outputs[name] else 'false'), file=out)
+
+
+def main():
+    ''' Program start '''
+    args = parse_commandline()
+    specialize_config(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,412 @@
+/******************************************************************************
+
+    Multiplexed UART output test
+
+    Runs uart_mux.c of the firmware on the build host. The transmitted bytes
+    are fed back into uart_mux_receive_byte(), the receiver used by
+    uart_reader.c and process_slave().
+
+    First the framing is checked: escaping of the byte values 0x80..0x87,
+    frames with a wrong CRC, and 0x87 (the start byte of the raw slave and
+    preprocessor protocols) aborting a frame.
+
+    Then a master with slave, preprocessor and winch output is simulated in
+    steps of 1 us:
+
+    - The mainloop runs every mainloop period. Like main.c it produces a
+      slave frame with 16 LEDs after every systick (20 ms), a preprocessor
+      frame after every receiver frame, and a winch command every second,
+      and then calls process_uart_mux().
+    - The UART has a transmit holding register and a shift register, and
+      sends a byte in 10 bit times.
+
+    process_uart_mux() polls the UART, so the mainloop period must be short
+    compared to the time of a byte. The mainloop of the firmware spins
+    freely, the default of 100 us is a conservative estimate.
+
+    For each channel the number of frames produced and received is reported,
+    along with the latency from production to the end of the last byte of
+    the received frame. Frames that are replaced by a newer one before they
+    are sent are counted as superseded.
+
+    The test fails if a frame is received corrupted, or if a slave frame or
+    winch command is lost.
+
+    The baudrate is config.baudrate, given at compile time with -DBAUDRATE
+    (see makefile).
+
+    Usage: uart_mux_test [receiver frame in us [mainloop period in us]]
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <globals.h>
+#include <uart0.h>
+
+#define DEFAULT_RECEIVER_FRAME 18000
+#define DEFAULT_MAINLOOP_PERIOD 100
+#define SIMULATION_TIME 60000000
+#define SYSTICK_PERIOD (__SYSTICK_IN_MS * 1000)
+#define WINCH_PERIOD 1000000
+
+#define SLAVE_LEDS 16
+#define MAX_FRAMES 4000
+
+
+// Environment uart_mux.c expects from the rest of the firmware
+GLOBAL_FLAGS_T global_flags;
+uint32_t entropy;
+
+const LIGHT_CONTROLLER_CONFIG_T config = {
+    .mode = MASTER_WITH_SERVO_READER,
+    .flags = {
+        .slave_output = true,
+        .preprocessor_output = true,
+        .winch_output = true
+    },
+    .baudrate = BAUDRATE
+};
+
+
+// UART model
+static long now;
+static long bit_time_x10;           // Time for a byte in 1/10 us
+static long shift_end_x10;          // End of the byte in the shift register
+static bool holding_full;
+static uint8_t holding;
+static uint8_t shifting;
+
+static uint8_t loopback[256];       // Bytes sent by the framing tests
+static int loopback_length;
+
+
+// Frames produced and received per channel
+typedef struct {
+    const char *name;
+    long produced_time[MAX_FRAMES];
+    long produced;
+    long received;
+    long superseded;
+    long corrupted;
+    long latency_min;
+    long latency_max;
+    long long latency_sum;
+} CHANNEL_STATISTICS_T;
+
+static CHANNEL_STATISTICS_T statistics[UART_MUX_NUMBER_OF_CHANNELS] = {
+    [UART_MUX_CHANNEL_WINCH] = {.name = "Winch", .latency_min = -1},
+    [UART_MUX_CHANNEL_PREPROCESSOR] = {.name = "Preprocessor", .latency_min = -1},
+    [UART_MUX_CHANNEL_SLAVE] = {.name = "Slave", .latency_min = -1}
+};
+
+static int failures;
+
+
+// ****************************************************************************
+// UART driver (uart0.c). Before the simulation starts the bytes are
+// collected in loopback[].
+bool uart0_send_is_ready(void)
+{
+    return bit_time_x10 == 0  ||  !holding_full;
+}
+
+
+// ****************************************************************************
+void uart0_send_char(const char c)
+{
+    if (bit_time_x10 == 0) {
+        loopback[loopback_length++] = (uint8_t)c;
+        return;
+    }
+
+    holding = (uint8_t)c;
+    holding_full = true;
+}
+
+
+// ****************************************************************************
+static void check(bool condition, const char *message)
+{
+    if (!condition) {
+        printf("    FAIL: %s\n", message);
+        ++failures;
+    }
+}
+
+
+// ****************************************************************************
+// Send a frame through uart_mux.c and return the frame received from it
+static const UART_MUX_FRAME_T *loopback_frame(UART_MUX_CHANNEL_T mux_channel,
+    const uint8_t *payload, uint8_t length, int corrupt_index, int abort_index)
+{
+    const UART_MUX_FRAME_T *frame = NULL;
+    const UART_MUX_FRAME_T *received = NULL;
+    int i;
+
+    loopback_length = 0;
+    uart_mux_send(mux_channel, payload, length);
+    global_flags.systick = 1;
+    process_uart_mux();
+    global_flags.systick = 0;
+
+    if (corrupt_index >= 0) {
+        loopback[corrupt_index] ^= 0x01;
+    }
+
+    for (i = 0; i < loopback_length; i++) {
+        if (i == abort_index) {
+            check(uart_mux_receive_byte(0x87, &frame) == UART_MUX_NO_FRAME,
+                "0x87 within a frame is passed on to the raw protocol");
+        }
+        if (uart_mux_receive_byte(loopback[i], &frame) ==
+                UART_MUX_FRAME_RECEIVED) {
+            received = frame;
+        }
+    }
+
+    return received;
+}
+
+
+// ****************************************************************************
+static void test_framing(void)
+{
+    uint8_t payload[UART_MUX_MAX_PAYLOAD];
+    const UART_MUX_FRAME_T *frame;
+    bool escaped_ok;
+    int i;
+
+    printf("Framing:\n");
+
+    for (i = 0; i < UART_MUX_MAX_PAYLOAD; i++) {
+        payload[i] = 0x80 + (i % 8);
+    }
+    frame = loopback_frame(UART_MUX_CHANNEL_SLAVE, payload, sizeof(payload), -1, -1);
+    check(frame != NULL, "frame with byte values 0x80..0x87 is received");
+    if (frame) {
+        escaped_ok = frame->channel == UART_MUX_CHANNEL_SLAVE  &&
+            frame->length == sizeof(payload);
+        for (i = 0; i < UART_MUX_MAX_PAYLOAD; i++) {
+            escaped_ok = escaped_ok  &&  frame->payload[i] == payload[i];
+        }
+        check(escaped_ok, "frame with byte values 0x80..0x87 is unchanged");
+    }
+    for (i = 1; i < loopback_length; i++) {
+        check(loopback[i] < 0x84  ||  loopback[i] > 0x87  ||  loopback[i] == 0x85,
+            "no byte after the sync byte is 0x84, 0x86 or 0x87");
+    }
+
+    frame = loopback_frame(UART_MUX_CHANNEL_WINCH, (const uint8_t *)"2", 1, 4, -1);
+    check(frame == NULL, "frame with wrong CRC is ignored");
+
+    frame = loopback_frame(UART_MUX_CHANNEL_WINCH, (const uint8_t *)"3", 1, -1, 3);
+    check(frame == NULL, "frame is aborted by 0x87");
+
+    frame = loopback_frame(UART_MUX_CHANNEL_WINCH, (const uint8_t *)"1", 1, -1, -1);
+    check(frame != NULL  &&  frame->payload[0] == '1',
+        "frame after an aborted frame is received");
+
+    printf("    %s\n", failures ? "failed" : "ok");
+}
+
+
+// ****************************************************************************
+static void produce(UART_MUX_CHANNEL_T mux_channel, const uint8_t *payload,
+    uint8_t length)
+{
+    CHANNEL_STATISTICS_T *s = &statistics[mux_channel];
+
+    if (s->produced >= MAX_FRAMES) {
+        return;
+    }
+    s->produced_time[s->produced] = now;
+    ++s->produced;
+    uart_mux_send(mux_channel, payload, length);
+}
+
+
+// ****************************************************************************
+// The first payload byte of every frame is the number of the frame, so that
+// the receiver can tell which frame arrived
+static void receive(const UART_MUX_FRAME_T *frame)
+{
+    CHANNEL_STATISTICS_T *s;
+    long n;
+    long latency;
+    int i;
+    bool ok;
+
+    if (frame->channel >= UART_MUX_NUMBER_OF_CHANNELS  ||  frame->length < 1) {
+        ++failures;
+        return;
+    }
+    s = &statistics[frame->channel];
+
+    // Frame numbers wrap around at 63, the largest LED value
+    n = s->received + s->superseded;
+    while ((n % 64) != frame->payload[0]  &&  n < s->produced) {
+        ++s->superseded;
+        ++n;
+    }
+
+    ok = (n < s->produced);
+    for (i = 1; i < frame->length; i++) {
+        ok = ok  &&  frame->payload[i] == (uint8_t)((frame->payload[0] + i) % 64);
+    }
+    if (!ok) {
+        ++s->corrupted;
+        ++failures;
+        return;
+    }
+
+    latency = now - s->produced_time[n];
+    if (s->latency_min < 0  ||  latency < s->latency_min) {
+        s->latency_min = latency;
+    }
+    if (latency > s->latency_max) {
+        s->latency_max = latency;
+    }
+    s->latency_sum += latency;
+    ++s->received;
+}
+
+
+// ****************************************************************************
+static void fill_payload(uint8_t *payload, long n, int length)
+{
+    int i;
+
+    for (i = 0; i < length; i++) {
+        payload[i] = (uint8_t)((n + i) % 64);
+    }
+}
+
+
+// ****************************************************************************
+static void simulate(long receiver_frame, long mainloop_period)
+{
+    uint8_t payload[SLAVE_LEDS];
+    const UART_MUX_FRAME_T *frame;
+    bool systick_pending = false;
+    bool receiver_frame_pending = false;
+    bool winch_pending = false;
+    long systick_bytes = 0;
+    long max_systick_bytes = 0;
+    long budget;
+    int i;
+
+    budget = (config.baudrate / 10) * SYSTICK_PERIOD / 1000000;
+    bit_time_x10 = 10 * 10 * 1000000L / config.baudrate;
+    shift_end_x10 = -1;
+
+    for (now = 0; now < SIMULATION_TIME; now++) {
+        if ((now % SYSTICK_PERIOD) == 0) {
+            systick_pending = true;
+            if (systick_bytes > max_systick_bytes) {
+                max_systick_bytes = systick_bytes;
+            }
+            systick_bytes = 0;
+        }
+        if ((now % receiver_frame) == 0) {
+            receiver_frame_pending = true;
+        }
+        if ((now % WINCH_PERIOD) == 0) {
+            winch_pending = true;
+        }
+
+        if ((now % mainloop_period) == 0) {
+            global_flags.systick = systick_pending;
+
+            if (winch_pending) {
+                fill_payload(payload, statistics[UART_MUX_CHANNEL_WINCH].produced, 1);
+                produce(UART_MUX_CHANNEL_WINCH, payload, 1);
+            }
+            if (systick_pending) {
+                fill_payload(payload, statistics[UART_MUX_CHANNEL_SLAVE].produced, SLAVE_LEDS);
+                produce(UART_MUX_CHANNEL_SLAVE, payload, SLAVE_LEDS);
+            }
+            if (receiver_frame_pending) {
+                fill_payload(payload, statistics[UART_MUX_CHANNEL_PREPROCESSOR].produced, 3);
+                produce(UART_MUX_CHANNEL_PREPROCESSOR, payload, 3);
+            }
+            process_uart_mux();
+
+            systick_pending = false;
+            receiver_frame_pending = false;
+            winch_pending = false;
+        }
+
+        // UART: the shift register takes the next byte from the holding
+        // register when it is done
+        if (now * 10 >= shift_end_x10) {
+            if (shift_end_x10 >= 0) {
+                if (uart_mux_receive_byte(shifting, &frame) ==
+                        UART_MUX_FRAME_RECEIVED) {
+                    receive(frame);
+                }
+                shift_end_x10 = -1;
+            }
+            if (holding_full) {
+                shifting = holding;
+                holding_full = false;
+                shift_end_x10 = now * 10 + bit_time_x10;
+                ++systick_bytes;
+            }
+        }
+    }
+
+    printf("Baudrate %u, receiver frame %ld us, mainloop %ld us:\n",
+        (unsigned)config.baudrate, receiver_frame, mainloop_period);
+    printf("    %ld of %ld bytes per systick used at most\n",
+        max_systick_bytes, budget);
+
+    for (i = 0; i < UART_MUX_NUMBER_OF_CHANNELS; i++) {
+        CHANNEL_STATISTICS_T *s = &statistics[i];
+
+        printf("    %-13s %ld of %ld frames received, %ld superseded; "
+            "latency min %ld us, avg %ld us, max %ld us\n",
+            s->name, s->received, s->produced, s->superseded,
+            s->latency_min, s->received ? (long)(s->latency_sum / s->received) : 0,
+            s->latency_max);
+    }
+
+    check(statistics[UART_MUX_CHANNEL_SLAVE].superseded <= 1,
+        "slave frames lost");
+    check(statistics[UART_MUX_CHANNEL_WINCH].superseded == 0,
+        "winch commands lost");
+    for (i = 0; i < UART_MUX_NUMBER_OF_CHANNELS; i++) {
+        check(statistics[i].corrupted == 0, "corrupted frames received");
+    }
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    long receiver_frame = DEFAULT_RECEIVER_FRAME;
+    long mainloop_period = DEFAULT_MAINLOOP_PERIOD;
+
+    if (argc > 1) {
+        receiver_frame = atol(argv[1]);
+    }
+    if (argc > 2) {
+        mainloop_period = atol(argv[2]);
+    }
+    if (receiver_frame <= 0  ||  mainloop_period <= 0) {
+        fprintf(stderr, "Usage: %s [receiver frame in us [mainloop period "
+            "in us]]\n", argv[0]);
+        return 1;
+    }
+
+    test_framing();
+    simulate(receiver_frame, mainloop_period);
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
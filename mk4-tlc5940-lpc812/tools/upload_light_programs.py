@@ -0,0 +1,296 @@
+#!/usr/bin/env python
+'''
+upload_light_programs.py
+
+Uploads light programs into the flash memory of the TLC5940/LPC812 based
+light controller over the UART, without re-flashing the firmware. The
+firmware must be built with LIGHT_PROGRAM_UPLOAD (see the makefile of the
+firmware).
+
+Connect a USB-to-serial adapter to the ISP header (RX of the light controller
+is the ST pin, TX is the TH pin), start this tool and power up the light
+controller. The light controller enters maintenance mode when it receives
+a HELLO frame shortly after power-up. See maintenance.c of the firmware for
+the protocol.
+
+The light programs are either a light program source file, which is
+assembled with the light program assembler of the configurator, or the
+C file written by the assembler. Light programs compiled to native code can
+not be uploaded.
+
+The uploaded light programs are verified the same way as
+validate_image_file.py does before they are sent, and by the firmware after
+the reset that ends maintenance mode. If the verification fails the light
+programs built into the firmware are used. Flashing the firmware removes
+uploaded light programs.
+
+Author:         Werner Lane
+E-mail:         laneboysrc@gmail.com
+'''
+
+from __future__ import print_function
+
+import argparse
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+import serial
+
+from validate_image_file import ROM_MAGIC, LIGHT_PROGRAMS, \
+    MAX_LIGHT_PROGRAMS, verify_light_programs
+
+
+PROTOCOL_VERSION = 1
+
+FRAME_SYNC = 0xa5
+
+COMMAND_HELLO = 0x01
+COMMAND_BEGIN = 0x02
+COMMAND_WRITE = 0x03
+COMMAND_COMMIT = 0x04
+COMMAND_EXIT = 0x05
+RESPONSE_ACK = 0x06
+RESPONSE_NAK = 0x15
+
+ERRORS = {1: "unknown command", 2: "invalid parameter", 3: "no upload",
+    4: "flash write failed", 5: "CRC mismatch"}
+
+# Size of LIGHT_PROGRAMS_T without programs[]: magic, number_of_programs and
+# start[]
+HEADER_SIZE = 8 + 4 + 4 * MAX_LIGHT_PROGRAMS
+
+RETRIES = 5
+
+ASSEMBLER_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+    'configurator', 'assembler')
+
+
+def parse_commandline():
+    ''' Command line option parsing '''
+    parser = argparse.ArgumentParser(
+        description='''\
+Upload light programs into the light controller over the UART.''')
+
+    parser.add_argument("input_file", nargs=1,
+        help="the light program source, or the C file written by the light "
+            "program assembler")
+
+    parser.add_argument("-p", "--port", default="/dev/ttyUSB0",
+        help="the serial port the light controller is connected to. "
+            "Default is /dev/ttyUSB0")
+
+    parser.add_argument("-b", "--baudrate", type=int, default=115200,
+        help="the baudrate of the light controller. Default is 115200")
+
+    parser.add_argument("-t", "--timeout", type=float, default=30,
+        help="seconds to wait for the light controller to be powered up. "
+            "Default is 30")
+
+    return parser.parse_args()
+
+
+def crc16(data, crc=0xffff):
+    ''' CRC-16-CCITT, same as crc16_ccitt() in utils.c of the firmware '''
+    for byte in bytearray(data):
+        crc ^= byte << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xffff
+            else:
+                crc = (crc << 1) & 0xffff
+    return crc
+
+
+def assemble(filename):
+    ''' Run the light program assembler and return the C source it wrote '''
+    handle, output = tempfile.mkstemp(suffix='.c')
+    os.close(handle)
+    try:
+        subprocess.check_call(['make', '-s', '-C', ASSEMBLER_PATH, 'run',
+            'RUN_OPTIONS=-o {} {}'.format(output, os.path.abspath(filename))])
+        with open(output) as c_file:
+            return c_file.read()
+    except (OSError, subprocess.CalledProcessError):
+        print('ERROR: Failed to assemble {}'.format(filename))
+        sys.exit(1)
+    finally:
+        os.remove(output)
+
+
+def parse_assembler_output(source):
+    ''' Return the list of start offsets (in words) and the list of program
+        words of the C source written by the light program assembler '''
+    if 'native_light_programs' in source:
+        print('ERROR: Light programs compiled to native code can not be '
+            'uploaded')
+        sys.exit(1)
+
+    try:
+        start_list = re.search(r'\.start\s*=\s*{(.*?)}', source, re.S).group(1)
+        programs_list = re.search(r'\.programs\s*=\s*{(.*?)}', source,
+            re.S).group(1)
+    except AttributeError:
+        print('ERROR: Input is not a light program or assembler output')
+        sys.exit(1)
+
+    starts = [int(s) for s in re.findall(r'programs\[(\d+)\]', start_list)]
+    words = [int(w, 16) for w in re.findall(r'0x([0-9a-fA-F]+)', programs_list)]
+    return starts, words
+
+
+def build_light_programs(starts, words, info):
+    ''' Return LIGHT_PROGRAMS_T located at the flash region given by the
+        HELLO response, padded to full flash pages '''
+    address = info['address']
+
+    start = [address + HEADER_SIZE + 4 * s for s in starts]
+    start += [0] * (MAX_LIGHT_PROGRAMS - len(start))
+
+    blob = struct.pack('<IHHi', ROM_MAGIC, LIGHT_PROGRAMS,
+        info['light_programs_version'], len(starts))
+    blob += struct.pack('<{}I'.format(MAX_LIGHT_PROGRAMS), *start)
+    blob += struct.pack('<{}I'.format(len(words)), *words)
+
+    if len(blob) > info['size']:
+        print('ERROR: Light programs need {} bytes, only {} bytes available'
+            .format(len(blob), info['size']))
+        sys.exit(1)
+
+    page_size = info['page_size']
+    blob += b'\xff' * (-len(blob) % page_size)
+
+    error = verify_light_programs(bytearray(blob), 0)
+    if error:
+        print('ERROR: Light programs failed verification: {}'.format(error))
+        sys.exit(1)
+
+    return blob
+
+
+class LightController(object):
+    ''' Frames of the maintenance mode protocol over a serial port '''
+
+    def __init__(self, port, baudrate):
+        try:
+            self.port = serial.Serial(port, baudrate, timeout=0.2)
+        except serial.SerialException as error:
+            print('ERROR: Unable to open port {}: {}'.format(port, error))
+            sys.exit(1)
+
+    def send(self, command, payload=b''):
+        ''' Send a command frame '''
+        frame = bytearray([command, len(payload)]) + bytearray(payload)
+        crc = crc16(frame)
+        frame = bytearray([FRAME_SYNC]) + frame + \
+            bytearray([crc & 0xff, crc >> 8])
+        self.port.write(bytes(frame))
+
+    def receive(self):
+        ''' Return (response, payload) of the next frame with valid CRC, or
+            (None, None) on timeout '''
+        while True:
+            sync = bytearray(self.port.read(1))
+            if not sync:
+                return None, None
+            if sync[0] != FRAME_SYNC:
+                continue
+
+            header = bytearray(self.port.read(2))
+            if len(header) != 2:
+                return None, None
+            payload = bytearray(self.port.read(header[1]))
+            crc = bytearray(self.port.read(2))
+            if len(payload) != header[1] or len(crc) != 2:
+                return None, None
+
+            if crc16(header + payload) == crc[0] | (crc[1] << 8):
+                return header[0], payload
+
+    def execute(self, command, payload=b''):
+        ''' Send a command and return the payload of the ACK. Retries on
+            timeout; a NAK is fatal. '''
+        for _ in range(RETRIES):
+            self.send(command, payload)
+            response, result = self.receive()
+            if response == RESPONSE_ACK:
+                return result
+            if response == RESPONSE_NAK:
+                print('ERROR: Light controller responded with NAK: {}'.format(
+                    ERRORS.get(result[0], result[0]) if result else ''))
+                sys.exit(1)
+
+        print('ERROR: No response from the light controller')
+        sys.exit(1)
+
+    def wait_for_maintenance_mode(self, timeout):
+        ''' Send HELLO until the light controller responds, and return the
+            information about the flash region '''
+        self.port.timeout = 0.005
+        end = time.time() + timeout
+        while time.time() < end:
+            self.send(COMMAND_HELLO)
+            response, payload = self.receive()
+            if response == RESPONSE_ACK and len(payload) == 9:
+                break
+        else:
+            print('ERROR: Light controller did not enter maintenance mode')
+            sys.exit(1)
+
+        self.port.timeout = 0.2
+        self.port.reset_input_buffer()
+
+        version, light_programs_version, address, size, page_size = \
+            struct.unpack('<BBIHB', bytes(payload))
+        if version != PROTOCOL_VERSION:
+            print('ERROR: Unsupported protocol version {}'.format(version))
+            sys.exit(1)
+
+        return {'light_programs_version': light_programs_version,
+            'address': address, 'size': size, 'page_size': page_size}
+
+
+def upload_light_programs(args):
+    ''' Upload the light programs '''
+    filename = args.input_file[0]
+    with open(filename) as input_file:
+        source = input_file.read()
+    if '.programs' not in source:
+        source = assemble(filename)
+    starts, words = parse_assembler_output(source)
+
+    controller = LightController(args.port, args.baudrate)
+    print('Waiting for the light controller, please power it up ...')
+    info = controller.wait_for_maintenance_mode(args.timeout)
+    print('Light controller is in maintenance mode')
+
+    blob = build_light_programs(starts, words, info)
+    started = time.time()
+
+    controller.execute(COMMAND_BEGIN, struct.pack('<HH', len(blob),
+        crc16(blob)))
+
+    page_size = info['page_size']
+    for offset in range(0, len(blob), page_size):
+        controller.execute(COMMAND_WRITE, struct.pack('<H', offset) +
+            blob[offset:offset + page_size])
+
+    controller.execute(COMMAND_COMMIT)
+    controller.execute(COMMAND_EXIT)
+
+    print('Uploaded {} light programs ({} bytes) in {:.1f} s'.format(
+        len(starts), len(blob), time.time() - started))
+
+
+def main():
+    ''' Program start '''
+    args = parse_commandline()
+    upload_light_programs(args)
+
+
+if __name__ == '__main__':
+    main()
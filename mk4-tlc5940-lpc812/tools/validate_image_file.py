@@ -7,6 +7,11 @@ to ensure it contains the required sections for the configuration tool.
 Each section has a magic value 0x6372424c, followed by the section identifier
 and a version number.
 
+The light programs are verified the same way as init_light_programs() in
+light_programs.c of the firmware does: every instruction must be known, jump
+targets must be inside the program, variable ids must be below
+MAX_LIGHT_PROGRAM_VARIABLES and LED indices below MAX_LIGHTS.
+
 '''
 from __future__ import print_function
 import sys
@@ -21,6 +26,43 @@ SECTIONS = {0x01: "Configuration", 0x02: "Gamma table", 0x30: "Light programs",
 
 MAX_FILE_SIZE = 16 * 1024       # 16 kBytes FLASH size of the LCP812
 
+# Light programs, see globals.h of the firmware
+LIGHT_PROGRAMS = 0x30
+MAX_LIGHTS = 32
+MAX_LIGHT_PROGRAMS = 25
+MAX_LIGHT_PROGRAM_VARIABLES = 100
+FIRST_OPCODE_OFFSET = 3 * 4
+SUBROUTINE_FIRST_OPCODE_OFFSET = 2 * 4
+PATTERN_TABLE_FIRST_BYTE_OFFSET = 1 * 4
+
+OPCODE_GOTO = 0x01
+OPCODE_SET = 0x02
+OPCODE_SET_I = 0x03
+OPCODE_FADE = 0x04
+OPCODE_FADE_I = 0x05
+OPCODE_SLEEP = 0x06
+OPCODE_SLEEP_I = 0x07
+OPCODE_SET_LED = 0x08
+OPCODE_SET_LED_I = 0x09
+OPCODE_FADE_LED = 0x0a
+OPCODE_FADE_LED_I = 0x0b
+OPCODE_CALL = 0x0c
+OPCODE_RETURN = 0x0d
+OPCODE_PATTERN = 0x0e
+OPCODE_PATTERN_I = 0x0f
+OPCODE_ABS = 0x40
+OPCODE_ABS_I = 0x41
+OPCODE_SET_MASK = 0x48
+OPCODE_FADE_MASK_I = 0x4b
+OPCODE_PATTERN_TABLE = 0xfc
+OPCODE_SUBROUTINE = 0xfd
+OPCODE_END_OF_PROGRAM = 0xfe
+OPCODE_END_OF_PROGRAMS = 0xff
+
+PARAMETER_TYPE_VARIABLE = 0
+PARAMETER_TYPE_LED = 1
+PARAMETER_TYPE_GEAR = 5
+
 
 def parse_commandline():
     ''' Command line option parsing '''
@@ -56,6 +98,269 @@ def find_section(content, offset):
     return (None, None, None)
 
 
+def instruction_length(opcode):
+    ''' Length of an instruction in bytes, same as the table in
+        light_programs.c '''
+    if opcode in (OPCODE_RETURN, OPCODE_END_OF_PROGRAM):
+        return 1
+    if opcode in (OPCODE_PATTERN, OPCODE_PATTERN_I):
+        return 5
+    if OPCODE_SET_MASK <= opcode <= OPCODE_FADE_MASK_I:
+        return 6
+    if opcode == OPCODE_GOTO or OPCODE_SLEEP <= opcode <= OPCODE_CALL or \
+            0x50 <= opcode <= 0x57:
+        return 3
+    return 4
+
+
+def is_skip_if(opcode):
+    ''' SKIP IF comparing a var or LED, or SKIP IF ANY/ALL/NONE '''
+    return 0x20 <= opcode <= 0x37 or 0x60 <= opcode <= 0xbf
+
+
+class LightProgramVerifier(object):
+    ''' Verify the light programs of the image. The programs, subroutines
+        and pattern tables are consecutive blocks starting at base, each
+        aligned to a word and identified by the top-most byte of its first
+        word. '''
+
+    def __init__(self, content, base):
+        self.content = content
+        self.base = base
+        self.limit = min(len(content), base + MAX_FILE_SIZE)
+
+    def word(self, offset):
+        ''' Return the uint32 at offset '''
+        return struct.unpack('<I', bytes(self.content[offset:offset+4]))[0]
+
+    def end_of_block(self, block):
+        ''' Return the offset after the block, or None if it is corrupt '''
+        if block + 4 > self.limit:
+            return None
+
+        header = self.word(block)
+        block_type = header >> 24
+        if block_type == 0:
+            end = block + FIRST_OPCODE_OFFSET
+            while end < self.limit and \
+                    self.content[end] != OPCODE_END_OF_PROGRAM:
+                end += instruction_length(self.content[end])
+            end += 1
+        elif block_type == OPCODE_SUBROUTINE:
+            end = block + SUBROUTINE_FIRST_OPCODE_OFFSET + (header & 0xffff)
+        elif block_type == OPCODE_PATTERN_TABLE:
+            end = block + PATTERN_TABLE_FIRST_BYTE_OFFSET + (header & 0xffff)
+        else:
+            return None
+
+        # There must be room for the header of the next block
+        if end > self.limit - 4:
+            return None
+        return end
+
+    def next_block(self, block):
+        ''' Return the offset of the block following block '''
+        end = self.end_of_block(block)
+        if end is None:
+            return None
+        return self.base + ((end - self.base + 3) & ~3)
+
+    def is_block(self, header, block_type):
+        ''' True if header is the first word of a block of block_type '''
+        block = self.base
+        while block is not None and block < header:
+            if self.word(block) >> 24 == OPCODE_END_OF_PROGRAMS:
+                return False
+            block = self.next_block(block)
+        return block == header and self.word(block) >> 24 == block_type
+
+    def is_instruction(self, first, end, target):
+        ''' True if target is the first byte of an instruction '''
+        if target < first or target >= end:
+            return False
+        pc = first
+        while pc < target:
+            pc += instruction_length(self.content[pc])
+        return pc == target
+
+    def is_valid_pattern(self, table, first_led):
+        ''' table points to the first byte of a pattern table, which holds
+            the number of LEDs per frame and the number of frames '''
+        header = table - PATTERN_TABLE_FIRST_BYTE_OFFSET
+        if not self.is_block(header, OPCODE_PATTERN_TABLE):
+            return False
+        width = self.content[table]
+        frames = self.content[table + 1]
+        return frames != 0 and \
+            2 + width * frames <= (self.word(header) & 0xffff) and \
+            first_led + width <= MAX_LIGHTS
+
+    def verify_instruction(self, first, end, pc, subroutine):
+        ''' Return an error message, or None if the instruction is valid '''
+        opcode, operand1, operand2, operand3, operand4 = \
+            (self.content[pc:pc+5] + bytearray(5))[:5]
+        next_pc = pc + instruction_length(opcode)
+        parameter = operand2 | (operand3 << 8)
+        offset = struct.unpack('<h', struct.pack('<H',
+            operand1 | (operand2 << 8)))[0]
+
+        def valid_var(var):
+            ''' Variable id check '''
+            return var < MAX_LIGHT_PROGRAM_VARIABLES
+
+        def valid_led(led):
+            ''' LED index check '''
+            return led < MAX_LIGHTS
+
+        def valid_parameter(parameter):
+            ''' Odd opcodes have an immediate, even ones a type and id '''
+            if opcode & 0x01:
+                return True
+            if parameter >> 8 == PARAMETER_TYPE_VARIABLE:
+                return valid_var(parameter & 0xff)
+            if parameter >> 8 == PARAMETER_TYPE_LED:
+                return valid_led(parameter & 0xff)
+            return parameter >> 8 <= PARAMETER_TYPE_GEAR
+
+        if next_pc > end:
+            return 'Instruction 0x{:02x} exceeds the program'.format(opcode)
+
+        if is_skip_if(opcode):
+            if next_pc >= end or self.content[next_pc] == OPCODE_END_OF_PROGRAM:
+                return 'Nothing to skip after SKIP IF'
+            if subroutine and \
+                    next_pc + instruction_length(self.content[next_pc]) >= end:
+                return 'SKIP IF skips the end of the subroutine'
+            if opcode <= 0x37:
+                # Bit 2 in the opcode field is cleared for VARIABLE, set for LED
+                valid = valid_led(operand1) if opcode & 0x02 \
+                    else valid_var(operand1)
+                if not (valid and valid_parameter(parameter)):
+                    return 'Invalid variable or LED in SKIP IF'
+            return None
+
+        if opcode in (OPCODE_SET, OPCODE_FADE, OPCODE_SET_I, OPCODE_FADE_I):
+            if opcode in (OPCODE_SET, OPCODE_FADE) and not valid_var(operand3):
+                return 'Invalid variable'
+            if operand1 > operand2 or not valid_led(operand2):
+                return 'Invalid LED range'
+        elif OPCODE_SET_LED <= opcode <= OPCODE_FADE_LED_I:
+            if not opcode & 0x01 and not valid_var(operand2):
+                return 'Invalid variable'
+            if not valid_led(operand1):
+                return 'Invalid LED'
+        elif OPCODE_SET_MASK <= opcode <= OPCODE_FADE_MASK_I:
+            if not opcode & 0x01 and not valid_var(operand1):
+                return 'Invalid variable'
+        elif opcode in (OPCODE_PATTERN, OPCODE_PATTERN_I):
+            if opcode == OPCODE_PATTERN and not valid_var(operand4):
+                return 'Invalid variable'
+            if not self.is_valid_pattern(next_pc + offset, operand3):
+                return 'Invalid pattern table or LED range'
+        elif opcode in (OPCODE_SLEEP, OPCODE_SLEEP_I):
+            if not valid_parameter(operand1 | (operand2 << 8)):
+                return 'Invalid parameter'
+        elif opcode == OPCODE_GOTO:
+            if not self.is_instruction(first, end, next_pc + offset):
+                return 'GOTO target outside the program'
+        elif opcode == OPCODE_CALL:
+            if not self.is_block(next_pc + offset -
+                    SUBROUTINE_FIRST_OPCODE_OFFSET, OPCODE_SUBROUTINE):
+                return 'CALL target is not a subroutine'
+        elif opcode == OPCODE_RETURN:
+            if not subroutine:
+                return 'RETURN outside of a subroutine'
+        elif 0x10 <= opcode <= 0x1f or opcode in (OPCODE_ABS, OPCODE_ABS_I):
+            if not valid_var(operand1) or not valid_parameter(parameter):
+                return 'Invalid variable or parameter'
+        elif 0x50 <= opcode <= 0x57:
+            if not valid_var(operand1):
+                return 'Invalid variable'
+        elif opcode == OPCODE_END_OF_PROGRAM:
+            if subroutine:
+                return 'END OF PROGRAM in a subroutine'
+        else:
+            return 'Unknown opcode 0x{:02x}'.format(opcode)
+
+        return None
+
+    def verify_code(self, first, end, subroutine):
+        ''' Verify the instructions of a program or subroutine. Returns an
+            error message, or None if all instructions are valid. '''
+        pc = first
+        opcode = None
+        while pc < end:
+            error = self.verify_instruction(first, end, pc, subroutine)
+            if error:
+                return '{} at offset 0x{:x}'.format(error, pc)
+            opcode = self.content[pc]
+            pc += instruction_length(opcode)
+
+        # The last instruction must not fall through to the next block
+        if subroutine and opcode not in (OPCODE_RETURN, OPCODE_GOTO):
+            return 'Subroutine at offset 0x{:x} does not end with ' \
+                'RETURN or GOTO'.format(first)
+        if not subroutine and opcode != OPCODE_END_OF_PROGRAM:
+            return 'Program at offset 0x{:x} does not end'.format(first)
+        return None
+
+    def verify(self, section_offset):
+        ''' Verify the light programs of the LIGHT_PROGRAMS_T section at
+            section_offset. Returns an error message, or None. '''
+        number_of_programs = struct.unpack('<i',
+            bytes(self.content[section_offset+8:section_offset+12]))[0]
+        start = struct.unpack('<{}I'.format(MAX_LIGHT_PROGRAMS),
+            bytes(self.content[section_offset+12:self.base]))
+
+        if not 0 <= number_of_programs <= MAX_LIGHT_PROGRAMS:
+            return 'Invalid number of light programs {}'.format(
+                number_of_programs)
+
+        n = 0
+        block = self.base
+        while self.word(block) >> 24 != OPCODE_END_OF_PROGRAMS:
+            end = self.end_of_block(block)
+            if end is None:
+                return 'Corrupt block at offset 0x{:x}'.format(block)
+
+            block_type = self.word(block) >> 24
+            error = None
+            if block_type == 0:
+                if n >= number_of_programs or start[n] != block:
+                    return 'Light program at offset 0x{:x} is not in the ' \
+                        'list of programs'.format(block)
+                n += 1
+                # Location of the local variables shared with other programs
+                priority = self.word(block)
+                if ((priority >> 8) & 0xff) + ((priority >> 16) & 0xff) > \
+                        MAX_LIGHT_PROGRAM_VARIABLES:
+                    return 'Variables of light program at offset 0x{:x} ' \
+                        'out of range'.format(block)
+                error = self.verify_code(block + FIRST_OPCODE_OFFSET, end,
+                    False)
+            elif block_type == OPCODE_SUBROUTINE:
+                error = self.verify_code(
+                    block + SUBROUTINE_FIRST_OPCODE_OFFSET, end, True)
+            if error:
+                return error
+
+            block = self.next_block(block)
+
+        if n != number_of_programs:
+            return 'Found {} light programs, expected {}'.format(
+                n, number_of_programs)
+        return None
+
+
+def verify_light_programs(content, section_offset):
+    ''' Verify the light programs section at section_offset. content
+        must be a bytearray. '''
+    # LIGHT_PROGRAMS_T: magic, number_of_programs, start[], programs[]
+    base = section_offset + 8 + 4 + 4 * MAX_LIGHT_PROGRAMS
+    verifier = LightProgramVerifier(content, base)
+    return verifier.verify(section_offset)
+
+
 def dump_sections(args):
     ''' Find all sections in the image file and dump their name and offset '''
     try:
@@ -74,6 +379,8 @@ def dump_sections(args):
         sys.exit(1)
 
 
+    content = bytearray(content)
+
     available_sections = dict()
     for section_name in SECTIONS.values():
         available_sections[section_name] = 0
@@ -87,6 +394,11 @@ def dump_sections(args):
             if args.verbose:
                 print('Found "{:s}", version {:d} at offset 0x{:x}'.format(
                     section_name, version, offset))
+            if section_name == SECTIONS[LIGHT_PROGRAMS]:
+                error = verify_light_programs(content, offset)
+                if error:
+                    print('ERROR: Invalid light programs: {}'.format(error))
+                    error_found = True
         except KeyError:
             print('ERROR: Unknown section {}'.format(section_name))
             error_found = True
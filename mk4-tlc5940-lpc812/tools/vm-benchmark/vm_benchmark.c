@@ -0,0 +1,97 @@
+/******************************************************************************
+
+    Light program VM benchmark
+
+    Runs the light program VM of the firmware (light_programs.c) on the build
+    host and reports how long the VM takes per instruction.
+
+    The light programs used must never sleep (see benchmark.light_program),
+    so that every program executes MAX_INSTRUCTIONS_PER_SYSTICK instructions
+    each systick.
+
+    The absolute numbers are meaningless for the LPC812, but they allow
+    comparing different implementations of the VM and bytecode formats, as
+    well as the bytecode VM with light programs compiled to native code
+    ("make compare").
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <globals.h>
+
+#define DEFAULT_SYSTICKS 1000000
+
+extern void init_light_programs(void);
+extern uint32_t process_light_programs(void);
+
+
+// Environment the VM expects from the rest of the firmware
+uint32_t entropy = 0x12345678;
+GLOBAL_FLAGS_T global_flags;
+CHANNEL_T channel[3];
+
+LED_T light_setpoint[MAX_LIGHTS];
+LED_T light_actual[MAX_LIGHTS];
+uint8_t max_change_per_systick[MAX_LIGHTS];
+uint8_t light_switch_position;
+
+const LIGHT_CONTROLLER_CONFIG_T config = {
+    .light_switch_positions = 5
+};
+
+
+// ****************************************************************************
+bool diagnostics_enabled(void)
+{
+    return false;
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    long systicks = DEFAULT_SYSTICKS;
+    long i;
+    clock_t start;
+    double elapsed;
+    double instructions;
+
+    if (argc > 1) {
+        systicks = atol(argv[1]);
+    }
+
+    init_light_programs();
+
+    start = clock();
+    for (i = 0; i < systicks; i++) {
+        // Vary the inputs so that all branches of the programs are taken
+        channel[ST].normalized = (int16_t)((i % 201) - 100);
+        channel[TH].normalized = (int16_t)((i % 77) - 38);
+        global_flags.braking = (i >> 4) & 1;
+        global_flags.blink_hazard = (i >> 6) & 1;
+
+        process_light_programs();
+
+        light_actual[10] = light_setpoint[10];
+        light_actual[11] = light_setpoint[11];
+    }
+    elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    instructions = (double)systicks * MAX_INSTRUCTIONS_PER_SYSTICK *
+        light_programs.number_of_programs;
+
+    printf("Light programs:    %s\n",
+        (light_programs.magic.version & LIGHT_PROGRAMS_NATIVE) ?
+            "native code" : "bytecode");
+    printf("Programs:          %d\n", light_programs.number_of_programs);
+    printf("Systicks:          %ld\n", systicks);
+    printf("Instructions:      %.0f\n", instructions);
+    printf("Time:              %.3f s\n", elapsed);
+    printf("Time/instruction:  %.2f ns\n", elapsed * 1e9 / instructions);
+
+    return 0;
+}
@@ -0,0 +1,332 @@
+/******************************************************************************
+
+    Winch link test
+
+    Runs winch.c of the firmware on the build host against a model of the
+    winch controller, connected through a UART that loses bytes.
+
+    The simulation runs for 10 minutes in steps of 10 us:
+
+    - Every 2..8 s the operator changes the winch mode with CH3 clicks
+      (winch in, winch out, enable/disable) or by steering (abort winching).
+    - The mainloop runs every 100 us and calls process_winch(), like main.c.
+    - The UART sends a byte in 10 bit times at 38400 Baud. Each byte is lost
+      with the given probability, on the way to the winch controller as well
+      as on the way back.
+    - The winch controller model executes each command it receives and,
+      with echo enabled, echoes it back WINCH_RESPONSE_TIME later.
+
+    For every change of the winch mode the latency until the winch
+    controller executes it is reported. A change counts as lost when the
+    winch controller has not executed it by the time of the next change.
+    The bytes sent show how busy the UART is.
+
+    The test fails if a change is lost on a link without loss, or on a link
+    with echo; or if an acknowledged link without loss sends anything but
+    the changes and the keep-alives.
+
+    Usage: winch_link_test [echo (0 or 1) [loss in percent]]
+
+******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <globals.h>
+#include <uart0.h>
+
+#define SIMULATION_TIME 600000000L
+#define STEP 10
+#define SYSTICK_PERIOD (__SYSTICK_IN_MS * 1000)
+#define MAINLOOP_PERIOD 100
+#define BYTE_TIME 260
+#define WINCH_RESPONSE_TIME 1000
+#define KEEPALIVE_TIME (10 * 1000000L)
+
+#define RECEIVE_BUFFER_SIZE 16
+
+
+// Environment winch.c expects from the rest of the firmware
+GLOBAL_FLAGS_T global_flags;
+
+const LIGHT_CONTROLLER_CONFIG_T config = {
+    .mode = MASTER_WITH_CPPM_READER,
+    .flags = {
+        .winch_output = true
+    },
+    .winch_command_repeat_time = (1000 / __SYSTICK_IN_MS),
+    .baudrate = 38400
+};
+
+
+static long now;
+static bool echo;
+static int loss_percent;
+static uint32_t loss_random = 12345;       // Losses on the UART
+static uint32_t operator_random = 54321;   // Same operator in every run
+
+// UART towards the winch controller
+static bool holding_full;
+static char holding;
+static char shifting;
+static long shift_end = -1;
+static long bytes_sent;
+
+// UART back from the winch controller
+static char echo_byte;
+static long echo_time = -1;
+static uint8_t receive_buffer[RECEIVE_BUFFER_SIZE];
+static int receive_write;
+static int receive_read;
+
+// Winch controller model
+static char winch_state;
+
+// Changes of the winch mode
+static char desired;
+static long change_time;
+static bool change_pending;
+static long changes;
+static long lost;
+static long latency_min = -1;
+static long latency_max;
+static long long latency_sum;
+static long executed;
+
+
+// ****************************************************************************
+static uint32_t random_number(uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 16) & 0x7fff;
+}
+
+
+// ****************************************************************************
+static bool byte_lost(void)
+{
+    return (int)(random_number(&loss_random) % 100) < loss_percent;
+}
+
+
+// ****************************************************************************
+// UART driver (uart0.c)
+bool uart0_send_is_ready(void)
+{
+    return !holding_full;
+}
+
+
+// ****************************************************************************
+void uart0_send_char(const char c)
+{
+    holding = c;
+    holding_full = true;
+}
+
+
+// ****************************************************************************
+bool uart0_read_is_byte_pending(void)
+{
+    return receive_read != receive_write;
+}
+
+
+// ****************************************************************************
+uint8_t uart0_read_byte(void)
+{
+    uint8_t data = receive_buffer[receive_read];
+
+    receive_read = (receive_read + 1) % RECEIVE_BUFFER_SIZE;
+    return data;
+}
+
+
+// ****************************************************************************
+// Light programs (light_programs.c) and multiplexed UART (uart_mux.c) are
+// not used by this test
+void post_light_program_event(LIGHT_PROGRAM_EVENT_T event)
+{
+    (void)event;
+}
+
+
+// ****************************************************************************
+void uart_mux_send(UART_MUX_CHANNEL_T mux_channel, const uint8_t *payload, uint8_t length)
+{
+    (void)mux_channel;
+    (void)payload;
+    (void)length;
+}
+
+
+// ****************************************************************************
+static char command_of_mode(void)
+{
+    switch (global_flags.winch_mode) {
+        case WINCH_IDLE:
+            return '1';
+
+        case WINCH_IN:
+            return '2';
+
+        case WINCH_OUT:
+            return '3';
+
+        case WINCH_DISABLED:
+        default:
+            return '0';
+    }
+}
+
+
+// ****************************************************************************
+static void winch_controller_receive(char command)
+{
+    long latency;
+
+    winch_state = command;
+
+    if (change_pending  &&  winch_state == desired) {
+        change_pending = false;
+        latency = now - change_time;
+        latency_sum += latency;
+        ++executed;
+        if (latency_min < 0  ||  latency < latency_min) {
+            latency_min = latency;
+        }
+        if (latency > latency_max) {
+            latency_max = latency;
+        }
+    }
+
+    if (echo) {
+        echo_byte = command;
+        echo_time = now + WINCH_RESPONSE_TIME + BYTE_TIME;
+    }
+}
+
+
+// ****************************************************************************
+static void operator_action(void)
+{
+    switch (random_number(&operator_random) % 4) {
+        case 0:
+            winch_action(1);
+            break;
+
+        case 1:
+            winch_action(2);
+            break;
+
+        case 2:
+            abort_winching();
+            break;
+
+        default:
+            winch_action(5);
+            break;
+    }
+
+    if (command_of_mode() == desired) {
+        return;
+    }
+
+    if (change_pending) {
+        ++lost;
+    }
+    desired = command_of_mode();
+    change_time = now;
+    change_pending = true;
+    ++changes;
+}
+
+
+// ****************************************************************************
+int main(int argc, char *argv[])
+{
+    long next_change = 2000000;
+    long keepalive_bytes;
+    int failures = 0;
+
+    if (argc > 1) {
+        echo = atoi(argv[1]) ? true : false;
+    }
+    if (argc > 2) {
+        loss_percent = atoi(argv[2]);
+    }
+    if (loss_percent < 0  ||  loss_percent > 100) {
+        fprintf(stderr, "Usage: %s [echo (0 or 1) [loss in percent]]\n",
+            argv[0]);
+        return 1;
+    }
+
+    global_flags.winch_mode = WINCH_DISABLED;
+    desired = command_of_mode();
+
+    for (now = 0; now < SIMULATION_TIME; now += STEP) {
+        global_flags.systick = 0;
+
+        if ((now % MAINLOOP_PERIOD) == 0) {
+            // The mainloop sees the systick flag once per systick
+            if (((now / MAINLOOP_PERIOD) % (SYSTICK_PERIOD / MAINLOOP_PERIOD)) == 0) {
+                global_flags.systick = 1;
+            }
+            if (now >= next_change) {
+                operator_action();
+                next_change = now + 2000000 + (random_number(&operator_random) % 6000) * 1000L;
+            }
+            process_winch();
+        }
+
+        // UART towards the winch controller
+        if (shift_end >= 0  &&  now >= shift_end) {
+            shift_end = -1;
+            if (!byte_lost()) {
+                winch_controller_receive(shifting);
+            }
+        }
+        if (shift_end < 0  &&  holding_full) {
+            shifting = holding;
+            holding_full = false;
+            shift_end = now + BYTE_TIME;
+            ++bytes_sent;
+        }
+
+        // UART back from the winch controller
+        if (echo_time >= 0  &&  now >= echo_time) {
+            echo_time = -1;
+            if (!byte_lost()) {
+                receive_buffer[receive_write] = (uint8_t)echo_byte;
+                receive_write = (receive_write + 1) % RECEIVE_BUFFER_SIZE;
+            }
+        }
+    }
+
+    printf("Echo %s, %d%% loss:\n", echo ? "on" : "off", loss_percent);
+    printf("    %ld changes, %ld lost; latency min %ld us, avg %lld us, "
+        "max %ld us\n", changes, lost, latency_min,
+        executed ? latency_sum / executed : 0, latency_max);
+    printf("    %ld bytes sent, %ld per minute\n", bytes_sent,
+        bytes_sent * 60000000L / SIMULATION_TIME);
+
+    if (lost  &&  (echo  ||  loss_percent == 0)) {
+        printf("    FAIL: changes of the winch mode lost\n");
+        ++failures;
+    }
+
+    keepalive_bytes = SIMULATION_TIME / KEEPALIVE_TIME + 1;
+    if (echo  &&  loss_percent == 0  &&
+            bytes_sent > changes + keepalive_bytes + 1) {
+        printf("    FAIL: acknowledged link sends more than changes and "
+            "keep-alives\n");
+        ++failures;
+    }
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
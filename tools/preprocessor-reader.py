@@ -5,6 +5,12 @@
 #   This utility reads the output of an RC light controller pre-proessor
 #   and displays it in human readable form.
 #
+#   Both the 4 byte frames starting with 0x87 and the frames of preprocessor
+#   protocol v2 starting with 0x83 are recognized. Protocol v2 frames show
+#   steering, throttle and CH3/AUX with two decimals, and the number of
+#   frames lost according to their sequence number. See preprocessor_output.c
+#   of the mk4-tlc5940-lpc812 firmware for the protocol.
+#
 #   The serial port where the pre-processor is connected can be specified
 #   on the command line.
 #
@@ -20,6 +26,60 @@ import sys
 
 STARTUP_MODE_NEUTRAL = 4
 
+SLAVE_MAGIC_BYTE = 0x87
+V2_SYNC = 0x83
+V2_ESCAPE = 0x85
+V2_ESCAPE_XOR = 0x20
+V2_STEPS_PER_PERCENT = 20.0
+
+# Sequence, steering, throttle, CH3/AUX, flags and CRC
+V2_FRAME_SIZE = 10
+
+
+def crc16(data, crc=0xffff):
+    ''' CRC-16-CCITT, same as crc16_ccitt() in utils.c of the firmware '''
+    for byte in bytearray(data):
+        crc ^= byte << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xffff
+            else:
+                crc = (crc << 1) & 0xffff
+    return crc
+
+
+def signed8(value):
+    if value > 127:
+        return -(256 - value)
+    return value
+
+
+def signed16(low, high):
+    value = low | (high << 8)
+    if value > 32767:
+        return -(65536 - value)
+    return value
+
+
+def flags_message(ch3):
+    if ch3 & (1 << STARTUP_MODE_NEUTRAL):
+        return 'STARTUP_MODE_NEUTRAL'
+    return ''
+
+
+def read_v2_frame(s):
+    ''' Return the unescaped bytes of a v2 frame following the sync byte, and
+        the byte that aborted the frame (None if it is complete) '''
+    data = bytearray()
+    while len(data) < V2_FRAME_SIZE:
+        byte = ord(s.read(1))
+        if byte == V2_ESCAPE:
+            byte = ord(s.read(1)) ^ V2_ESCAPE_XOR
+        elif byte >= 0x80 and byte <= SLAVE_MAGIC_BYTE:
+            return data, byte
+        data.append(byte)
+    return data, None
+
 
 def preprocessor_reader(port):
     try:
@@ -28,28 +88,44 @@ def preprocessor_reader(port):
         print("Unable to open port %s.\nError message: %s" % (port, e))
         sys.exit(0)
 
+    sequence = None
+    sync = ord(s.read(1))
+
     while True:
-        sync = 0x00
-        while sync != 0x87:
-            sync = ord(s.read(1))
-            if sync != 0x87:
-                print("Out of sync: %x" % sync)
-
-        st = ord(s.read(1))
-        th = ord(s.read(1))
-        ch3 = ord(s.read(1))
-
-        if st > 127:
-            st = -(256 - st)
-        if th > 127:
-            th = -(256 - th)
-
-        message = ""
-        if ch3 & (1 << STARTUP_MODE_NEUTRAL):
-            message += 'STARTUP_MODE_NEUTRAL'
-        ch3 = ch3 & 0x0f
-
-        print("%+04d %+04d %d %s" % (st, th, ch3, message))
+        if sync == SLAVE_MAGIC_BYTE:
+            st = signed8(ord(s.read(1)))
+            th = signed8(ord(s.read(1)))
+            ch3 = ord(s.read(1))
+
+            print("%+04d %+04d %d %s" % (st, th, ch3 & 0x0f,
+                flags_message(ch3)))
+
+        elif sync == V2_SYNC:
+            data, aborted = read_v2_frame(s)
+            if aborted is not None:
+                print("Frame aborted by: %x" % aborted)
+                sync = aborted
+                continue
+
+            if crc16(data[:-2]) != data[-2] | (data[-1] << 8):
+                print("CRC error")
+            else:
+                lost = ''
+                if sequence is not None and data[0] != (sequence + 1) & 0xff:
+                    lost = 'lost %d' % ((data[0] - sequence - 1) & 0xff)
+                sequence = data[0]
+
+                st = signed16(data[1], data[2]) / V2_STEPS_PER_PERCENT
+                th = signed16(data[3], data[4]) / V2_STEPS_PER_PERCENT
+                aux = signed16(data[5], data[6]) / V2_STEPS_PER_PERCENT
+
+                print("%+07.2f %+07.2f %+07.2f %d %s %s" % (st, th, aux,
+                    data[7] & 0x0f, flags_message(data[7]), lost))
+
+        else:
+            print("Out of sync: %x" % sync)
+
+        sync = ord(s.read(1))
 
 
 if __name__ == '__main__':
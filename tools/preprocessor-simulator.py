@@ -7,6 +7,10 @@ light controller functionality without hooking up a RC system.
 
 A web browser is used for the user interface
 
+With --protocol 2 the frames of preprocessor protocol v2 are sent: steering,
+throttle and an analog CH3/AUX value in steps of 0.05%, a sequence number and
+a CRC. See preprocessor_output.c of the mk4-tlc5940-lpc812 firmware.
+
 Author:         Werner Lane
 E-mail:         laneboysrc@gmail.com
 '''
@@ -32,9 +36,46 @@ except ImportError:
 
 
 SLAVE_MAGIC_BYTE = 0x87
+V2_SYNC = 0x83
+V2_ESCAPE = 0x85
+V2_ESCAPE_XOR = 0x20
+V2_STEPS_PER_PERCENT = 20
 HTML_FILE = "preprocessor-simulator.html"
 
 
+def crc16(data, crc=0xffff):
+    ''' CRC-16-CCITT, same as crc16_ccitt() in utils.c of the firmware '''
+    for byte in bytearray(data):
+        crc ^= byte << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xffff
+            else:
+                crc = (crc << 1) & 0xffff
+    return crc
+
+
+def v2_frame(sequence, steering, throttle, ch3, last_byte):
+    ''' Return a protocol v2 frame; steering, throttle and ch3 are in
+        percent '''
+    payload = bytearray([sequence & 0xff])
+    for value in (steering, throttle, ch3):
+        value = int(round(value * V2_STEPS_PER_PERCENT)) & 0xffff
+        payload += bytearray([value & 0xff, value >> 8])
+    payload.append(last_byte)
+
+    crc = crc16(payload)
+    payload += bytearray([crc & 0xff, crc >> 8])
+
+    frame = bytearray([V2_SYNC])
+    for byte in payload:
+        if 0x80 <= byte <= SLAVE_MAGIC_BYTE:
+            frame += bytearray([V2_ESCAPE, byte ^ V2_ESCAPE_XOR])
+        else:
+            frame.append(byte)
+    return frame
+
+
 class QuietBaseHTTPRequestHandler(BaseHTTPRequestHandler):
     def log_request(self, code, message=None):
         ''' Supress logging of HTTP requests '''
@@ -52,6 +93,10 @@ def parse_commandline():
     parser.add_argument("-p", "--port", type=int, default=1234,
         help='HTTP port for the web UI. Default is localhost:1234.')
 
+    parser.add_argument("--protocol", type=int, choices=[1, 2], default=1,
+        help='Preprocessor protocol: 1 for the 4 byte frames, 2 for the '
+            'frames of protocol v2. Default is 1.')
+
     parser.add_argument("tty", nargs="?", default="/dev/ttyUSB0",
         help="serial port to use. ")
 
@@ -114,8 +159,9 @@ class PreprocessorApp(object):
             print("Unable to open port %s: %s" % (self.args.tty, error))
             sys.exit(1)
 
-        print("Simulating on {uart} at {baudrate} baud.".format(
-            uart=self.uart.port, baudrate=self.uart.baudrate))
+        print("Simulating protocol {protocol} on {uart} at {baudrate} "
+            "baud.".format(protocol=self.args.protocol, uart=self.uart.port,
+            baudrate=self.uart.baudrate))
 
     def api(self, query):
         ''' Web api handler '''
@@ -152,6 +198,7 @@ class PreprocessorApp(object):
 
         def writer(app):
             ''' Background thread performing the UART transmission '''
+            sequence = 0
             while not app.done:
                 steering = app.receiver['ST']
                 if steering < 0:
@@ -167,8 +214,14 @@ class PreprocessorApp(object):
                 if app.receiver['STARTUP_MODE']:
                     last_byte += 0x10
 
-                data = bytearray(
-                    [SLAVE_MAGIC_BYTE, steering, throttle, last_byte])
+                if app.args.protocol == 2:
+                    data = v2_frame(sequence, app.receiver['ST'],
+                        app.receiver['TH'],
+                        100 if app.receiver['CH3'] else -100, last_byte)
+                    sequence += 1
+                else:
+                    data = bytearray(
+                        [SLAVE_MAGIC_BYTE, steering, throttle, last_byte])
                 app.uart.write(data)
                 app.uart.flush()
 